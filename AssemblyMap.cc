@@ -0,0 +1,319 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * AssemblyMap.cc
+ */
+
+#include "AssemblyMap.h"
+#include "Threads.h"
+
+AssemblyMap::AssemblyMap () {
+
+  isSetUp = PETSC_FALSE;
+  nel = nen = ndof = nedof = nrows = 0;
+  edof = NULL;
+  ncolors = 0;
+  color = NULL;
+  rows = NULL;
+  pos = NULL;
+  adi = NULL;
+  aoi = NULL;
+  ghostRows = NULL;
+  ke = NULL;
+}
+
+AssemblyMap::~AssemblyMap () {
+
+  PetscFree (rows);
+  PetscFree (pos);
+  PetscFree (adi);
+  PetscFree (aoi);
+  PetscFree (ghostRows);
+  PetscFree (ke);
+}
+
+PetscErrorCode AssemblyMap::GetBlocks (Mat A, Mat *Ad, Mat *Ao,
+    const PetscInt *garray[]) {
+
+  PetscErrorCode ierr = 0;
+  PetscBool mpiaij, seqaij;
+
+  ierr = PetscObjectTypeCompare ((PetscObject) A, MATMPIAIJ, &mpiaij);
+  CHKERRQ(ierr);
+  ierr = PetscObjectTypeCompare ((PetscObject) A, MATSEQAIJ, &seqaij);
+  CHKERRQ(ierr);
+
+  *Ad = NULL;
+  *Ao = NULL;
+  *garray = NULL;
+  if (mpiaij) {
+    ierr = MatMPIAIJGetSeqAIJ (A, Ad, Ao, garray);
+    CHKERRQ(ierr);
+  } else if (seqaij) {
+    *Ad = A;
+  }
+
+  return ierr;
+}
+
+PetscErrorCode AssemblyMap::SetUp (Mat A, PetscInt nel, PetscInt nen,
+    PetscInt ndof, const PetscInt *edof, PetscInt ncolors,
+    const PetscInt *color) {
+
+  PetscErrorCode ierr = 0;
+
+  isSetUp = PETSC_FALSE;
+
+  Mat Ad, Ao;
+  const PetscInt *garray;
+  ierr = GetBlocks (A, &Ad, &Ao, &garray);
+  CHKERRQ(ierr);
+  if (Ad == NULL) {
+    return ierr;
+  }
+
+  this->nel = nel;
+  this->nen = nen;
+  this->ndof = ndof;
+  this->nedof = nen * ndof;
+  this->edof = edof;
+  this->ncolors = ncolors;
+  this->color = color;
+
+  // Global numbers of all element dofs
+  ISLocalToGlobalMapping ltog;
+  ierr = MatGetLocalToGlobalMapping (A, &ltog, NULL);
+  CHKERRQ(ierr);
+  PetscInt *gdof;
+  ierr = PetscMalloc1 (nel * nedof, &gdof);
+  CHKERRQ(ierr);
+  ierr = ISLocalToGlobalMappingApply (ltog, nel * nedof, edof, gdof);
+  CHKERRQ(ierr);
+
+  PetscInt rstart, rend, cstart, cend, nco = 0;
+  MatGetOwnershipRange (A, &rstart, &rend);
+  MatGetOwnershipRangeColumn (A, &cstart, &cend);
+  if (Ao != NULL) {
+    MatGetSize (Ao, NULL, &nco);
+  }
+
+  // CSR structure of the blocks
+  PetscInt n;
+  const PetscInt *ia, *ja, *oia = NULL, *oja = NULL;
+  PetscBool done;
+  ierr = MatGetRowIJ (Ad, 0, PETSC_FALSE, PETSC_FALSE, &n, &ia, &ja, &done);
+  CHKERRQ(ierr);
+  if (Ao != NULL) {
+    ierr = MatGetRowIJ (Ao, 0, PETSC_FALSE, PETSC_FALSE, &n, &oia, &oja,
+        &done);
+    CHKERRQ(ierr);
+  }
+  nrows = rend - rstart;
+  PetscFree (adi);
+  PetscFree (aoi);
+  ierr = PetscMalloc1 (nrows + 1, &adi);
+  CHKERRQ(ierr);
+  ierr = PetscMalloc1 (nrows + 1, &aoi);
+  CHKERRQ(ierr);
+  for (PetscInt r = 0; r <= nrows; r++) {
+    adi[r] = ia[r];
+    aoi[r] = (oia != NULL) ? oia[r] : 0;
+  }
+
+  PetscFree (rows);
+  PetscFree (pos);
+  ierr = PetscMalloc1 (nel * nen, &rows);
+  CHKERRQ(ierr);
+  ierr = PetscMalloc1 (nel * nen * nen, &pos);
+  CHKERRQ(ierr);
+
+  // Locate every node block of every owned element row
+  PetscBool found = PETSC_TRUE;
+  for (PetscInt e = 0; e < nel && found; e++) {
+    const PetscInt *ge = gdof + e * nedof;
+    for (PetscInt a = 0; a < nen && found; a++) {
+      PetscInt g = ge[a * ndof];
+      if (g < rstart || g >= rend) {
+        rows[e * nen + a] = -1;
+        continue;
+      }
+      PetscInt r = g - rstart;
+      rows[e * nen + a] = r;
+      for (PetscInt i = 1; i < ndof; i++) {
+        found = (PetscBool) (found && ge[a * ndof + i] == g + i);
+      }
+      for (PetscInt b = 0; b < nen && found; b++) {
+        PetscInt gc = ge[b * ndof];
+        // Column of the block in the diagonal or the off-diagonal part
+        PetscBool diag = (PetscBool) (gc >= cstart && gc < cend);
+        PetscInt c = gc - cstart;
+        if (!diag) {
+          PetscFindInt (gc, nco, garray, &c);
+          if (c < 0) {
+            found = PETSC_FALSE;
+            break;
+          }
+        }
+        const PetscInt *ri = diag ? ia : oia;
+        const PetscInt *rj = diag ? ja : oja;
+        // Same position in the rows of all dofs of the node, contiguous
+        // columns for the dofs of the node block
+        PetscInt p;
+        PetscFindInt (c, ri[r + 1] - ri[r], rj + ri[r], &p);
+        for (PetscInt i = 0; i < ndof && found; i++) {
+          for (PetscInt j = 0; j < ndof && found; j++) {
+            PetscInt k = ri[r + i] + p + j;
+            found = (PetscBool) (p >= 0 && k < ri[r + i + 1]
+                                 && rj[k] == c + j);
+          }
+        }
+        pos[(e * nen + a) * nen + b] = diag ? p : -1 - p;
+      }
+    }
+  }
+
+  ierr = MatRestoreRowIJ (Ad, 0, PETSC_FALSE, PETSC_FALSE, &n, &ia, &ja,
+      &done);
+  CHKERRQ(ierr);
+  if (Ao != NULL) {
+    ierr = MatRestoreRowIJ (Ao, 0, PETSC_FALSE, PETSC_FALSE, &n, &oia, &oja,
+        &done);
+    CHKERRQ(ierr);
+  }
+  PetscFree (gdof);
+
+  // The map is only used if it is complete on all ranks
+  PetscMPIInt ok = found ? 1 : 0, allOk;
+  MPI_Allreduce(&ok, &allOk, 1, MPI_INT, MPI_MIN,
+      PetscObjectComm ((PetscObject) A));
+  if (!allOk) {
+    return ierr;
+  }
+
+  PetscFree (ghostRows);
+  PetscFree (ke);
+  ierr = PetscMalloc1 (2 * nen, &ghostRows);
+  CHKERRQ(ierr);
+  ierr = PetscMalloc1 (nedof * nedof, &ke);
+  CHKERRQ(ierr);
+
+  // The structure is exact: new nonzeros are an error, not a malloc
+  ierr = MatSetOption (A, MAT_NEW_NONZERO_ALLOCATION_ERR, PETSC_TRUE);
+  CHKERRQ(ierr);
+
+  isSetUp = PETSC_TRUE;
+
+  return ierr;
+}
+
+PetscErrorCode AssemblyMap::Assemble (Mat A, const PetscScalar *KE,
+    const PetscScalar *xp, PetscScalar Emin, PetscScalar Emax,
+    PetscScalar penal, PetscInt n, const PetscInt *elist) {
+
+  PetscErrorCode ierr = 0;
+
+  if (!isSetUp) {
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ORDER, "AssemblyMap is not set up");
+  }
+
+  Mat Ad, Ao;
+  const PetscInt *garray;
+  ierr = GetBlocks (A, &Ad, &Ao, &garray);
+  CHKERRQ(ierr);
+
+  ierr = MatZeroEntries (A);
+  CHKERRQ(ierr);
+
+  PetscScalar *ad, *ao = NULL;
+  ierr = MatSeqAIJGetArray (Ad, &ad);
+  CHKERRQ(ierr);
+  if (Ao != NULL) {
+    ierr = MatSeqAIJGetArray (Ao, &ao);
+    CHKERRQ(ierr);
+  }
+
+  // Owned rows: accumulate into the value arrays, with several threads
+  // colour by colour
+  PetscInt nc = (Threads::Count () > 1) ? ncolors : 1;
+  for (PetscInt c = 0; c < nc; c++) {
+    TOPOPT_OMP(omp parallel for schedule(static))
+    for (PetscInt k = 0; k < n; k++) {
+      PetscInt e = (elist != NULL) ? elist[k] : k;
+      if (nc > 1 && color[e] != c) continue;
+      // Use SIMP for the interpolation
+      PetscScalar dens = Emin + PetscPowScalar(xp[e], penal) * (Emax - Emin);
+      const PetscInt *re = rows + e * nen;
+      for (PetscInt a = 0; a < nen; a++) {
+        if (re[a] < 0) continue;
+        const PetscInt *pa = pos + (e * nen + a) * nen;
+        for (PetscInt i = 0; i < ndof; i++) {
+          PetscInt r = re[a] + i;
+          const PetscScalar *kr = KE + (a * ndof + i) * nedof;
+          for (PetscInt b = 0; b < nen; b++) {
+            PetscInt p = pa[b];
+            PetscScalar *v = (p >= 0) ? ad + adi[r] + p : ao + aoi[r] - 1 - p;
+            const PetscScalar *kb = kr + b * ndof;
+            for (PetscInt j = 0; j < ndof; j++) {
+              v[j] += dens * kb[j];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Rows of other ranks: through the stash of MatSetValuesBlockedLocal
+  // (node blocks of ndof dofs), the owned rows are skipped (negative
+  // indices)
+  for (PetscInt k = 0; k < n; k++) {
+    PetscInt e = (elist != NULL) ? elist[k] : k;
+    const PetscInt *re = rows + e * nen;
+    PetscBool ghost = PETSC_FALSE;
+    for (PetscInt a = 0; a < nen; a++) {
+      ghost = (PetscBool) (ghost || re[a] < 0);
+    }
+    if (!ghost) continue;
+    const PetscInt *ed = edof + e * nedof;
+    PetscInt *ghostCols = ghostRows + nen;
+    for (PetscInt a = 0; a < nen; a++) {
+      ghostCols[a] = ed[a * ndof] / ndof;
+      ghostRows[a] = (re[a] < 0) ? ghostCols[a] : -1;
+    }
+    PetscScalar dens = Emin + PetscPowScalar(xp[e], penal) * (Emax - Emin);
+    for (PetscInt q = 0; q < nedof * nedof; q++) {
+      ke[q] = dens * KE[q];
+    }
+    ierr = MatSetValuesBlockedLocal (A, nen, ghostRows, nen, ghostCols, ke,
+        ADD_VALUES);
+    CHKERRQ(ierr);
+  }
+  PetscLogFlops ((2.0 * nedof * nedof + 3.0) * n);
+
+  ierr = MatSeqAIJRestoreArray (Ad, &ad);
+  CHKERRQ(ierr);
+  if (Ao != NULL) {
+    ierr = MatSeqAIJRestoreArray (Ao, &ao);
+    CHKERRQ(ierr);
+  }
+
+  MatAssemblyBegin (A, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd (A, MAT_FINAL_ASSEMBLY);
+
+  return ierr;
+}
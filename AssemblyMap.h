@@ -0,0 +1,104 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * AssemblyMap.h
+ *
+ * Cached scatter of the element matrices into the CSR storage of an AIJ
+ * matrix created by DMCreateMatrix on a nodal DMDA.
+ *
+ * The DMDA preallocates and fills the exact nonzero structure of the Q1
+ * stencil, which never changes afterwards. SetUp looks up, once, where
+ * every element entry lives in the value arrays of the diagonal and the
+ * off-diagonal block of the owned rows. Assemble then accumulates
+ * Emin + x_e^penal (Emax - Emin) KE directly into these arrays, without
+ * the index translation, the row search and the hash of MatSetValuesLocal.
+ * Only the rows owned by other ranks still go through
+ * MatSetValuesBlockedLocal: the elements of a rank reach one node below its
+ * range of nodes (xs - 1), so these are the ghost nodes on the lower
+ * partition boundary.
+ *
+ * The owned rows are accumulated by the threads (see Threads.h) colour by
+ * colour over the element colouring of ElementMesh, the rows of other
+ * ranks afterwards by the calling thread only.
+ *
+ * Per element are stored the local row of the first dof of each node and
+ * the position of each node block in these rows; the dofs of a node are
+ * contiguous in the rows and columns of a DMDA matrix. This is
+ * nen * (nen + 1) integers per element, instead of nedof^2 for a full
+ * entry map.
+ */
+
+#ifndef ASSEMBLYMAP_H_
+#define ASSEMBLYMAP_H_
+
+#include <petsc.h>
+
+class AssemblyMap {
+
+  public:
+
+    // Empty map
+    AssemblyMap ();
+
+    // Destructor
+    ~AssemblyMap ();
+
+    // Build the map of nel elements with nen nodes and ndof dofs per node
+    // (edof: local dof numbers as cached by ElementMesh::GetEdof, color:
+    // element colours of ElementMesh::GetColors) into the nonzero
+    // structure of A. Not supported (see IsSetUp) are other matrix types
+    // than (MPI/Seq)AIJ and structures that miss element entries.
+    PetscErrorCode SetUp (Mat A, PetscInt nel, PetscInt nen, PetscInt ndof,
+        const PetscInt *edof, PetscInt ncolors, const PetscInt *color);
+
+    // The map is built and can be used with matrices of the structure of A
+    PetscBool IsSetUp () const {
+      return (isSetUp);
+    }
+
+    // Zero A (A or a duplicate of the matrix of SetUp) and assemble the
+    // SIMP scaled element matrix KE of the n elements elist (all if NULL)
+    PetscErrorCode Assemble (Mat A, const PetscScalar *KE,
+        const PetscScalar *xp, PetscScalar Emin, PetscScalar Emax,
+        PetscScalar penal, PetscInt n, const PetscInt *elist);
+
+  private:
+
+    PetscBool isSetUp; // Map is built
+    PetscInt nel, nen, ndof, nedof; // Elements, nodes and dofs per element
+    const PetscInt *edof; // Element dofs (referenced)
+    PetscInt ncolors; // Number of element colours
+    const PetscInt *color; // Element colours (referenced)
+    PetscInt *rows; // Local row of the first dof of each element node, -1 if
+                    // the row is owned by another rank (nel x nen)
+    PetscInt *pos; // Position of the node block b in the rows of node a,
+                   // p >= 0 in the diagonal, -1 - p in the off-diagonal
+                   // block (nel x nen x nen)
+    PetscInt nrows; // Number of owned rows
+    PetscInt *adi, *aoi; // Row starts of the diagonal, off-diagonal block
+    PetscInt *ghostRows; // Work: element node rows, -1 for the owned ones,
+                         // followed by the element node columns
+    PetscScalar *ke; // Work: scaled element matrix
+
+    // Diagonal and off-diagonal (NULL if none) block of A
+    static PetscErrorCode GetBlocks (Mat A, Mat *Ad, Mat *Ao,
+        const PetscInt *garray[]);
+};
+
+#endif /* ASSEMBLYMAP_H_ */
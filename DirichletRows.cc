@@ -0,0 +1,118 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * DirichletRows.cc
+ */
+
+#include "DirichletRows.h"
+
+DirichletRows::DirichletRows () {
+
+  PetscBool flg;
+  zeroRows = PETSC_FALSE; // N'*K*N + (I-N) by default
+  PetscOptionsGetBool (NULL, NULL, "-bcZeroRows", &zeroRows, &flg);
+  n = 0;
+  NI = NULL;
+  rows = NULL;
+  diag = NULL;
+}
+
+DirichletRows::~DirichletRows () {
+
+  for (PetscInt lc = 0; lc < n; ++lc) {
+    VecDestroy (&(NI[lc]));
+    ISDestroy (&(rows[lc]));
+  }
+  PetscFree (NI);
+  PetscFree (rows);
+  PetscFree (diag);
+}
+
+PetscErrorCode DirichletRows::SetUp (PetscInt n) {
+
+  PetscErrorCode ierr = 0;
+
+  this->n = n;
+  ierr = PetscCalloc1 (n, &NI);
+  CHKERRQ(ierr);
+  ierr = PetscCalloc1 (n, &rows);
+  CHKERRQ(ierr);
+  ierr = PetscCalloc1 (n, &diag);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode DirichletRows::SetUpLoadCondition (PetscInt lc, Vec N,
+    PetscScalar rowDiag) {
+
+  PetscErrorCode ierr = 0;
+
+  // I - N, added to the diagonal of N'*K*N
+  if (NI[lc] == NULL) {
+    ierr = VecDuplicate (N, &(NI[lc]));
+    CHKERRQ(ierr);
+  }
+  VecSet (NI[lc], 1.0);
+  VecAXPY (NI[lc], -1.0, N);
+
+  // The owned constrained rows (N = 0)
+  PetscInt nloc, rstart, nrows = 0;
+  PetscInt *r;
+  const PetscScalar *np;
+  VecGetLocalSize (N, &nloc);
+  VecGetOwnershipRange (N, &rstart, NULL);
+  ierr = PetscMalloc1(nloc, &r);
+  CHKERRQ(ierr);
+  VecGetArrayRead (N, &np);
+  for (PetscInt i = 0; i < nloc; i++) {
+    if (np[i] == 0.0) r[nrows++] = rstart + i;
+  }
+  VecRestoreArrayRead (N, &np);
+  ISDestroy (&(rows[lc]));
+  ierr = ISCreateGeneral (PetscObjectComm ((PetscObject) N), nrows, r,
+      PETSC_OWN_POINTER, &(rows[lc]));
+  CHKERRQ(ierr);
+
+  diag[lc] = rowDiag;
+
+  return ierr;
+}
+
+PetscErrorCode DirichletRows::Apply (Mat K, PetscInt lc, Vec N,
+    PetscScalar scale) {
+
+  PetscErrorCode ierr = 0;
+
+  if (zeroRows) {
+    // Zeroing rows must not shrink the nonzero pattern of K
+    ierr = MatSetOption (K, MAT_KEEP_NONZERO_PATTERN, PETSC_TRUE);
+    CHKERRQ(ierr);
+    ierr = MatZeroRowsColumnsIS (K, rows[lc], scale * diag[lc], NULL, NULL);
+    CHKERRQ(ierr);
+  } else {
+    // K = N'*K*N - (N-I)
+    ierr = MatDiagonalScale (K, N, N);
+    CHKERRQ(ierr);
+    ierr = MatDiagonalSet (K, NI[lc], ADD_VALUES);
+    CHKERRQ(ierr);
+  }
+
+  return ierr;
+}
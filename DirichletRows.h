@@ -0,0 +1,74 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * DirichletRows.h
+ *
+ * The Dirichlet conditions of the load conditions on an assembled operator
+ * K, shared by all physics. The Dirichlet vector N of a load condition is
+ * 1 at the free and 0 at the constrained dofs. Imposed are either
+ *
+ *  - K = N'*K*N + (I-N) (default): the constrained rows and columns become
+ *    identity rows, by a diagonal scaling and a diagonal update
+ *  - MatZeroRowsColumns (-bcZeroRows) on the constrained rows, with a
+ *    diagonal of the size of the free ones, which keeps the constrained
+ *    rows scaled like the free ones on all multigrid levels
+ *
+ * I - N and the constrained rows are cached per load condition once N is
+ * set up. The diagonal of the constrained rows per unit modulus is given by
+ * the physics, e.g. the diagonal of a node in solid material.
+ */
+
+#ifndef DIRICHLETROWS_H_
+#define DIRICHLETROWS_H_
+
+#include <petsc.h>
+
+class DirichletRows {
+
+  public:
+
+    // Read -bcZeroRows
+    DirichletRows ();
+
+    // Destructor
+    ~DirichletRows ();
+
+    // Room for n load conditions
+    PetscErrorCode SetUp (PetscInt n);
+
+    // Cache I - N and the constrained rows of load condition lc from its
+    // Dirichlet vector N, with rowDiag the diagonal of the constrained rows
+    // per unit modulus
+    PetscErrorCode SetUpLoadCondition (PetscInt lc, Vec N,
+        PetscScalar rowDiag);
+
+    // Impose the Dirichlet conditions of load condition lc on the
+    // assembled K, scale: modulus of the diagonal (-bcZeroRows only)
+    PetscErrorCode Apply (Mat K, PetscInt lc, Vec N, PetscScalar scale);
+
+  private:
+
+    PetscBool zeroRows; // MatZeroRowsColumns instead of N'*K*N + (I-N)
+    PetscInt n; // Number of load conditions
+    Vec *NI; // I - N of each load condition
+    IS *rows; // Constrained (global) rows of each load condition
+    PetscScalar *diag; // Diagonal of the constrained rows / modulus
+};
+
+#endif /* DIRICHLETROWS_H_ */
@@ -0,0 +1,66 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * DomainMask.cc
+ */
+
+#include "DomainMask.h"
+
+DomainMask::DomainMask (PetscInt nel) {
+
+  this->nel = nel;
+  state = 0;
+  mask = new uint64_t[nel];
+  for (PetscInt e = 0; e < nel; e++) {
+    mask[e] = 0;
+  }
+}
+
+DomainMask::~DomainMask () {
+
+  delete[] mask;
+}
+
+void DomainMask::SetAll (Kind kind, PetscInt index) {
+
+  uint64_t w = (kind == NONE) ? 0 : (Word (kind) | Bit (index));
+  for (PetscInt e = 0; e < nel; e++) {
+    mask[e] = w;
+  }
+  state++;
+}
+
+void DomainMask::GetValues (Kind kind, PetscScalar *v) const {
+
+  for (PetscInt e = 0; e < nel; e++) {
+    v[e] = ((mask[e] & kindMask) == Word (kind)) ?
+        (PetscScalar) (mask[e] & indexMask) : 0.0;
+  }
+}
+
+PetscErrorCode DomainMask::CheckIndices (PetscInt n, const char *what) {
+
+  if (n > maxIndex) {
+    SETERRQ3(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE,
+        "%D %s exceed the %D supported by the domain mask", n, what,
+        maxIndex);
+  }
+
+  return 0;
+}
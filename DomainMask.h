@@ -0,0 +1,154 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * DomainMask.h
+ *
+ * Domain membership of the local elements (the elements owned by the rank,
+ * in the order of the element vectors like xPhys).
+ *
+ * Every element is of one kind: outside, design domain, non-designable
+ * solid, fixture or loading domain. The kinds are exclusive, the last
+ * assignment wins. Per kind an element holds a set of indices: the design
+ * or solid domains it belongs to, or the load conditions it is a fixture
+ * or a loading domain of. Both are packed into one 64-bit word per element
+ * (kind in the upper bits, one bit per index below), so all tests are O(1)
+ * bit operations.
+ *
+ * The former xPassive0..3 vectors stored the indices of the design, solid,
+ * fixture and loading kinds as sums of 2^index in doubles; GetValues
+ * reproduces that encoding for the VTK and restart output.
+ */
+
+#ifndef DOMAINMASK_H_
+#define DOMAINMASK_H_
+
+#include <petsc.h>
+#include <stdint.h>
+
+class DomainMask {
+
+  public:
+
+    // Kind of an element
+    enum Kind {
+      NONE = 0, // outside of all domains
+      DESIGN = 1, // design domain(s)
+      SOLID = 2, // non-designable solid domain(s)
+      FIXTURE = 3, // fixture of load condition(s)
+      LOAD = 4 // loading domain of load condition(s)
+    };
+
+    // Number of indices (domains or load conditions) per kind
+    static const PetscInt maxIndex = 60;
+
+    // All nel local elements are outside of all domains
+    DomainMask (PetscInt nel);
+
+    // Destructor
+    ~DomainMask ();
+
+    // Number of local elements
+    PetscInt GetSize () const {
+      return (nel);
+    }
+
+    // Kind of element e
+    Kind GetKind (PetscInt e) const {
+      return (Kind (mask[e] >> indexBits));
+    }
+
+    // Indices of element e, bit i set for index i
+    uint64_t GetIndices (PetscInt e) const {
+      return (mask[e] & indexMask);
+    }
+
+    // Element e is in a design domain
+    bool IsDesign (PetscInt e) const {
+      return ((mask[e] & kindMask) == Word (DESIGN));
+    }
+
+    // Element e is passive, i.e. solid, a fixture or a loading domain
+    bool IsPassive (PetscInt e) const {
+      return (mask[e] >= Word (SOLID));
+    }
+
+    // Element e is a fixture (of any load condition)
+    bool IsFixture (PetscInt e) const {
+      return ((mask[e] & kindMask) == Word (FIXTURE));
+    }
+
+    // Element e is a fixture of load condition lc
+    bool IsFixed (PetscInt e, PetscInt lc) const {
+      return ((mask[e] & (kindMask | Bit (lc))) == (Word (FIXTURE) | Bit (lc)));
+    }
+
+    // Element e is a loading domain of load condition lc
+    bool IsLoaded (PetscInt e, PetscInt lc) const {
+      return ((mask[e] & (kindMask | Bit (lc))) == (Word (LOAD) | Bit (lc)));
+    }
+
+    // Add index to element e; an element of another kind is reset first
+    void Add (PetscInt e, Kind kind, PetscInt index) {
+      if ((mask[e] & kindMask) != Word (kind)) {
+        mask[e] = Word (kind);
+      }
+      mask[e] |= Bit (index);
+      state++;
+    }
+
+    // Element e is outside of all domains
+    void Clear (PetscInt e) {
+      mask[e] = 0;
+      state++;
+    }
+
+    // All elements are of kind with the single index
+    void SetAll (Kind kind, PetscInt index);
+
+    // Counter increased by every change of the mask, lets the users of the
+    // mask (e.g. the element lists of ElementMesh) detect changes
+    PetscInt GetState () const {
+      return (state);
+    }
+
+    // Indices of kind as sum of 2^index per element, 0 for other kinds
+    void GetValues (Kind kind, PetscScalar *v) const;
+
+    // Check that n indices (what: e.g. "load conditions") fit in the mask
+    static PetscErrorCode CheckIndices (PetscInt n, const char *what);
+
+  private:
+
+    static const int indexBits = 60; // Bits of the indices, kind above
+    static const uint64_t indexMask = (uint64_t (1) << indexBits) - 1;
+    static const uint64_t kindMask = ~indexMask;
+
+    static uint64_t Word (Kind kind) {
+      return (uint64_t (kind) << indexBits);
+    }
+    static uint64_t Bit (PetscInt index) {
+      return (uint64_t (1) << index);
+    }
+
+    PetscInt nel; // Number of local elements
+    uint64_t *mask; // Kind and indices of each local element
+    PetscInt state; // Number of changes of the mask
+};
+
+#endif /* DOMAINMASK_H_ */
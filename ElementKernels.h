@@ -0,0 +1,175 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: Apr. 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * ElementKernels.h
+ *
+ * Element-batched kernels for the element energies v_e^T KE u_e that
+ * drive the objective and the sensitivities of all physics.
+ *
+ * The element vectors of a block of W elements are gathered into a
+ * structure-of-arrays buffer (dof-major, element-minor), so that one row
+ * of KE is broadcast and multiplied with W elements at once. The element
+ * dofs are taken from the edof table of ElementMesh. The kernel is
+ * specialised at compile time on the number of element dofs, i.e.
+ * nedof = 8/24 (elasticity) or 4/8 (heat conduction).
+ *
+ * W = 8 with AVX-512, W = 4 with AVX2 (double precision real scalars
+ * only); otherwise a portable loop with W = 4 is used, which the compiler
+ * is free to vectorise on its own. The blocks are shared among the OpenMP
+ * threads of the rank (see Threads.h).
+ */
+
+#ifndef ELEMENTKERNELS_H_
+#define ELEMENTKERNELS_H_
+
+#include <petsc.h>
+#include "Threads.h"
+
+#if defined(PETSC_USE_REAL_DOUBLE) && !defined(PETSC_USE_COMPLEX)
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define ELEMENTKERNELS_AVX512
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define ELEMENTKERNELS_AVX2
+#endif
+#endif
+
+template<PetscInt NEDOF>
+class ElementKernels {
+
+  public:
+
+    static const PetscInt nedof = NEDOF; // Number of elemental dofs
+#if defined(ELEMENTKERNELS_AVX512)
+    static const PetscInt W = 8; // Elements per block
+#else
+    static const PetscInt W = 4; // Elements per block
+#endif
+
+    // Element energies out[e] = v_e^T (KE + diag(s_e)) u_e for the elements
+    // e = elist[0..n-1]; edof holds the nedof local dofs of each element,
+    // v, u and s are local (ghosted) arrays and s may be NULL. Entries of
+    // out not in elist are left untouched.
+    static void QuadraticForm (const PetscScalar *KE, const PetscInt *edof,
+        const PetscInt *elist, PetscInt n, const PetscScalar *v,
+        const PetscScalar *u, const PetscScalar *s, PetscScalar *out) {
+
+      // The blocks are independent (each writes only its own entries of
+      // out) and are shared among the threads
+      TOPOPT_OMP(omp parallel for schedule(static))
+      for (PetscInt i0 = 0; i0 < n; i0 += W) {
+        const PetscInt nb = (n - i0 < W) ? n - i0 : W;
+
+        // SoA buffers: entry (k, b) is dof k of element b in the block
+        PetscScalar ub[nedof * W] __attribute__((aligned(64)));
+        PetscScalar vb[nedof * W] __attribute__((aligned(64)));
+        PetscScalar eb[W] __attribute__((aligned(64)));
+
+        // Gather, the lanes beyond the tail are zero padded
+        for (PetscInt b = 0; b < W; b++) {
+          if (b < nb) {
+            const PetscInt *ed = edof + elist[i0 + b] * nedof;
+            for (PetscInt k = 0; k < nedof; k++) {
+              ub[k * W + b] = u[ed[k]];
+              vb[k * W + b] = v[ed[k]];
+            }
+          } else {
+            for (PetscInt k = 0; k < nedof; k++) {
+              ub[k * W + b] = 0.0;
+              vb[k * W + b] = 0.0;
+            }
+          }
+        }
+
+        Block (KE, ub, vb, eb);
+
+        // Diagonal term, e.g. the external springs of the compliant problem
+        if (s != NULL) {
+          for (PetscInt b = 0; b < nb; b++) {
+            const PetscInt *ed = edof + elist[i0 + b] * nedof;
+            for (PetscInt k = 0; k < nedof; k++) {
+              eb[b] += vb[k * W + b] * s[ed[k]] * ub[k * W + b];
+            }
+          }
+        }
+
+        // Scatter
+        for (PetscInt b = 0; b < nb; b++) {
+          out[elist[i0 + b]] = eb[b];
+        }
+      }
+
+      PetscLogFlops ((2.0 * nedof * nedof + 2.0 * nedof
+          + (s != NULL ? 3.0 * nedof : 0.0)) * n);
+    }
+
+  private:
+
+    // eb[b] = sum_k vb(k,b) sum_h KE(k,h) ub(h,b) for one block
+    static inline void Block (const PetscScalar *KE, const PetscScalar *ub,
+        const PetscScalar *vb, PetscScalar *eb) {
+#if defined(ELEMENTKERNELS_AVX512)
+      __m512d e = _mm512_setzero_pd ();
+      for (PetscInt k = 0; k < nedof; k++) {
+        const PetscScalar *KEk = KE + k * nedof;
+        __m512d Ku = _mm512_setzero_pd ();
+        for (PetscInt h = 0; h < nedof; h++) {
+          Ku = _mm512_fmadd_pd (_mm512_set1_pd (KEk[h]),
+              _mm512_load_pd (ub + h * W), Ku);
+        }
+        e = _mm512_fmadd_pd (_mm512_load_pd (vb + k * W), Ku, e);
+      }
+      _mm512_store_pd (eb, e);
+#elif defined(ELEMENTKERNELS_AVX2)
+      __m256d e = _mm256_setzero_pd ();
+      for (PetscInt k = 0; k < nedof; k++) {
+        const PetscScalar *KEk = KE + k * nedof;
+        __m256d Ku = _mm256_setzero_pd ();
+        for (PetscInt h = 0; h < nedof; h++) {
+          Ku = _mm256_fmadd_pd (_mm256_broadcast_sd (KEk + h),
+              _mm256_load_pd (ub + h * W), Ku);
+        }
+        e = _mm256_fmadd_pd (_mm256_load_pd (vb + k * W), Ku, e);
+      }
+      _mm256_store_pd (eb, e);
+#else
+      for (PetscInt b = 0; b < W; b++) {
+        eb[b] = 0.0;
+      }
+      for (PetscInt k = 0; k < nedof; k++) {
+        const PetscScalar *KEk = KE + k * nedof;
+        PetscScalar Ku[W];
+        for (PetscInt b = 0; b < W; b++) {
+          Ku[b] = 0.0;
+        }
+        for (PetscInt h = 0; h < nedof; h++) {
+          for (PetscInt b = 0; b < W; b++) {
+            Ku[b] += KEk[h] * ub[h * W + b];
+          }
+        }
+        for (PetscInt b = 0; b < W; b++) {
+          eb[b] += vb[k * W + b] * Ku[b];
+        }
+      }
+#endif
+    }
+};
+
+#endif /* ELEMENTKERNELS_H_ */
@@ -0,0 +1,437 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: Apr. 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * ElementMesh.cc
+ */
+
+#include "ElementMesh.h"
+
+namespace TOPOPT_NS {
+
+ElementMesh::ElementMesh (DM da_nodes) {
+
+  this->da_nodes = da_nodes;
+  PetscObjectReference ((PetscObject) da_nodes);
+
+  DMDAGetElements (da_nodes, &nel, &nen, &necon);
+
+  for (PetscInt i = 0; i <= maxdof; i++) {
+    edof[i] = NULL;
+  }
+
+  maskState = -1;
+  nact = 0;
+  elist = NULL;
+  nactive = 0;
+  alist = NULL;
+  ncolors = 0;
+  color = NULL;
+}
+
+ElementMesh::~ElementMesh () {
+
+  for (PetscInt i = 0; i <= maxdof; i++) {
+    if (edof[i] != NULL) PetscFree(edof[i]);
+  }
+  if (elist != NULL) PetscFree(elist);
+  if (alist != NULL) PetscFree(alist);
+  if (color != NULL) PetscFree(color);
+
+  DMDestroy (&da_nodes);
+}
+
+PetscErrorCode ElementMesh::GetElements (PetscInt *nel, PetscInt *nen,
+    const PetscInt *e[]) {
+
+  *nel = this->nel;
+  *nen = this->nen;
+  *e = necon;
+
+  return (0);
+}
+
+PetscErrorCode ElementMesh::GetEdof (PetscInt ndof, const PetscInt *edof[]) {
+
+  PetscErrorCode ierr = 0;
+
+  if (ndof < 1 || ndof > maxdof) {
+    SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE,
+        "Unsupported number of dofs per node %D", ndof);
+  }
+
+  // Build the table on first request
+  if (this->edof[ndof] == NULL) {
+    PetscInt nedof = nen * ndof;
+    ierr = PetscMalloc1(nel * nedof, &(this->edof[ndof]));
+    CHKERRQ(ierr);
+    PetscInt *ep = this->edof[ndof];
+    for (PetscInt i = 0; i < nel; i++) {
+      for (PetscInt j = 0; j < nen; j++) {
+        for (PetscInt k = 0; k < ndof; k++) {
+          ep[i * nedof + j * ndof + k] = ndof * necon[i * nen + j] + k;
+        }
+      }
+    }
+  }
+
+  *edof = this->edof[ndof];
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::GetDesignElements (DomainMask *domain,
+    PetscInt *nact,
+    const PetscInt *elist[]) {
+
+  PetscErrorCode ierr = 0;
+
+  ierr = UpdateElementLists (domain);
+  CHKERRQ(ierr);
+
+  *nact = this->nact;
+  *elist = this->elist;
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::GetActiveElements (DomainMask *domain,
+    PetscInt *nact,
+    const PetscInt *alist[]) {
+
+  PetscErrorCode ierr = 0;
+
+  ierr = UpdateElementLists (domain);
+  CHKERRQ(ierr);
+
+  *nact = this->nactive;
+  *alist = this->alist;
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::GetActiveDofs (DomainMask *domain, DM dm,
+    PetscInt ndof, Vec active) {
+
+  PetscErrorCode ierr = 0;
+
+  ierr = UpdateElementLists (domain);
+  CHKERRQ(ierr);
+  const PetscInt *ep;
+  ierr = GetEdof (ndof, &ep);
+  CHKERRQ(ierr);
+
+  // Mark the local dofs of the active elements
+  Vec aloc;
+  ierr = DMGetLocalVector (dm, &aloc);
+  CHKERRQ(ierr);
+  VecSet (aloc, 0.0);
+  PetscScalar *ap;
+  VecGetArray (aloc, &ap);
+  PetscInt nedof = nen * ndof;
+  for (PetscInt a = 0; a < nactive; a++) {
+    const PetscInt *ed = ep + alist[a] * nedof;
+    for (PetscInt j = 0; j < nedof; j++) {
+      ap[ed[j]] = 1.0;
+    }
+  }
+  VecRestoreArray (aloc, &ap);
+
+  // Sum the marks of the ranks sharing a node
+  VecSet (active, 0.0);
+  DMLocalToGlobalBegin (dm, aloc, ADD_VALUES, active);
+  DMLocalToGlobalEnd (dm, aloc, ADD_VALUES, active);
+  ierr = DMRestoreLocalVector (dm, &aloc);
+  CHKERRQ(ierr);
+
+  PetscInt nloc;
+  VecGetLocalSize (active, &nloc);
+  VecGetArray (active, &ap);
+  for (PetscInt i = 0; i < nloc; i++) {
+    ap[i] = (ap[i] > 0.0) ? 1.0 : 0.0;
+  }
+  VecRestoreArray (active, &ap);
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::EliminateVoidDofs (DomainMask *domain, DM dm,
+    PetscInt ndof, Vec N, PetscBool print) {
+
+  PetscErrorCode ierr = 0;
+
+  Vec active;
+  ierr = VecDuplicate (N, &active);
+  CHKERRQ(ierr);
+  ierr = GetActiveDofs (domain, dm, ndof, active);
+  CHKERRQ(ierr);
+  VecPointwiseMult (N, N, active);
+  if (print) {
+    PetscScalar nActive;
+    PetscInt nDofs;
+    VecSum (active, &nActive);
+    VecGetSize (active, &nDofs);
+    PetscPrintf (PETSC_COMM_WORLD,
+        "# Dofs outside of all domains eliminated: %D of %D\n",
+        nDofs - (PetscInt) nActive, nDofs);
+  }
+  VecDestroy (&active);
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::SetUpAssemblyMap (Mat A, PetscInt ndof,
+    AssemblyMap **map) {
+
+  PetscErrorCode ierr = 0;
+
+  if (*map != NULL) {
+    return ierr;
+  }
+
+  const PetscInt *ep;
+  ierr = GetEdof (ndof, &ep);
+  CHKERRQ(ierr);
+  PetscInt nc;
+  const PetscInt *c;
+  ierr = GetColors (&nc, &c);
+  CHKERRQ(ierr);
+  *map = new AssemblyMap ();
+  ierr = (*map)->SetUp (A, nel, nen, ndof, ep, nc, c);
+  CHKERRQ(ierr);
+  if (!(*map)->IsSetUp ()) {
+    PetscPrintf (PETSC_COMM_WORLD, "# Assembly map: not supported by the "
+        "matrix, using MatSetValuesBlockedLocal\n");
+  }
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::UpdateElementLists (DomainMask *domain) {
+
+  PetscErrorCode ierr = 0;
+
+  if (maskState == domain->GetState ()) {
+    return ierr;
+  }
+
+  if (elist == NULL) {
+    ierr = PetscMalloc1(nel, &elist);
+    CHKERRQ(ierr);
+    ierr = PetscMalloc1(nel, &alist);
+    CHKERRQ(ierr);
+  }
+
+  nact = 0;
+  nactive = 0;
+  for (PetscInt i = 0; i < nel; i++) {
+    if (domain->IsDesign (i)) {
+      elist[nact++] = i;
+    }
+    if (domain->GetKind (i) != DomainMask::NONE) {
+      alist[nactive++] = i;
+    }
+  }
+
+  maskState = domain->GetState ();
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::GetColors (PetscInt *ncolors,
+    const PetscInt *color[]) {
+
+  PetscErrorCode ierr = 0;
+
+  // Greedy colouring in the element order, which gives the 2^DIM parity
+  // colours of the structured mesh
+  if (this->color == NULL) {
+    PetscInt nnodes = 0;
+    for (PetscInt i = 0; i < nel * nen; i++) {
+      nnodes = PetscMax(nnodes, necon[i] + 1);
+    }
+    // Colours used by the elements of each node, one bit per colour
+    PetscInt64 *used;
+    ierr = PetscCalloc1(nnodes, &used);
+    CHKERRQ(ierr);
+    ierr = PetscMalloc1(nel, &(this->color));
+    CHKERRQ(ierr);
+
+    this->ncolors = 0;
+    for (PetscInt i = 0; i < nel; i++) {
+      PetscInt64 taken = 0;
+      for (PetscInt j = 0; j < nen; j++) {
+        taken |= used[necon[i * nen + j]];
+      }
+      PetscInt c = 0;
+      while (taken & ((PetscInt64) 1 << c)) {
+        c++;
+      }
+      this->color[i] = c;
+      this->ncolors = PetscMax(this->ncolors, c + 1);
+      for (PetscInt j = 0; j < nen; j++) {
+        used[necon[i * nen + j]] |= (PetscInt64) 1 << c;
+      }
+    }
+    ierr = PetscFree(used);
+    CHKERRQ(ierr);
+  }
+
+  *ncolors = this->ncolors;
+  *color = this->color;
+
+  return ierr;
+}
+
+PetscErrorCode ElementMesh::CheckLayout (DM dm) {
+
+  PetscErrorCode ierr = 0;
+
+  PetscInt c0[6], c1[6], g0[6], g1[6];
+  ierr = DMDAGetCorners (da_nodes, &c0[0], &c0[1], &c0[2], &c0[3], &c0[4],
+      &c0[5]);
+  CHKERRQ(ierr);
+  ierr = DMDAGetCorners (dm, &c1[0], &c1[1], &c1[2], &c1[3], &c1[4], &c1[5]);
+  CHKERRQ(ierr);
+  ierr = DMDAGetGhostCorners (da_nodes, &g0[0], &g0[1], &g0[2], &g0[3],
+      &g0[4], &g0[5]);
+  CHKERRQ(ierr);
+  ierr = DMDAGetGhostCorners (dm, &g1[0], &g1[1], &g1[2], &g1[3], &g1[4],
+      &g1[5]);
+  CHKERRQ(ierr);
+
+  for (PetscInt i = 0; i < 6; i++) {
+    if (c0[i] != c1[i] || g0[i] != g1[i]) {
+      SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_INCOMP,
+          "Nodal mesh does not share the layout of the element mesh cache");
+    }
+  }
+
+  return ierr;
+}
+
+#if DIM == 2
+PetscErrorCode ElementMesh::DMDAGetElements (DM dm, PetscInt *nel,
+    PetscInt *nen, const PetscInt *e[]) {
+  PetscErrorCode ierr;
+  DM_DA *da = (DM_DA*) dm->data;
+  PetscInt i, xs, xe, Xs, Xe;
+  PetscInt j, ys, ye, Ys, Ye;
+  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
+  PetscInt c;
+  if (!da->e) {
+    if (da->elementtype == DMDA_ELEMENT_Q1) {
+      ns = 1;
+      nn = 4;
+    }
+    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
+    CHKERRQ(ierr);
+    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
+    CHKERRQ(ierr);
+    xe += xs;
+    Xe += Xs;
+    if (xs != Xs) xs -= 1;
+    ye += ys;
+    Ye += Ys;
+    if (ys != Ys) ys -= 1;
+
+    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
+    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
+    for (j = ys; j < ye - 1; j++) {
+      for (i = xs; i < xe - 1; i++) {
+        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
+        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
+        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
+        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
+        if (da->elementtype == DMDA_ELEMENT_Q1) {
+          for (c = 0; c < ns * nn; c++)
+            da->e[cnt++] = cell[c];
+        }
+      }
+    }
+  }
+  *nel = da->ne;
+  *nen = nn;
+  *e = da->e;
+  return (0);
+}
+#elif DIM == 3
+PetscErrorCode ElementMesh::DMDAGetElements (DM dm, PetscInt *nel,
+    PetscInt *nen, const PetscInt *e[]) {
+  PetscErrorCode ierr;
+  DM_DA *da = (DM_DA*) dm->data;
+  PetscInt i, xs, xe, Xs, Xe;
+  PetscInt j, ys, ye, Ys, Ye;
+  PetscInt k, zs, ze, Zs, Ze;
+  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
+  PetscInt c;
+  if (!da->e) {
+    if (da->elementtype == DMDA_ELEMENT_Q1) {
+      ns = 1;
+      nn = 8;
+    }
+    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
+    CHKERRQ(ierr);
+    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
+    CHKERRQ(ierr);
+    xe += xs;
+    Xe += Xs;
+    if (xs != Xs) xs -= 1;
+    ye += ys;
+    Ye += Ys;
+    if (ys != Ys) ys -= 1;
+    ze += zs;
+    Ze += Zs;
+    if (zs != Zs) zs -= 1;
+    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
+    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
+    for (k = zs; k < ze - 1; k++) {
+      for (j = ys; j < ye - 1; j++) {
+        for (i = xs; i < xe - 1; i++) {
+          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
+                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
+          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
+                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
+          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
+                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
+          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
+                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
+          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
+                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
+          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
+                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
+          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
+                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
+          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
+                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
+          if (da->elementtype == DMDA_ELEMENT_Q1) {
+            for (c = 0; c < ns * nn; c++)
+              da->e[cnt++] = cell[c];
+          }
+        }
+      }
+    }
+  }
+  *nel = da->ne;
+  *nen = nn;
+  *e = da->e;
+  return (0);
+}
+#endif
+
+} // namespace TOPOPT_NS
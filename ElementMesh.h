@@ -0,0 +1,134 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: Apr. 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * ElementMesh.h
+ *
+ * Element connectivity of a nodal DMDA, built once and shared.
+ *
+ * TopOpt owns the instance of the nodal mesh da_nodes and hands it to the
+ * physics and the pre-/post-processing. The nodal meshes of the physics
+ * and of the filters are created with the same sizes, partitioning and
+ * stencil as da_nodes, so their local (ghosted) node numbering and element
+ * ordering is identical and the cached tables are valid for all of them
+ * (see CheckLayout).
+ *
+ * Cached are:
+ *  - necon: local element -> local node numbers (nel x nen)
+ *  - edof: local element -> local dof numbers for 1..3 dofs per node
+ *    (nel x nen*ndof), built on first request
+ *  - the lists of the design and of the active elements (see DomainMask),
+ *    rebuilt when the domain mask has changed since they were built
+ *  - a colouring of the elements: elements of one colour share no node,
+ *    so threads can scatter-add into nodal arrays colour by colour
+ *
+ * DMDAGetElements is the one implementation of the Q1 connectivity used by
+ * all classes, also on DMs that are not da_nodes (multigrid levels, ...).
+ */
+
+#ifndef ELEMENTMESH_H_
+#define ELEMENTMESH_H_
+
+#include <petsc.h>
+#include <petsc/private/dmdaimpl.h>
+
+#include "options.h" // framework options
+#include "DomainMask.h" // domain membership of the elements
+#include "AssemblyMap.h" // cached scatter into AIJ matrices
+
+namespace TOPOPT_NS {
+
+class ElementMesh {
+
+  public:
+
+    // Build the connectivity of the nodal mesh
+    ElementMesh (DM da_nodes);
+
+    // Destructor
+    ~ElementMesh ();
+
+    // Local elements and their local node numbers
+    PetscErrorCode GetElements (PetscInt *nel, PetscInt *nen,
+        const PetscInt *e[]);
+
+    // Local dof numbers of all local elements for ndof dofs per node
+    PetscErrorCode GetEdof (PetscInt ndof, const PetscInt *edof[]);
+
+    // Local design elements of the domain mask
+    PetscErrorCode GetDesignElements (DomainMask *domain, PetscInt *nact,
+        const PetscInt *elist[]);
+
+    // Local active elements of the domain mask, i.e. the elements of the
+    // design and the passive domains (all but the ones outside)
+    PetscErrorCode GetActiveElements (DomainMask *domain, PetscInt *nact,
+        const PetscInt *alist[]);
+
+    // Global vector active of the nodal mesh dm with ndof dofs per node:
+    // 1 at the dofs of active elements, 0 at the dofs that belong only to
+    // elements outside of all domains
+    PetscErrorCode GetActiveDofs (DomainMask *domain, DM dm, PetscInt ndof,
+        Vec active);
+
+    // Constrain the dofs outside of all domains like Dirichlet dofs: zero
+    // them in the Dirichlet vector N of dm with ndof dofs per node, and
+    // report their number if print is set
+    PetscErrorCode EliminateVoidDofs (DomainMask *domain, DM dm,
+        PetscInt ndof, Vec N, PetscBool print);
+
+    // Cached scatter of the element matrices with ndof dofs per node into
+    // A (see AssemblyMap.h), built into *map on first use (*map == NULL);
+    // *map reports whether the structure of A is supported
+    PetscErrorCode SetUpAssemblyMap (Mat A, PetscInt ndof, AssemblyMap **map);
+
+    // Colour of every local element (0..ncolors-1), built on first request
+    PetscErrorCode GetColors (PetscInt *ncolors, const PetscInt *color[]);
+
+    // Check that dm has the local node layout of the nodal mesh
+    PetscErrorCode CheckLayout (DM dm);
+
+    // Q1 connectivity of a DMDA, cached by the DMDA. Unlike DMDAGetElements
+    // of PETSc the element type is not changed upon repeated calls.
+    static PetscErrorCode DMDAGetElements (DM dm, PetscInt *nel,
+        PetscInt *nen, const PetscInt *e[]);
+
+  private:
+
+    static const PetscInt maxdof = 3; // Maximum number of dofs per node
+
+    DM da_nodes; // Nodal mesh (referenced)
+    PetscInt nel, nen; // Number of local elements and nodes per element
+    const PetscInt *necon; // Element connectivity (cached by the DMDA)
+    PetscInt *edof[maxdof + 1]; // edof tables, indexed by dofs per node
+
+    // Rebuild the element lists if the domain mask has changed
+    PetscErrorCode UpdateElementLists (DomainMask *domain);
+
+    PetscInt maskState; // state of the domain mask of the lists, -1 if none
+    PetscInt nact; // Number of local design elements
+    PetscInt *elist; // Local design elements
+    PetscInt nactive; // Number of local active elements
+    PetscInt *alist; // Local active elements
+
+    PetscInt ncolors; // Number of element colours, 0 if not built
+    PetscInt *color; // Colour of each local element
+};
+
+} // namespace TOPOPT_NS
+
+#endif /* ELEMENTMESH_H_ */
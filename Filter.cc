@@ -1,5 +1,7 @@
 #include "Filter.h"
 
+namespace TOPOPT_NS {
+
 /* -----------------------------------------------------------------------------
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
  Copyright (C) 2013-2014,
@@ -28,20 +30,39 @@
 
 // # modified
 Filter::Filter (DM da_nodes, Vec x, PetscInt filterT, PetscScalar Rin,
-    Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3) {
+    DomainMask *domain) {
   // Set all pointers to NULL
   H = NULL;
   Hs = NULL;
   dx = NULL; // # new added
+  xwork = NULL; // # new
+  dxState = -1; // # new
+  dxBeta = 0.0; // # new
+  dxEta = 0.0; // # new
   da_elem = NULL;
   pdef = NULL;
+  w = NULL; // # new
+  dloc = NULL; // # new
+  xloc = NULL; // # new
+  G = NULL; // # new
+  HG = NULL; // # new
+  da_multi = NULL; // # new
+  gglob = NULL; // # new
+  hglob = NULL; // # new
+  gloc = NULL; // # new
+  ncols = 0; // # new
+
+  // # new; apply H by its stencil instead of an assembled matrix
+  matrixFree = PETSC_FALSE;
+  PetscBool flg;
+  PetscOptionsGetBool (NULL, NULL, "-filterMatrixFree", &matrixFree, &flg);
 
   // Get parameters
   R = Rin;
   filterType = filterT;
 
   // Call the setup method
-  SetUp (da_nodes, x, xPassive0, xPassive1, xPassive2, xPassive3); // # modified
+  SetUp (da_nodes, x, domain); // # modified
 }
 
 Filter::~Filter () {
@@ -61,6 +82,11 @@ Filter::~Filter () {
   if (dx != NULL) {
     VecDestroy (&dx);
   }
+  if (xwork != NULL) VecDestroy (&xwork); // # new
+  PetscFree (w); // # new
+  if (dloc != NULL) VecDestroy (&dloc); // # new
+  if (xloc != NULL) VecDestroy (&xloc); // # new
+  FreeColumns (); // # new
 }
 
 // Filter design variables
@@ -69,41 +95,18 @@ PetscErrorCode Filter::FilterProject (Vec x, Vec xTilde, Vec xPhys,
   PetscErrorCode ierr;
 
   // Filter the design variables or copy to xPhys
+  // # modified; the normalization (or bound check), the projection and its
+  // chain rule factor run in one pass, see ProjectKernel
   // STANDARD FILTER
   if (filterType == 1) {
     // Filter the densitities
     ierr = MatMult (H, x, xTilde);
     CHKERRQ(ierr);
-    VecPointwiseDivide (xTilde, xTilde, Hs);
   }
   // PDE FILTER
   else if (filterType == 2) {
     ierr = pdef->FilterProject (x, xTilde);
     CHKERRQ(ierr);
-    // Check for bound violation: simple, but cheap check!
-    PetscScalar *xp;
-    PetscInt locsiz;
-    VecGetArray (xTilde, &xp);
-    VecGetLocalSize (xTilde, &locsiz);
-    for (PetscInt i = 0; i < locsiz; i++) {
-      if (xp[i] < 0.0) {
-        if (PetscAbsReal(xp[i]) > 1.0e-4) {
-          PetscPrintf (PETSC_COMM_WORLD,
-              "BOUND VIOLATION IN PDEFILTER - INCREASE RMIN OR MESH "
-                  "RESOLUTION: xPhys = %f\n", xp[i]);
-        }
-        xp[i] = 0.0;
-      }
-      if (xp[i] > 1.0) {
-        if (PetscAbsReal(xp[i] - 1.0) > 1.0e-4) {
-          PetscPrintf (PETSC_COMM_WORLD,
-              "BOUND VIOLATION IN PDEFILTER - INCREASE RMIN OR MESH "
-                  "RESOLUTION: xPhys = %f\n", xp[i]);
-        }
-        xp[i] = 1.0;
-      }
-    }
-    VecRestoreArray (xTilde, &xp);
   }
   // COPY IN CASE OF SENSITIVITY FILTER
   else {
@@ -111,12 +114,8 @@ PetscErrorCode Filter::FilterProject (Vec x, Vec xTilde, Vec xPhys,
     CHKERRQ(ierr);
   }
 
-  // Check for projection
-  if (projectionFilter) {
-    HeavisideFilter (xPhys, xTilde, beta, eta);
-  } else {
-    VecCopy (xTilde, xPhys);
-  }
+  ierr = ProjectKernel (xTilde, xPhys, projectionFilter, beta, eta);
+  CHKERRQ(ierr);
 
   return ierr;
 }
@@ -126,84 +125,67 @@ PetscErrorCode Filter::Gradients (Vec x, Vec xTilde, Vec dfdx, PetscInt m,
     Vec *dgdx, PetscBool projectionFilter, PetscScalar beta, PetscScalar eta) {
 
   PetscErrorCode ierr = 0;
-  // Cheinrule for projection filtering
-  if (projectionFilter) {
-
-    // Get correction
-    ChainruleHeavisideFilter (dx, xTilde, beta, eta);
 
-    PetscScalar *xt, *dg, *df, *dxp;
-    PetscInt locsiz;
+  // # modified; objective and constraints as one set of fields
+  Vec *v;
+  ierr = PetscMalloc1 (m + 1, &v);
+  CHKERRQ(ierr);
+  v[0] = dfdx;
+  for (PetscInt i = 0; i < m; i++) {
+    v[i + 1] = dgdx[i];
+  }
 
-    ierr = VecGetLocalSize (xTilde, &locsiz);
-    CHKERRQ(ierr);
-    ierr = VecGetArray (xTilde, &xt);
-    CHKERRQ(ierr);
-    ierr = VecGetArray (dx, &dxp);
-    CHKERRQ(ierr);
-    // Objective function
-    ierr = VecGetArray (dfdx, &df);
-    CHKERRQ(ierr);
-    for (PetscInt j = 0; j < locsiz; j++) {
-      df[j] = df[j] * dxp[j];
-    }
-    ierr = VecRestoreArray (dfdx, &df);
-    CHKERRQ(ierr);
-    // Run through all constraints
-    for (PetscInt i = 0; i < m; i++) {
-      ierr = VecGetArray (dgdx[i], &dg);
+  // Cheinrule for projection filtering
+  if (projectionFilter) {
+    // # modified; the factor of the last FilterProject, unless the design or
+    // beta changed since
+    PetscObjectState state;
+    PetscObjectStateGet ((PetscObject) xTilde, &state);
+    if (state != dxState || beta != dxBeta || eta != dxEta) {
+      ierr = ProjectKernel (xTilde, NULL, projectionFilter, beta, eta);
       CHKERRQ(ierr);
-      // The eta item corresponding to the correct realization
-      for (PetscInt j = 0; j < locsiz; j++) {
-        dg[j] = dg[j] * dxp[j];
-      }
-      ierr = VecRestoreArray (dgdx[i], &dg);
+    }
+    // The standard filter applies it while packing the fields
+    if (filterType != 1) {
+      ierr = ScaleFields (m + 1, v, dx);
       CHKERRQ(ierr);
     }
-    ierr = VecRestoreArray (dx, &dxp);
-    CHKERRQ(ierr);
-    ierr = VecRestoreArray (dgdx[0], &dg);
-    CHKERRQ(ierr);
-    ierr = VecRestoreArray (xTilde, &xt);
-    CHKERRQ(ierr);
   }
 
   // Chainrule/Filter for the sensitivities
   if (filterType == 0)
       // Filter the sensitivities, df,dg
       {
-    Vec xtmp;
-    ierr = VecDuplicate (xTilde, &xtmp);
+    // # modified; persistent work vector, one pass for both divisions
+    VecPointwiseMult (xwork, dfdx, x);
+    ierr = MatMult (H, xwork, dfdx);
     CHKERRQ(ierr);
-    VecPointwiseMult (xtmp, dfdx, x);
-    MatMult (H, xtmp, dfdx);
-    VecPointwiseDivide (xtmp, dfdx, Hs);
-    VecPointwiseDivide (dfdx, xtmp, x);
-    VecDestroy (&xtmp);
+    PetscScalar *df;
+    const PetscScalar *hs, *xp;
+    PetscInt locsiz;
+    VecGetLocalSize (dfdx, &locsiz);
+    VecGetArray (dfdx, &df);
+    VecGetArrayRead (Hs, &hs);
+    VecGetArrayRead (x, &xp);
+    TOPOPT_OMP(omp parallel for schedule(static))
+    for (PetscInt j = 0; j < locsiz; j++) {
+      df[j] = df[j] / hs[j] / xp[j];
+    }
+    VecRestoreArray (dfdx, &df);
+    VecRestoreArrayRead (Hs, &hs);
+    VecRestoreArrayRead (x, &xp);
   } else if (filterType == 1) {
     // Filter the densities, df,dg: STANDARD FILTER
-    Vec xtmp;
-    ierr = VecDuplicate (x, &xtmp);
+    // # modified; all gradients in one pass over H
+    ierr = FilterColumns (m + 1, v, projectionFilter ? dx : NULL);
     CHKERRQ(ierr);
-    // dfdx
-    VecPointwiseDivide (xtmp, dfdx, Hs);
-    MatMult (H, xtmp, dfdx);
-    // dgdx
-    for (PetscInt i = 0; i < m; i++) {
-      VecPointwiseDivide (xtmp, dgdx[i], Hs);
-      MatMult (H, xtmp, dgdx[i]);
-    }
-    // tidy up
-    VecDestroy (&xtmp);
   } else if (filterType == 2) {
     // Filter the densities, df,dg: PDE FILTER
-    ierr = pdef->Gradients (dfdx, dfdx);
+    // # modified; all gradients in one pass over T
+    ierr = pdef->Gradients (m + 1, v);
     CHKERRQ(ierr);
-    for (PetscInt i = 0; i < m; i++) {
-      ierr = pdef->Gradients (dgdx[i], dgdx[i]);
-      CHKERRQ(ierr);
-    }
   }
+  PetscFree (v);
 
   return ierr;
 }
@@ -229,47 +211,123 @@ PetscScalar Filter::GetMND (Vec x) {
   return mnd;
 }
 
-PetscErrorCode Filter::HeavisideFilter (Vec y, Vec x, PetscReal beta,
-    PetscReal eta) {
-  PetscErrorCode ierr;
+PetscErrorCode Filter::ProjectKernel (Vec xTilde, Vec xPhys,
+    PetscBool projectionFilter, PetscReal beta, PetscReal eta) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  // With xPhys, xTilde is completed first: divided by Hs (standard filter)
+  // or checked for bound violations (PDE filter)
+  PetscBool normalize = (PetscBool) (xPhys != NULL && filterType == 1);
+  PetscBool clamp = (PetscBool) (xPhys != NULL && filterType == 2);
+  PetscBool project = projectionFilter;
+
+  // The constants of the projection, y = (te + tanh(beta (x - eta))) / den
+  const PetscReal te = tanh (beta * eta);
+  const PetscReal den = te + tanh (beta * (1.0 - eta));
 
-  PetscScalar *yp, *xp;
+  PetscScalar *xt, *xp = NULL, *dxp = NULL;
+  const PetscScalar *hs = NULL;
   PetscInt nelloc;
-  VecGetLocalSize (x, &nelloc);
-  ierr = VecGetArray (x, &xp);
-  CHKERRQ(ierr);
-  ierr = VecGetArray (y, &yp);
-  CHKERRQ(ierr);
+  VecGetLocalSize (xTilde, &nelloc);
+  if (xPhys != NULL) {
+    ierr = VecGetArray (xTilde, &xt);
+    CHKERRQ(ierr);
+    ierr = VecGetArray (xPhys, &xp);
+    CHKERRQ(ierr);
+  } else {
+    ierr = VecGetArrayRead (xTilde, (const PetscScalar**) &xt);
+    CHKERRQ(ierr);
+  }
+  if (normalize) {
+    VecGetArrayRead (Hs, &hs);
+  }
+  if (project) {
+    VecGetArray (dx, &dxp);
+  }
 
+  PetscReal violation = 0.0;
+  TOPOPT_OMP(omp parallel for reduction(max:violation) schedule(static))
   for (PetscInt i = 0; i < nelloc; i++) {
-    yp[i] = SmoothProjection (xp[i], beta, eta);
+    PetscScalar x = xt[i];
+    if (normalize) {
+      x = x / hs[i];
+      xt[i] = x;
+    } else if (clamp) {
+      if (x < 0.0 || x > 1.0) {
+        violation = PetscMax(violation, PetscMax(-x, x - 1.0));
+        x = PetscMin(PetscMax(x, 0.0), 1.0);
+        xt[i] = x;
+      }
+    }
+    if (project) {
+      PetscReal t = tanh (beta * (x - eta));
+      if (xPhys != NULL) xp[i] = (te + t) / den;
+      dxp[i] = beta * (1.0 - t * t) / den;
+    } else if (xPhys != NULL) {
+      xp[i] = x;
+    }
   }
-  ierr = VecRestoreArray (x, &xp);
-  CHKERRQ(ierr);
-  ierr = VecRestoreArray (y, &yp);
-  CHKERRQ(ierr);
+
+  if (project) {
+    VecRestoreArray (dx, &dxp);
+  }
+  if (normalize) {
+    VecRestoreArrayRead (Hs, &hs);
+  }
+  if (xPhys != NULL) {
+    ierr = VecRestoreArray (xPhys, &xp);
+    CHKERRQ(ierr);
+    ierr = VecRestoreArray (xTilde, &xt);
+    CHKERRQ(ierr);
+  } else {
+    ierr = VecRestoreArrayRead (xTilde, (const PetscScalar**) &xt);
+    CHKERRQ(ierr);
+  }
+
+  // Check for bound violation of the PDE filter: simple, but cheap check!
+  if (clamp) {
+    PetscReal vmax;
+    MPI_Allreduce (&violation, &vmax, 1, MPIU_REAL, MPI_MAX,
+        PETSC_COMM_WORLD);
+    if (vmax > 1.0e-4) {
+      PetscPrintf (PETSC_COMM_WORLD,
+          "BOUND VIOLATION IN PDEFILTER - INCREASE RMIN OR MESH "
+              "RESOLUTION: max. violation = %f\n", vmax);
+    }
+  }
+
+  // The chain rule factor holds for this xTilde and projection
+  if (project) {
+    PetscObjectStateGet ((PetscObject) xTilde, &dxState);
+    dxBeta = beta;
+    dxEta = eta;
+  }
+
   return ierr;
 }
 
-PetscErrorCode Filter::ChainruleHeavisideFilter (Vec y, Vec x, PetscReal beta,
-    PetscReal eta) {
-  PetscErrorCode ierr;
+PetscErrorCode Filter::ScaleFields (PetscInt nv, Vec *v, Vec s) { // # new
 
-  PetscScalar *yp, *xp;
-  PetscInt nelloc;
-  VecGetLocalSize (x, &nelloc);
-  ierr = VecGetArray (x, &xp);
-  CHKERRQ(ierr);
-  ierr = VecGetArray (y, &yp);
-  CHKERRQ(ierr);
+  PetscErrorCode ierr = 0;
 
-  for (PetscInt i = 0; i < nelloc; i++) {
-    yp[i] = ChainruleSmoothProjection (xp[i], beta, eta);
+  PetscInt nelloc;
+  VecGetLocalSize (s, &nelloc);
+  const PetscScalar *sp;
+  VecGetArrayRead (s, &sp);
+  for (PetscInt k = 0; k < nv; k++) {
+    PetscScalar *vp;
+    ierr = VecGetArray (v[k], &vp);
+    CHKERRQ(ierr);
+    TOPOPT_OMP(omp parallel for schedule(static))
+    for (PetscInt j = 0; j < nelloc; j++) {
+      vp[j] = vp[j] * sp[j];
+    }
+    ierr = VecRestoreArray (v[k], &vp);
+    CHKERRQ(ierr);
   }
-  ierr = VecRestoreArray (x, &xp);
-  CHKERRQ(ierr);
-  ierr = VecRestoreArray (y, &yp);
-  CHKERRQ(ierr);
+  VecRestoreArrayRead (s, &sp);
+
   return ierr;
 }
 
@@ -297,13 +355,15 @@ PetscBool Filter::IncreaseBeta (PetscReal *beta, PetscReal betaFinal,
   return changeBeta;
 }
 
-PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
-    Vec xPassive2, Vec xPassive3) {
+PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, DomainMask *domain) {
 
   PetscErrorCode ierr = 0;
 
+  double t1 = MPI_Wtime (); // # new
+
   VecDuplicate (x, &dx);
   VecSet (dx, 1.0);
+  VecDuplicate (x, &xwork); // # new; work vector of the gradients
 
   if (filterType == 0 || filterType == 1) {
 #if DIM == 2   // # new
@@ -323,7 +383,7 @@ PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
 
     PetscInt nel, nen;
     const PetscInt *necon;
-    DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
+    ElementMesh::DMDAGetElements (da_nodes, &nel, &nen, &necon);
 
     PetscScalar dx, dy;
     // Use the first element to compute the dx, dy
@@ -385,109 +445,10 @@ PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
     DMDASetUniformCoordinates (da_elem, dx / 2.0, xmax - dx / 2.0, dy / 2.0,
         ymax - dy / 2.0, 0.0, 0.0);
 
-    // Allocate and assemble
-    DMCreateMatrix (da_elem, &H);
-    DMCreateGlobalVector (da_elem, &Hs);
-
-    // Set the filter matrix and vector
-    DMGetCoordinatesLocal (da_elem, &lcoor);
-    VecGetArray (lcoor, &lcoorp);
-    DMDALocalInfo info;
-    DMDAGetLocalInfo (da_elem, &info);
-    // The variables from info that are used are described below:
-    // -------------------------------------------------------------------------
-    // sw = Stencil width
-    // mx, my = Global number of "elements" in each direction
-    // xs, ys = Starting point of this processor, excluding ghosts
-    // xm, ym = Number of grid points on this processor, excluding ghosts
-    // gxs, gys = Starting point of this processor, including ghosts
-    // gxm, gym = Number of grid points on this processor, including ghosts
-    // -------------------------------------------------------------------------
-
-    // Outer loop is local part = find row
-    // What is done here, is:
-    //
-    // 1. Run through all elements in the mesh - should not include ghosts
-    for (PetscInt j = info.ys; j < info.ys + info.ym; j++) {
-      for (PetscInt i = info.xs; i < info.xs + info.xm; i++) {
-        // The row number of the element we are considering:
-        PetscInt row = (i - info.gxs) + (j - info.gys) * (info.gxm);
-        //
-        // 2. Loop over nodes (including ghosts) within a square area with
-        // center at (i,j)
-        //    For each element, run through all elements in a box of size
-        //    stencilWidth * stencilWidth * stencilWidth Remark, we want to
-        //    make sure we are not running "out of the domain", therefore k2
-        //    etc. are limited to the max global index (info.my-1 etc.)
-
-        for (PetscInt j2 = PetscMax(j - info.sw, 0);
-            j2 <= PetscMin(j + info.sw, info.my - 1); j2++) {
-          for (PetscInt i2 = PetscMax(i - info.sw, 0);
-              i2 <= PetscMin(i + info.sw, info.mx - 1); i2++) {
-            PetscInt col = (i2 - info.gxs) + (j2 - info.gys) * (info.gxm);
-            PetscScalar dist = 0.0;
-            // Compute the distance from the "col"-element to the
-            // "row"-element
-            for (PetscInt kk = 0; kk < 2; kk++) {
-              dist = dist
-                  + PetscPowScalar(lcoorp[2 * row + kk] - lcoorp[2 * col + kk],
-                      2.0);
-            }
-            dist = PetscSqrtScalar(dist);
-            if (dist < R) {
-              // Longer distances should have less weight
-              dist = R - dist;
-              MatSetValuesLocal (H, 1, &row, 1, &col, &dist, INSERT_VALUES);
-            }
-          }
-        }
-      }
-    }
-
-    // Exclude the non-designable domain from the distance matrix
-    // Get pointer to the Petsc Vectors
-    PetscScalar **xPassive0p_2D, **xPassive1p_2D, **xPassive2p_2D, **xPassive3p_2D;
-    Vec xPassive0loc, xPassive1loc, xPassive2loc, xPassive3loc;
-    DMCreateLocalVector (da_elem, &xPassive0loc);
-    DMGlobalToLocalBegin (da_elem, xPassive0, INSERT_VALUES, xPassive0loc);
-    DMGlobalToLocalEnd (da_elem, xPassive0, INSERT_VALUES, xPassive0loc);
-    DMDAVecGetArray (da_elem, xPassive0loc, &xPassive0p_2D);
-    DMCreateLocalVector (da_elem, &xPassive1loc);
-    DMGlobalToLocalBegin (da_elem, xPassive1, INSERT_VALUES, xPassive1loc);
-    DMGlobalToLocalEnd (da_elem, xPassive1, INSERT_VALUES, xPassive1loc);
-    DMDAVecGetArray (da_elem, xPassive1loc, &xPassive1p_2D);
-    DMCreateLocalVector (da_elem, &xPassive2loc);
-    DMGlobalToLocalBegin (da_elem, xPassive2, INSERT_VALUES, xPassive2loc);
-    DMGlobalToLocalEnd (da_elem, xPassive2, INSERT_VALUES, xPassive2loc);
-    DMDAVecGetArray (da_elem, xPassive2loc, &xPassive2p_2D);
-    DMCreateLocalVector (da_elem, &xPassive3loc);
-    DMGlobalToLocalBegin (da_elem, xPassive3, INSERT_VALUES, xPassive3loc);
-    DMGlobalToLocalEnd (da_elem, xPassive3, INSERT_VALUES, xPassive3loc);
-    DMDAVecGetArray (da_elem, xPassive3loc, &xPassive3p_2D);
-
-    PetscScalar dist;
-    for (PetscInt j = info.ys; j < info.ys + info.ym; j++) {
-      for (PetscInt i = info.xs; i < info.xs + info.xm; i++) {
-
-        if (xPassive0p_2D[j][i] == 0) {
-          PetscInt row = (i - info.gxs) + (j - info.gys) * (info.gxm);
-          for (PetscInt j2 = PetscMax(j - info.sw, 0);
-              j2 <= PetscMin(j + info.sw, info.my - 1); j2++) {
-            for (PetscInt i2 = PetscMax(i - info.sw, 0);
-                i2 <= PetscMin(i + info.sw, info.mx - 1); i2++) {
-              PetscInt col = (i2 - info.gxs) + (j2 - info.gys) * (info.gxm);
-              if (i2 == i && j2 == j) {
-                dist = 1.0;
-              } else {
-                dist = 0.0;
-              }
-              MatSetValuesLocal (H, 1, &row, 1, &col, &dist, INSERT_VALUES);
-              MatSetValuesLocal (H, 1, &col, 1, &row, &dist, INSERT_VALUES);
-            }
-          }
-        }
-      }
-    }
+    // # new; element size of the stencil weights
+    PetscScalar h[3] = { dx, dy, 0.0 };
+    delete[] Lx;
+    delete[] Ly;
 
 #elif DIM == 3
     // Extract information from the nodal mesh
@@ -505,7 +466,7 @@ PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
 
     PetscInt nel, nen;
     const PetscInt *necon;
-    DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
+    ElementMesh::DMDAGetElements (da_nodes, &nel, &nen, &necon);
 
     PetscScalar dx, dy, dz;
     // Use the first element to compute the dx, dy, dz
@@ -570,121 +531,35 @@ PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
     PetscScalar zmax = (P - 1) * dz;
     DMDASetUniformCoordinates (da_elem, dx / 2.0, xmax - dx / 2.0, dy / 2.0, ymax - dy / 2.0, dz / 2.0, zmax - dz / 2.0);
 
-    // Allocate and assemble
-    DMCreateMatrix (da_elem, &H);
-    DMCreateGlobalVector (da_elem, &Hs);
-
-    // Set the filter matrix and vector
-    DMGetCoordinatesLocal (da_elem, &lcoor);
-    VecGetArray (lcoor, &lcoorp);
-    DMDALocalInfo info;
-    DMDAGetLocalInfo (da_elem, &info);
-    // The variables from info that are used are described below:
-    // -------------------------------------------------------------------------
-    // sw = Stencil width
-    // mx, my, mz = Global number of "elements" in each direction
-    // xs, ys, zs = Starting point of this processor, excluding ghosts
-    // xm, ym, zm = Number of grid points on this processor, excluding ghosts
-    // gxs, gys, gzs = Starting point of this processor, including ghosts
-    // gxm, gym, gzm = Number of grid points on this processor, including ghosts
-    // -------------------------------------------------------------------------
-
-    // Outer loop is local part = find row
-    // What is done here, is:
-    //
-    // 1. Run through all elements in the mesh - should not include ghosts
-    for (PetscInt k = info.zs; k < info.zs + info.zm; k++) {
-      for (PetscInt j = info.ys; j < info.ys + info.ym; j++) {
-        for (PetscInt i = info.xs; i < info.xs + info.xm; i++) {
-          // The row number of the element we are considering:
-          PetscInt row = (i - info.gxs) + (j - info.gys) * (info.gxm) + (k - info.gzs) * (info.gxm) * (info.gym);
-          //
-          // 2. Loop over nodes (including ghosts) within a cubic domain with
-          // center at (i,j,k)
-          //    For each element, run through all elements in a box of size
-          //    stencilWidth * stencilWidth * stencilWidth Remark, we want to
-          //    make sure we are not running "out of the domain", therefore k2
-          //    etc. are limited to the max global index (info.mz-1 etc.)
-          for (PetscInt k2 = PetscMax(k - info.sw, 0);
-              k2 <= PetscMin(k + info.sw, info.mz - 1); k2++) {
-            for (PetscInt j2 = PetscMax(j - info.sw, 0);
-                j2 <= PetscMin(j + info.sw, info.my - 1); j2++) {
-              for (PetscInt i2 = PetscMax(i - info.sw, 0);
-                  i2 <= PetscMin(i + info.sw, info.mx - 1); i2++) {
-                PetscInt col = (i2 - info.gxs) + (j2 - info.gys) * (info.gxm) + (k2 - info.gzs) * (info.gxm) * (info.gym);
-                PetscScalar dist = 0.0;
-                // Compute the distance from the "col"-element to the
-                // "row"-element
-                for (PetscInt kk = 0; kk < 3; kk++) {
-                  dist = dist + PetscPowScalar(lcoorp[3 * row + kk] - lcoorp[3 * col + kk], 2.0);
-                }
-                dist = PetscSqrtScalar(dist);
-                if (dist < R) {
-                  // Longer distances should have less weight
-                  dist = R - dist;
-                  MatSetValuesLocal (H, 1, &row, 1, &col, &dist, INSERT_VALUES);
-                }
-              }
-            }
-          }
-        }
-      }
-    }
-    // # new
-    // Exclude the non-designable domain from the distance matrix
-    // Get pointer to the Petsc Vectors
-    PetscScalar ***xPassive0p_3D, ***xPassive1p_3D, ***xPassive2p_3D, ***xPassive3p_3D;
-    Vec xPassive0loc, xPassive1loc, xPassive2loc, xPassive3loc;
-    DMCreateLocalVector (da_elem, &xPassive0loc);
-    DMGlobalToLocalBegin (da_elem, xPassive0, INSERT_VALUES, xPassive0loc);
-    DMGlobalToLocalEnd (da_elem, xPassive0, INSERT_VALUES, xPassive0loc);
-    DMDAVecGetArray (da_elem, xPassive0loc, &xPassive0p_3D);
-    DMCreateLocalVector (da_elem, &xPassive1loc);
-    DMGlobalToLocalBegin (da_elem, xPassive1, INSERT_VALUES, xPassive1loc);
-    DMGlobalToLocalEnd (da_elem, xPassive1, INSERT_VALUES, xPassive1loc);
-    DMDAVecGetArray (da_elem, xPassive1loc, &xPassive1p_3D);
-    DMCreateLocalVector (da_elem, &xPassive2loc);
-    DMGlobalToLocalBegin (da_elem, xPassive2, INSERT_VALUES, xPassive2loc);
-    DMGlobalToLocalEnd (da_elem, xPassive2, INSERT_VALUES, xPassive2loc);
-    DMDAVecGetArray (da_elem, xPassive2loc, &xPassive2p_3D);
-    DMCreateLocalVector (da_elem, &xPassive3loc);
-    DMGlobalToLocalBegin (da_elem, xPassive3, INSERT_VALUES, xPassive3loc);
-    DMGlobalToLocalEnd (da_elem, xPassive3, INSERT_VALUES, xPassive3loc);
-    DMDAVecGetArray (da_elem, xPassive3loc, &xPassive3p_3D);
-
-    PetscScalar dist;
-    for (PetscInt k = info.zs; k < info.zs + info.zm; k++) {
-      for (PetscInt j = info.ys; j < info.ys + info.ym; j++) {
-        for (PetscInt i = info.xs; i < info.xs + info.xm; i++) {
-          if (xPassive0p_3D[k][j][i] == 0) {
-            PetscInt row = (i - info.gxs) + (j - info.gys) * (info.gxm) + (k - info.gzs) * (info.gxm) * (info.gym);
-            for (PetscInt k2 = PetscMax(k - info.sw, 0);
-                k2 <= PetscMin(k + info.sw, info.mz - 1); k2++) {
-              for (PetscInt j2 = PetscMax(j - info.sw, 0);
-                  j2 <= PetscMin(j + info.sw, info.my - 1); j2++) {
-                for (PetscInt i2 = PetscMax(i - info.sw, 0);
-                    i2 <= PetscMin(i + info.sw, info.mx - 1); i2++) {
-                  PetscInt col = (i2 - info.gxs) + (j2 - info.gys) * (info.gxm) + (k2 - info.gzs) * (info.gxm) * (info.gym);
-                  if (i2 == i && j2 == j && k2 == k) {
-                    dist = 1.0;
-                  } else {
-                    dist = 0.0;
-                  }
-                  MatSetValuesLocal (H, 1, &row, 1, &col, &dist, INSERT_VALUES);
-                  MatSetValuesLocal (H, 1, &col, 1, &row, &dist, INSERT_VALUES);
-                }
-              }
-            }
-          }
-        }
-      }
-    }
+    // # new; element size of the stencil weights
+    PetscScalar h[3] = { dx, dy, dz };
+    delete[] Lx;
+    delete[] Ly;
+    delete[] Lz;
 
 #endif
 
-    // Assemble H:
-    MatAssemblyBegin (H, MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd (H, MAT_FINAL_ASSEMBLY);
+    // # new; Weights of the stencil and design mask of the ghosted elements
+    ierr = SetUpStencil (domain, h);
+    CHKERRQ(ierr);
+
+    DMCreateGlobalVector (da_elem, &Hs);
+    if (matrixFree) { // # new; H is applied by the stencil
+      PetscInt nloc, nglob;
+      VecGetLocalSize (Hs, &nloc);
+      VecGetSize (Hs, &nglob);
+      ierr = MatCreateShell (PETSC_COMM_WORLD, nloc, nloc, nglob, nglob,
+          (void*) this, &H);
+      CHKERRQ(ierr);
+      MatShellSetOperation (H, MATOP_MULT, (void (*) (void)) MatMult_Stencil);
+      MatShellSetOperation (H, MATOP_MULT_TRANSPOSE,
+          (void (*) (void)) MatMult_Stencil);
+      PetscPrintf (PETSC_COMM_WORLD, "# Filter: matrix-free \n");
+    } else {
+      ierr = AssembleMatrix (); // # modified; moved
+      CHKERRQ(ierr);
+    }
+
     // Compute the Hs, i.e. sum the rows
     Vec dummy;
     VecDuplicate (Hs, &dummy);
@@ -692,24 +567,11 @@ PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
     MatMult (H, dummy, Hs);
 
     // Clean up
-    VecRestoreArray (lcoor, &lcoorp);
     VecDestroy (&dummy);
-#if DIM == 2    // # new
-    delete[] Lx;
-    delete[] Ly;
-    DMDAVecRestoreArray (da_elem, xPassive0loc, &xPassive0p_2D);
-    DMDAVecRestoreArray (da_elem, xPassive1loc, &xPassive1p_2D);
-    DMDAVecRestoreArray (da_elem, xPassive2loc, &xPassive2p_2D);
-    DMDAVecRestoreArray (da_elem, xPassive3loc, &xPassive3p_2D);
-#elif DIM == 3
-    delete[] Lx;
-    delete[] Ly;
-    delete[] Lz;
-    DMDAVecRestoreArray (da_elem, xPassive0loc, &xPassive0p_3D);
-    DMDAVecRestoreArray (da_elem, xPassive1loc, &xPassive1p_3D);
-    DMDAVecRestoreArray (da_elem, xPassive2loc, &xPassive2p_3D);
-    DMDAVecRestoreArray (da_elem, xPassive3loc, &xPassive3p_3D);
-#endif
+
+    // # new
+    PetscPrintf (PETSC_COMM_WORLD, "# Filter setup time: %f s \n",
+        MPI_Wtime () - t1);
 
   } else if (filterType == 2) {
     // ALLOCATE AND SETUP THE PDE FILTER CLASS
@@ -719,107 +581,459 @@ PetscErrorCode Filter::SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
   return ierr;
 }
 
-#if DIM == 2    // # new
-PetscErrorCode Filter::DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-    const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 4;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
+PetscErrorCode Filter::AssembleMatrix () { // # new; moved from SetUp
+
+  PetscErrorCode ierr = 0;
+
+  // # modified; every row of H is built from the stencil weights and the
+  // design mask (see StencilRow), counted first for an exact preallocation
+  // and inserted with one call
+  DMDALocalInfo info;
+  DMDAGetLocalInfo (da_elem, &info);
+  const PetscScalar *dp;
+  VecGetArrayRead (dloc, &dp);
+  PetscInt nloc = info.xm * info.ym * info.zm;
+
+  PetscInt *dnnz, *onnz, *ia;
+  ierr = PetscMalloc1 (nloc, &dnnz);
+  CHKERRQ(ierr);
+  ierr = PetscMalloc1 (nloc, &onnz);
+  CHKERRQ(ierr);
+  ierr = PetscMalloc1 (nloc + 1, &ia);
+  CHKERRQ(ierr);
+  TOPOPT_OMP(omp parallel for schedule(static))
+  for (PetscInt e = 0; e < nloc; e++) {
+    PetscInt i = info.xs + e % info.xm;
+    PetscInt j = info.ys + (e / info.xm) % info.ym;
+    PetscInt k = info.zs + e / (info.xm * info.ym);
+    PetscInt nd, n = StencilRow (info, dp, i, j, k, NULL, NULL, &nd);
+    dnnz[e] = nd;
+    onnz[e] = n - nd;
+  }
+  ia[0] = 0;
+  for (PetscInt e = 0; e < nloc; e++) {
+    ia[e + 1] = ia[e] + dnnz[e] + onnz[e];
+  }
+
+  ierr = MatCreate (PETSC_COMM_WORLD, &H);
+  CHKERRQ(ierr);
+  ierr = MatSetSizes (H, nloc, nloc, PETSC_DETERMINE, PETSC_DETERMINE);
+  CHKERRQ(ierr);
+  ierr = MatSetType (H, MATAIJ);
+  CHKERRQ(ierr);
+  ISLocalToGlobalMapping ltog;
+  DMGetLocalToGlobalMapping (da_elem, &ltog);
+  ierr = MatSetLocalToGlobalMapping (H, ltog, ltog);
+  CHKERRQ(ierr);
+  ierr = MatXAIJSetPreallocation (H, 1, dnnz, onnz, NULL, NULL);
+  CHKERRQ(ierr);
+  // Every rank sets its own rows only
+  MatSetOption (H, MAT_NO_OFF_PROC_ENTRIES, PETSC_TRUE);
+
+  PetscInt *ja;
+  PetscScalar *va;
+  ierr = PetscMalloc1 (ia[nloc], &ja);
+  CHKERRQ(ierr);
+  ierr = PetscMalloc1 (ia[nloc], &va);
+  CHKERRQ(ierr);
+  TOPOPT_OMP(omp parallel for schedule(static))
+  for (PetscInt e = 0; e < nloc; e++) {
+    PetscInt i = info.xs + e % info.xm;
+    PetscInt j = info.ys + (e / info.xm) % info.ym;
+    PetscInt k = info.zs + e / (info.xm * info.ym);
+    PetscInt nd;
+    StencilRow (info, dp, i, j, k, ja + ia[e], va + ia[e], &nd);
+  }
+  // MatSetValues is not thread safe, the rows are inserted in order
+  for (PetscInt e = 0; e < nloc; e++) {
+    PetscInt i = info.xs + e % info.xm;
+    PetscInt j = info.ys + (e / info.xm) % info.ym;
+    PetscInt k = info.zs + e / (info.xm * info.ym);
+    PetscInt row = (i - info.gxs)
+        + ((j - info.gys) + (k - info.gzs) * info.gym) * info.gxm;
+    ierr = MatSetValuesLocal (H, 1, &row, ia[e + 1] - ia[e], ja + ia[e],
+        va + ia[e], INSERT_VALUES);
     CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs)
-      xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys)
-      ys -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (j = ys; j < ye - 1; j++) {
-      for (i = xs; i < xe - 1; i++) {
-        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-        if (da->elementtype == DMDA_ELEMENT_Q1) {
-          for (c = 0; c < ns * nn; c++)
-            da->e[cnt++] = cell[c];
+  }
+
+  // Assemble H:
+  MatAssemblyBegin (H, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd (H, MAT_FINAL_ASSEMBLY);
+  VecRestoreArrayRead (dloc, &dp);
+
+  PetscInt64 nnz = ia[nloc], nnzglob;
+  MPI_Allreduce (&nnz, &nnzglob, 1, MPIU_INT64, MPI_SUM, PETSC_COMM_WORLD);
+  PetscPrintf (PETSC_COMM_WORLD, "# Filter matrix: %lld nonzeros \n",
+      (long long) nnzglob);
+
+  PetscFree (dnnz);
+  PetscFree (onnz);
+  PetscFree (ia);
+  PetscFree (ja);
+  PetscFree (va);
+
+  return ierr;
+}
+
+PetscInt Filter::StencilRow (const DMDALocalInfo &info, const PetscScalar *dp,
+    PetscInt i, PetscInt j, PetscInt k, PetscInt *cols, PetscScalar *vals,
+    PetscInt *ndiag) { // # new
+
+  const PetscInt nb = 2 * sw + 1;
+  PetscInt row = (i - info.gxs)
+      + ((j - info.gys) + (k - info.gzs) * info.gym) * info.gxm;
+
+  // Elements outside the design domain are not filtered, H_ii = 1
+  if (dp[row] == 0.0) {
+    if (cols != NULL) {
+      cols[0] = row;
+      vals[0] = 1.0;
+    }
+    *ndiag = 1;
+    return 1;
+  }
+
+  // Otherwise the weights of the design elements within R; the box is
+  // clipped at the boundary of the domain (in 2D, mz = 1 and k = 0)
+  PetscInt n = 0;
+  *ndiag = 0;
+  for (PetscInt k2 = PetscMax(k - sw, 0); k2 <= PetscMin(k + sw, info.mz - 1);
+      k2++) {
+    for (PetscInt j2 = PetscMax(j - sw, 0);
+        j2 <= PetscMin(j + sw, info.my - 1); j2++) {
+      PetscInt wj = (((DIM == 3) ? (k2 - k + sw) * nb : 0) + j2 - j + sw) * nb
+          + sw - i;
+      PetscInt cj = ((k2 - info.gzs) * info.gym + j2 - info.gys) * info.gxm
+          - info.gxs;
+      PetscBool owned = (PetscBool) (k2 >= info.zs && k2 < info.zs + info.zm
+          && j2 >= info.ys && j2 < info.ys + info.ym);
+      for (PetscInt i2 = PetscMax(i - sw, 0);
+          i2 <= PetscMin(i + sw, info.mx - 1); i2++) {
+        PetscScalar wd = w[wj + i2] * dp[cj + i2];
+        if (wd == 0.0) continue;
+        if (cols != NULL) {
+          cols[n] = cj + i2;
+          vals[n] = wd;
         }
+        n++;
+        if (owned && i2 >= info.xs && i2 < info.xs + info.xm) (*ndiag)++;
       }
     }
   }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
+
+  return n;
 }
 
+PetscErrorCode Filter::SetUpStencil (DomainMask *domain,
+    const PetscScalar h[]) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  // The grid is uniform: the weight of an element only depends on its offset
+  DMDALocalInfo info;
+  DMDAGetLocalInfo (da_elem, &info);
+  sw = info.sw;
+  PetscInt nb = 2 * sw + 1;
+#if DIM == 2
+  nw = nb * nb;
 #elif DIM == 3
-PetscErrorCode Filter::DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
+  nw = nb * nb * nb;
+#endif
+  PetscFree (w);
+  ierr = PetscMalloc1 (nw, &w);
+  CHKERRQ(ierr);
+  PetscInt nnz = 0;
+  for (PetscInt o = 0; o < nw; o++) {
+    PetscScalar oi = (PetscScalar) (o % nb - sw) * h[0];
+    PetscScalar oj = (PetscScalar) ((o / nb) % nb - sw) * h[1];
+    PetscScalar ok = (DIM == 3) ? (PetscScalar) (o / (nb * nb) - sw) * h[2] : 0.0;
+    PetscScalar dist = PetscSqrtScalar(oi * oi + oj * oj + ok * ok);
+    // Longer distances should have less weight
+    w[o] = (PetscRealPart(dist) < PetscRealPart(R)) ? R - dist : 0.0;
+    if (w[o] != 0.0) nnz++;
+  }
+
+  // Design mask of the owned and the ghost elements: the elements outside
+  // the design domain are neither filtered nor part of a filtered value
+  Vec dmask;
+  DMCreateGlobalVector (da_elem, &dmask);
+  PetscScalar *dp;
+  PetscInt nloc;
+  VecGetLocalSize (dmask, &nloc);
+  VecGetArray (dmask, &dp);
+  for (PetscInt e = 0; e < nloc; e++) {
+    dp[e] = domain->IsDesign (e) ? 1.0 : 0.0;
+  }
+  VecRestoreArray (dmask, &dp);
+  if (dloc == NULL) {
+    DMCreateLocalVector (da_elem, &dloc);
+  }
+  DMGlobalToLocalBegin (da_elem, dmask, INSERT_VALUES, dloc);
+  DMGlobalToLocalEnd (da_elem, dmask, INSERT_VALUES, dloc);
+  VecDestroy (&dmask);
+
+  if (matrixFree && xloc == NULL) {
+    DMCreateLocalVector (da_elem, &xloc);
+  }
+
+  PetscPrintf (PETSC_COMM_WORLD, "# Filter stencil: %D weights per element\n",
+      nnz);
+
+  return ierr;
+}
+
+PetscErrorCode Filter::MatMult_Stencil (Mat A, Vec x, Vec y) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  Filter *f;
+  MatShellGetContext (A, (void**) &f);
+
+  ierr = DMGlobalToLocalBegin (f->da_elem, x, INSERT_VALUES, f->xloc);
+  CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd (f->da_elem, x, INSERT_VALUES, f->xloc);
+  CHKERRQ(ierr);
+
+  const PetscScalar *xp, *dp;
+  PetscScalar *yp;
+  VecGetArrayRead (f->xloc, &xp);
+  VecGetArrayRead (f->dloc, &dp);
+  VecGetArray (y, &yp);
+  DMDALocalInfo info;
+  DMDAGetLocalInfo (f->da_elem, &info);
+  f->ApplyStencil (info, dp, xp, yp);
+  VecRestoreArrayRead (f->xloc, &xp);
+  VecRestoreArrayRead (f->dloc, &dp);
+  VecRestoreArray (y, &yp);
+
+  return ierr;
+}
+
+void Filter::ApplyStencil (const DMDALocalInfo &info, const PetscScalar *dp,
+    const PetscScalar *xp, PetscScalar *yp) { // # new
+
+  const PetscInt nv = info.dof;
+  const PetscInt nb = 2 * sw + 1;
+
+  // Row of H: the weighted sum over the box around the element, clipped at
+  // the boundary of the domain, of the design elements. The nv fields are
+  // interleaved, so every weight is applied to all of them at once. Only
+  // the applied weights are counted as flops, passive rows are copied.
+  PetscInt64 nterms = 0;
+#if DIM == 2
+  TOPOPT_OMP(omp parallel for reduction(+:nterms) schedule(static))
+  for (PetscInt j = info.ys; j < info.ys + info.ym; j++) {
+    for (PetscInt i = info.xs; i < info.xs + info.xm; i++) {
+      PetscInt row = (i - info.gxs) + (j - info.gys) * info.gxm;
+      PetscScalar *ye = yp + ((i - info.xs) + (j - info.ys) * info.xm) * nv;
+      if (dp[row] == 0.0) {
+        for (PetscInt c = 0; c < nv; c++) {
+          ye[c] = xp[row * nv + c];
+        }
+        continue;
+      }
+      for (PetscInt c = 0; c < nv; c++) {
+        ye[c] = 0.0;
+      }
+      for (PetscInt j2 = PetscMax(j - sw, 0);
+          j2 <= PetscMin(j + sw, info.my - 1); j2++) {
+        PetscInt wj = (j2 - j + sw) * nb + sw - i;
+        PetscInt cj = (j2 - info.gys) * info.gxm - info.gxs;
+        for (PetscInt i2 = PetscMax(i - sw, 0);
+            i2 <= PetscMin(i + sw, info.mx - 1); i2++) {
+          PetscScalar wd = w[wj + i2] * dp[cj + i2];
+          if (wd == 0.0) continue;
+          nterms++;
+          const PetscScalar *xe = xp + (cj + i2) * nv;
+          for (PetscInt c = 0; c < nv; c++) {
+            ye[c] += wd * xe[c];
+          }
+        }
+      }
     }
-    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs)
-      xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys)
-      ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs)
-      zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs) + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs) + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs) + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs) + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs) + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs) + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs) + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs) + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
+  }
+#elif DIM == 3
+  TOPOPT_OMP(omp parallel for reduction(+:nterms) schedule(static))
+  for (PetscInt k = info.zs; k < info.zs + info.zm; k++) {
+    for (PetscInt j = info.ys; j < info.ys + info.ym; j++) {
+      for (PetscInt i = info.xs; i < info.xs + info.xm; i++) {
+        PetscInt row = (i - info.gxs) + (j - info.gys) * info.gxm
+            + (k - info.gzs) * info.gxm * info.gym;
+        PetscScalar *ye = yp + ((i - info.xs) + (j - info.ys) * info.xm
+            + (k - info.zs) * info.xm * info.ym) * nv;
+        if (dp[row] == 0.0) {
+          for (PetscInt c = 0; c < nv; c++) {
+            ye[c] = xp[row * nv + c];
+          }
+          continue;
+        }
+        for (PetscInt c = 0; c < nv; c++) {
+          ye[c] = 0.0;
+        }
+        for (PetscInt k2 = PetscMax(k - sw, 0);
+            k2 <= PetscMin(k + sw, info.mz - 1); k2++) {
+          for (PetscInt j2 = PetscMax(j - sw, 0);
+              j2 <= PetscMin(j + sw, info.my - 1); j2++) {
+            PetscInt wj = ((k2 - k + sw) * nb + j2 - j + sw) * nb + sw - i;
+            PetscInt cj = ((k2 - info.gzs) * info.gym + j2 - info.gys)
+                * info.gxm - info.gxs;
+            for (PetscInt i2 = PetscMax(i - sw, 0);
+                i2 <= PetscMin(i + sw, info.mx - 1); i2++) {
+              PetscScalar wd = w[wj + i2] * dp[cj + i2];
+              if (wd == 0.0) continue;
+              nterms++;
+              const PetscScalar *xe = xp + (cj + i2) * nv;
+              for (PetscInt c = 0; c < nv; c++) {
+                ye[c] += wd * xe[c];
+              }
+            }
           }
         }
       }
     }
   }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
+#endif
+  PetscLogFlops (2.0 * nv * nterms);
 }
+
+PetscErrorCode Filter::FilterColumns (PetscInt nv, Vec *v, Vec scale) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  // The work objects are kept for the run, m does not change
+  if (nv != ncols) {
+    ierr = FreeColumns ();
+    CHKERRQ(ierr);
+    ncols = nv;
+  }
+
+  PetscInt nloc, nglob;
+  VecGetLocalSize (Hs, &nloc);
+  VecGetSize (Hs, &nglob);
+  const PetscScalar *hs, *vp;
+  PetscScalar *gp;
+  VecGetArrayRead (Hs, &hs);
+  // Factor of the packed fields: 1 / Hs, times the chain rule factor
+  PetscScalar *fp;
+  VecGetArray (xwork, &fp);
+  if (scale != NULL) {
+    const PetscScalar *sp;
+    VecGetArrayRead (scale, &sp);
+    for (PetscInt j = 0; j < nloc; j++) {
+      fp[j] = sp[j] / hs[j];
+    }
+    VecRestoreArrayRead (scale, &sp);
+  } else {
+    for (PetscInt j = 0; j < nloc; j++) {
+      fp[j] = 1.0 / hs[j];
+    }
+  }
+
+  if (!matrixFree) {
+    // Columns of a dense matrix, filtered by one product with H
+    if (G == NULL) {
+      ierr = MatCreateDense (PETSC_COMM_WORLD, nloc, PETSC_DECIDE, nglob, nv,
+          NULL, &G);
+      CHKERRQ(ierr);
+    }
+    MatDenseGetArray (G, &gp);
+    for (PetscInt k = 0; k < nv; k++) {
+      VecGetArrayRead (v[k], &vp);
+      for (PetscInt j = 0; j < nloc; j++) {
+        gp[k * nloc + j] = vp[j] * fp[j];
+      }
+      VecRestoreArrayRead (v[k], &vp);
+    }
+    MatDenseRestoreArray (G, &gp);
+
+    ierr = MatMatMult (H, G, HG == NULL ? MAT_INITIAL_MATRIX : MAT_REUSE_MATRIX,
+        PETSC_DEFAULT, &HG);
+    CHKERRQ(ierr);
+
+    PetscScalar *vq;
+    MatDenseGetArray (HG, &gp);
+    for (PetscInt k = 0; k < nv; k++) {
+      VecGetArray (v[k], &vq);
+      PetscMemcpy (vq, gp + k * nloc, nloc * sizeof(PetscScalar));
+      VecRestoreArray (v[k], &vq);
+    }
+    MatDenseRestoreArray (HG, &gp);
+  } else {
+    // Fields interleaved on an element grid with nv dofs: one ghost
+    // exchange and one pass over the stencil
+    if (da_multi == NULL) {
+      PetscInt dim, M, N, P, md, nd, pd, s;
+      DMBoundaryType bx, by, bz;
+      DMDAStencilType st;
+      DMDAGetInfo (da_elem, &dim, &M, &N, &P, &md, &nd, &pd, NULL, &s, &bx,
+          &by, &bz, &st);
+      const PetscInt *lx, *ly, *lz;
+      DMDAGetOwnershipRanges (da_elem, &lx, &ly, &lz);
+#if DIM == 2
+      ierr = DMDACreate2d (PETSC_COMM_WORLD, bx, by, st, M, N, md, nd, nv, s,
+          lx, ly, &da_multi);
+#elif DIM == 3
+      ierr = DMDACreate3d (PETSC_COMM_WORLD, bx, by, bz, st, M, N, P, md, nd,
+          pd, nv, s, lx, ly, lz, &da_multi);
 #endif
+      CHKERRQ(ierr);
+      ierr = DMSetUp (da_multi);
+      CHKERRQ(ierr);
+      DMCreateGlobalVector (da_multi, &gglob);
+      VecDuplicate (gglob, &hglob);
+      DMCreateLocalVector (da_multi, &gloc);
+    }
+    VecGetArray (gglob, &gp);
+    for (PetscInt k = 0; k < nv; k++) {
+      VecGetArrayRead (v[k], &vp);
+      for (PetscInt j = 0; j < nloc; j++) {
+        gp[j * nv + k] = vp[j] * fp[j];
+      }
+      VecRestoreArrayRead (v[k], &vp);
+    }
+    VecRestoreArray (gglob, &gp);
+    ierr = DMGlobalToLocalBegin (da_multi, gglob, INSERT_VALUES, gloc);
+    CHKERRQ(ierr);
+    ierr = DMGlobalToLocalEnd (da_multi, gglob, INSERT_VALUES, gloc);
+    CHKERRQ(ierr);
+
+    const PetscScalar *xp, *dp;
+    DMDALocalInfo info;
+    DMDAGetLocalInfo (da_multi, &info);
+    VecGetArrayRead (gloc, &xp);
+    VecGetArrayRead (dloc, &dp);
+    VecGetArray (hglob, &gp);
+    ApplyStencil (info, dp, xp, gp);
+    VecRestoreArrayRead (gloc, &xp);
+    VecRestoreArrayRead (dloc, &dp);
+
+    PetscScalar *vq;
+    for (PetscInt k = 0; k < nv; k++) {
+      VecGetArray (v[k], &vq);
+      for (PetscInt j = 0; j < nloc; j++) {
+        vq[j] = gp[j * nv + k];
+      }
+      VecRestoreArray (v[k], &vq);
+    }
+    VecRestoreArray (hglob, &gp);
+  }
+  VecRestoreArray (xwork, &fp);
+  VecRestoreArrayRead (Hs, &hs);
+
+  return ierr;
+}
+
+PetscErrorCode Filter::FreeColumns () { // # new
+
+  if (G != NULL) MatDestroy (&G);
+  if (HG != NULL) MatDestroy (&HG);
+  if (gglob != NULL) VecDestroy (&gglob);
+  if (hglob != NULL) VecDestroy (&hglob);
+  if (gloc != NULL) VecDestroy (&gloc);
+  if (da_multi != NULL) DMDestroy (&da_multi);
+  ncols = 0;
+
+  return 0;
+}
+
+} // namespace TOPOPT_NS
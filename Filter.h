@@ -9,6 +9,10 @@
 #include <petsc/private/dmdaimpl.h>
 
 #include "options.h" // # new ; framework options
+#include "DomainMask.h" // # new; domain membership of the elements
+#include "Threads.h" // # new; OpenMP threading of the element loops
+
+namespace TOPOPT_NS {
 
 /* -----------------------------------------------------------------------------
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -42,7 +46,7 @@ class Filter {
   public:
     // Constructor
     Filter (DM da_nodes, Vec x, PetscInt filterT, PetscScalar Rin,
-        Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3); // # modified
+        DomainMask *domain); // # modified
 
     // Destructor
     ~Filter ();
@@ -79,39 +83,71 @@ class Filter {
     PDEFilt *pdef; // PDE filter class
 
     // Setup datastructures for the filter
-    PetscErrorCode SetUp (DM da_nodes, Vec x, Vec xPassive0, Vec xPassive1,
-        Vec xPassive2, Vec xPassive3); // # new
-
-    // Projection
-    PetscErrorCode HeavisideFilter (Vec x, Vec y, PetscReal beta,
-        PetscReal eta);
-    PetscErrorCode ChainruleHeavisideFilter (Vec y, Vec x, PetscReal beta,
-        PetscReal eta);
-
-    // The HS projection
-    inline PetscReal SmoothProjection (PetscReal x, PetscReal beta,
-        PetscReal eta) {
-      PetscReal y = (tanh (beta * eta) + tanh (beta * (x - eta)))
-          / (tanh (beta * eta) + tanh (beta * (1.0 - eta)));
-      return y;
-    }
-    ;
-    // Chainrule contribution
-    inline PetscReal ChainruleSmoothProjection (PetscReal x, PetscReal beta,
-        PetscReal eta) {
-      PetscReal dx = beta * (1.0 - pow (tanh (beta * (x - eta)), 2.0))
-          / (tanh (beta * eta) + tanh (beta * (1.0 - eta)));
-      return dx;
-    }
-    ;
-
-    // Routine that doesn't change the element type upon repeated calls
-#if DIM == 2   // # new
-    PetscErrorCode DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-#elif DIM == 3
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen, const PetscInt *e[]);
-#endif
+    PetscErrorCode SetUp (DM da_nodes, Vec x, DomainMask *domain); // # new
+
+    // # new; Stencil of H on the uniform element grid: the weights depend on
+    // the offset of two elements only. With -filterMatrixFree, H is a shell
+    // matrix applying them to the ghosted field of da_elem, i.e. O(n)
+    // memory instead of (2 sw + 1)^DIM nonzeros per row.
+    PetscBool matrixFree; // H is applied by the stencil
+    PetscInt sw; // Stencil width in elements
+    PetscInt nw; // Size of the stencil box, (2 sw + 1)^DIM
+    PetscScalar *w; // Weight of every offset in the box, 0 beyond R
+    Vec dloc; // Design mask (1: design element) with the ghost elements
+    Vec xloc; // Work: ghosted field
+
+    // # new; Weights of the offsets for the element size h, design mask
+    PetscErrorCode SetUpStencil (DomainMask *domain, const PetscScalar h[]);
+
+    // # new; Assemble H (the former part of SetUp) row by row from the
+    // stencil, with exact preallocation
+    PetscErrorCode AssembleMatrix ();
+
+    // # new; Row of H of the element (i,j,k): the nonzeros (local ghosted
+    // columns and values, only counted if cols is NULL) and the number of
+    // them in owned columns (ndiag)
+    PetscInt StencilRow (const DMDALocalInfo &info, const PetscScalar *dp,
+        PetscInt i, PetscInt j, PetscInt k, PetscInt *cols, PetscScalar *vals,
+        PetscInt *ndiag);
+
+    // # new; y = H x by the stencil
+    static PetscErrorCode MatMult_Stencil (Mat A, Vec x, Vec y);
+
+    // # new; Rows of H for the owned elements of a grid with info.dof
+    // interleaved fields: xp ghosted, dp design mask of dloc
+    void ApplyStencil (const DMDALocalInfo &info, const PetscScalar *dp,
+        const PetscScalar *xp, PetscScalar *yp);
+
+    // # new; Batched gradients: v[k] = H (v[k] .* scale / Hs) for all k in
+    // one pass over H, as one product with a dense matrix of nv columns
+    // (G, HG) or one stencil sweep over an element grid with nv dofs
+    // (da_multi); the optional scale is the chain rule factor of the
+    // projection
+    PetscInt ncols; // Columns of the work objects
+    Mat G, HG; // Assembled H: dense columns and their product with H
+    DM da_multi; // Matrix-free: element grid with ncols dofs
+    Vec gglob, hglob, gloc; // Matrix-free: interleaved fields
+    PetscErrorCode FilterColumns (PetscInt nv, Vec *v, Vec scale);
+    PetscErrorCode FreeColumns ();
+
+    // # new; Projection, fused with the last step of the filter: one pass
+    // over the elements that divides xTilde by Hs (standard filter) or
+    // clamps it to [0,1] (PDE filter), projects it to xPhys and stores the
+    // chain rule factor in dx. With xPhys NULL only dx is computed.
+    // tanh(beta eta) and tanh(beta (1 - eta)) are computed once per call.
+    PetscErrorCode ProjectKernel (Vec xTilde, Vec xPhys,
+        PetscBool projectionFilter, PetscReal beta, PetscReal eta);
+
+    // # new; v[k] = v[k] .* s for all k
+    PetscErrorCode ScaleFields (PetscInt nv, Vec *v, Vec s);
+
+    // # new; dx holds the chain rule factor of xTilde in this state and of
+    // this beta and eta
+    PetscObjectState dxState;
+    PetscReal dxBeta, dxEta;
+    Vec xwork; // # new; work vector of the gradients
 };
 
+} // namespace TOPOPT_NS
+
 #endif
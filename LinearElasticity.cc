@@ -1,5 +1,7 @@
 #include "LinearElasticity.h"
 
+namespace TOPOPT_NS {
+
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
 
@@ -13,25 +15,63 @@
  * Modified by Zhidong Brian Zhang in May 2020, University of Waterloo
  */
 
-LinearElasticity::LinearElasticity (DM da_nodes, PetscInt m, PetscInt numDES,
-    PetscInt numLODFIX, PetscInt numNodeLoadAddingCounts, PetscScalar nu,
-    PetscScalar E, PetscScalar *loadVector, Vec xPassive0, Vec xPassive1,
-    Vec xPassive2, Vec xPassive3) { // # modified
+LinearElasticity::LinearElasticity (DM da_nodes, ElementMesh *mesh, PetscInt m,
+    PetscInt numDES, PetscInt numLODFIX, PetscInt numNodeLoadAddingCounts,
+    PetscScalar nu, PetscScalar E, PetscScalar *loadVector,
+    DomainMask *domain) { // # modified
   // Set pointers to null
   K = NULL;
   U = NULL;
   RHS = NULL;
   N = NULL;
   ksp = NULL;
+  stateRtol = 1.0e-5; // # new
   da_nodal = NULL;
+  mfl = NULL; // # new
+  Kmf = NULL; // # new
+  Pmf = NULL; // # new
+  Kmfc = NULL; // # new
+  K0 = NULL; // # new
+  bcGroup = NULL; // # new
+  numBCGroups = 0; // # new
+  bcApplied = -1; // # new
+  assembled = PETSC_FALSE; // # new
+  xPhysId = 0; // # new
+  Pmg = NULL; // # new
+  Kmg = NULL; // # new
+  xPhysPC = NULL; // # new
+  pcGroup = -1; // # new
+  pcLagCount = 0; // # new
+  pcFreshIts = -1; // # new
+  pcRefresh = PETSC_FALSE; // # new
+
+  this->mesh = mesh; // # new; shared element connectivity
+  this->domain = domain; // # new; domain mask, owned by TopOpt
 
   // Parameters - to be changed on read of variables
   this->nu = nu; // # modified
   this->E = E; // # new
-  nlvls = 4;
+  // # modified; same levels as TopOpt (-nlvls, see MGLevels.h)
+  MGLevels::GetLevels (da_nodes, &nlvls);
   PetscBool flg;
-  PetscOptionsGetInt (NULL, NULL, "-nlvls", &nlvls, &flg);
   PetscOptionsGetReal (NULL, NULL, "-nu", &nu, &flg);
+  matrixFree = PETSC_FALSE; // # new; assembled operator by default
+  PetscOptionsGetBool (NULL, NULL, "-matrixFree", &matrixFree, &flg); // # new
+  reusePtAP = PETSC_FALSE; // # new; PCMG forms the Galerkin products
+  PetscOptionsGetBool (NULL, NULL, "-mg_reuse_ptap", &reusePtAP, &flg); // # new
+  pcLagCh = 0.0; // # new; fresh preconditioner for every design
+  PetscOptionsGetReal (NULL, NULL, "-pc_lag_ch", &pcLagCh, &flg); // # new
+  pcLagMax = 5; // # new
+  PetscOptionsGetInt (NULL, NULL, "-pc_lag_max", &pcLagMax, &flg); // # new
+  pcLagIts = 1.5; // # new
+  PetscOptionsGetReal (NULL, NULL, "-pc_lag_its", &pcLagIts, &flg); // # new
+  eliminateVoid = PETSC_FALSE; // # new; elements outside get Emin stiffness
+  PetscOptionsGetBool (NULL, NULL, "-eliminateVoid", &eliminateVoid, &flg); // # new
+  assemblyMap = PETSC_TRUE; // # new; direct assembly into the CSR values
+  PetscOptionsGetBool (NULL, NULL, "-assemblyMap", &assemblyMap, &flg); // # new
+  asmMap = NULL; // # new
+  symmetricSolve = preset.IsSymmetric (); // # new; CG for the SPD presets
+  PetscOptionsGetBool (NULL, NULL, "-symmetricSolve", &symmetricSolve, &flg); // # new
 
   this->m = m; // # new
   this->numDES = numDES; // # new; num of design domains, save for internal uses
@@ -49,14 +89,18 @@ LinearElasticity::LinearElasticity (DM da_nodes, PetscInt m, PetscInt numDES,
 
   RHS = new Vec[numLODFIX]; // # new
   N = new Vec[numLODFIX]; // # new
+  dirichlet.SetUp (numLODFIX); // # new
 
   // Setup sitffness matrix, load vector and bcs (Dirichlet) for the design
   // problem
   for (PetscInt loadCondition = 0; loadCondition < this->numLODFIX;
       ++loadCondition) { // # new
-    SetUpLoadAndBC (da_nodes, xPassive0, xPassive1, xPassive2, xPassive3,
+    SetUpLoadAndBC (da_nodes, domain,
         loadCondition); // # modified
   }
+
+  // # new; Load conditions sharing the fixture share the constrained K
+  SetUpBoundaryConditionGroups ();
 }
 
 LinearElasticity::~LinearElasticity ()
@@ -65,8 +109,40 @@ LinearElasticity::~LinearElasticity ()
   VecDestroy (&(U)); // # modified
   VecDestroyVecs (numLODFIX, &(RHS)); // # modified
   VecDestroyVecs (numLODFIX, &(N)); // # modified
+  delete asmMap; // # new
   MatDestroy (&(K));
+  MatDestroy (&(K0)); // # new
+  MatDestroy (&(Kmfc)); // # new
   KSPDestroy (&(ksp));
+  if (bcGroup != NULL) delete[] bcGroup; // # new
+  VecDestroy (&(xPhysPC)); // # new
+
+  if (Pmg != NULL) { // # new; Galerkin hierarchy, Kmg[nlvls - 1] is K
+    for (PetscInt k = 0; k < nlvls; k++) {
+      if (k < nlvls - 1) MatDestroy (&(Kmg[k]));
+      if (k > 0) MatDestroy (&(Pmg[k]));
+    }
+    delete[] Pmg;
+    delete[] Kmg;
+  }
+
+  if (mfl != NULL) { // # new; matrix-free hierarchy
+    for (PetscInt k = 0; k < nlvls; k++) {
+      MatDestroy (&(Kmf[k]));
+      if (k > 0) MatDestroy (&(Pmf[k]));
+      VecDestroy (&(mfl[k].dens));
+      VecDestroy (&(mfl[k].N));
+      VecDestroy (&(mfl[k].xwork));
+      VecDestroy (&(mfl[k].xloc));
+      VecDestroy (&(mfl[k].yloc));
+      DMDestroy (&(mfl[k].da_elem));
+      delete mfl[k].mesh;
+      DMDestroy (&(mfl[k].da_nodal));
+    }
+    delete[] mfl;
+    delete[] Kmf;
+    delete[] Pmf;
+  }
 
   if (da_nodal != NULL) {
     DMDestroy (&(da_nodal));
@@ -75,8 +151,8 @@ LinearElasticity::~LinearElasticity ()
 }
 
 PetscErrorCode
-LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
-    Vec xPassive2, Vec xPassive3, PetscInt loadCondition) {
+LinearElasticity::SetUpLoadAndBC (DM da_nodes, DomainMask *domain,
+    PetscInt loadCondition) {
   PetscErrorCode ierr = 0;
 
 #if DIM == 2  // # new
@@ -106,7 +182,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
 
       PetscInt nel, nen;
       const PetscInt *necon;
-      DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
+      mesh->GetElements (&nel, &nen, &necon);
 
       // Use the first element to compute the dx, dy, dz
       dx = lcoorp[DIM * necon[0 * nen + 1] + 0]
@@ -140,13 +216,23 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
     // P1 ! STILL DOESN*T WORK !!!!
     DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
 
-    // Allocate matrix and the RHS and Solution vector and Dirichlet vector
-    ierr = DMCreateMatrix (da_nodal, &(K));
+    // # new; The element connectivity is shared with da_nodes
+    ierr = mesh->CheckLayout (da_nodal);
     CHKERRQ(ierr);
+
+    // Allocate matrix and the RHS and Solution vector and Dirichlet vector
+    if (!matrixFree) { // # modified; the matrix-free K is set up later
+      ierr = DMCreateMatrix (da_nodal, &(K));
+      CHKERRQ(ierr);
+      ierr = SetSymmetryFlags (K); // # new
+      CHKERRQ(ierr);
+    }
     ierr = DMCreateGlobalVector (da_nodal, &(U));
     CHKERRQ(ierr);
     VecDuplicateVecs (U, numLODFIX, &(RHS));
     VecDuplicateVecs (U, numLODFIX, &(N));
+    ierr = warmStart.SetUp (U, numLODFIX, PETSC_FALSE); // # new
+    CHKERRQ(ierr);
 
     // Set the local stiffness matrix
     PetscScalar X[4] = { 0.0, dx, dx, 0.0 };
@@ -179,12 +265,6 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
 
   // Compute epsilon parameter for finding points in space:
   PetscScalar epsi = PetscMin(dx * 0.05, dy * 0.05);
-  // Passive design variable vector
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
 
   // Set the RHS and Dirichlet vector
   PetscScalar rhs_ele[8]; // local rhs
@@ -194,7 +274,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
   // Find the element size
   PetscInt nel, nen;
   const PetscInt *necon;
-  DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
+  mesh->GetElements (&nel, &nen, &necon);
 
   if (IMPORT_GEO == 0) {
     // Set the values:
@@ -217,8 +297,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
   } else { // # new
     // Set the values:
     // In this case:
-    // xPassive2 indicates fix,
-    // xPassive3 indicates loading.
+    // fixture and loading elements of the domain mask
     // Load and constraints
     for (PetscInt i = 0; i < nel; i++) {
 
@@ -232,7 +311,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
         }
       }
 
-      if (std::fmod ((xPassive3p[i] / std::pow (2.0, loadCondition)), 2) >= 1.0) {
+      if (domain->IsLoaded (i, loadCondition)) {
         for (PetscInt j = 0; j < 8; j++) {
           rhs_ele[j] = loadVector[DIM * loadCondition + j % DIM];
         }
@@ -241,7 +320,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
         CHKERRQ(ierr);
       }
 
-      if (std::fmod ((xPassive2p[i] / std::pow (2.0, loadCondition)), 2) >= 1.0) {
+      if (domain->IsFixed (i, loadCondition)) {
         for (PetscInt j = 0; j < 8; j++) {
           n_ele[j] = 0.0;
         }
@@ -278,7 +357,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
 
       PetscInt nel, nen;
       const PetscInt *necon;
-      DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
+      mesh->GetElements (&nel, &nen, &necon);
 
       // Use the first element to compute the dx, dy, dz
       dx = lcoorp[3 * necon[0 * nen + 1] + 0]
@@ -321,13 +400,23 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
     // P1 ! STILL DOESN*T WORK !!!!
     DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
 
-    // Allocate matrix and the RHS and Solution vector and Dirichlet vector
-    ierr = DMCreateMatrix (da_nodal, &(K));
+    // # new; The element connectivity is shared with da_nodes
+    ierr = mesh->CheckLayout (da_nodal);
     CHKERRQ(ierr);
+
+    // Allocate matrix and the RHS and Solution vector and Dirichlet vector
+    if (!matrixFree) { // # modified; the matrix-free K is set up later
+      ierr = DMCreateMatrix (da_nodal, &(K));
+      CHKERRQ(ierr);
+      ierr = SetSymmetryFlags (K); // # new
+      CHKERRQ(ierr);
+    }
     ierr = DMCreateGlobalVector (da_nodal, &(U));
     CHKERRQ(ierr);
     VecDuplicateVecs (U, numLODFIX, &(RHS)); // # modified
     VecDuplicateVecs (U, numLODFIX, &(N)); // # modified
+    ierr = warmStart.SetUp (U, numLODFIX, PETSC_FALSE); // # new
+    CHKERRQ(ierr);
 
     // Set the local stiffness matrix
     PetscScalar X[8] = { 0.0, dx, dx, 0.0, 0.0, dx, dx, 0.0 };
@@ -363,12 +452,6 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
   // Compute epsilon parameter for finding points in space:
   PetscScalar epsi = PetscMin(dx * 0.05, PetscMin(dy * 0.05, dz * 0.05));
 
-  // # new; Passive design variable vector
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
 
   // # new; Set the local RHS and Dirichlet vector
   PetscScalar rhs_ele[24]; // local rhs
@@ -378,7 +461,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
   // # new; Find the element size
   PetscInt nel, nen;
   const PetscInt *necon;
-  DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+  mesh->GetElements (&nel, &nen, &necon);
 
   if (IMPORT_GEO == 0) {
     // Set the values:
@@ -423,8 +506,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
   } else { // # new
     // Set the values:
     // In this case:
-    // xPassive2 indicates fix,
-    // xPassive3 indicates loading.
+    // fixture and loading elements of the domain mask
     // Load and constraints
     for (PetscInt i = 0; i < nel; i++) {
       //std::fill_n(rhs_ele, 24, 0); // initialization
@@ -438,7 +520,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
         }
       }
 
-      if (std::fmod ((xPassive3p[i] / std::pow (2.0, loadCondition)), 2) >= 1.0) {
+      if (domain->IsLoaded (i, loadCondition)) {
         for (PetscInt j = 0; j < 24; j++) {
           rhs_ele[j] = loadVector[DIM * loadCondition + j % DIM];
         }
@@ -447,7 +529,7 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
         CHKERRQ(ierr);
       }
 
-      if (std::fmod ((xPassive2p[i] / std::pow (2.0, loadCondition)), 2) >= 1.0) {
+      if (domain->IsFixed (i, loadCondition)) {
         for (PetscInt j = 0; j < 24; j++) {
           n_ele[j] = 0.0;
         }
@@ -465,11 +547,18 @@ LinearElasticity::SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
   VecAssemblyBegin (RHS[loadCondition]); // # modified
   VecAssemblyEnd (RHS[loadCondition]); // # modified
   VecRestoreArray (lcoor, &lcoorp);
-  DMDARestoreElements (da_nodal, &nel, &nen, &necon); // # new
-  VecRestoreArray (xPassive0, &xPassive0p); // # new
-  VecRestoreArray (xPassive1, &xPassive1p); // # new
-  VecRestoreArray (xPassive2, &xPassive2p); // # new
-  VecRestoreArray (xPassive3, &xPassive3p); // # new
+
+  // # new; Eliminate the dofs of the elements outside of all domains: they
+  // are constrained like Dirichlet dofs (identity rows, zero RHS)
+  if (eliminateVoid) {
+    ierr = mesh->EliminateVoidDofs (domain, da_nodal, DIM, N[loadCondition],
+        (PetscBool) (loadCondition == 0));
+    CHKERRQ(ierr);
+  }
+
+  // # new; Cache I - N and the constrained rows of the load condition
+  ierr = SetUpConstrainedRows (loadCondition);
+  CHKERRQ(ierr);
 
   return ierr;
 }
@@ -483,23 +572,24 @@ LinearElasticity::SolveState (Vec xPhys, PetscScalar Emin,
   double t1, t2;
   t1 = MPI_Wtime ();
 
-  // Assemble the stiffness matrix
-  ierr = AssembleStiffnessMatrix (xPhys, Emin, Emax, penal, loadCondition);
+  // # new; Assemble, impose the BCs and set up the solver
+  ierr = SetUpOperator (xPhys, Emin, Emax, penal, loadCondition);
   CHKERRQ(ierr);
 
-  // Setup the solver
-  if (ksp == NULL) {
-    ierr = SetUpSolver ();
-    CHKERRQ(ierr);
-  } else {
-    ierr = KSPSetOperators (ksp, K, K);
-    CHKERRQ(ierr);
-    KSPSetUp (ksp);
-  }
-
   // Solve
+  ierr = warmStart.Guess (loadCondition, U); // # new
+  CHKERRQ(ierr);
+  PerfLog::Begin (PerfLog::KSPSOLVE); // # new
   ierr = KSPSolve (ksp, RHS[loadCondition], U);
   CHKERRQ(ierr);
+  PerfLog::End (PerfLog::KSPSOLVE); // # new
+  ierr = warmStart.Store (loadCondition, U); // # new
+  CHKERRQ(ierr);
+
+  // # new; Keep the Chebyshev estimates of this set up for the next designs
+  PC pc;
+  KSPGetPC (ksp, &pc);
+  ierr = preset.CacheEigenvalues (pc);
   CHKERRQ(ierr);
 
   // DEBUG
@@ -507,11 +597,23 @@ LinearElasticity::SolveState (Vec xPhys, PetscScalar Emin,
   PetscInt niter;
   PetscScalar rnorm;
   KSPGetIterationNumber (ksp, &niter);
+  PerfLog::AddSolverIterations (niter); // # new
   KSPGetResidualNorm (ksp, &rnorm);
   PetscReal RHSnorm;
   ierr = VecNorm (RHS[loadCondition], NORM_2, &RHSnorm);
   CHKERRQ(ierr);
   rnorm = rnorm / RHSnorm;
+  PerfLog::AddSolverResidual (rnorm); // # new
+
+  // # new; Iterations of the fresh preconditioner are the reference of the
+  // lagged ones; refresh it once the iterations rise beyond that
+  if (pcLagCh > 0.0 && numBCGroups <= 1) {
+    if (pcLagCount == 0) {
+      pcFreshIts = PetscMax(pcFreshIts, niter);
+    } else if (niter > pcLagIts * pcFreshIts) {
+      pcRefresh = PETSC_TRUE;
+    }
+  }
 
   t2 = MPI_Wtime ();
   PetscPrintf (PETSC_COMM_WORLD,
@@ -520,11 +622,94 @@ LinearElasticity::SolveState (Vec xPhys, PetscScalar Emin,
   return ierr;
 }
 
+PetscErrorCode
+LinearElasticity::SetUpOperator (Vec xPhys, PetscScalar Emin,
+    PetscScalar Emax, PetscScalar penal, PetscInt loadCondition) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  // # modified; Assemble the stiffness matrix once per design, i.e. only if
+  // xPhys or the interpolation parameters changed since the last assembly;
+  // the state alone does not tell apart two vectors
+  PetscObjectState xstate;
+  PetscObjectStateGet ((PetscObject) xPhys, &xstate);
+  PetscObjectId xid;
+  PetscObjectGetId ((PetscObject) xPhys, &xid);
+  PerfLog::Begin (PerfLog::ASSEMBLY); // # new
+  if (!assembled || xid != xPhysId || xstate != xPhysState
+      || Emin != assembledParams[0]
+      || Emax != assembledParams[1] || penal != assembledParams[2]) {
+    if (matrixFree) { // # new
+      ierr = AssembleMatrixFree (xPhys, Emin, Emax, penal);
+    } else {
+      ierr = AssembleStiffnessMatrix (xPhys, Emin, Emax, penal);
+    }
+    CHKERRQ(ierr);
+    assembled = PETSC_TRUE;
+    PetscObjectStateGet ((PetscObject) xPhys, &xPhysState);
+    xPhysId = xid;
+    assembledParams[0] = Emin;
+    assembledParams[1] = Emax;
+    assembledParams[2] = penal;
+  }
+
+  // # new; Impose the BCs, unless K already carries the ones of this group
+  PetscBool newOperator = PETSC_FALSE;
+  if (bcApplied != bcGroup[loadCondition]) {
+    if (matrixFree) {
+      ierr = ApplyBoundaryConditionsMatrixFree (loadCondition);
+    } else {
+      ierr = ApplyBoundaryConditions (xPhys, Emin, Emax, penal, loadCondition);
+    }
+    CHKERRQ(ierr);
+    bcApplied = bcGroup[loadCondition];
+    newOperator = PETSC_TRUE;
+  }
+
+  // Zero out possible loads in the RHS that coincide
+  // with Dirichlet conditions
+  VecPointwiseMult (RHS[loadCondition], RHS[loadCondition], N[loadCondition]); // # modified
+  PerfLog::End (PerfLog::ASSEMBLY); // # new
+
+  // Setup the solver
+  PerfLog::Begin (PerfLog::MGSETUP); // # new
+  if (ksp == NULL) {
+    PetscBool lag; // # new; always a fresh PC, records its design
+    ierr = LagPreconditioner (xPhys, loadCondition, &lag);
+    CHKERRQ(ierr);
+    ierr = SetUpSolver ();
+    CHKERRQ(ierr);
+    ierr = MGLevels::SetUpTelescopeSolve (ksp); // # new
+    CHKERRQ(ierr);
+  } else if (newOperator) { // # modified; otherwise reuse the preconditioner
+    // # new; keep the MG hierarchy of a previous design if allowed
+    PetscBool lag;
+    ierr = LagPreconditioner (xPhys, loadCondition, &lag);
+    CHKERRQ(ierr);
+    if (!lag) {
+      ierr = UpdateCoarseOperators (); // # new; numeric PtAP only
+      CHKERRQ(ierr);
+      PC pc;
+      KSPGetPC (ksp, &pc);
+      ierr = preset.NewOperator (pc); // # new; age of the Chebyshev estimates
+      CHKERRQ(ierr);
+    }
+    ierr = KSPSetOperators (ksp, K, K);
+    CHKERRQ(ierr);
+    ierr = KSPSetReusePreconditioner (ksp, lag); // # new
+    CHKERRQ(ierr);
+    KSPSetUp (ksp);
+  }
+  PerfLog::End (PerfLog::MGSETUP); // # new
+
+  return ierr;
+}
+
 PetscErrorCode
 LinearElasticity::ComputeObjectiveConstraintsSensitivities (
     PetscScalar *fx, PetscScalar *gx, Vec dfdx, Vec *dgdx, Vec xPhys,
     PetscScalar Emin, PetscScalar Emax, PetscScalar penal, PetscScalar volfrac,
-    Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3) { // # modified
+    DomainMask *domain) { // # modified
   // Errorcode
   PetscErrorCode ierr;
 
@@ -532,27 +717,19 @@ LinearElasticity::ComputeObjectiveConstraintsSensitivities (
     // Solve state eqs
     ierr = SolveState (xPhys, Emin, Emax, penal, loadCondition); // # modified
     CHKERRQ(ierr);
+    PerfLog::Begin (PerfLog::SENSITIVITY); // # new
 
     // Get the FE mesh structure (from the nodal mesh)
     PetscInt nel, nen;
     const PetscInt *necon;
-#if DIM == 2    // # new
-    ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
-    CHKERRQ(ierr);
-#elif DIM == 3
-    ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+    ierr = mesh->GetElements (&nel, &nen, &necon);
     CHKERRQ(ierr);
-#endif
     // DMDAGetElements(da_nodes,&nel,&nen,&necon); // Still issue with elemtype
     // change !
 
     // Get pointer to the densities
-    PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p; // # modified
-    VecGetArray (xPhys, &xp);
-    VecGetArray (xPassive0, &xPassive0p); // # new
-    VecGetArray (xPassive1, &xPassive1p); // # new
-    VecGetArray (xPassive2, &xPassive2p); // # new
-    VecGetArray (xPassive3, &xPassive3p); // # new
+    const PetscScalar *xp; // # modified; read only, keeps the state of xPhys
+    VecGetArrayRead (xPhys, &xp);
 
     // Get Solution
     Vec Uloc;
@@ -581,27 +758,36 @@ LinearElasticity::ComputeObjectiveConstraintsSensitivities (
     PetscScalar nNonDesign = 0; // # new
     VecGetSize (xPhys, &neltot); // # modified
 
-    // Edof array
-    PetscInt edof[nedof]; // # modified
+    // # new; Element energies of the design elements, batched
+    const PetscInt *edof, *elist;
+    PetscInt nact;
+    ierr = mesh->GetEdof (DIM, &edof);
+    CHKERRQ(ierr);
+    ierr = mesh->GetDesignElements (domain, &nact, &elist);
+    CHKERRQ(ierr);
+    PetscScalar *uKue;
+    ierr = PetscMalloc1 (nel, &uKue);
+    CHKERRQ(ierr);
+    ElementKernels<nedof>::QuadraticForm (KE, edof, elist, nact, up, up,
+        NULL, uKue);
 
-    fx[0] = 0.0;
-    // # modified; Loop over elements
+    // # new; Elements outside of all domains, the active ones are set below
+    const PetscInt *alist;
+    PetscInt nactive;
+    ierr = mesh->GetActiveElements (domain, &nactive, &alist);
+    CHKERRQ(ierr);
     for (PetscInt i = 0; i < nel; i++) {
-      // loop over element nodes
-      if (xPassive0p[i] != 0) {
-        for (PetscInt j = 0; j < nen; j++) {
-          // Get local dofs
-          for (PetscInt k = 0; k < DIM; k++) {
-            edof[j * DIM + k] = DIM * necon[i * nen + j] + k;
-          }
-        }
-        // Use SIMP for stiffness interpolation
-        PetscScalar uKu = 0.0;
-        for (PetscInt k = 0; k < nedof; k++) {
-          for (PetscInt h = 0; h < nedof; h++) {
-            uKu += up[edof[k]] * KE[k * nedof + h] * up[edof[h]];
-          }
-        }
+      df[i] = 1.0E9;
+    }
+    nNonDesign = nel - nact; // # new
+
+    fx[0] = 0.0;
+    // # modified; Loop over the active elements
+    for (PetscInt a = 0; a < nactive; a++) {
+      PetscInt i = alist[a]; // # new
+      if (domain->IsDesign (i)) {
+      // Use SIMP for stiffness interpolation
+        PetscScalar uKu = uKue[i]; // # modified
         // Add to objective
         fx[0] += (Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin)) * uKu;
         // Set the Senstivity
@@ -613,13 +799,8 @@ LinearElasticity::ComputeObjectiveConstraintsSensitivities (
           dg[j][i] = 1;
         }
 
-      } else if (xPassive1p[i] != 0 || xPassive2p[i] != 0
-                 || xPassive3p[i] != 0) { // # new
+      } else { // # new; passive
         df[i] = -1.0E9; // # new
-        nNonDesign += 1; // # new
-      } else { // # new
-        df[i] = 1.0E9; // # new
-        nNonDesign += 1; // # new
       }
     }
 
@@ -645,15 +826,13 @@ LinearElasticity::ComputeObjectiveConstraintsSensitivities (
           1.0 / ((PetscScalar) neltot - nNonDesign)); // # modified
     }
 
-    VecRestoreArray (xPhys, &xp);
-    VecRestoreArray (xPassive0, &xPassive0p); // # new
-    VecRestoreArray (xPassive1, &xPassive1p); // # new
-    VecRestoreArray (xPassive2, &xPassive2p); // # new
-    VecRestoreArray (xPassive3, &xPassive3p); // # new
+    VecRestoreArrayRead (xPhys, &xp);
     VecRestoreArray (Uloc, &up);
     VecRestoreArray (dfdx, &df);
     VecRestoreArrays (dgdx, m, &dg);
     VecDestroy (&Uloc);
+    PetscFree (uKue); // # new
+    PerfLog::End (PerfLog::SENSITIVITY); // # new
 
   } // # new
 
@@ -661,239 +840,22 @@ LinearElasticity::ComputeObjectiveConstraintsSensitivities (
 }
 
 PetscErrorCode
-LinearElasticity::ComputeObjectiveConstraints (PetscScalar *fx,
-    PetscScalar *gx, Vec xPhys, PetscScalar Emin, PetscScalar Emax,
-    PetscScalar penal, PetscScalar volfrac, Vec xPassive0, Vec xPassive1,
-    Vec xPassive2, Vec xPassive3) {
-
-  // Error code
-  PetscErrorCode ierr;
+LinearElasticity::SetStateTolerance (PetscReal rtol) { // # new
 
-  for (PetscInt loadCondition = 0; loadCondition < numLODFIX; ++loadCondition) { // # new
-    // Solve state eqs
-    VecSet (U, 0.0);
-    ierr = SolveState (xPhys, Emin, Emax, penal, loadCondition); // # modified
-    CHKERRQ(ierr);
+  PetscErrorCode ierr = 0;
 
-    // Get the FE mesh structure (from the nodal mesh)
-    PetscInt nel, nen;
-    const PetscInt *necon;
-#if DIM == 2   // # new
-    ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
+  stateRtol = rtol;
+  PerfLog::SetSolverTolerance (rtol);
+  if (ksp != NULL) {
+    PetscReal atol, dtol;
+    PetscInt maxits;
+    ierr = KSPGetTolerances (ksp, NULL, &atol, &dtol, &maxits);
     CHKERRQ(ierr);
-#elif DIM == 3
-    ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+    ierr = KSPSetTolerances (ksp, rtol, atol, dtol, maxits);
     CHKERRQ(ierr);
-#endif
-
-    // Get pointer to the densities
-    PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p; // # modified
-    VecGetArray (xPhys, &xp);
-    VecGetArray (xPassive0, &xPassive0p); // # new
-    VecGetArray (xPassive1, &xPassive1p); // # new
-    VecGetArray (xPassive2, &xPassive2p); // # new
-    VecGetArray (xPassive3, &xPassive3p); // # new
-
-    // Get Solution
-    Vec Uloc;
-    DMCreateLocalVector (da_nodal, &Uloc);
-    DMGlobalToLocalBegin (da_nodal, U, INSERT_VALUES, Uloc);
-    DMGlobalToLocalEnd (da_nodal, U, INSERT_VALUES, Uloc);
-
-    // get pointer to local vector
-    PetscScalar *up;
-    VecGetArray (Uloc, &up);
-
-    // # new; Get gx
-    for (PetscInt i = 0; i < m; ++i) {
-      gx[i] = 0;
-    }
-
-    // Number of total elements and nonDesign domain elements
-    PetscInt neltot = 0;
-    PetscScalar nNonDesign = 0; // # new
-    VecGetSize (xPhys, &neltot); // # modified
-
-    // Edof array
-    PetscInt edof[nedof]; // # modified
-
-    fx[0] = 0.0;
-    // # modified; Loop over elements
-    for (PetscInt i = 0; i < nel; i++) {
-      // loop over element nodes
-      if (xPassive0p[i] >= 1) {
-        for (PetscInt j = 0; j < nen; j++) {
-          // Get local dofs
-          for (PetscInt k = 0; k < DIM; k++) {
-            edof[j * DIM + k] = DIM * necon[i * nen + j] + k;
-          }
-        }
-        // # modified; Use SIMP for stiffness interpolation
-        PetscScalar uKu = 0.0;
-        for (PetscInt k = 0; k < nedof; k++) {
-          for (PetscInt h = 0; h < nedof; h++) {
-            uKu += up[edof[k]] * KE[k * nedof + h] * up[edof[h]];
-          }
-        }
-        // Add to objective
-        fx[0] += (Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin)) * uKu;
-        // # new; Constraints
-        for (PetscInt j = 0; j < m; ++j) {
-          gx[j] += xp[i];
-        }
-      } else if (xPassive1p[i] != 0 || xPassive2p[i] != 0
-                 || xPassive3p[i] != 0) { // # new
-        nNonDesign += 1; // # new
-      } else { // # new
-        nNonDesign += 1; // # new
-      }
-
-      // Allreduce fx[0]
-      PetscScalar tmp = fx[0];
-      fx[0] = 0.0;
-      MPI_Allreduce(&tmp, &(fx[0]), 1, MPIU_SCALAR, MPI_SUM, PETSC_COMM_WORLD);
-
-      tmp = nNonDesign; // # new
-      nNonDesign = 0.0; // # new
-      MPI_Allreduce(&tmp, &(nNonDesign), 1, MPIU_SCALAR, MPI_SUM,
-          PETSC_COMM_WORLD); // # new
-      // # modified; Allreduce gx
-      for (PetscInt i = 0; i < m; ++i) {
-        tmp = gx[i];
-        gx[i] = 0.0;
-        MPI_Allreduce(&tmp, &(gx[i]), 1, MPIU_SCALAR, MPI_SUM,
-            PETSC_COMM_WORLD);
-        gx[i] = gx[i]
-                / ((PetscScalar) neltot - nNonDesign)
-                - volfrac; // # modified
-      }
-    }
-    VecRestoreArray (xPhys, &xp);
-    VecRestoreArray (xPassive0, &xPassive0p); // # new
-    VecRestoreArray (xPassive1, &xPassive1p); // # new
-    VecRestoreArray (xPassive2, &xPassive2p); // # new
-    VecRestoreArray (xPassive3, &xPassive3p); // # new
-    VecRestoreArray (Uloc, &up);
-    VecDestroy (&Uloc);
-  } //# new
-
-  return (ierr);
-}
-
-PetscErrorCode
-LinearElasticity::ComputeSensitivities (Vec dfdx, Vec *dgdx,
-    Vec xPhys, PetscScalar Emin, PetscScalar Emax, PetscScalar penal,
-    PetscScalar volfrac, Vec xPassive0, Vec xPassive1,
-    Vec xPassive2, Vec xPassive3) {
-
-  PetscErrorCode ierr;
-
-  // Get the FE mesh structure (from the nodal mesh)
-  PetscInt nel, nen;
-  const PetscInt *necon;
-#if DIM == 2  // # new
-  ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
-#elif DIM == 3
-  ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
-#endif
-  CHKERRQ(ierr);
-
-  // Get pointer to the densities
-  PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p; // # modified
-  VecGetArray (xPhys, &xp);
-  VecGetArray (xPassive0, &xPassive0p); // # new
-  VecGetArray (xPassive1, &xPassive1p); // # new
-  VecGetArray (xPassive2, &xPassive2p); // # new
-  VecGetArray (xPassive3, &xPassive3p); // # new
-
-  // Get Solution
-  Vec Uloc;
-  DMCreateLocalVector (da_nodal, &Uloc);
-  DMGlobalToLocalBegin (da_nodal, U, INSERT_VALUES, Uloc);
-  DMGlobalToLocalEnd (da_nodal, U, INSERT_VALUES, Uloc);
-
-  // get pointer to local vector
-  PetscScalar *up;
-  VecGetArray (Uloc, &up);
-
-  // Get dfdx
-  PetscScalar *df;
-  VecGetArray (dfdx, &df);
-
-  // # new; Get dgdx
-  // # new; Get dgdx
-  PetscScalar **dg;
-  for (PetscInt i = 0; i < m; ++i) {
-    VecSet (dgdx[i], 0);
   }
-  VecGetArrays (dgdx, m, &dg);
-
-  // Number of total elements and nonDesign domain elements
-  PetscInt neltot = 0;
-  PetscScalar nNonDesign = 0; // # new
-  VecGetSize (xPhys, &neltot); // # modified
-
-  // Edof array
-  PetscInt edof[nedof]; // # modified
-
-  // # modified; Loop over elements
-  for (PetscInt i = 0; i < nel; i++) {
-    // loop over element nodes
-    if (xPassive0p[i] != 0) {
-      for (PetscInt j = 0; j < nen; j++) {
-        // Get local dofs
-        for (PetscInt k = 0; k < DIM; k++) {
-          edof[j * DIM + k] = DIM * necon[i * nen + j] + k;
-        }
-      }
-      // # modified; Use SIMP for stiffness interpolation
-      PetscScalar uKu = 0.0;
-      for (PetscInt k = 0; k < nedof; k++) {
-        for (PetscInt h = 0; h < nedof; h++) {
-          uKu += up[edof[k]] * KE[k * nedof + h] * up[edof[h]];
-        }
-      }
-      // Set the Senstivity
-      df[i] = -1.0 * penal * PetscPowScalar(xp[i], penal - 1) * (Emax - Emin)
-              * uKu;
-      // # new; Constraints
-      for (PetscInt j = 0; j < m; ++j) {
-        dg[j][i] = 1;
-      }
-    } else if (xPassive1p[i] != 0 || xPassive2p[i] != 0
-               || xPassive3p[i] != 0) { // # new
-      df[i] = -1.0E9; // # new
-      nNonDesign += 1; // # new
-    } else { // # new
-      df[i] = 1.0E9; // # new
-      nNonDesign += 1; // # new
-    }
 
-    // Allreduce nNonDesign
-    PetscScalar tmp = nNonDesign;
-    nNonDesign = 0.0;
-    MPI_Allreduce(&tmp, &(nNonDesign), 1, MPIU_SCALAR, MPI_SUM,
-        PETSC_COMM_WORLD);
-
-    // # modified; Allreduce gx
-    for (PetscInt i = 0; i < m; ++i) {
-      VecScale (dgdx[i],
-          1.0 / ((PetscScalar) neltot - nNonDesign)); // # modified
-    }
-
-    VecRestoreArray (xPhys, &xp);
-    VecRestoreArray (xPassive0, &xPassive0p); // # new
-    VecRestoreArray (xPassive1, &xPassive1p); // # new
-    VecRestoreArray (xPassive2, &xPassive2p); // # new
-    VecRestoreArray (xPassive3, &xPassive3p); // # new
-    VecRestoreArray (Uloc, &up);
-    VecRestoreArray (dfdx, &df);
-    VecRestoreArrays (dgdx, m, &dg);
-    VecDestroy (&Uloc);
-
-  } // # new
-
-  return (ierr);
+  return ierr;
 }
 
 PetscErrorCode
@@ -933,12 +895,15 @@ LinearElasticity::WriteRestartFiles ()
   return ierr;
 }
 
-PetscErrorCode LinearElasticity::FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
-    Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadConditionFEA,
+PetscErrorCode LinearElasticity::FEAWithTopOptResults (Vec xPhys,
+    DomainMask *domain, PetscInt loadConditionFEA,
     PetscScalar *loadVectorFEAp) { // # new
   // Errorcode
   PetscErrorCode ierr = 0;
 
+  // # new; The FEA loads have no history of their own
+  warmStart.Disable ();
+
   PetscPrintf (PETSC_COMM_WORLD, "FEA with TopOpt Results, step: %d\n",
       loadConditionFEA);
 
@@ -950,7 +915,8 @@ PetscErrorCode LinearElasticity::FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
       loadVector[i] = loadVectorFEAp[DIM * loadConditionFEA + i]; // update the load vector
   }
   // only first load condition because we are solving FEA only one at a time
-  SetUpLoadAndBC (da_nodal, xPassive0, xPassive1, xPassive2, xPassive3, 0);
+  SetUpLoadAndBC (da_nodal, domain, 0);
+  SetUpBoundaryConditionGroups (); // # new; N[0] may have changed
   // Solve state eqs,
   ierr = SolveState (xPhys, 1E-9, 1.0, 1.0, 0);
   CHKERRQ(ierr);
@@ -967,75 +933,564 @@ PetscErrorCode LinearElasticity::FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
 
 PetscErrorCode
 LinearElasticity::AssembleStiffnessMatrix (Vec xPhys,
-    PetscScalar Emin, PetscScalar Emax, PetscScalar penal,
-    PetscInt loadCondition) {
+    PetscScalar Emin, PetscScalar Emax, PetscScalar penal) { // # modified
 
   PetscErrorCode ierr;
 
+// # new; With several BC groups the unconstrained matrix is kept in K0
+  Mat A = (K0 != NULL) ? K0 : K;
+
 // Get the FE mesh structure (from the nodal mesh)
   PetscInt nel, nen;
   const PetscInt *necon;
-#if DIM == 2    // # new
-  ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
+  ierr = mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
-#elif DIM == 3
-  ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+
+// Get pointer to the densities
+  const PetscScalar *xp;
+  VecGetArrayRead (xPhys, &xp); // # modified; keeps the state of xPhys
+
+  PetscScalar ke[nedof * nedof];
+
+// # new; Elements to assemble: all, or only the active ones if the dofs
+// outside of all domains are eliminated (see SetUpLoadAndBC)
+  PetscInt nasm = nel;
+  const PetscInt *alist = NULL;
+  if (eliminateVoid) {
+    ierr = mesh->GetActiveElements (domain, &nasm, &alist);
+    CHKERRQ(ierr);
+  }
+
+// # new; Cached scatter into the CSR storage of the matrix (-assemblyMap),
+// set up on the first assembly
+  if (assemblyMap) {
+    ierr = mesh->SetUpAssemblyMap (A, DIM, &asmMap);
+    CHKERRQ(ierr);
+  }
+
+  if (asmMap != NULL && asmMap->IsSetUp ()) {
+    ierr = asmMap->Assemble (A, KE, xp, Emin, Emax, penal, nasm, alist);
+    CHKERRQ(ierr);
+  } else {
+    // Zero the matrix
+    MatZeroEntries (A);
+
+    // # modified; Loop over elements
+    for (PetscInt a = 0; a < nasm; a++) {
+      PetscInt i = (alist != NULL) ? alist[a] : a;
+      // Use SIMP for stiffness interpolation
+      PetscScalar dens = Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
+      for (PetscInt k = 0; k < nedof * nedof; k++) {
+        ke[k] = KE[k] * dens;
+      }
+      // # modified; Add values to the sparse matrix, one DIM x DIM block
+      // per pair of element nodes
+      ierr = MatSetValuesBlockedLocal (A, nen, necon + i * nen, nen,
+          necon + i * nen, ke, ADD_VALUES);
+      CHKERRQ(ierr);
+    }
+    PetscLogFlops ((nedof * nedof + 3.0) * nasm); // # new
+    MatAssemblyBegin (A, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd (A, MAT_FINAL_ASSEMBLY);
+  }
+
+  VecRestoreArrayRead (xPhys, &xp);
+
+// # new; K is unconstrained (or stale if K0 was assembled)
+  bcApplied = (K0 != NULL) ? -2 : -1;
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::ApplyBoundaryConditions (Vec xPhys, PetscScalar Emin,
+    PetscScalar Emax, PetscScalar penal, PetscInt loadCondition) { // # new
+
+  PetscErrorCode ierr = 0;
+
+// Restore the unconstrained matrix
+  if (K0 != NULL) {
+    ierr = MatCopy (K0, K, SAME_NONZERO_PATTERN);
+    CHKERRQ(ierr);
+  } else if (bcApplied != -1) {
+    // K carries other BCs and there is no copy: assemble again
+    ierr = AssembleStiffnessMatrix (xPhys, Emin, Emax, penal);
+    CHKERRQ(ierr);
+  }
+
+// # modified; Impose the dirichlet conditions (see DirichletRows.h)
+  ierr = dirichlet.Apply (K, loadCondition, N[loadCondition], Emax);
   CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::SetSymmetryFlags (Mat A) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  // K is symmetric, and stays symmetric with the BCs imposed
+  ierr = MatSetOption (A, MAT_SYMMETRIC, PETSC_TRUE);
+  CHKERRQ(ierr);
+  ierr = MatSetOption (A, MAT_SYMMETRY_ETERNAL, PETSC_TRUE);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::SetUpConstrainedRows (PetscInt loadCondition) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  // Diagonal of the constrained rows per unit modulus: the one of a node
+  // in solid material, i.e. of the 2^DIM elements around it
+  ierr = dirichlet.SetUpLoadCondition (loadCondition, N[loadCondition],
+      (1 << DIM) * KE[0]);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::SetUpBoundaryConditionGroups () { // # new
+
+  PetscErrorCode ierr = 0;
+
+  if (bcGroup == NULL) {
+    bcGroup = new PetscInt[numLODFIX];
+  }
+
+  // A load condition joins the group of the first one with an equal N
+  PetscInt numGroups = 0;
+  for (PetscInt lc = 0; lc < numLODFIX; ++lc) {
+    bcGroup[lc] = -1;
+    for (PetscInt prev = 0; prev < lc && bcGroup[lc] < 0; ++prev) {
+      PetscBool equal;
+      ierr = VecEqual (N[lc], N[prev], &equal);
+      CHKERRQ(ierr);
+      if (equal) bcGroup[lc] = bcGroup[prev];
+    }
+    if (bcGroup[lc] < 0) bcGroup[lc] = numGroups++;
+  }
+
+  numBCGroups = numGroups;
+
+  // Several groups: keep the unconstrained matrix to restore K from
+  if (numGroups > 1 && K0 == NULL && !matrixFree) {
+    ierr = MatDuplicate (K, MAT_DO_NOT_COPY_VALUES, &K0);
+    CHKERRQ(ierr);
+    ierr = SetSymmetryFlags (K0);
+    CHKERRQ(ierr);
+    assembled = PETSC_FALSE;
+  }
+
+  // The Dirichlet vectors may have changed: impose them again
+  if (bcApplied >= 0) bcApplied = -2;
+
+  PetscPrintf (PETSC_COMM_WORLD,
+      "# Load conditions: %D, Dirichlet condition groups: %D\n", numLODFIX,
+      numGroups);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::SetUpMatrixFree () { // # new
+  PetscErrorCode ierr = 0;
+
+  mfl = new MFLevel[nlvls];
+  Kmf = new Mat[nlvls];
+  Pmf = new Mat[nlvls];
+  Pmf[0] = NULL;
+
+  // Nodal meshes: the finest is da_nodal, the coarser ones are rediscretized
+  DM *daclist;
+  PetscMalloc(sizeof(DM) * nlvls, &daclist);
+  daclist[0] = da_nodal;
+  ierr = DMCoarsenHierarchy (da_nodal, nlvls - 1, &daclist[1]);
+  CHKERRQ(ierr);
+  for (PetscInt k = 0; k < nlvls; k++) {
+    mfl[k].da_nodal = daclist[nlvls - 1 - k];
+  }
+  PetscObjectReference ((PetscObject) da_nodal);
+  PetscFree(daclist);
+
+  for (PetscInt k = 0; k < nlvls; k++) {
+    MFLevel *lvl = &(mfl[k]);
+
+    // Same coordinates on all levels and Q1 elements for DMDAGetElements
+#if DIM == 2
+    DMDASetUniformCoordinates (lvl->da_nodal, xc[0], xc[1], xc[2], xc[3], 0.0,
+        0.0);
+#elif DIM == 3
+    DMDASetUniformCoordinates (lvl->da_nodal, xc[0], xc[1], xc[2], xc[3], xc[4],
+        xc[5]);
 #endif
+    DMDASetElementType (lvl->da_nodal, DMDA_ELEMENT_Q1);
 
-// Get pointer to the densities
-  PetscScalar *xp;
-  VecGetArray (xPhys, &xp);
+    // Element mesh with the partitioning of the nodal mesh, i.e. the element
+    // ordering of DMDAGetElements. The stencil width must hold the children
+    // of all locally owned elements of the next coarser level.
+    PetscInt elemStencil = 3;
+#if DIM == 2
+    {
+      PetscInt M, N, md, nd;
+      DMBoundaryType bx, by;
+      DMDAGetInfo (lvl->da_nodal, NULL, &M, &N, NULL, &md, &nd, NULL, NULL,
+          NULL, &bx, &by, NULL, NULL);
+      const PetscInt *LxCorrect, *LyCorrect;
+      DMDAGetOwnershipRanges (lvl->da_nodal, &LxCorrect, &LyCorrect, NULL);
+      PetscInt *Lx = new PetscInt[md];
+      PetscInt *Ly = new PetscInt[nd];
+      for (PetscInt i = 0; i < md; i++) {
+        Lx[i] = LxCorrect[i] - (i == 0 ? 1 : 0);
+      }
+      for (PetscInt i = 0; i < nd; i++) {
+        Ly[i] = LyCorrect[i] - (i == 0 ? 1 : 0);
+      }
+      ierr = DMDACreate2d (PETSC_COMM_WORLD, bx, by, DMDA_STENCIL_BOX, M - 1,
+          N - 1, md, nd, 1, elemStencil, Lx, Ly, &(lvl->da_elem));
+      CHKERRQ(ierr);
+      DMSetUp (lvl->da_elem);
+      delete[] Lx;
+      delete[] Ly;
+    }
+#elif DIM == 3
+    {
+      PetscInt M, N, P, md, nd, pd;
+      DMBoundaryType bx, by, bz;
+      DMDAGetInfo (lvl->da_nodal, NULL, &M, &N, &P, &md, &nd, &pd, NULL, NULL,
+          &bx, &by, &bz, NULL);
+      const PetscInt *LxCorrect, *LyCorrect, *LzCorrect;
+      DMDAGetOwnershipRanges (lvl->da_nodal, &LxCorrect, &LyCorrect,
+          &LzCorrect);
+      PetscInt *Lx = new PetscInt[md];
+      PetscInt *Ly = new PetscInt[nd];
+      PetscInt *Lz = new PetscInt[pd];
+      for (PetscInt i = 0; i < md; i++) {
+        Lx[i] = LxCorrect[i] - (i == 0 ? 1 : 0);
+      }
+      for (PetscInt i = 0; i < nd; i++) {
+        Ly[i] = LyCorrect[i] - (i == 0 ? 1 : 0);
+      }
+      for (PetscInt i = 0; i < pd; i++) {
+        Lz[i] = LzCorrect[i] - (i == 0 ? 1 : 0);
+      }
+      ierr = DMDACreate3d (PETSC_COMM_WORLD, bx, by, bz, DMDA_STENCIL_BOX,
+          M - 1, N - 1, P - 1, md, nd, pd, 1, elemStencil, Lx, Ly, Lz,
+          &(lvl->da_elem));
+      CHKERRQ(ierr);
+      DMSetUp (lvl->da_elem);
+      delete[] Lx;
+      delete[] Ly;
+      delete[] Lz;
+    }
+#endif
+
+    // Level vectors
+    ierr = DMCreateGlobalVector (lvl->da_elem, &(lvl->dens));
+    CHKERRQ(ierr);
+    ierr = DMCreateGlobalVector (lvl->da_nodal, &(lvl->N));
+    CHKERRQ(ierr);
+    VecSet (lvl->N, 1.0);
+    VecDuplicate (lvl->N, &(lvl->xwork));
+    ierr = DMCreateLocalVector (lvl->da_nodal, &(lvl->xloc));
+    CHKERRQ(ierr);
+    VecDuplicate (lvl->xloc, &(lvl->yloc));
 
-// Zero the matrix
-  MatZeroEntries (K);
+    // Element connectivity and dofs of the level
+    lvl->mesh = new ElementMesh (lvl->da_nodal);
+    PetscInt nen;
+    const PetscInt *necon;
+    ierr = lvl->mesh->GetElements (&(lvl->nel), &nen, &necon);
+    CHKERRQ(ierr);
+    ierr = lvl->mesh->GetEdof (DIM, &(lvl->edof));
+    CHKERRQ(ierr);
 
-// # modified; Edof array
-  PetscInt edof[nedof];
-  PetscScalar ke[nedof * nedof];
+    // Element stiffness matrix: the element size doubles per coarsening
+    PetscScalar h = PetscPowScalar (2.0, (PetscScalar) (nlvls - 1 - k));
+#if DIM == 2
+    PetscScalar X[4] = { 0.0, h * dx, h * dx, 0.0 };
+    PetscScalar Y[4] = { 0.0, 0.0, h * dy, h * dy };
+    Quad4Isoparametric (X, Y, nu, false, lvl->KE);
+#elif DIM == 3
+    PetscScalar X[8] = { 0.0, h * dx, h * dx, 0.0, 0.0, h * dx, h * dx, 0.0 };
+    PetscScalar Y[8] = { 0.0, 0.0, h * dy, h * dy, 0.0, 0.0, h * dy, h * dy };
+    PetscScalar Z[8] = { 0.0, 0.0, 0.0, 0.0, h * dz, h * dz, h * dz, h * dz };
+    Hex8Isoparametric (X, Y, Z, nu, false, lvl->KE);
+#endif
 
-// # modified; Loop over elements
-  for (PetscInt i = 0; i < nel; i++) {
-    // loop over element nodes
-    for (PetscInt j = 0; j < nen; j++) {
-      // Get local dofs
-      for (PetscInt k = 0; k < DIM; k++) {
-        edof[j * DIM + k] = DIM * necon[i * nen + j] + k;
+    // Operator: assembled on the coarsest level, shell on all other levels
+    if (k == 0) {
+      ierr = DMCreateMatrix (lvl->da_nodal, &(Kmf[k]));
+      CHKERRQ(ierr);
+      ierr = MatDuplicate (Kmf[k], MAT_DO_NOT_COPY_VALUES, &Kmfc);
+      CHKERRQ(ierr);
+    } else {
+      PetscInt nloc, nglob;
+      VecGetLocalSize (lvl->N, &nloc);
+      VecGetSize (lvl->N, &nglob);
+      ierr = MatCreateShell (PETSC_COMM_WORLD, nloc, nloc, nglob, nglob,
+          (void*) lvl, &(Kmf[k]));
+      CHKERRQ(ierr);
+      MatShellSetOperation (Kmf[k], MATOP_MULT,
+          (void (*) (void)) MatMult_MatrixFree);
+      MatShellSetOperation (Kmf[k], MATOP_MULT_TRANSPOSE,
+          (void (*) (void)) MatMult_MatrixFree);
+      MatShellSetOperation (Kmf[k], MATOP_GET_DIAGONAL,
+          (void (*) (void)) MatGetDiagonal_MatrixFree);
+
+      // Interpolation from the next coarser level
+      ierr = DMCreateInterpolation (mfl[k - 1].da_nodal, lvl->da_nodal,
+          &(Pmf[k]), NULL);
+      CHKERRQ(ierr);
+    }
+  }
+
+  // The finest operator is the system matrix
+  K = Kmf[nlvls - 1];
+  PetscObjectReference ((PetscObject) K);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::AssembleMatrixFree (Vec xPhys, PetscScalar Emin,
+    PetscScalar Emax, PetscScalar penal) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  if (mfl == NULL) {
+    ierr = SetUpMatrixFree ();
+    CHKERRQ(ierr);
+  }
+
+  // Use SIMP for stiffness interpolation on the finest level
+  {
+    PetscInt nloc;
+    const PetscScalar *xp;
+    PetscScalar *dp;
+    VecGetLocalSize (xPhys, &nloc);
+    VecGetArrayRead (xPhys, &xp);
+    VecGetArray (mfl[nlvls - 1].dens, &dp);
+    for (PetscInt i = 0; i < nloc; i++) {
+      dp[i] = (eliminateVoid && domain->GetKind (i) == DomainMask::NONE) ?
+          0.0 : Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
+    }
+    VecRestoreArrayRead (xPhys, &xp);
+    VecRestoreArray (mfl[nlvls - 1].dens, &dp);
+  }
+
+  // Restrict the densities level by level
+  for (PetscInt k = nlvls - 1; k > 0; k--) {
+    MFLevel *fine = &(mfl[k]);
+    MFLevel *coarse = &(mfl[k - 1]);
+
+    // Coarse element = average of its children
+    Vec floc;
+    DMGetLocalVector (fine->da_elem, &floc);
+    DMGlobalToLocalBegin (fine->da_elem, fine->dens, INSERT_VALUES, floc);
+    DMGlobalToLocalEnd (fine->da_elem, fine->dens, INSERT_VALUES, floc);
+    PetscInt xs, ys, zs, xm, ym, zm;
+    DMDAGetCorners (coarse->da_elem, &xs, &ys, &zs, &xm, &ym, &zm);
+#if DIM == 2
+    PetscScalar **fp, **cp;
+    DMDAVecGetArray (fine->da_elem, floc, &fp);
+    DMDAVecGetArray (coarse->da_elem, coarse->dens, &cp);
+    for (PetscInt j = ys; j < ys + ym; j++) {
+      for (PetscInt i = xs; i < xs + xm; i++) {
+        cp[j][i] = 0.25 * (fp[2 * j][2 * i] + fp[2 * j][2 * i + 1]
+                           + fp[2 * j + 1][2 * i] + fp[2 * j + 1][2 * i + 1]);
       }
     }
-    // Use SIMP for stiffness interpolation
-    PetscScalar dens = Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
-    for (PetscInt k = 0; k < nedof * nedof; k++) {
-      ke[k] = KE[k] * dens;
+#elif DIM == 3
+    PetscScalar ***fp, ***cp;
+    DMDAVecGetArray (fine->da_elem, floc, &fp);
+    DMDAVecGetArray (coarse->da_elem, coarse->dens, &cp);
+    for (PetscInt l = zs; l < zs + zm; l++) {
+      for (PetscInt j = ys; j < ys + ym; j++) {
+        for (PetscInt i = xs; i < xs + xm; i++) {
+          PetscScalar sum = 0.0;
+          for (PetscInt c = 0; c < 8; c++) {
+            sum += fp[2 * l + c / 4][2 * j + (c / 2) % 2][2 * i + c % 2];
+          }
+          cp[l][j][i] = 0.125 * sum;
+        }
+      }
     }
-    // Add values to the sparse matrix
-    ierr = MatSetValuesLocal (K, nedof, edof, nedof, edof, ke, ADD_VALUES);
+#endif
+    DMDAVecRestoreArray (fine->da_elem, floc, &fp);
+    DMDAVecRestoreArray (coarse->da_elem, coarse->dens, &cp);
+    DMRestoreLocalVector (fine->da_elem, &floc);
+
+    // The shell data changed: let the smoothers redo their setup
+    PetscObjectStateIncrease ((PetscObject) Kmf[k]);
+  }
+
+  // Assemble the unconstrained coarsest level
+  {
+    MFLevel *lvl = &(mfl[0]);
+    MatZeroEntries (Kmfc);
+    PetscInt nel, nen;
+    const PetscInt *necon;
+    ierr = lvl->mesh->GetElements (&nel, &nen, &necon);
     CHKERRQ(ierr);
+    const PetscScalar *dp;
+    VecGetArrayRead (lvl->dens, &dp);
+    PetscScalar ke[nedof * nedof];
+    for (PetscInt i = 0; i < nel; i++) {
+      for (PetscInt k = 0; k < nedof * nedof; k++) {
+        ke[k] = lvl->KE[k] * dp[i];
+      }
+      ierr = MatSetValuesBlockedLocal (Kmfc, nen, necon + i * nen, nen,
+          necon + i * nen, ke, ADD_VALUES);
+      CHKERRQ(ierr);
+    }
+    VecRestoreArrayRead (lvl->dens, &dp);
+    MatAssemblyBegin (Kmfc, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd (Kmfc, MAT_FINAL_ASSEMBLY);
   }
-  MatAssemblyBegin (K, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd (K, MAT_FINAL_ASSEMBLY);
-
-// Impose the dirichlet conditions, i.e. K = N'*K*N - (N-I)
-// 1.: K = N'*K*N
-  MatDiagonalScale (K, N[loadCondition], N[loadCondition]); // # modified
-// 2. Add ones, i.e. K = K + NI, NI = I - N
-  Vec NI;
-  VecDuplicate (N[loadCondition], &NI); // # modified
-  VecSet (NI, 1.0);
-  VecAXPY (NI, -1.0, N[loadCondition]); // # modified
-  MatDiagonalSet (K, NI, ADD_VALUES);
-
-// Zero out possible loads in the RHS that coincide
-// with Dirichlet conditions
-  VecPointwiseMult (RHS[loadCondition], RHS[loadCondition], N[loadCondition]); // # modified
 
-  VecDestroy (&NI);
-  VecRestoreArray (xPhys, &xp);
-  DMDARestoreElements (da_nodal, &nel, &nen, &necon);
+  // The BCs of all levels have to be imposed again
+  bcApplied = -2;
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::ApplyBoundaryConditionsMatrixFree (PetscInt loadCondition) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  VecCopy (N[loadCondition], mfl[nlvls - 1].N);
+  PetscObjectStateIncrease ((PetscObject) Kmf[nlvls - 1]);
+
+  for (PetscInt k = nlvls - 1; k > 0; k--) {
+    MFLevel *fine = &(mfl[k]);
+    MFLevel *coarse = &(mfl[k - 1]);
+
+    // A coarse dof is fixed if the interpolation couples it to fixed fine
+    // dofs with a total weight of at least 1/2
+    VecSet (fine->xwork, 1.0);
+    VecAXPY (fine->xwork, -1.0, fine->N);
+    ierr = MatMultTranspose (Pmf[k], fine->xwork, coarse->N);
+    CHKERRQ(ierr);
+    PetscInt nloc;
+    PetscScalar *np;
+    VecGetLocalSize (coarse->N, &nloc);
+    VecGetArray (coarse->N, &np);
+    for (PetscInt i = 0; i < nloc; i++) {
+      np[i] = (np[i] >= 0.5) ? 0.0 : 1.0;
+    }
+    VecRestoreArray (coarse->N, &np);
+    if (k > 1) PetscObjectStateIncrease ((PetscObject) Kmf[k - 1]);
+  }
+
+  // Coarsest level: K = N'*K0*N + (I-N)
+  MFLevel *lvl = &(mfl[0]);
+  ierr = MatCopy (Kmfc, Kmf[0], SAME_NONZERO_PATTERN);
+  CHKERRQ(ierr);
+  MatDiagonalScale (Kmf[0], lvl->N, lvl->N);
+  VecSet (lvl->xwork, 1.0);
+  VecAXPY (lvl->xwork, -1.0, lvl->N);
+  MatDiagonalSet (Kmf[0], lvl->xwork, ADD_VALUES);
 
   return ierr;
 }
 
+PetscErrorCode
+LinearElasticity::MatMult_MatrixFree (Mat A, Vec x, Vec y) { // # new
+
+  PetscErrorCode ierr;
+
+  MFLevel *lvl;
+  ierr = MatShellGetContext (A, &lvl);
+  CHKERRQ(ierr);
+
+  // Remove the constrained dofs from the input: xwork = N*x
+  ierr = VecPointwiseMult (lvl->xwork, x, lvl->N);
+  CHKERRQ(ierr);
+  DMGlobalToLocalBegin (lvl->da_nodal, lvl->xwork, INSERT_VALUES, lvl->xloc);
+  DMGlobalToLocalEnd (lvl->da_nodal, lvl->xwork, INSERT_VALUES, lvl->xloc);
+  VecSet (lvl->yloc, 0.0);
+
+  const PetscScalar *xp, *dp;
+  PetscScalar *yp;
+  VecGetArrayRead (lvl->xloc, &xp);
+  VecGetArrayRead (lvl->dens, &dp);
+  VecGetArray (lvl->yloc, &yp);
+
+  // y_e = dens_e * KE * x_e
+  PetscScalar ue[nedof];
+  for (PetscInt i = 0; i < lvl->nel; i++) {
+    const PetscInt *edof = lvl->edof + i * nedof;
+    for (PetscInt k = 0; k < nedof; k++) {
+      ue[k] = xp[edof[k]];
+    }
+    for (PetscInt k = 0; k < nedof; k++) {
+      PetscScalar Ku = 0.0;
+      for (PetscInt h = 0; h < nedof; h++) {
+        Ku += lvl->KE[k * nedof + h] * ue[h];
+      }
+      yp[edof[k]] += dp[i] * Ku;
+    }
+  }
+  PetscLogFlops (2.0 * nedof * nedof * lvl->nel);
+
+  VecRestoreArrayRead (lvl->xloc, &xp);
+  VecRestoreArrayRead (lvl->dens, &dp);
+  VecRestoreArray (lvl->yloc, &yp);
+
+  VecSet (y, 0.0);
+  DMLocalToGlobalBegin (lvl->da_nodal, lvl->yloc, ADD_VALUES, y);
+  DMLocalToGlobalEnd (lvl->da_nodal, lvl->yloc, ADD_VALUES, y);
+
+  // Impose the dirichlet conditions: y = N*K*N*x + (x - N*x)
+  VecPointwiseMult (y, y, lvl->N);
+  VecAXPY (y, 1.0, x);
+  VecAXPY (y, -1.0, lvl->xwork);
+
+  return (0);
+}
+
+PetscErrorCode
+LinearElasticity::MatGetDiagonal_MatrixFree (Mat A, Vec d) { // # new
+
+  PetscErrorCode ierr;
+
+  MFLevel *lvl;
+  ierr = MatShellGetContext (A, &lvl);
+  CHKERRQ(ierr);
+
+  VecSet (lvl->yloc, 0.0);
+  const PetscScalar *dp;
+  PetscScalar *yp;
+  VecGetArrayRead (lvl->dens, &dp);
+  VecGetArray (lvl->yloc, &yp);
+  for (PetscInt i = 0; i < lvl->nel; i++) {
+    const PetscInt *edof = lvl->edof + i * nedof;
+    for (PetscInt l = 0; l < nedof; l++) {
+      yp[edof[l]] += dp[i] * lvl->KE[l * nedof + l];
+    }
+  }
+  VecRestoreArrayRead (lvl->dens, &dp);
+  VecRestoreArray (lvl->yloc, &yp);
+
+  VecSet (d, 0.0);
+  DMLocalToGlobalBegin (lvl->da_nodal, lvl->yloc, ADD_VALUES, d);
+  DMLocalToGlobalEnd (lvl->da_nodal, lvl->yloc, ADD_VALUES, d);
+
+  // Constrained dofs have a unit diagonal: d = N*d + (1-N)
+  VecPointwiseMult (d, d, lvl->N);
+  VecSet (lvl->xwork, 1.0);
+  VecAXPY (lvl->xwork, -1.0, lvl->N);
+  VecAXPY (d, 1.0, lvl->xwork);
+
+  return (0);
+}
+
 PetscErrorCode
 LinearElasticity::SetUpSolver ()
 {
@@ -1111,7 +1566,7 @@ LinearElasticity::SetUpSolver ()
 
 // SET THE DEFAULT SOLVER PARAMETERS
 // The fine grid solver settings
-  PetscScalar rtol = 1.0e-5;
+  PetscScalar rtol = stateRtol; // # modified
   PetscScalar atol = 1.0e-50;
   PetscScalar dtol = 1.0e5;
   PetscInt restart = 100;
@@ -1128,7 +1583,8 @@ LinearElasticity::SetUpSolver ()
   PetscInt smooth_sweeps = 4;
 
 // Set up the solver
-  ierr = KSPSetType (ksp, KSPFGMRES); // KSPCG, KSPGMRES
+// # modified; CG if the smoothers keep the V-cycle symmetric (-symmetricSolve)
+  ierr = KSPSetType (ksp, symmetricSolve ? KSPCG : KSPFGMRES); // KSPCG, KSPGMRES
   CHKERRQ(ierr);
 
   ierr = KSPGMRESSetRestart (ksp, restart);
@@ -1150,6 +1606,8 @@ LinearElasticity::SetUpSolver ()
 
 // Set solver from options
   KSPSetFromOptions (ksp);
+  KSPGetTolerances (ksp, &stateRtol, NULL, NULL, NULL); // # new
+  PerfLog::SetSolverTolerance (stateRtol); // # new
 
 // Get the prec again - check if it has changed
   KSPGetPC (ksp, &pc);
@@ -1161,58 +1619,98 @@ LinearElasticity::SetUpSolver ()
 // Only if PCMG is used
   if (pcmg_flag) {
 
-    // DMs for grid hierachy
-    DM *da_list, *daclist;
-    Mat R;
+    if (matrixFree) { // # new; rediscretized levels, see SetUpMatrixFree
+      PCMGSetLevels (pc, nlvls, NULL);
+      PCMGSetType (pc, PC_MG_MULTIPLICATIVE); // Default
+      ierr = PCMGSetCycleType (pc, PC_MG_CYCLE_V);
+      CHKERRQ(ierr);
+      // No Galerkin products: every level has its own operator
+      PCMGSetGalerkin (pc, PC_MG_GALERKIN_NONE);
+      for (PetscInt k = 1; k < nlvls; k++) {
+        PCMGSetInterpolation (pc, k, Pmf[k]);
+      }
+      for (PetscInt k = 0; k < nlvls; k++) {
+        KSP lksp;
+        PCMGGetSmoother (pc, k, &lksp);
+        KSPSetOperators (lksp, Kmf[k], Kmf[k]);
+      }
+    } else {
+      // DMs for grid hierachy
+      DM *da_list, *daclist;
+      Mat R;
 
-    PetscMalloc(sizeof(DM) * nlvls, &da_list);
-    for (PetscInt k = 0; k < nlvls; k++)
-      da_list[k] = NULL;
-    PetscMalloc(sizeof(DM) * nlvls, &daclist);
-    for (PetscInt k = 0; k < nlvls; k++)
-      daclist[k] = NULL;
+      PetscMalloc(sizeof(DM) * nlvls, &da_list);
+      for (PetscInt k = 0; k < nlvls; k++)
+        da_list[k] = NULL;
+      PetscMalloc(sizeof(DM) * nlvls, &daclist);
+      for (PetscInt k = 0; k < nlvls; k++)
+        daclist[k] = NULL;
 
-    // Set 0 to the finest level
-    daclist[0] = da_nodal;
+      // Set 0 to the finest level
+      daclist[0] = da_nodal;
 
-// Coordinates
+      // Coordinates
 #if DIM == 2  // # new
-    PetscReal xmin = xc[0], xmax = xc[1], ymin = xc[2], ymax = xc[3];
+      PetscReal xmin = xc[0], xmax = xc[1], ymin = xc[2], ymax = xc[3];
 #elif DIM == 3
-    PetscReal xmin = xc[0], xmax = xc[1], ymin = xc[2], ymax = xc[3],
-        zmin = xc[4], zmax = xc[5];
+      PetscReal xmin = xc[0], xmax = xc[1], ymin = xc[2], ymax = xc[3],
+          zmin = xc[4], zmax = xc[5];
 #endif
-    // Set up the coarse meshes
-    DMCoarsenHierarchy (da_nodal, nlvls - 1, &daclist[1]);
-    for (PetscInt k = 0; k < nlvls; k++) {
-      // NOTE: finest grid is nlevels - 1: PCMG MUST USE THIS ORDER ???
-      da_list[k] = daclist[nlvls - 1 - k];
-      // THIS SHOULD NOT BE NECESSARY
+      // Set up the coarse meshes
+      DMCoarsenHierarchy (da_nodal, nlvls - 1, &daclist[1]);
+      for (PetscInt k = 0; k < nlvls; k++) {
+        // NOTE: finest grid is nlevels - 1: PCMG MUST USE THIS ORDER ???
+        da_list[k] = daclist[nlvls - 1 - k];
+        // THIS SHOULD NOT BE NECESSARY
 #if DIM == 2   // # new
-      DMDASetUniformCoordinates (da_list[k], xmin, xmax, ymin, ymax, 0.0, 0.0);
+        DMDASetUniformCoordinates (da_list[k], xmin, xmax, ymin, ymax, 0.0, 0.0);
 #elif DIM == 3
-      DMDASetUniformCoordinates (da_list[k], xmin, xmax, ymin, ymax, zmin,
-          zmax);
+        DMDASetUniformCoordinates (da_list[k], xmin, xmax, ymin, ymax, zmin,
+            zmax);
 #endif
-    }
-    // the PCMG specific options
-    PCMGSetLevels (pc, nlvls, NULL);
-    PCMGSetType (pc, PC_MG_MULTIPLICATIVE); // Default
-    ierr = PCMGSetCycleType (pc, PC_MG_CYCLE_V);
-    CHKERRQ(ierr);
-    PCMGSetGalerkin (pc, PC_MG_GALERKIN_BOTH);
-    for (PetscInt k = 1; k < nlvls; k++) {
-      DMCreateInterpolation (da_list[k - 1], da_list[k], &R, NULL);
-      PCMGSetInterpolation (pc, k, R);
-      MatDestroy (&R);
-    }
+      }
+      // the PCMG specific options
+      PCMGSetLevels (pc, nlvls, NULL);
+      PCMGSetType (pc, PC_MG_MULTIPLICATIVE); // Default
+      ierr = PCMGSetCycleType (pc, PC_MG_CYCLE_V);
+      CHKERRQ(ierr);
+      if (reusePtAP) { // # new; the coarse operators are formed here
+        PCMGSetGalerkin (pc, PC_MG_GALERKIN_NONE);
+        Pmg = new Mat[nlvls];
+        Kmg = new Mat[nlvls];
+        for (PetscInt k = 0; k < nlvls; k++) {
+          Pmg[k] = NULL;
+          Kmg[k] = NULL;
+        }
+      } else {
+        PCMGSetGalerkin (pc, PC_MG_GALERKIN_BOTH);
+      }
+      for (PetscInt k = 1; k < nlvls; k++) {
+        DMCreateInterpolation (da_list[k - 1], da_list[k], &R, NULL);
+        PCMGSetInterpolation (pc, k, R);
+        if (reusePtAP) { // # new; kept for the numeric PtAP
+          Pmg[k] = R;
+        } else {
+          MatDestroy (&R);
+        }
+      }
+      if (reusePtAP) { // # new; symbolic and numeric PtAP on all levels
+        ierr = UpdateCoarseOperators ();
+        CHKERRQ(ierr);
+        for (PetscInt k = 0; k < nlvls; k++) {
+          KSP lksp;
+          PCMGGetSmoother (pc, k, &lksp);
+          KSPSetOperators (lksp, Kmg[k], Kmg[k]);
+        }
+      }
 
-    // tidy up
-    for (PetscInt k = 1; k < nlvls; k++) { // DO NOT DESTROY LEVEL 0
-      DMDestroy (&daclist[k]);
+      // tidy up
+      for (PetscInt k = 1; k < nlvls; k++) { // DO NOT DESTROY LEVEL 0
+        DMDestroy (&daclist[k]);
+      }
+      PetscFree(da_list);
+      PetscFree(daclist);
     }
-    PetscFree(da_list);
-    PetscFree(daclist);
 
     // AVOID THE DEFAULT FOR THE MG PART
     {
@@ -1221,7 +1719,7 @@ LinearElasticity::SetUpSolver ()
       KSP cksp;
       PCMGGetCoarseSolve (pc, &cksp);
       // The solver
-      ierr = KSPSetType (cksp, KSPGMRES); // KSPCG, KSPFGMRES
+      ierr = KSPSetType (cksp, symmetricSolve ? KSPCG : KSPGMRES); // # modified
       ierr = KSPGMRESSetRestart (cksp, coarse_restart);
       // ierr = KSPSetType(cksp,KSPCG);
 
@@ -1231,6 +1729,12 @@ LinearElasticity::SetUpSolver ()
       PC cpc;
       KSPGetPC (cksp, &cpc);
       PCSetType (cpc, PCSOR); // PCGAMG, PCSOR, PCSPAI (NEEDS TO BE COMPILED), PCJACOBI
+      // # new; Direct or AMG coarse solve of the cg_* presets
+      ierr = preset.SetUpCoarseSolve (cksp);
+      CHKERRQ(ierr);
+      // # new; Agglomerate a small coarse problem onto fewer ranks
+      ierr = MGLevels::SetUpCoarseSolve (pc, da_nodal, nlvls);
+      CHKERRQ(ierr);
 
       // Set smoothers on all levels (except for coarse grid):
       for (PetscInt k = 1; k < nlvls; k++) {
@@ -1238,13 +1742,32 @@ LinearElasticity::SetUpSolver ()
         PCMGGetSmoother (pc, k, &dksp);
         PC dpc;
         KSPGetPC (dksp, &dpc);
-        ierr = KSPSetType (dksp,
-        KSPGMRES); // KSPCG, KSPGMRES, KSPCHEBYSHEV (VERY GOOD FOR SPD)
-        ierr = KSPGMRESSetRestart (dksp, smooth_sweeps);
-        // ierr = KSPSetType(dksp,KSPCHEBYSHEV);
-        ierr = KSPSetTolerances (dksp, PETSC_DEFAULT, PETSC_DEFAULT,
-        PETSC_DEFAULT, smooth_sweeps); // NOTE in the above maxitr=restart;
-        PCSetType (dpc, PCSOR); // PCJACOBI, PCSOR for KSPCHEBYSHEV very good
+        // # modified; Chebyshev+Jacobi: the shell operators only provide a
+        // diagonal, the cg_* presets need a symmetric smoother
+        if (matrixFree || preset.IsSymmetric ()) {
+          ierr = preset.SetUpSmoother (dksp, smooth_sweeps);
+          CHKERRQ(ierr);
+        } else if (symmetricSolve) {
+          // # new; -symmetricSolve with the fgmres preset: CG outside needs
+          // a fixed symmetric smoother, Chebyshev with symmetric SOR sweeps
+          ierr = KSPSetType (dksp, KSPCHEBYSHEV);
+          CHKERRQ(ierr);
+          ierr = KSPChebyshevEstEigSet (dksp, 0.0, 0.1, 0.0, 1.1);
+          CHKERRQ(ierr);
+          ierr = KSPSetTolerances (dksp, PETSC_DEFAULT, PETSC_DEFAULT,
+          PETSC_DEFAULT, smooth_sweeps);
+          CHKERRQ(ierr);
+          ierr = PCSetType (dpc, PCSOR);
+          CHKERRQ(ierr);
+        } else {
+          ierr = KSPSetType (dksp,
+          KSPGMRES); // KSPCG, KSPGMRES, KSPCHEBYSHEV (VERY GOOD FOR SPD)
+          ierr = KSPGMRESSetRestart (dksp, smooth_sweeps);
+          // ierr = KSPSetType(dksp,KSPCHEBYSHEV);
+          ierr = KSPSetTolerances (dksp, PETSC_DEFAULT, PETSC_DEFAULT,
+          PETSC_DEFAULT, smooth_sweeps); // NOTE in the above maxitr=restart;
+          PCSetType (dpc, PCSOR); // PCJACOBI, PCSOR for KSPCHEBYSHEV very good
+        }
       }
     }
 
@@ -1298,6 +1821,21 @@ LinearElasticity::SetUpSolver ()
       "################# Linear solver settings #####################\n");
   PetscPrintf (PETSC_COMM_WORLD,
       "# Main solver: %s, prec.: %s, maxiter.: %i \n", ksptype, pctype, mmax);
+  preset.Print (); // # new
+  warmStart.Print (); // # new
+  if (matrixFree) { // # new
+    PetscPrintf (PETSC_COMM_WORLD,
+        "# Operator: matrix-free, rediscretized coarse levels \n");
+  }
+  if (Pmg != NULL) { // # new
+    PetscPrintf (PETSC_COMM_WORLD,
+        "# Coarse operators: Galerkin PtAP, symbolic product reused \n");
+  }
+  if (pcLagCh > 0.0 && !matrixFree) { // # new
+    PetscPrintf (PETSC_COMM_WORLD,
+        "# Lagged prec.: change < %g, max. designs: %D, its. factor: %g \n",
+        pcLagCh, pcLagMax, pcLagIts);
+  }
 
 // Only if pcmg is used
   if (pcmg_flag) {
@@ -1317,6 +1855,7 @@ LinearElasticity::SetUpSolver ()
           "# Level %i smoother: %s, prec.: %s, sweep: %i \n", k, dksptype,
           dpctype, mmax);
     }
+    MGLevels::Print (pc, da_nodal, nlvls); // # new
   }
   PetscPrintf (PETSC_COMM_WORLD,
       "##############################################################\n");
@@ -1324,52 +1863,79 @@ LinearElasticity::SetUpSolver ()
   return (ierr);
 }
 
-#if DIM == 2   // # new
-PetscErrorCode LinearElasticity::DMDAGetElements_2D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 4;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
+PetscErrorCode
+LinearElasticity::UpdateCoarseOperators () { // # new
+
+  PetscErrorCode ierr = 0;
+
+  if (Pmg == NULL) return ierr;
+
+  // The finest level is K itself; the coarse levels keep their nonzero
+  // structure, so after the first call only the numeric product is computed
+  MatReuse reuse = (Kmg[0] == NULL) ? MAT_INITIAL_MATRIX : MAT_REUSE_MATRIX;
+  Kmg[nlvls - 1] = K;
+  for (PetscInt k = nlvls - 1; k > 0; k--) {
+    ierr = MatPtAP (Kmg[k], Pmg[k], reuse, 2.0, &(Kmg[k - 1]));
     CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (j = ys; j < ye - 1; j++) {
-      for (i = xs; i < xe - 1; i++) {
-        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-        if (da->elementtype == DMDA_ELEMENT_Q1) {
-          for (c = 0; c < ns * nn; c++)
-            da->e[cnt++] = cell[c];
-        }
+  }
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearElasticity::LagPreconditioner (Vec xPhys, PetscInt loadCondition,
+    PetscBool *lag) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  *lag = PETSC_FALSE;
+  // Several BC groups set up the PC for every group: nothing to track
+  if (numBCGroups > 1) {
+    return ierr;
+  }
+  if (pcLagCh > 0.0 && !matrixFree && xPhysPC != NULL && !pcRefresh
+      && pcLagCount < pcLagMax && pcGroup == bcGroup[loadCondition]) {
+    // Max change of xPhys since the set up of the preconditioner
+    PetscInt nloc;
+    const PetscScalar *xp, *xpc;
+    PetscReal chloc = 0.0, ch;
+    VecGetLocalSize (xPhys, &nloc);
+    VecGetArrayRead (xPhys, &xp);
+    VecGetArrayRead (xPhysPC, &xpc);
+    for (PetscInt i = 0; i < nloc; i++) {
+      chloc = PetscMax(chloc, PetscAbsScalar(xp[i] - xpc[i]));
+    }
+    VecRestoreArrayRead (xPhys, &xp);
+    VecRestoreArrayRead (xPhysPC, &xpc);
+    MPI_Allreduce (&chloc, &ch, 1, MPIU_REAL, MPI_MAX, PETSC_COMM_WORLD);
+    *lag = (ch < pcLagCh) ? PETSC_TRUE : PETSC_FALSE;
+  }
+
+  if (*lag) {
+    pcLagCount++;
+  } else {
+    if (pcRefresh) {
+      PetscPrintf (PETSC_COMM_WORLD, "# Preconditioner refreshed: "
+          "KSP iterations rose above %g x %D \n", pcLagIts, pcFreshIts);
+    }
+    pcLagCount = 0;
+    pcFreshIts = -1;
+    pcRefresh = PETSC_FALSE;
+    pcGroup = bcGroup[loadCondition];
+    if (pcLagCh > 0.0) {
+      if (xPhysPC == NULL) {
+        ierr = VecDuplicate (xPhys, &xPhysPC);
+        CHKERRQ(ierr);
       }
+      ierr = VecCopy (xPhys, xPhysPC);
+      CHKERRQ(ierr);
     }
   }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
+
+  return ierr;
 }
 
+#if DIM == 2   // # new
 PetscInt LinearElasticity::Quad4Isoparametric (PetscScalar *X, PetscScalar *Y,
     PetscScalar nu, PetscInt redInt, PetscScalar *ke) {
   // QUA4_ISOPARAMETRIC - Computes QUA4 isoparametric element matrices
@@ -1546,69 +2112,6 @@ PetscScalar LinearElasticity::Inverse2M (PetscScalar J[][2],
 }
 
 #elif DIM == 3
-PetscErrorCode
-LinearElasticity::DMDAGetElements_3D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs) zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
-          }
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
 PetscInt
 LinearElasticity::Hex8Isoparametric (PetscScalar *X, PetscScalar *Y,
     PetscScalar *Z, PetscScalar nu, PetscInt redInt, PetscScalar *ke) {
@@ -1833,3 +2336,5 @@ LinearElasticity::Dot (PetscScalar *v1, PetscScalar *v2,
   }
   return result;
 }
+
+} // namespace TOPOPT_NS
@@ -8,6 +8,17 @@
 #include <petsc/private/dmdaimpl.h>
 
 #include "options.h" // # new; framework options
+#include "ElementKernels.h" // # new; batched element kernels
+#include "ElementMesh.h" // # new; shared element connectivity
+#include "DomainMask.h" // # new; domain membership of the elements
+#include "MGLevels.h" // # new; multigrid depth and coarse solve
+#include "WarmStart.h" // # new; initial guesses of the state solves
+#include "AssemblyMap.h" // # new; cached assembly into the CSR values
+#include "DirichletRows.h" // # new; Dirichlet conditions on K
+#include "PerfLog.h" // # new; per-phase performance log
+#include "SolverPreset.h" // # new; named solver configurations
+
+namespace TOPOPT_NS {
 
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -28,10 +39,10 @@ class LinearElasticity {
 
   public:
     // Constructor
-    LinearElasticity (DM da_nodes, PetscInt m, PetscInt numDES,
-        PetscInt numLODFIX, PetscInt numNodeLoadAddingCounts, PetscScalar nu,
-        PetscScalar E, PetscScalar *loadVector, Vec xPassive0, Vec xPassive1,
-        Vec xPassive2, Vec xPassive3); // # modified
+    LinearElasticity (DM da_nodes, ElementMesh *mesh, PetscInt m,
+        PetscInt numDES, PetscInt numLODFIX, PetscInt numNodeLoadAddingCounts,
+        PetscScalar nu, PetscScalar E, PetscScalar *loadVector,
+        DomainMask *domain); // # modified
 
     // Destructor
     ~LinearElasticity ();
@@ -40,24 +51,15 @@ class LinearElasticity {
     // SELF_ADJOINT PROBLEMS
     PetscErrorCode ComputeObjectiveConstraintsSensitivities (PetscScalar *fx,
         PetscScalar *gx, Vec dfdx, Vec *dgdx, Vec xPhys, PetscScalar Emin,
-        PetscScalar Emax, PetscScalar penal, PetscScalar volfrac, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3); // # modified
-
-    // Compute objective and constraints for the optimiation
-    PetscErrorCode ComputeObjectiveConstraints (PetscScalar *fx,
-        PetscScalar *gx, Vec xPhys, PetscScalar Emin, PetscScalar Emax,
-        PetscScalar penal, PetscScalar volfrac, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3); // # modified
-
-    // Compute sensitivities
-    PetscErrorCode ComputeSensitivities (Vec dfdx, Vec *dgdx, Vec xPhys,
-        PetscScalar Emin, PetscScalar Emax, PetscScalar penal,
-        PetscScalar volfrac, Vec xPassive0, Vec xPassive1,
-        Vec xPassive2, Vec xPassive3); // # modified; needs ....
+        PetscScalar Emax, PetscScalar penal, PetscScalar volfrac,
+        DomainMask *domain); // # modified
 
     // Restart writer
     PetscErrorCode WriteRestartFiles ();
 
+    // Relative tolerance of the next state solves (see StateTolerance.h)
+    PetscErrorCode SetStateTolerance (PetscReal rtol); // # new
+
     // Get pointer to the FE solution
     Vec GetStateField () {
       return (U);
@@ -72,8 +74,8 @@ class LinearElasticity {
     DM da_nodal; // Nodal mesh
 
     // # new; FEA with the TopOpt final results
-    PetscErrorCode FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadConditionFEA,
+    PetscErrorCode FEAWithTopOptResults (Vec xPhys, DomainMask *domain,
+        PetscInt loadConditionFEA,
         PetscScalar *loadVectorFEAp);
 
   private:
@@ -81,9 +83,16 @@ class LinearElasticity {
     PetscInt nn[DIM]; // # modified; Number of nodes in each direction
     PetscInt ne[DIM]; // # modified; Number of elements in each direction
     PetscScalar xc[2 * DIM]; // # modified; Domain coordinates
+    ElementMesh *mesh; // # new; element connectivity, owned by TopOpt
+    DomainMask *domain; // # new; domain membership, owned by TopOpt
+
+    // # new; Eliminate the dofs that belong only to elements outside of all
+    // domains (-eliminateVoid), only the active elements are assembled
+    PetscBool eliminateVoid;
 
     // Linear algebra
     Mat K; // Global stiffness matrix
+    Mat K0; // # new; unconstrained K, only needed with several BC groups
     Vec U; // # modified; Displacement vector
     Vec *RHS; // # modified; Load vector
     Vec *N; // # modified; Dirichlet vector (used when imposing BCs)
@@ -96,6 +105,7 @@ class LinearElasticity {
 
     // Solver
     KSP ksp; // Pointer to the KSP object i.e. the linear solver+prec
+    PetscReal stateRtol; // # new; Relative tolerance of the state solves
     PetscInt nlvls;
     PetscScalar nu; // Possions ratio
     PetscScalar E; // Young's modulus
@@ -113,25 +123,129 @@ class LinearElasticity {
     PetscInt m; // # new
 
     // Set up the FE mesh, data structures, and load and boundary conditions
-    PetscErrorCode SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
-        Vec xPassive2, Vec xPassive3, PetscInt loadCondition); // # modified
+    PetscErrorCode SetUpLoadAndBC (DM da_nodes, DomainMask *domain,
+        PetscInt loadCondition); // # modified
 
     // Solve the FE problem
     PetscErrorCode SolveState (Vec xPhys, PetscScalar Emin, PetscScalar Emax,
         PetscScalar penal, PetscInt loadCondition); // # modified
 
-    // Assemble the stiffness matrix
+    // # new; Assemble (if needed), impose the BCs and set up the solver
+    PetscErrorCode SetUpOperator (Vec xPhys, PetscScalar Emin,
+        PetscScalar Emax, PetscScalar penal, PetscInt loadCondition);
+
+    // # modified; Assemble the unconstrained stiffness matrix (K0 or K)
     PetscErrorCode AssembleStiffnessMatrix (Vec xPhys, PetscScalar Emin,
-        PetscScalar Emax, PetscScalar penal, PetscInt loadCondition); // # modified
+        PetscScalar Emax, PetscScalar penal);
+
+    // # new; Impose the Dirichlet conditions of a load condition on K
+    PetscErrorCode ApplyBoundaryConditions (Vec xPhys, PetscScalar Emin,
+        PetscScalar Emax, PetscScalar penal, PetscInt loadCondition);
+
+    // # new; Dirichlet conditions of the load conditions on K
+    DirichletRows dirichlet;
+
+    // # new; Cache the constrained rows of a load condition, after N is set
+    // up, with the diagonal of the elasticity rows
+    PetscErrorCode SetUpConstrainedRows (PetscInt loadCondition);
+
+    // # new; Cached scatter of the element matrices into K (-assemblyMap)
+    PetscBool assemblyMap;
+    AssemblyMap *asmMap; // # new
+
+    // # new; CG with symmetric smoothers (-symmetricSolve)
+    PetscBool symmetricSolve;
+
+    // # new; Solver configuration (-solverPreset) and the cache of the
+    // Chebyshev eigenvalue estimates
+    SolverPreset preset;
+
+    // # new; Initial guesses of the state solves (-warmStart)
+    WarmStart warmStart;
+
+    // # new; Flag a new stiffness matrix symmetric. K is assembled by
+    // DIM x DIM node blocks (MatSetValuesBlockedLocal) but stored as AIJ:
+    // the Galerkin PtAP and the SOR smoothers of PETSc 3.10 need AIJ
+    PetscErrorCode SetSymmetryFlags (Mat A);
+
+    // # new; Group the load conditions with identical Dirichlet vectors
+    PetscErrorCode SetUpBoundaryConditionGroups ();
+
+    // # new; Assembly cache: K is assembled once per design and shared by
+    // all load conditions, its BCs are only re-imposed when the group changes
+    PetscInt *bcGroup; // BC group of each load condition
+    PetscInt numBCGroups; // number of BC groups
+    PetscInt bcApplied; // group imposed on K, -1 unconstrained, -2 stale
+    PetscBool assembled; // K (or K0) holds a valid assembly
+    PetscObjectState xPhysState; // state of xPhys at the last assembly
+    PetscObjectId xPhysId; // xPhys of the last assembly
+    PetscScalar assembledParams[3]; // Emin, Emax, penal of the last assembly
 
     // Start the solver
     PetscErrorCode SetUpSolver ();
 
-#if DIM == 2    // # new
-    // Routine that doesn't change the element type upon repeated calls
-    PetscErrorCode DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
+    // # new; Galerkin coarse operators with symbolic reuse (-mg_reuse_ptap):
+    // the PtAP products are formed once and afterwards only recomputed
+    // numerically, instead of letting PCMG redo them at every KSPSetUp
+    PetscBool reusePtAP; // compute the coarse operators here
+    Mat *Pmg; // interpolation from level k-1 to level k
+    Mat *Kmg; // level operators, 0 is the coarsest, nlvls-1 is K
+
+    // # new; Compute (first call) or numerically update the coarse operators
+    PetscErrorCode UpdateCoarseOperators ();
+
+    // # new; Lagged preconditioner (-pc_lag_ch): the MG hierarchy is kept for
+    // several designs while xPhys changes little, and refreshed when the
+    // number of KSP iterations rises. Only with a single BC group: otherwise
+    // the PC is set up again for every group anyway
+    PetscScalar pcLagCh; // max change of xPhys to keep the PC, 0: never lag
+    PetscInt pcLagMax; // max number of designs solved with a lagged PC
+    PetscScalar pcLagIts; // refresh if its > pcLagIts * its with a fresh PC
+    Vec xPhysPC; // xPhys when the PC was set up
+    PetscInt pcGroup; // BC group the PC was set up for
+    PetscInt pcLagCount; // designs solved with the current PC since set up
+    PetscInt pcFreshIts; // iterations with the fresh PC, -1 if none yet
+    PetscBool pcRefresh; // set up a fresh PC for the next design
+
+    // # new; Decide whether the PC is lagged for the operator of xPhys
+    PetscErrorCode LagPreconditioner (Vec xPhys, PetscInt loadCondition,
+        PetscBool *lag);
+
+    // # new; Matrix-free operator (-matrixFree): data of one multigrid level
+    typedef struct {
+      DM da_nodal; // Nodal mesh of the level
+      DM da_elem; // Element mesh of the level (holds dens)
+      Vec dens; // SIMP interpolated Young's modulus per element
+      Vec N; // Dirichlet vector of the level
+      Vec xwork; // Global work vector
+      Vec xloc, yloc; // Local (ghosted) work vectors
+      ElementMesh *mesh; // Element connectivity of the level
+      PetscInt nel; // Number of local elements
+      const PetscInt *edof; // Element dofs (cached by mesh)
+      PetscScalar KE[nedof * nedof]; // Element stiffness matrix of the level
+    } MFLevel;
+
+    PetscBool matrixFree; // # new; use the matrix-free operator hierarchy
+    MFLevel *mfl; // # new; levels, 0 is the coarsest (PCMG ordering)
+    Mat *Kmf; // # new; level operators, the coarsest one is assembled
+    Mat *Pmf; // # new; interpolation from level k-1 to level k
+    Mat Kmfc; // # new; unconstrained coarsest operator
+
+    // # new; Set up the rediscretized mesh hierarchy and the shell operators
+    PetscErrorCode SetUpMatrixFree ();
+
+    // # new; Update the densities of all levels (replaces assembly)
+    PetscErrorCode AssembleMatrixFree (Vec xPhys, PetscScalar Emin,
+        PetscScalar Emax, PetscScalar penal);
+
+    // # new; Restrict the Dirichlet conditions to all levels
+    PetscErrorCode ApplyBoundaryConditionsMatrixFree (PetscInt loadCondition);
+
+    // # new; Shell operations: y = N*K*N*x + (I-N)*x and its diagonal
+    static PetscErrorCode MatMult_MatrixFree (Mat A, Vec x, Vec y);
+    static PetscErrorCode MatGetDiagonal_MatrixFree (Mat A, Vec d);
 
+#if DIM == 2    // # new
     // Methods used to assemble the element stiffness matrix
     PetscInt Quad4Isoparametric (PetscScalar *X, PetscScalar *Y, PetscScalar nu,
         PetscInt redInt, PetscScalar *ke);
@@ -140,10 +254,6 @@ class LinearElasticity {
     PetscScalar Inverse2M (PetscScalar J[][2], PetscScalar invJ[][2]);
 
 #elif DIM == 3
-    // Routine that doesn't change the element type upon repeated calls
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-
     // Methods used to assemble the element stiffness matrix
     PetscInt Hex8Isoparametric (PetscScalar *X, PetscScalar *Y, PetscScalar *Z,
         PetscScalar nu, PetscInt redInt, PetscScalar *ke);
@@ -170,4 +280,6 @@ class LinearElasticity {
     }
 };
 
+} // namespace TOPOPT_NS
+
 #endif
@@ -0,0 +1,275 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * MGLevels.cc
+ */
+
+#include "MGLevels.h"
+
+PetscErrorCode MGLevels::GetLevels (DM da, PetscInt *nlvls) {
+
+  PetscErrorCode ierr = 0;
+
+  PetscInt dim, M[3] = { 1, 1, 1 }, P[3] = { 1, 1, 1 };
+  ierr = DMDAGetInfo (da, &dim, &M[0], &M[1], &M[2], &P[0], &P[1], &P[2],
+      NULL, NULL, NULL, NULL, NULL, NULL);
+  CHKERRQ(ierr);
+
+  PetscBool flg;
+  PetscInt n = 0;
+  PetscOptionsGetInt (NULL, NULL, "-nlvls", &n, &flg);
+  if (n > 0) {
+    // Given: every direction must be halved n - 1 times
+    for (PetscInt d = 0; d < dim; d++) {
+      if ((M[d] - 1) % (1 << (n - 1)) != 0) {
+        SETERRQ3(PETSC_COMM_WORLD, PETSC_ERR_ARG_INCOMP,
+            "Mesh not compatible with %D multigrid levels: %D nodes in "
+            "direction %D cannot be halved", n, M[d], d);
+      }
+    }
+    *nlvls = n;
+    return ierr;
+  }
+
+  PetscInt maxLevels = 10, minNodes = 2;
+  PetscOptionsGetInt (NULL, NULL, "-nlvlsMax", &maxLevels, &flg);
+  PetscOptionsGetInt (NULL, NULL, "-mgCoarseNodes", &minNodes, &flg);
+
+  // Fewest nodes of a rank per direction, the coarse grids keep the
+  // partitioning of da
+  const PetscInt *l[3] = { NULL, NULL, NULL };
+  ierr = DMDAGetOwnershipRanges (da, &l[0], &l[1], &l[2]);
+  CHKERRQ(ierr);
+  PetscInt lmin[3] = { 1, 1, 1 };
+  for (PetscInt d = 0; d < dim; d++) {
+    lmin[d] = M[d];
+    for (PetscInt i = 0; i < P[d]; i++) {
+      lmin[d] = PetscMin(lmin[d], l[d][i]);
+    }
+  }
+
+  // Add a level as long as all directions can be halved once more
+  n = 1;
+  while (n < maxLevels) {
+    PetscInt h = 1 << n;
+    PetscBool ok = PETSC_TRUE;
+    for (PetscInt d = 0; d < dim; d++) {
+      ok = (PetscBool) (ok && (M[d] - 1) % h == 0 && lmin[d] / h >= minNodes);
+    }
+    if (!ok) break;
+    n++;
+  }
+  *nlvls = n;
+
+  return ierr;
+}
+
+PetscErrorCode MGLevels::SetUpCoarseSolve (PC pc, DM da, PetscInt nlvls) {
+
+  PetscErrorCode ierr = 0;
+
+  // The physics set the PC from the options before PCMGSetLevels, the
+  // events of -pc_mg_log are only registered for the levels present then
+  const char *pcPrefix;
+  PCGetOptionsPrefix (pc, &pcPrefix);
+  PetscBool flg;
+  PetscOptionsHasName (NULL, pcPrefix, "-pc_mg_log", &flg);
+  if (flg) {
+    ierr = PCSetFromOptions (pc);
+    CHKERRQ(ierr);
+  }
+
+  PetscInt target = 2000;
+  PetscOptionsGetInt (NULL, NULL, "-mgTelescopeDofs", &target, &flg);
+  PetscMPIInt size;
+  MPI_Comm_size (PetscObjectComm ((PetscObject) pc), &size);
+
+  PetscInt dim, M[3], ndof;
+  ierr = LevelNodes (da, nlvls, 0, &dim, M, &ndof);
+  CHKERRQ(ierr);
+  PetscInt64 nc = ndof;
+  for (PetscInt d = 0; d < dim; d++) {
+    nc *= M[d];
+  }
+  if (target <= 0 || size == 1 || nc >= (PetscInt64) target * size) {
+    return ierr;
+  }
+  // About target dofs on each of size / factor ranks
+  PetscInt factor = (PetscInt) PetscMin((PetscInt64 ) size,
+      ((PetscInt64) target * size + nc - 1) / nc);
+  if (factor < 2) {
+    return ierr;
+  }
+
+  // The configured coarse solve runs on the sub-communicator
+  KSP cksp;
+  PCMGGetCoarseSolve (pc, &cksp);
+  PC cpc;
+  KSPGetPC (cksp, &cpc);
+  KSPType ktype;
+  PCType ptype;
+  KSPGetType (cksp, &ktype);
+  PCGetType (cpc, &ptype);
+  PetscReal rtol;
+  PetscInt maxits;
+  KSPGetTolerances (cksp, &rtol, NULL, NULL, &maxits);
+
+  // Kept on the telescope PC until its inner solver exists
+  CoarseSolve *coarse;
+  ierr = PetscNew (&coarse);
+  CHKERRQ(ierr);
+  PetscStrncpy (coarse->kspType, ktype, sizeof(coarse->kspType));
+  if (ptype != NULL) {
+    PetscStrncpy (coarse->pcType, ptype, sizeof(coarse->pcType));
+  }
+  coarse->rtol = rtol;
+  coarse->maxits = maxits;
+  PetscContainer container;
+  ierr = PetscContainerCreate (PetscObjectComm ((PetscObject) cpc),
+      &container);
+  CHKERRQ(ierr);
+  PetscContainerSetPointer (container, coarse);
+  PetscContainerSetUserDestroy (container, PetscContainerUserDestroyDefault);
+  ierr = PetscObjectCompose ((PetscObject) cpc, "MGLevels_CoarseSolve",
+      (PetscObject) container);
+  CHKERRQ(ierr);
+  PetscContainerDestroy (&container);
+
+  ierr = KSPSetType (cksp, KSPPREONLY);
+  CHKERRQ(ierr);
+  ierr = PCSetType (cpc, PCTELESCOPE);
+  CHKERRQ(ierr);
+  ierr = PCTelescopeSetReductionFactor (cpc, factor);
+  CHKERRQ(ierr);
+  // Redistribute the operator only, not the coarse DMDA
+  ierr = PCTelescopeSetIgnoreDM (cpc, PETSC_TRUE);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode MGLevels::SetUpTelescopeSolve (KSP ksp) {
+
+  PetscErrorCode ierr = 0;
+
+  PC pc;
+  KSPGetPC (ksp, &pc);
+  PetscBool mg;
+  PetscObjectTypeCompare ((PetscObject) pc, PCMG, &mg);
+  if (!mg) {
+    return ierr;
+  }
+  KSP cksp;
+  PCMGGetCoarseSolve (pc, &cksp);
+  PC cpc;
+  KSPGetPC (cksp, &cpc);
+  PetscContainer container = NULL;
+  PetscObjectQuery ((PetscObject) cpc, "MGLevels_CoarseSolve",
+      (PetscObject *) &container);
+  if (container == NULL) {
+    return ierr;
+  }
+
+  // The set up of the telescope PC creates its inner solver
+  ierr = KSPSetUp (ksp);
+  CHKERRQ(ierr);
+  KSP sksp = NULL;
+  ierr = PCTelescopeGetKSP (cpc, &sksp);
+  CHKERRQ(ierr);
+  if (sksp != NULL) { // NULL on the ranks left out of the coarse solve
+    CoarseSolve *coarse;
+    PetscContainerGetPointer (container, (void **) &coarse);
+    ierr = KSPSetType (sksp, coarse->kspType);
+    CHKERRQ(ierr);
+    if (coarse->pcType[0] != '\0') {
+      PC spc;
+      KSPGetPC (sksp, &spc);
+      ierr = PCSetType (spc, coarse->pcType);
+      CHKERRQ(ierr);
+    }
+    ierr = KSPSetTolerances (sksp, coarse->rtol, PETSC_DEFAULT, PETSC_DEFAULT,
+        coarse->maxits);
+    CHKERRQ(ierr);
+    // The telescope_ options of the command line still apply
+    ierr = KSPSetFromOptions (sksp);
+    CHKERRQ(ierr);
+  }
+  // Only once, later set ups keep the inner solver
+  ierr = PetscObjectCompose ((PetscObject) cpc, "MGLevels_CoarseSolve", NULL);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode MGLevels::Print (PC pc, DM da, PetscInt nlvls) {
+
+  PetscErrorCode ierr = 0;
+
+  PetscMPIInt size;
+  MPI_Comm_size (PetscObjectComm ((PetscObject) pc), &size);
+
+  for (PetscInt k = 0; k < nlvls; k++) {
+    PetscInt dim, M[3], ndof;
+    ierr = LevelNodes (da, nlvls, k, &dim, M, &ndof);
+    CHKERRQ(ierr);
+    PetscInt n = ndof;
+    for (PetscInt d = 0; d < dim; d++) {
+      n *= M[d];
+    }
+    if (dim == 2) {
+      PetscPrintf (PETSC_COMM_WORLD, "# Level %D grid: (%D,%D), dofs: %D, "
+          "per rank: %D \n", k, M[0], M[1], n, n / size);
+    } else {
+      PetscPrintf (PETSC_COMM_WORLD, "# Level %D grid: (%D,%D,%D), dofs: %D, "
+          "per rank: %D \n", k, M[0], M[1], M[2], n, n / size);
+    }
+  }
+
+  KSP cksp;
+  PCMGGetCoarseSolve (pc, &cksp);
+  PC cpc;
+  KSPGetPC (cksp, &cpc);
+  PetscBool telescope;
+  PetscObjectTypeCompare ((PetscObject) cpc, PCTELESCOPE, &telescope);
+  if (telescope) {
+    PetscInt factor;
+    PCTelescopeGetReductionFactor (cpc, &factor);
+    PetscPrintf (PETSC_COMM_WORLD, "# Coarse solve agglomerated on %D of %d "
+        "ranks \n", size / factor, size);
+  }
+
+  return ierr;
+}
+
+PetscErrorCode MGLevels::LevelNodes (DM da, PetscInt nlvls, PetscInt k,
+    PetscInt *dim, PetscInt M[], PetscInt *ndof) {
+
+  PetscErrorCode ierr = 0;
+
+  M[0] = M[1] = M[2] = 1;
+  ierr = DMDAGetInfo (da, dim, &M[0], &M[1], &M[2], NULL, NULL, NULL, ndof,
+      NULL, NULL, NULL, NULL, NULL);
+  CHKERRQ(ierr);
+  // Every coarsening halves the elements
+  for (PetscInt d = 0; d < *dim; d++) {
+    M[d] = (M[d] - 1) / (1 << (nlvls - 1 - k)) + 1;
+  }
+
+  return ierr;
+}
@@ -0,0 +1,86 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * MGLevels.h
+ *
+ * Depth and coarse solve of the geometric multigrid hierarchies of the
+ * nodal DMDA, shared by TopOpt and all physics:
+ *
+ *  -nlvls <n>           n > 0: n levels, the mesh must allow to halve the
+ *                       elements of every direction n - 1 times
+ *                       0 (default): the deepest hierarchy the mesh allows,
+ *                       as long as every rank keeps at least -mgCoarseNodes
+ *                       (2) nodes per direction on the coarsest grid, at
+ *                       most -nlvlsMax (10) levels
+ *  -mgTelescopeDofs <n> if the coarsest grid has less than n (2000) dofs per
+ *                       rank, the coarse solve is agglomerated onto fewer
+ *                       ranks (PCTELESCOPE) so that every active rank has
+ *                       about n dofs; 0: coarse solve on all ranks
+ *
+ * The coarse solver (KSP and PC type, tolerances) set up by the physics
+ * is given to the inner solver of the telescope PC once it exists, after
+ * the first set up; its options prefix is the one of the coarse solve
+ * followed by telescope_ (e.g. -mg_coarse_telescope_pc_type), and these
+ * options take precedence. With -pc_mg_log, -log_view reports the
+ * smoothing, residual and interpolation time of every level.
+ *
+ * The choice only depends on the mesh, its partitioning and the options,
+ * so all callers with the same DMDA get the same number of levels.
+ */
+
+#ifndef MGLEVELS_H_
+#define MGLEVELS_H_
+
+#include <petsc.h>
+
+class MGLevels {
+
+  public:
+
+    // Number of levels of the hierarchy of the nodal mesh da (see above)
+    static PetscErrorCode GetLevels (DM da, PetscInt *nlvls);
+
+    // After the coarse solve of the PCMG pc is configured: agglomerate it
+    // if the coarsest of the nlvls levels of da is small per rank, and
+    // enable the per-level events of -pc_mg_log
+    static PetscErrorCode SetUpCoarseSolve (PC pc, DM da, PetscInt nlvls);
+
+    // After the operators of the PCMG solver ksp are set: set ksp up and
+    // configure the inner solver of an agglomerated coarse solve
+    static PetscErrorCode SetUpTelescopeSolve (KSP ksp);
+
+    // Print the size of every level and the ranks of the coarse solve
+    static PetscErrorCode Print (PC pc, DM da, PetscInt nlvls);
+
+  private:
+
+    // Coarse solver that the agglomerated solve inherits
+    struct CoarseSolve {
+        char kspType[64];
+        char pcType[64];
+        PetscReal rtol;
+        PetscInt maxits;
+    };
+
+    // Global nodes per direction of level k (nlvls - 1: da itself)
+    static PetscErrorCode LevelNodes (DM da, PetscInt nlvls, PetscInt k,
+        PetscInt *dim, PetscInt M[], PetscInt *ndof);
+};
+
+#endif /* MGLEVELS_H_ */
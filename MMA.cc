@@ -1,5 +1,6 @@
 
 #include "MMA.h"
+#include "Threads.h"
 #include <iostream>
 #include <math.h>
 
@@ -537,6 +538,7 @@ PetscErrorCode MMA::GenSub(Vec xval, Vec dfdx, PetscScalar* gx, Vec* dgdx, Vec x
     VecGetArrays(pij, m, &pijv);
     VecGetArrays(qij, m, &qijv);
     if (k > 2) {
+        TOPOPT_OMP(omp parallel for private(gamma, helpvar) schedule(static))
         for (PetscInt i = 0; i < nloc; i++) {
             helpvar = (xv[i] - x1v[i]) * (x1v[i] - x2v[i]);
             if (helpvar < 0.0) {
@@ -575,6 +577,7 @@ PetscErrorCode MMA::GenSub(Vec xval, Vec dfdx, PetscScalar* gx, Vec* dgdx, Vec x
     }
     PetscScalar dfdxp, dfdxm;
     PetscScalar feps = 1.0e-6;
+    TOPOPT_OMP(omp parallel for private(dfdxp, dfdxm) schedule(static))
     for (PetscInt i = 0; i < nloc; i++) {
         alf[i] = Max(xminv[i], 0.9 * Lv[i] + 0.1 * xv[i]);
         bet[i] = Min(xmaxv[i], 0.9 * Uv[i] + 0.1 * xv[i]);
@@ -597,10 +600,12 @@ PetscErrorCode MMA::GenSub(Vec xval, Vec dfdx, PetscScalar* gx, Vec* dgdx, Vec x
         }
     }
     for (PetscInt j = 0; j < m; j++) {
-        b[j] = 0.0;
+        PetscScalar bj = 0.0;
+        TOPOPT_OMP(omp parallel for reduction(+:bj) schedule(static))
         for (PetscInt i = 0; i < nloc; i++) {
-            b[j] += pijv[j][i] / (Uv[i] - xv[i]) + qijv[j][i] / (xv[i] - Lv[i]);
+            bj += pijv[j][i] / (Uv[i] - xv[i]) + qijv[j][i] / (xv[i] - Lv[i]);
         }
+        b[j] = bj;
     }
     {
         PetscScalar* tmp = new PetscScalar[m];
@@ -735,10 +740,12 @@ PetscErrorCode MMA::DualGrad(Vec x) {
     VecGetArray(L, &Lv);
     VecGetArray(U, &Uv);
     for (PetscInt j = 0; j < m; j++) {
-        grad[j] = 0.0;
+        PetscScalar gj = 0.0;
+        TOPOPT_OMP(omp parallel for reduction(+:gj) schedule(static))
         for (PetscInt i = 0; i < nloc; i++) {
-            grad[j] += pijv[j][i] / (Uv[i] - xv[i]) + qijv[j][i] / (xv[i] - Lv[i]);
+            gj += pijv[j][i] / (Uv[i] - xv[i]) + qijv[j][i] / (xv[i] - Lv[i]);
         }
+        grad[j] = gj;
     }
     {
         PetscScalar* tmp = new PetscScalar[m];
@@ -778,6 +785,7 @@ PetscErrorCode MMA::DualHess(Vec x) {
     PetscScalar* df2 = new PetscScalar[nloc];
     PetscScalar* PQ  = new PetscScalar[nloc * m];
     PetscScalar  pjlam, qjlam;
+    TOPOPT_OMP(omp parallel for private(pjlam, qjlam) schedule(static))
     for (PetscInt i = 0; i < nloc; i++) {
         pjlam = p0v[i];
         qjlam = q0v[i];
@@ -797,6 +805,7 @@ PetscErrorCode MMA::DualHess(Vec x) {
     }
     PetscScalar* tmp = new PetscScalar[n * m];
     for (PetscInt j = 0; j < m; j++) {
+        TOPOPT_OMP(omp parallel for schedule(static))
         for (PetscInt i = 0; i < nloc; i++) {
             tmp[j * nloc + i] = 0.0;
             tmp[j * nloc + i] += PQ[i * m + j] * df2[i];
@@ -804,10 +813,12 @@ PetscErrorCode MMA::DualHess(Vec x) {
     }
     for (PetscInt i = 0; i < m; i++) {
         for (PetscInt j = 0; j < m; j++) {
-            Hess[i * m + j] = 0.0;
+            PetscScalar hij = 0.0;
+            TOPOPT_OMP(omp parallel for reduction(+:hij) schedule(static))
             for (PetscInt k = 0; k < nloc; k++) {
-                Hess[i * m + j] += tmp[i * nloc + k] * PQ[k * m + j];
+                hij += tmp[i * nloc + k] * PQ[k * m + j];
             }
+            Hess[i * m + j] = hij;
         }
     }
     {
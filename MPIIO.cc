@@ -3,6 +3,8 @@
 #include <cstdlib> // To get the exit function
 #include <iostream>
 
+namespace TOPOPT_NS {
+
 /* -----------------------------------------------------------------------------
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
  Updated: June 2019, Niels Aage
@@ -76,11 +78,7 @@ MPIIO::MPIIO (DM da_nodes, int nPf, std::string pnames, int nCf, std::string cna
   // Get the FE mesh structure (from the nodal mesh)
   PetscInt nel, nen;
   const PetscInt *necon;
-#if DIM == 2 // # new
-  DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
-#elif DIM == 3
-  DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
-#endif
+  ElementMesh::DMDAGetElements (da_nodes, &nel, &nen, &necon);
 
   // Number of points/cells in each domain for this rank
 #if DIM == 2  // # new
@@ -192,7 +190,8 @@ MPIIO::~MPIIO () {
   delete[] nCFields;
 }
 
-PetscErrorCode MPIIO::WriteVTK (DM da_nodes, Vec U, Vec nodeDensity, Vec x, Vec xTilde, Vec xPhys, Vec xPassive0, Vec xPassive1,Vec xPassive2, Vec xPassive3, PetscInt itr) {
+PetscErrorCode MPIIO::WriteVTK (DM da_nodes, Vec U, Vec nodeDensity, Vec x, Vec xTilde, Vec xPhys,
+    DomainMask *domain, PetscInt itr) { // # modified
 
   // Here we only have one "timestep" (no optimization)
   unsigned long int timestep = itr;
@@ -271,36 +270,31 @@ PetscErrorCode MPIIO::WriteVTK (DM da_nodes, Vec U, Vec nodeDensity, Vec x, Vec
   CHKERRQ(ierr);
 
   // CELL FIELD(S)
-  PetscScalar *xpp, *xp, *xt;
-  VecGetArray (x, &xp);
-  VecGetArray (xTilde, &xt);
-  VecGetArray (xPhys, &xpp);
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;  // # new
-  VecGetArray (xPassive0, &xPassive0p);  // # new
-  VecGetArray (xPassive1, &xPassive1p);  // # new
-  VecGetArray (xPassive2, &xPassive2p);  // # new
-  VecGetArray (xPassive3, &xPassive3p);  // # new
+  // # modified; read only, writing the output keeps the state of the fields
+  const PetscScalar *xpp, *xp, *xt;
+  VecGetArrayRead (x, &xp);
+  VecGetArrayRead (xTilde, &xt);
+  VecGetArrayRead (xPhys, &xpp);
 
   for (unsigned long int i = 0; i < nCellsMyrank[0]; i++) { // 2D/3D use the same code for cell field
     // Density
     workCellField[i + 0 * nCellsMyrank[0]] = float (xp[i]);
     workCellField[i + 1 * nCellsMyrank[0]] = float (xt[i]);
     workCellField[i + 2 * nCellsMyrank[0]] = float (xpp[i]);
-    workCellField[i + 3 * nCellsMyrank[0]] = float (xPassive0p[i]);  // # new
-    workCellField[i + 4 * nCellsMyrank[0]] = float (xPassive1p[i]);  // # new
-    workCellField[i + 5 * nCellsMyrank[0]] = float (xPassive2p[i]);  // # new
-    workCellField[i + 6 * nCellsMyrank[0]] = float (xPassive3p[i]);  // # new
+    // # modified; domain mask in the encoding of the former xPassive0..3
+    DomainMask::Kind kind = domain->GetKind (i);
+    float indices = float (domain->GetIndices (i));
+    workCellField[i + 3 * nCellsMyrank[0]] = (kind == DomainMask::DESIGN) ? indices : 0.0f;
+    workCellField[i + 4 * nCellsMyrank[0]] = (kind == DomainMask::SOLID) ? indices : 0.0f;
+    workCellField[i + 5 * nCellsMyrank[0]] = (kind == DomainMask::FIXTURE) ? indices : 0.0f;
+    workCellField[i + 6 * nCellsMyrank[0]] = (kind == DomainMask::LOAD) ? indices : 0.0f;
   }
   writeCellFields (0, workCellField);
 
   // Restore arrays
-  VecRestoreArray (x, &xp);
-  VecRestoreArray (xTilde, &xt);
-  VecRestoreArray (xPhys, &xpp);
-  VecRestoreArray (xPassive0, &xPassive0p); // # new
-  VecRestoreArray (xPassive1, &xPassive1p); // # new
-  VecRestoreArray (xPassive2, &xPassive2p); // # new
-  VecRestoreArray (xPassive3, &xPassive3p); // # new
+  VecRestoreArrayRead (x, &xp);
+  VecRestoreArrayRead (xTilde, &xt);
+  VecRestoreArrayRead (xPhys, &xpp);
 
   // clean up
   ierr = VecDestroy (&Ulocal);
@@ -878,111 +872,4 @@ unsigned long int MPIIO::sum (unsigned long int *startPos,
   return total;
 }
 
-#if DIM == 2   // # new
-PetscErrorCode MPIIO::DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-    const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 4;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (j = ys; j < ye - 1; j++) {
-      for (i = xs; i < xe - 1; i++) {
-        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-        if (da->elementtype == DMDA_ELEMENT_Q1) {
-          for (c = 0; c < ns * nn; c++)
-            da->e[cnt++] = cell[c];
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
-#elif DIM == 3
-PetscErrorCode MPIIO::DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen,
-    const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs) zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
-          }
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-#endif
+} // namespace TOPOPT_NS
@@ -10,6 +10,10 @@
 #include <string>
 
 #include "options.h" // # new; framework options
+#include "ElementMesh.h" // # new; shared element connectivity
+#include "DomainMask.h" // # new; domain membership of the elements
+
+namespace TOPOPT_NS {
 
 /* -----------------------------------------------------------------------------
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -47,7 +51,7 @@ class MPIIO {
 
     // NOT CLEAN INTERFACE: REPLACE BY STD::PAIR OR SUCH !!!!!!
     PetscErrorCode WriteVTK (DM da_nodes, Vec U, Vec nodeDen, Vec x,
-        Vec xTilde, Vec xPhys, Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3,
+        Vec xTilde, Vec xPhys, DomainMask *domain,
         PetscInt itr);  // # modified
 
   private:
@@ -95,13 +99,6 @@ class MPIIO {
     // Converters needed for PETSc adaptation
     unsigned long int *nPointsMyrank, *nCellsMyrank;
     float *workPointField, *workCellField;
-
-#if DIM == 2  // # new
-    PetscErrorCode DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-#elif DIM == 3
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen, const PetscInt *e[]);
-#endif
 };
 /** @example
  An illustrative example explaining how to use the class
@@ -177,4 +174,6 @@ class MPIIO {
  @endcode
  */
 
+} // namespace TOPOPT_NS
+
 #endif
@@ -2,6 +2,8 @@
 //#include "TopOpt.h"
 //#include <petsc-private/dmdaimpl.h>
 #include <petsc/private/dmdaimpl.h>
+
+namespace TOPOPT_NS {
 /* -----------------------------------------------------------------------------
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
  Updated: June 2019, Niels Aage
@@ -35,6 +37,12 @@ PDEFilt::PDEFilt (DM da_nodes, PetscScalar rmin) {
 
   nlvls = 3; // MG levels
 
+  // # new; work matrices of the batched gradients
+  S = NULL;
+  B = NULL;
+  SF = NULL;
+  BX = NULL; // # new
+
   // number of nodal dofs
   PetscInt numnodaldof = 1;
 
@@ -58,7 +66,7 @@ PDEFilt::PDEFilt (DM da_nodes, PetscScalar rmin) {
 
         PetscInt        nel, nen;
         const PetscInt* necon;
-        DMDAGetElements_2D(da_nodes, &nel, &nen, &necon);
+        ElementMesh::DMDAGetElements (da_nodes, &nel, &nen, &necon);
 
         // Use the first element to compute the dx, dy
         dx = lcoorp[2 * necon[0 * nen + 1] + 0] - lcoorp[2 * necon[0 * nen + 0] + 0];
@@ -147,7 +155,7 @@ PDEFilt::PDEFilt (DM da_nodes, PetscScalar rmin) {
 
     PetscInt nel, nen;
     const PetscInt *necon;
-    DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
+    ElementMesh::DMDAGetElements (da_nodes, &nel, &nen, &necon);
 
     // Use the first element to compute the dx, dy, dz
     dx = lcoorp[3 * necon[0 * nen + 1] + 0]
@@ -246,6 +254,10 @@ PDEFilt::PDEFilt (DM da_nodes, PetscScalar rmin) {
 
   // create the stiffness matrix
   DMCreateMatrix (da_nodal, &(K));
+  // # new; K is symmetric positive definite (Cholesky of the direct solver)
+  MatSetOption (K, MAT_SYMMETRIC, PETSC_TRUE);
+  MatSetOption (K, MAT_SYMMETRY_ETERNAL, PETSC_TRUE);
+  MatSetOption (K, MAT_SPD, PETSC_TRUE);
   // create RHS
   DMCreateGlobalVector (da_nodal, &(RHS));
   DMCreateGlobalVector (da_element, &(X));
@@ -313,6 +325,9 @@ PetscErrorCode PDEFilt::FilterProject (Vec OX, Vec FX) {
   CHKERRQ(ierr);
   ierr = KSPGetResidualNorm (ksp, &rnorm);
   CHKERRQ(ierr);
+  PetscBool maxits = PETSC_FALSE; // # new
+  ierr = CheckConverged (&maxits, PETSC_FALSE);
+  CHKERRQ(ierr);
   ierr = MatMultTranspose (T, U, FX);
   CHKERRQ(ierr);
 
@@ -320,6 +335,8 @@ PetscErrorCode PDEFilt::FilterProject (Vec OX, Vec FX) {
   PetscPrintf (PETSC_COMM_WORLD,
       "PDEFilter solver:  iter: %i, rerr.: %e, time: %f\n", niter, rnorm,
       t2 - t1);
+  ierr = CheckConverged (&maxits, PETSC_TRUE); // # new
+  CHKERRQ(ierr);
   return ierr;
 }
 
@@ -327,6 +344,194 @@ PetscErrorCode PDEFilt::Gradients (Vec OS, Vec FS) {
   return FilterProject (OS, FS);
 }
 
+PetscErrorCode PDEFilt::ChooseSolver () { // # new
+
+  PetscErrorCode ierr = 0;
+
+  static const char *const names[] = { "auto", "fgmres", "direct", "cg_mg" };
+  PetscBool flg;
+  PetscInt choice = 1; // fgmres, the former solver
+  PetscOptionsGetEList (NULL, NULL, "-pdeFilterSolver", names, 4, &choice,
+      &flg);
+  PetscInt directNodes = 100000;
+  PetscOptionsGetInt (NULL, NULL, "-pdeFilterDirectNodes", &directNodes, &flg);
+
+  PetscInt nnodes;
+  VecGetSize (U, &nnodes);
+  if (choice == 0) {
+    // Direct below a mesh size to be set from measurements, above it keep
+    // the accurate FGMRES solve; the cheaper CG+MG solve has to be asked for
+    solver = (nnodes <= directNodes) ? DIRECT : FGMRES;
+  } else {
+    solver = (SolverType) (choice - 1);
+  }
+
+  // The CG+MG solve stops at a fixed, low number of iterations, the former
+  // FGMRES solve at 60
+  solverRtol = (solver == CG_MG) ? 1.0e-6 : 1.0e-8;
+  solverMaxIts = (solver == CG_MG) ? 10 : 60;
+  PetscOptionsGetReal (NULL, NULL, "-pdeFilterRtol", &solverRtol, &flg);
+  PetscOptionsGetInt (NULL, NULL, "-pdeFilterMaxIts", &solverMaxIts, &flg);
+
+  // The deepest hierarchy of the mesh, as the state solvers
+  if (solver == CG_MG) {
+    ierr = MGLevels::GetLevels (da_nodal, &nlvls);
+    CHKERRQ(ierr);
+  }
+
+  if (solver == DIRECT) {
+    PetscPrintf (PETSC_COMM_WORLD, "# PDE filter solver: direct (Cholesky, "
+        "redundant LU in parallel, kept for the run), %D nodes \n", nnodes);
+  } else {
+    PetscPrintf (PETSC_COMM_WORLD, "# PDE filter solver: %s, %D levels, "
+        "rtol: %g, max iter.: %D, %D nodes \n", names[solver + 1], nlvls,
+        (double) solverRtol, solverMaxIts, nnodes);
+  }
+
+  return ierr;
+}
+
+PetscErrorCode PDEFilt::Gradients (PetscInt nv, Vec *OS) { // # new
+
+  PetscErrorCode ierr;
+
+  double t1, t2;
+  PetscScalar rnorm, rmax = 0.0;
+  PetscInt niter, nitmax = 0;
+  PetscBool maxits = PETSC_FALSE; // a solve stopped at the iteration limit
+
+  t1 = MPI_Wtime ();
+
+  // The work matrices are kept for the run, the number of fields is fixed
+  PetscInt ncols = 0;
+  if (S != NULL) {
+    MatGetSize (S, NULL, &ncols);
+  }
+  if (ncols != nv) {
+    MatDestroy (&S);
+    MatDestroy (&B);
+    MatDestroy (&SF);
+    MatDestroy (&BX);
+  }
+
+  // Fields as dense columns, all right-hand sides by one product with T
+  PetscInt nelloc, nel, nnloc;
+  VecGetLocalSize (OS[0], &nelloc);
+  VecGetSize (OS[0], &nel);
+  VecGetLocalSize (U, &nnloc);
+  if (S == NULL) {
+    ierr = MatCreateDense (PETSC_COMM_WORLD, nelloc, PETSC_DECIDE, nel, nv,
+        NULL, &S);
+    CHKERRQ(ierr);
+  }
+  PetscScalar *sp;
+  const PetscScalar *op;
+  MatDenseGetArray (S, &sp);
+  for (PetscInt k = 0; k < nv; k++) {
+    VecGetArrayRead (OS[k], &op);
+    PetscMemcpy (sp + k * nelloc, op, nelloc * sizeof(PetscScalar));
+    VecRestoreArrayRead (OS[k], &op);
+  }
+  MatDenseRestoreArray (S, &sp);
+  ierr = MatMatMult (T, S, B == NULL ? MAT_INITIAL_MATRIX : MAT_REUSE_MATRIX,
+      PETSC_DEFAULT, &B);
+  CHKERRQ(ierr);
+
+  // Serial direct solver: all columns against the kept factor at once,
+  // from T*x as in FilterProject
+  PetscMPIInt size;
+  MPI_Comm_size (PETSC_COMM_WORLD, &size);
+  PC pc;
+  KSPGetPC (ksp, &pc);
+  PetscBool factor = PETSC_FALSE;
+  if (solver == DIRECT && size == 1) {
+    ierr = PetscObjectTypeCompareAny ((PetscObject) pc, &factor, PCCHOLESKY,
+        PCLU, "");
+    CHKERRQ(ierr);
+  }
+  Mat BU = B; // nodal solutions
+  if (factor) {
+    ierr = KSPSetUp (ksp); // factors K on first use only
+    CHKERRQ(ierr);
+    Mat F;
+    ierr = PCFactorGetMatrix (pc, &F);
+    CHKERRQ(ierr);
+    if (BX == NULL) {
+      ierr = MatDuplicate (B, MAT_DO_NOT_COPY_VALUES, &BX);
+      CHKERRQ(ierr);
+    }
+    ierr = MatScale (B, elemVol);
+    CHKERRQ(ierr);
+    ierr = MatMatSolve (F, B, BX);
+    CHKERRQ(ierr);
+    BU = BX;
+  } else {
+    // Iterative solvers: solve for every column in place
+    PetscScalar *bp;
+    MatDenseGetArray (B, &bp);
+    for (PetscInt k = 0; k < nv; k++) {
+      ierr = VecPlaceArray (U, bp + k * nnloc);
+      CHKERRQ(ierr);
+      ierr = VecCopy (U, RHS);
+      CHKERRQ(ierr);
+      ierr = VecScale (RHS, elemVol);
+      CHKERRQ(ierr);
+      ierr = KSPSolve (ksp, RHS, U);
+      CHKERRQ(ierr);
+      ierr = VecResetArray (U);
+      CHKERRQ(ierr);
+      KSPGetIterationNumber (ksp, &niter);
+      KSPGetResidualNorm (ksp, &rnorm);
+      ierr = CheckConverged (&maxits, PETSC_FALSE);
+      CHKERRQ(ierr);
+      nitmax = PetscMax(nitmax, niter);
+      rmax = PetscMax(PetscRealPart(rmax), PetscRealPart(rnorm));
+    }
+    MatDenseRestoreArray (B, &bp);
+  }
+
+  // All filtered fields by one product with T^T
+  ierr = MatTransposeMatMult (T, BU,
+      SF == NULL ? MAT_INITIAL_MATRIX : MAT_REUSE_MATRIX, PETSC_DEFAULT, &SF);
+  CHKERRQ(ierr);
+  PetscScalar *fp, *vp;
+  MatDenseGetArray (SF, &fp);
+  for (PetscInt k = 0; k < nv; k++) {
+    VecGetArray (OS[k], &vp);
+    PetscMemcpy (vp, fp + k * nelloc, nelloc * sizeof(PetscScalar));
+    VecRestoreArray (OS[k], &vp);
+  }
+  MatDenseRestoreArray (SF, &fp);
+
+  t2 = MPI_Wtime ();
+  PetscPrintf (PETSC_COMM_WORLD,
+      "PDEFilter solver:  %D fields, max iter: %D, max rerr.: %e, time: %f\n",
+      nv, nitmax, rmax, t2 - t1);
+  ierr = CheckConverged (&maxits, PETSC_TRUE);
+  CHKERRQ(ierr);
+  return ierr;
+}
+
+PetscErrorCode PDEFilt::CheckConverged (PetscBool *maxits,
+    PetscBool report) { // # new
+
+  PetscErrorCode ierr = 0;
+
+  KSPConvergedReason reason;
+  ierr = KSPGetConvergedReason (ksp, &reason);
+  CHKERRQ(ierr);
+  if (reason == KSP_DIVERGED_ITS) {
+    *maxits = PETSC_TRUE;
+  }
+  if (report && *maxits) {
+    PetscPrintf (PETSC_COMM_WORLD, "# PDE filter solver: stopped at the "
+        "iteration limit, raise -pdeFilterMaxIts or use -pdeFilterSolver "
+        "direct\n");
+  }
+
+  return ierr;
+}
+
 PDEFilt::~PDEFilt () {
   Free ();
 }
@@ -343,6 +548,10 @@ PetscErrorCode PDEFilt::Free () {
 
   MatDestroy (&T);
   MatDestroy (&K);
+  MatDestroy (&S); // # new
+  MatDestroy (&B); // # new
+  MatDestroy (&SF); // # new
+  MatDestroy (&BX); // # new
 
   ierr = DMDestroy (&da_nodal);
   CHKERRQ(ierr);
@@ -357,7 +566,7 @@ void PDEFilt::MatAssemble () {
   PetscInt nel, nen;
   const PetscInt *necon;
 #if DIM == 2  // # new
-    DMDAGetElements_2D(da_nodal, &nel, &nen, &necon);
+    ElementMesh::DMDAGetElements (da_nodal, &nel, &nen, &necon);
     MatZeroEntries(K);
     MatZeroEntries(T);
     PetscInt* edof = new PetscInt[4];
@@ -372,7 +581,7 @@ void PDEFilt::MatAssemble () {
             MatSetValuesLocal(T, 4, edof, 1, &i, TF, ADD_VALUES);
     }
 #elif DIM == 3
-  DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+  ElementMesh::DMDAGetElements (da_nodal, &nel, &nen, &necon);
   MatZeroEntries (K);
   MatZeroEntries (T);
   PetscInt *edof = new PetscInt[8];
@@ -400,19 +609,57 @@ PetscErrorCode PDEFilt::SetUpSolver () {
   PetscErrorCode ierr;
   PC pc;
 
+  // # new; the solver of the operator, which is constant for the run
+  ierr = ChooseSolver ();
+  CHKERRQ(ierr);
+
   // The fine grid Krylov method
   KSPCreate (PETSC_COMM_WORLD, &ksp);
-  ierr = KSPSetType (ksp, KSPFGMRES); // KSPCG, KSPGMRES
-  PetscInt restart = 20;
-  ierr = KSPGMRESSetRestart (ksp, restart);
+  KSPSetOperators (ksp, K, K); // ,SAME_PRECONDITIONER is now set in the prec
+
+  // # new; factored once, the factor is kept for the run
+  if (solver == DIRECT) {
+    ierr = KSPSetType (ksp, KSPPREONLY);
+    CHKERRQ(ierr);
+    KSPGetPC (ksp, &pc);
+    PetscMPIInt size;
+    MPI_Comm_size (PETSC_COMM_WORLD, &size);
+    PC fpc = pc;
+    if (size > 1) {
+      // Every rank factors the gathered operator. The gathered copy does not
+      // carry the symmetry flags of K, so it keeps the LU of PCREDUNDANT
+      ierr = PCSetType (pc, PCREDUNDANT);
+      CHKERRQ(ierr);
+      KSP rksp;
+      PCRedundantGetKSP (pc, &rksp);
+      KSPGetPC (rksp, &fpc);
+    } else {
+      // K is flagged symmetric positive definite, see the constructor
+      ierr = PCSetType (fpc, PCCHOLESKY);
+      CHKERRQ(ierr);
+    }
+    ierr = PCFactorSetMatOrderingType (fpc, MATORDERINGND);
+    CHKERRQ(ierr);
+    KSPSetFromOptions (ksp);
+    KSPGetPC (ksp, &pc);
+    ierr = PCSetReusePreconditioner (pc, PETSC_TRUE);
+    CHKERRQ(ierr);
+    return ierr;
+  }
 
-  PetscScalar rtol = 1.0e-8;
+  PetscScalar rtol = solverRtol; // # modified; -pdeFilterRtol
   PetscScalar atol = 1.0e-50;
   PetscScalar dtol = 1.0e3;
-  PetscInt maxitsGlobal = 60;
+  PetscInt maxitsGlobal = solverMaxIts; // # modified; -pdeFilterMaxIts
+  PetscInt restart = 20;
+  if (solver == CG_MG) { // # new
+    ierr = KSPSetType (ksp, KSPCG);
+  } else {
+    ierr = KSPSetType (ksp, KSPFGMRES); // KSPCG, KSPGMRES
+    ierr = KSPGMRESSetRestart (ksp, restart);
+  }
   ierr = KSPSetTolerances (ksp, rtol, atol, dtol, maxitsGlobal);
   ierr = KSPSetInitialGuessNonzero (ksp, PETSC_TRUE);
-  KSPSetOperators (ksp, K, K); // ,SAME_PRECONDITIONER is now set in the prec
 
   // preconditioner
   KSPGetPC (ksp, &pc);
@@ -485,8 +732,34 @@ PetscErrorCode PDEFilt::SetUpSolver () {
     PetscFree(da_list);
     PetscFree(daclist);
 
-    // AVOID THE DEFAULT FOR THE MG PART
-    {
+    // # new; symmetric V-cycle for CG: Chebyshev+Jacobi smoothers (the
+    // eigenvalue estimates are computed once, the operator is constant) and
+    // a direct coarse solve
+    if (solver == CG_MG) {
+      KSP cksp;
+      PCMGGetCoarseSolve (pc, &cksp);
+      ierr = KSPSetType (cksp, KSPPREONLY);
+      CHKERRQ(ierr);
+      PC cpc;
+      KSPGetPC (cksp, &cpc);
+      ierr = PCSetType (cpc, PCREDUNDANT);
+      CHKERRQ(ierr);
+      for (PetscInt k = 1; k < nlvls; k++) {
+        KSP dksp;
+        PCMGGetSmoother (pc, k, &dksp);
+        ierr = KSPSetType (dksp, KSPCHEBYSHEV);
+        CHKERRQ(ierr);
+        ierr = KSPChebyshevEstEigSet (dksp, 0.0, 0.1, 0.0, 1.1);
+        CHKERRQ(ierr);
+        ierr = KSPSetTolerances (dksp, PETSC_DEFAULT, PETSC_DEFAULT,
+            PETSC_DEFAULT, 2);
+        CHKERRQ(ierr);
+        PC dpc;
+        KSPGetPC (dksp, &dpc);
+        PCSetType (dpc, PCJACOBI);
+      }
+    } else {
+      // AVOID THE DEFAULT FOR THE MG PART
       // SET the coarse grid solver:
       // i.e. get a pointer to the ksp and change its settings
       KSP cksp;
@@ -562,52 +835,6 @@ PetscErrorCode PDEFilt::SetUpSolver () {
 }
 
 #if DIM == 2   // # new
-PetscErrorCode PDEFilt::DMDAGetElements_2D(DM dm, PetscInt* nel, PetscInt* nen, const PetscInt* e[]) {
-    PetscErrorCode ierr;
-    DM_DA*         da = (DM_DA*)dm->data;
-    PetscInt       i, xs, xe, Xs, Xe;
-    PetscInt       j, ys, ye, Ys, Ye;
-    PetscInt       cnt = 0, cell[4], ns = 1, nn = 4;
-    PetscInt       c;
-    if (!da->e) {
-            if (da->elementtype == DMDA_ELEMENT_Q1) {
-                    ns = 1;
-                    nn = 4;
-            }
-            ierr = DMDAGetCorners(dm, &xs, &ys, NULL, &xe, &ye, NULL);
-            CHKERRQ(ierr);
-            ierr = DMDAGetGhostCorners(dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
-            CHKERRQ(ierr);
-            xe += xs;
-            Xe += Xs;
-            if (xs != Xs)
-                xs -= 1;
-            ye += ys;
-            Ye += Ys;
-            if (ys != Ys)
-                ys -= 1;
-            da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-            PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-            for (j = ys; j < ye - 1; j++) {
-                    for (i = xs; i < xe - 1; i++) {
-                            cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-                            cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-                            cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-                            cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-                            if (da->elementtype == DMDA_ELEMENT_Q1) {
-                                    for (c = 0; c < ns * nn; c++)
-                                        da->e[cnt++] = cell[c];
-                            }
-                    }
-            }
-    }
-    *nel = da->ne;
-    *nen = nn;
-    *e   = da->e;
-    return (0);
-}
-
-
 void PDEFilt::PDEFilterMatrix_2D(PetscScalar dx, PetscScalar dy, PetscScalar RR, PetscScalar* KK,
                                  PetscScalar* T) {
     PetscScalar t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
@@ -661,65 +888,6 @@ void PDEFilt::PDEFilterMatrix_2D(PetscScalar dx, PetscScalar dy, PetscScalar RR,
 }
 
 #elif DIM == 3
-PetscErrorCode PDEFilt::DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen,
-    const PetscInt *e[]) {
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
-    }
-    DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs) zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
-          }
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
 void PDEFilt::PDEFilterMatrix (PetscScalar dx, PetscScalar dy, PetscScalar dz,
     PetscScalar RR, PetscScalar *KK, PetscScalar *T) {
   PetscScalar t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t15, t16, t18,
@@ -826,3 +994,5 @@ void PDEFilt::PDEFilterMatrix (PetscScalar dx, PetscScalar dy, PetscScalar dz,
   T[7] = 0.125 * vol;
 }
 #endif
+
+} // namespace TOPOPT_NS
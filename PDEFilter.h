@@ -4,6 +4,9 @@
 #include <petsc.h>
 
 #include "options.h"   // # new
+#include "MGLevels.h"  // # new
+
+namespace TOPOPT_NS {
 /* -----------------------------------------------------------------------------
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
  Updated: June 2019, Niels Aage
@@ -39,6 +42,11 @@ class PDEFilt {
 
     PetscErrorCode FilterProject (Vec XX, Vec F);
     PetscErrorCode Gradients (Vec OS, Vec FS);
+    // # new; Filter the nv gradients OS in place: the right-hand sides and
+    // the filtered fields by one product with T each (dense columns). The
+    // serial direct solver solves all columns against its factor at once
+    // (MatMatSolve), the iterative ones column by column
+    PetscErrorCode Gradients (PetscInt nv, Vec *OS);
 
   private:
 #if DIM == 2  // # new
@@ -76,14 +84,34 @@ class PDEFilt {
 
     KSP ksp; // linear solver
 
+    // # new; Solver of K, which is constant for the run (-pdeFilterSolver):
+    //  fgmres  FGMRES+MG, rtol 1e-8, 60 iterations (the former solver, and
+    //          the default)
+    //  auto    direct if the mesh has at most -pdeFilterDirectNodes (100000,
+    //          not measured, set it from timings) nodes, fgmres otherwise
+    //  direct  Cholesky factor of the SPD-flagged K (redundant LU in
+    //          parallel), kept for the run
+    //  cg_mg   CG with a Chebyshev+Jacobi V-cycle, stopped at rtol 1e-6 or
+    //          10 iterations: cheaper, but less accurate than fgmres
+    // -pdeFilterRtol and -pdeFilterMaxIts change the iterative tolerances
+    enum SolverType { FGMRES, DIRECT, CG_MG };
+    SolverType solver;
+    PetscReal solverRtol;
+    PetscInt solverMaxIts;
+    PetscErrorCode ChooseSolver ();
+    // Set *maxits if the last solve stopped at the iteration limit; with
+    // report, warn if *maxits is set
+    PetscErrorCode CheckConverged (PetscBool *maxits, PetscBool report);
+
+    Mat S, B, SF; // # new; fields, nodal solutions, filtered fields (dense)
+    Mat BX; // # new; solutions of the batched direct solve (dense)
+
 #if DIM == 2  // # new
     void PDEFilterMatrix_2D(PetscScalar dx, PetscScalar dy, PetscScalar R, PetscScalar* KK,
                          PetscScalar* T); // zzd
-    PetscErrorCode DMDAGetElements_2D(DM dm, PetscInt* nel, PetscInt* nen, const PetscInt* e[]);
 #elif DIM ==3
     void PDEFilterMatrix (PetscScalar dx, PetscScalar dy, PetscScalar dz, PetscScalar R, PetscScalar *KK, PetscScalar *T);
 
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen, const PetscInt *e[]);
 #endif
 
     void MatAssemble (); // assemble K and T
@@ -93,4 +121,6 @@ class PDEFilt {
     PetscErrorCode Free ();
 };
 
+} // namespace TOPOPT_NS
+
 #endif
@@ -0,0 +1,243 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: Apr. 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * PerfLog.cc
+ */
+
+#include "PerfLog.h"
+
+const char *PerfLog::names[NPHASES] = { "Voxelization", "PassiveAssign",
+    "Assembly", "MGSetUp", "StateSolve", "Sensitivity", "Filter", "MMAUpdate",
+    "VTKWrite", "RestartWrite" };
+const char *PerfLog::stageNames[NSTAGES] = { "TopOpt SetUp",
+    "TopOpt Optimize", "TopOpt FEA" };
+
+PetscBool PerfLog::initialized = PETSC_FALSE;
+PetscLogEvent PerfLog::events[NPHASES];
+PetscLogStage PerfLog::stages[NSTAGES];
+PetscInt PerfLog::depth[NPHASES];
+PetscLogDouble PerfLog::t0[NPHASES];
+PetscLogDouble PerfLog::f0[NPHASES];
+PetscLogDouble PerfLog::time[NPHASES];
+PetscLogDouble PerfLog::flops[NPHASES];
+PetscLogDouble PerfLog::tItr = 0.0;
+PetscInt PerfLog::solverIts = 0;
+PetscReal PerfLog::solverRtol = 0.0;
+PetscReal PerfLog::solverRerr = 0.0;
+PetscBool PerfLog::logFile = PETSC_FALSE;
+FILE *PerfLog::fp = NULL;
+
+PetscErrorCode PerfLog::Initialize () {
+
+  PetscErrorCode ierr = 0;
+
+  if (initialized) return ierr;
+
+  PetscClassId classid;
+  ierr = PetscClassIdRegister ("TopOpt", &classid);
+  CHKERRQ(ierr);
+  for (PetscInt i = 0; i < NPHASES; i++) {
+    ierr = PetscLogEventRegister (names[i], classid, &events[i]);
+    CHKERRQ(ierr);
+    depth[i] = 0;
+    time[i] = 0.0;
+    flops[i] = 0.0;
+  }
+  for (PetscInt i = 0; i < NSTAGES; i++) {
+    ierr = PetscLogStageRegister (stageNames[i], &stages[i]);
+    CHKERRQ(ierr);
+  }
+
+  // Track the memory high-water mark for the timing log
+  ierr = PetscMemorySetGetMaximumUsage ();
+  CHKERRQ(ierr);
+
+  // Timing log
+  char filename[PETSC_MAX_PATH_LEN];
+  PetscBool flg = PETSC_FALSE;
+  ierr = PetscOptionsGetString (NULL, NULL, "-timing_log", filename,
+      sizeof(filename), &flg);
+  CHKERRQ(ierr);
+  if (flg) {
+    logFile = PETSC_TRUE;
+    ierr = PetscFOpen (PETSC_COMM_WORLD, filename, "w", &fp);
+    CHKERRQ(ierr);
+    PetscMPIInt size;
+    MPI_Comm_size (PETSC_COMM_WORLD, &size);
+    ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, "# np = %d\n", size);
+    CHKERRQ(ierr);
+    ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, "itr,time");
+    CHKERRQ(ierr);
+    for (PetscInt i = 0; i < NPHASES; i++) {
+      ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, ",%s", names[i]);
+      CHKERRQ(ierr);
+    }
+    for (PetscInt i = 0; i < NPHASES; i++) {
+      ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, ",%s_flops", names[i]);
+      CHKERRQ(ierr);
+    }
+    ierr = PetscFPrintf (PETSC_COMM_WORLD, fp,
+        ",solver_its,solver_rtol,solver_rerr,mem_max_bytes\n");
+    CHKERRQ(ierr);
+  }
+
+  ierr = PetscTime (&tItr);
+  CHKERRQ(ierr);
+  initialized = PETSC_TRUE;
+
+  return ierr;
+}
+
+PetscErrorCode PerfLog::Finalize () {
+
+  PetscErrorCode ierr = 0;
+
+  if (logFile) {
+    ierr = PetscFClose (PETSC_COMM_WORLD, fp);
+    CHKERRQ(ierr);
+    fp = NULL;
+    logFile = PETSC_FALSE;
+  }
+  initialized = PETSC_FALSE;
+
+  return ierr;
+}
+
+PetscErrorCode PerfLog::Begin (Phase phase) {
+
+  PetscErrorCode ierr = 0;
+
+  if (!initialized) return ierr;
+
+  if (depth[phase]++ == 0) {
+    ierr = PetscLogEventBegin (events[phase], 0, 0, 0, 0);
+    CHKERRQ(ierr);
+    PetscTime (&t0[phase]);
+    PetscGetFlops (&f0[phase]);
+  }
+
+  return ierr;
+}
+
+PetscErrorCode PerfLog::End (Phase phase) {
+
+  PetscErrorCode ierr = 0;
+
+  if (!initialized) return ierr;
+
+  if (--depth[phase] == 0) {
+    PetscLogDouble t1, f1;
+    PetscTime (&t1);
+    PetscGetFlops (&f1);
+    time[phase] += t1 - t0[phase];
+    flops[phase] += f1 - f0[phase];
+    ierr = PetscLogEventEnd (events[phase], 0, 0, 0, 0);
+    CHKERRQ(ierr);
+    // The maximum usage is only updated when the current one is sampled
+    PetscLogDouble mem;
+    ierr = PetscMemoryGetCurrentUsage (&mem);
+    CHKERRQ(ierr);
+  }
+
+  return ierr;
+}
+
+PetscErrorCode PerfLog::StagePush (Stage stage) {
+
+  if (!initialized) return 0;
+
+  return PetscLogStagePush (stages[stage]);
+}
+
+PetscErrorCode PerfLog::StagePop () {
+
+  if (!initialized) return 0;
+
+  return PetscLogStagePop ();
+}
+
+void PerfLog::AddSolverIterations (PetscInt its) {
+
+  solverIts += its;
+}
+
+void PerfLog::SetSolverTolerance (PetscReal rtol) {
+
+  solverRtol = rtol;
+}
+
+void PerfLog::AddSolverResidual (PetscReal rerr) {
+
+  solverRerr = PetscMax(solverRerr, rerr);
+}
+
+PetscErrorCode PerfLog::WriteIteration (PetscInt itr) {
+
+  PetscErrorCode ierr = 0;
+
+  if (!initialized) return ierr;
+
+  PetscLogDouble t1;
+  PetscTime (&t1);
+
+  if (logFile) {
+    // Times: max over ranks; flops and memory: sum over ranks
+    PetscLogDouble tloc[NPHASES + 1], tmax[NPHASES + 1];
+    PetscLogDouble floc[NPHASES + 1], fsum[NPHASES + 1];
+    tloc[0] = t1 - tItr;
+    for (PetscInt i = 0; i < NPHASES; i++) {
+      tloc[i + 1] = time[i];
+      floc[i] = flops[i];
+    }
+    ierr = PetscMemoryGetCurrentUsage (&floc[NPHASES]);
+    CHKERRQ(ierr);
+    ierr = PetscMemoryGetMaximumUsage (&floc[NPHASES]);
+    CHKERRQ(ierr);
+    MPI_Allreduce (tloc, tmax, NPHASES + 1, MPIU_PETSCLOGDOUBLE, MPI_MAX,
+        PETSC_COMM_WORLD);
+    MPI_Allreduce (floc, fsum, NPHASES + 1, MPIU_PETSCLOGDOUBLE, MPI_SUM,
+        PETSC_COMM_WORLD);
+
+    ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, "%D,%g", itr, tmax[0]);
+    CHKERRQ(ierr);
+    for (PetscInt i = 0; i < NPHASES; i++) {
+      ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, ",%g", tmax[i + 1]);
+      CHKERRQ(ierr);
+    }
+    for (PetscInt i = 0; i < NPHASES; i++) {
+      ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, ",%g", fsum[i]);
+      CHKERRQ(ierr);
+    }
+    ierr = PetscFPrintf (PETSC_COMM_WORLD, fp, ",%D,%g,%g,%g\n", solverIts,
+        (double) solverRtol, (double) solverRerr, fsum[NPHASES]);
+    CHKERRQ(ierr);
+    if (fp != NULL) fflush (fp);
+  }
+
+  // Restart the accumulation
+  for (PetscInt i = 0; i < NPHASES; i++) {
+    time[i] = 0.0;
+    flops[i] = 0.0;
+  }
+  solverIts = 0;
+  solverRerr = 0.0;
+  PetscTime (&tItr);
+
+  return ierr;
+}
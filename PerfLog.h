@@ -0,0 +1,113 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: Apr. 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * PerfLog.h
+ *
+ * Per-phase performance instrumentation of the optimization.
+ *
+ * Every phase is a PetscLogEvent and every part of the run (set-up,
+ * optimization loop, FEA with the final design) a PetscLogStage, so that
+ * -log_view attributes time and flops across ranks. In addition the wall
+ * time and the flops of each phase are accumulated per iteration and, with
+ * -timing_log <file>, written as one CSV row per iteration (times: max over
+ * ranks, flops and memory: sum over ranks).
+ *
+ * The log is global like the PETSc log itself. Begin/End are cheap no-ops
+ * before Initialize, and nested calls of the same phase are counted once.
+ */
+
+#ifndef PERFLOG_H_
+#define PERFLOG_H_
+
+#include <petsc.h>
+
+class PerfLog {
+
+  public:
+
+    // Phases, each logged as a PetscLogEvent
+    enum Phase {
+      VOXELIZATION,
+      PASSIVE,
+      ASSEMBLY,
+      MGSETUP,
+      KSPSOLVE,
+      SENSITIVITY,
+      FILTER,
+      MMAUPDATE,
+      VTKWRITE,
+      RESTART,
+      NPHASES
+    };
+
+    // Parts of the run, each logged as a PetscLogStage
+    enum Stage {
+      SETUP,
+      OPTIMIZATION,
+      FEA,
+      NSTAGES
+    };
+
+    // Register the stages and events, open the timing log (-timing_log)
+    static PetscErrorCode Initialize ();
+
+    // Close the timing log
+    static PetscErrorCode Finalize ();
+
+    // Start and stop a phase
+    static PetscErrorCode Begin (Phase phase);
+    static PetscErrorCode End (Phase phase);
+
+    // Enter and leave a part of the run
+    static PetscErrorCode StagePush (Stage stage);
+    static PetscErrorCode StagePop ();
+
+    // Count iterations of the state solver(s) in the current iteration
+    static void AddSolverIterations (PetscInt its);
+
+    // Relative tolerance of the state solves of the current iteration and
+    // the relative residual one of them reached (the largest is logged)
+    static void SetSolverTolerance (PetscReal rtol);
+    static void AddSolverResidual (PetscReal rerr);
+
+    // Write the row of iteration itr and restart the accumulation
+    static PetscErrorCode WriteIteration (PetscInt itr);
+
+  private:
+
+    static const char *names[NPHASES]; // Event names (and CSV columns)
+    static const char *stageNames[NSTAGES]; // Stage names
+
+    static PetscBool initialized;
+    static PetscLogEvent events[NPHASES];
+    static PetscLogStage stages[NSTAGES];
+
+    static PetscInt depth[NPHASES]; // Nesting level of each phase
+    static PetscLogDouble t0[NPHASES], f0[NPHASES]; // Time and flops at Begin
+    static PetscLogDouble time[NPHASES], flops[NPHASES]; // Of this iteration
+    static PetscLogDouble tItr; // Start of this iteration
+    static PetscInt solverIts; // State solver iterations of this iteration
+    static PetscReal solverRtol; // State solver tolerance of this iteration
+    static PetscReal solverRerr; // Largest relative residual of this iteration
+
+    static PetscBool logFile; // -timing_log is given
+    static FILE *fp; // Timing log (open on rank 0 only)
+};
+
+#endif /* PERFLOG_H_ */
@@ -0,0 +1,165 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * SolverPreset.cc
+ */
+
+#include "SolverPreset.h"
+
+const char *const SolverPreset::names[NTYPES] = { "fgmres", "cg_direct",
+    "cg_amg" };
+
+const PetscReal SolverPreset::eigMin = 0.1;
+const PetscReal SolverPreset::eigMax = 1.1;
+
+SolverPreset::SolverPreset () {
+
+  PetscBool flg;
+  PetscInt t = FGMRES;
+  PetscOptionsGetEList (NULL, NULL, "-solverPreset", names, NTYPES, &t, &flg);
+  type = (Type) t;
+  eigLag = 0; // estimate on every set up unless asked for
+  PetscOptionsGetInt (NULL, NULL, "-chebEigLag", &eigLag, &flg);
+  eigAge = 0;
+  eigCached = PETSC_FALSE;
+}
+
+PetscErrorCode SolverPreset::SetUpSmoother (KSP dksp, PetscInt sweeps) {
+
+  PetscErrorCode ierr = 0;
+
+  ierr = KSPSetType (dksp, KSPCHEBYSHEV);
+  CHKERRQ(ierr);
+  ierr = KSPChebyshevEstEigSet (dksp, 0.0, eigMin, 0.0, eigMax);
+  CHKERRQ(ierr);
+  ierr = KSPSetTolerances (dksp, PETSC_DEFAULT, PETSC_DEFAULT, PETSC_DEFAULT,
+      sweeps);
+  CHKERRQ(ierr);
+  PC dpc;
+  KSPGetPC (dksp, &dpc);
+  ierr = PCSetType (dpc, PCJACOBI);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode SolverPreset::SetUpCoarseSolve (KSP cksp) {
+
+  PetscErrorCode ierr = 0;
+
+  PC cpc;
+  KSPGetPC (cksp, &cpc);
+  if (type == CG_DIRECT) {
+    // Every rank factors the gathered coarse operator (LU is the default
+    // inner solve of PCREDUNDANT)
+    ierr = KSPSetType (cksp, KSPPREONLY);
+    CHKERRQ(ierr);
+    ierr = PCSetType (cpc, PCREDUNDANT);
+    CHKERRQ(ierr);
+  } else if (type == CG_AMG) {
+    ierr = KSPSetType (cksp, KSPPREONLY);
+    CHKERRQ(ierr);
+    ierr = PCSetType (cpc, PCGAMG);
+    CHKERRQ(ierr);
+  }
+
+  return ierr;
+}
+
+PetscErrorCode SolverPreset::NewOperator (PC pc) {
+
+  PetscErrorCode ierr = 0;
+
+  if (!eigCached) {
+    return ierr;
+  }
+  eigAge++;
+  if (eigAge <= eigLag) {
+    return ierr;
+  }
+
+  // Estimate again on the next set up
+  PetscInt nlvls;
+  ierr = PCMGGetLevels (pc, &nlvls);
+  CHKERRQ(ierr);
+  for (PetscInt k = 1; k < nlvls; k++) {
+    KSP dksp;
+    PetscBool cheb;
+    PCMGGetSmoother (pc, k, &dksp);
+    PetscObjectTypeCompare ((PetscObject) dksp, KSPCHEBYSHEV, &cheb);
+    if (cheb) {
+      ierr = KSPChebyshevEstEigSet (dksp, 0.0, eigMin, 0.0, eigMax);
+      CHKERRQ(ierr);
+    }
+  }
+  eigCached = PETSC_FALSE;
+
+  return ierr;
+}
+
+PetscErrorCode SolverPreset::CacheEigenvalues (PC pc) {
+
+  PetscErrorCode ierr = 0;
+
+  PetscBool mg;
+  PetscObjectTypeCompare ((PetscObject) pc, PCMG, &mg);
+  if (eigLag <= 0 || eigCached || !mg) {
+    return ierr;
+  }
+
+  // Fix the bounds from the estimate of the last set up and drop the
+  // estimator, so that the next set ups skip the estimation
+  PetscInt nlvls;
+  ierr = PCMGGetLevels (pc, &nlvls);
+  CHKERRQ(ierr);
+  for (PetscInt k = 1; k < nlvls; k++) {
+    KSP dksp, kspest;
+    PetscBool cheb;
+    PCMGGetSmoother (pc, k, &dksp);
+    PetscObjectTypeCompare ((PetscObject) dksp, KSPCHEBYSHEV, &cheb);
+    if (!cheb) continue;
+    ierr = KSPChebyshevEstEigGetKSP (dksp, &kspest);
+    CHKERRQ(ierr);
+    if (kspest == NULL) continue;
+    PetscReal emax, emin;
+    ierr = KSPComputeExtremeSingularValues (kspest, &emax, &emin);
+    CHKERRQ(ierr);
+    ierr = KSPChebyshevEstEigSet (dksp, 0.0, 0.0, 0.0, 0.0);
+    CHKERRQ(ierr);
+    ierr = KSPChebyshevSetEigenvalues (dksp, eigMax * emax, eigMin * emax);
+    CHKERRQ(ierr);
+  }
+  eigCached = PETSC_TRUE;
+  eigAge = 0;
+
+  return ierr;
+}
+
+PetscErrorCode SolverPreset::Print () const {
+
+  PetscPrintf (PETSC_COMM_WORLD, "# Solver preset: %s", names[type]);
+  if (eigLag > 0) {
+    PetscPrintf (PETSC_COMM_WORLD, ", Chebyshev estimates reused for %D "
+        "operators \n", eigLag);
+  } else {
+    PetscPrintf (PETSC_COMM_WORLD, " \n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * SolverPreset.h
+ *
+ * Named configurations of the multigrid preconditioned state solvers
+ * (-solverPreset), shared by all physics:
+ *
+ *  fgmres     FGMRES outside, GMRES+SOR smoothers, GMRES+SOR coarse solve
+ *             (the original settings)
+ *  cg_direct  CG outside, Chebyshev+Jacobi smoothers, redundant LU on the
+ *             coarse grid
+ *  cg_amg     CG outside, Chebyshev+Jacobi smoothers, one GAMG cycle on the
+ *             coarse grid
+ *
+ * The cg_* presets keep the V-cycle a fixed symmetric positive definite
+ * operator (polynomial smoothers, linear coarse solve), as CG requires.
+ * Jacobi and Chebyshev are plain vector operations and thread well.
+ *
+ * The Chebyshev smoothers need an estimate of the largest eigenvalue of
+ * D^-1 K on every level, which PETSc recomputes by a few Krylov iterations
+ * whenever the operator changes. For SIMP this estimate barely moves from
+ * one design to the next (the contrast is bounded by Emin/Emax), so with
+ * -chebEigLag n the estimates are frozen after a solve and reused for n new
+ * operators. The default 0 estimates every time, as PETSc does; compare
+ * both with bench/solver_presets.py -eigLag 0,10 before changing it.
+ *
+ * fgmres stays the default preset, the cg_* presets are selected explicitly.
+ */
+
+#ifndef SOLVERPRESET_H_
+#define SOLVERPRESET_H_
+
+#include <petsc.h>
+
+class SolverPreset {
+
+  public:
+
+    enum Type {
+      FGMRES,
+      CG_DIRECT,
+      CG_AMG,
+      NTYPES
+    };
+
+    // Read -solverPreset and -chebEigLag
+    SolverPreset ();
+
+    Type GetType () const {
+      return (type);
+    }
+
+    const char *GetName () const {
+      return (names[type]);
+    }
+
+    // The preset makes the preconditioner symmetric (CG outside)
+    PetscBool IsSymmetric () const {
+      return ((PetscBool) (type != FGMRES));
+    }
+
+    // Chebyshev+Jacobi smoother of a level with eigenvalue estimation
+    PetscErrorCode SetUpSmoother (KSP dksp, PetscInt sweeps);
+
+    // Coarse grid solve of the preset (cg_direct, cg_amg only)
+    PetscErrorCode SetUpCoarseSolve (KSP cksp);
+
+    // Before the preconditioner is set up for a new operator: estimate the
+    // eigenvalues again once the cached ones are -chebEigLag operators old
+    PetscErrorCode NewOperator (PC pc);
+
+    // After a solve: cache the estimates of the Chebyshev smoothers of pc
+    PetscErrorCode CacheEigenvalues (PC pc);
+
+    // Print the preset
+    PetscErrorCode Print () const;
+
+  private:
+
+    static const char *const names[NTYPES];
+
+    // Chebyshev bounds from the estimate e of the largest eigenvalue:
+    // [emin, emax] = [0.1 e, 1.1 e]
+    static const PetscReal eigMin, eigMax;
+
+    Type type; // Preset
+    PetscInt eigLag; // Operators solved with cached estimates, 0: none
+    PetscInt eigAge; // Operators since the estimates were cached
+    PetscBool eigCached; // Estimates are cached
+};
+
+#endif /* SOLVERPRESET_H_ */
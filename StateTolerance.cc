@@ -0,0 +1,84 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * StateTolerance.cc
+ */
+
+#include "StateTolerance.h"
+
+StateTolerance::StateTolerance () {
+
+  PetscBool flg;
+  active = PETSC_FALSE;
+  PetscOptionsGetBool (NULL, NULL, "-inexactSolve", &active, &flg);
+  rtolMin = 1.0e-5;
+  PetscOptionsGetReal (NULL, NULL, "-rtolMin", &rtolMin, &flg);
+  rtolMax = 1.0e-2;
+  PetscOptionsGetReal (NULL, NULL, "-rtolMax", &rtolMax, &flg);
+  rtolMax = PetscMax(rtolMax, rtolMin);
+  decay = 0.8;
+  PetscOptionsGetReal (NULL, NULL, "-inexactDecay", &decay, &flg);
+  eta = 0.1;
+  PetscOptionsGetReal (NULL, NULL, "-inexactFactor", &eta, &flg);
+  ch = -1.0;
+  kkt = kkt1 = 0.0;
+}
+
+void StateTolerance::SetProgress (PetscScalar ch, PetscScalar kkt) {
+
+  this->ch = PetscRealPart(ch);
+  if (PetscRealPart(kkt) < 0.0) {
+    return; // no KKT residual before the first MMA update
+  }
+  this->kkt = PetscRealPart(kkt);
+  if (kkt1 <= 0.0) {
+    kkt1 = this->kkt;
+  }
+}
+
+PetscReal StateTolerance::Get (PetscInt itr) const {
+
+  if (!active) {
+    return (rtolMin);
+  }
+
+  PetscReal rtol = rtolMax * PetscPowReal(decay, (PetscReal) (itr - 1));
+  if (ch >= 0.0) {
+    rtol = PetscMin(rtol, eta * ch);
+  }
+  if (kkt1 > 0.0) {
+    rtol = PetscMin(rtol, eta * kkt / kkt1);
+  }
+
+  return (PetscMax(rtol, rtolMin));
+}
+
+PetscErrorCode StateTolerance::Print () const {
+
+  if (active) {
+    PetscPrintf (PETSC_COMM_WORLD, "# Inexact state solves: rtol in [%g,%g], "
+        "decay: %g, factor: %g \n", (double) rtolMin, (double) rtolMax,
+        (double) decay, (double) eta);
+  } else {
+    PetscPrintf (PETSC_COMM_WORLD, "# State solves: rtol %g \n",
+        (double) rtolMin);
+  }
+
+  return 0;
+}
@@ -0,0 +1,78 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * StateTolerance.h
+ *
+ * Relative tolerance of the state solves along the optimization
+ * (-inexactSolve). By default every state solve uses -rtolMin (1e-5). The
+ * early designs are far from optimal and only need the direction of the
+ * sensitivities, so in the inexact mode the tolerance of iteration itr is
+ *
+ *   rtol = max(rtolMin, min(rtolMax q^(itr-1), eta ch, eta r/r1))
+ *
+ * with the design change ch of the last MMA update and the KKT residual r
+ * of the design it started from (r1: the first one available, from the
+ * second update on), rtolMax = -rtolMax (1e-2), q = -inexactDecay
+ * (0.8) and eta = -inexactFactor (0.1). It tightens to rtolMin as the
+ * design converges; the final FEA uses rtolMin.
+ */
+
+#ifndef STATETOLERANCE_H_
+#define STATETOLERANCE_H_
+
+#include <petsc.h>
+
+class StateTolerance {
+
+  public:
+
+    // Read -inexactSolve, -rtolMin, -rtolMax, -inexactDecay, -inexactFactor
+    StateTolerance ();
+
+    // The inexact mode is on
+    PetscBool IsActive () const {
+      return (active);
+    }
+
+    // Design change of the last MMA update and KKT residual norm of the
+    // design before it (< 0: none, before the first update)
+    void SetProgress (PetscScalar ch, PetscScalar kkt);
+
+    // Tolerance of the state solves of iteration itr
+    PetscReal Get (PetscInt itr) const;
+
+    // Tolerance of the converged design
+    PetscReal GetFinal () const {
+      return (rtolMin);
+    }
+
+    // Print the settings
+    PetscErrorCode Print () const;
+
+  private:
+
+    PetscBool active; // Inexact mode
+    PetscReal rtolMin, rtolMax; // Bounds of the tolerance
+    PetscReal decay; // Decay of the upper bound per iteration
+    PetscReal eta; // Tolerance per unit design change and KKT residual
+    PetscReal ch; // Last design change, < 0: none yet
+    PetscReal kkt, kkt1; // Last and first KKT residual norm
+};
+
+#endif /* STATETOLERANCE_H_ */
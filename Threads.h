@@ -0,0 +1,74 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * Threads.h
+ *
+ * Optional OpenMP threading of the loops over the local elements and
+ * design variables of a rank (make OPENMP=1), so that e.g. one rank per
+ * NUMA domain with many threads can replace one rank per core, with less
+ * ghost exchange and halo memory.
+ *
+ * TOPOPT_OMP(directive) expands to the pragma only in OpenMP builds, the
+ * default build compiles without any warning about unknown pragmas.
+ * Loops that scatter-add into nodal arrays (assembly, node densities) run
+ * colour by colour over the element colouring of ElementMesh::GetColors,
+ * so that no two threads update the same node. PETSc and MPI are only
+ * called outside of the parallel regions.
+ */
+
+#ifndef THREADS_H_
+#define THREADS_H_
+
+#include <petsc.h>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#define TOPOPT_OMP(directive) _Pragma(#directive)
+#else
+#define TOPOPT_OMP(directive)
+#endif
+
+class Threads {
+
+  public:
+
+    // Set the number of threads per rank from -threads (default: the
+    // OpenMP default, e.g. OMP_NUM_THREADS) and report it
+    static PetscErrorCode Initialize () {
+#if defined(_OPENMP)
+      PetscInt n = omp_get_max_threads ();
+      PetscBool flg;
+      PetscOptionsGetInt (NULL, NULL, "-threads", &n, &flg);
+      omp_set_num_threads (n);
+      PetscPrintf (PETSC_COMM_WORLD, "# OpenMP threads per rank: %D\n", n);
+#endif
+      return 0;
+    }
+
+    // Number of threads of the parallel loops
+    static PetscInt Count () {
+#if defined(_OPENMP)
+      return (omp_get_max_threads ());
+#else
+      return (1);
+#endif
+    }
+};
+
+#endif /* THREADS_H_ */
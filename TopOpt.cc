@@ -1,6 +1,8 @@
 #include "TopOpt.h"
 #include <cmath>
 
+namespace TOPOPT_NS {
+
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
  Updated: June 2019, Niels Aage
@@ -37,6 +39,7 @@ void TopOpt::Init () { // Dummy constructor
   gx = NULL;
   da_nodes = NULL;
   da_elem = NULL;
+  mesh = NULL; // # new
 
   xo1 = NULL;
   xo2 = NULL;
@@ -46,10 +49,7 @@ void TopOpt::Init () { // Dummy constructor
   /**
    * Newly added items
    */
-  xPassive0 = NULL; // # new
-  xPassive1 = NULL; // # new
-  xPassive2 = NULL; // # new
-  xPassive3 = NULL; // # new
+  domain = NULL; // # new
   nodeDensity = NULL; // # new
   nodeAddingCounts = NULL; // # new
   loadVector = NULL; // # new
@@ -70,6 +70,7 @@ TopOpt::~TopOpt () {
   if (xmin != NULL) VecDestroy (&xmin);
   if (xmax != NULL) VecDestroy (&xmax);
 
+  if (mesh != NULL) delete mesh; // # new
   if (da_nodes != NULL) DMDestroy (&(da_nodes));
   if (da_elem != NULL) DMDestroy (&(da_elem));
 
@@ -86,10 +87,7 @@ TopOpt::~TopOpt () {
    * Newly added items
    */
   // Delete vectors
-  if (xPassive0 != NULL) VecDestroy (&xPassive0); // # new
-  if (xPassive1 != NULL) VecDestroy (&xPassive1); // # new
-  if (xPassive2 != NULL) VecDestroy (&xPassive2); // # new
-  if (xPassive3 != NULL) VecDestroy (&xPassive3); // # new
+  if (domain != NULL) delete domain; // # new
   if (nodeDensity != NULL) VecDestroy (&nodeDensity); // # new
   if (nodeAddingCounts != NULL) VecDestroy (&nodeAddingCounts); // # new
   if (inputSTL_DES != NULL) delete[] inputSTL_DES; // # new
@@ -191,7 +189,7 @@ PetscErrorCode TopOpt::SetUp () {
 #endif
 
   nu = 0.3;
-  nlvls = 4;
+  nlvls = 0; // # modified; chosen in SetUpMESH (MGLevels)
 
   // SET DEFAULTS for optimization problems
   maxItr = 400;
@@ -308,7 +306,7 @@ PetscErrorCode TopOpt::SetUp () {
 #endif
 
   nu = 0.3;
-  nlvls = 4;
+  nlvls = 0; // # modified; chosen in SetUpMESH (MGLevels)
   // SET DEFAULTS for optimization problems
   maxItr = 400;
   penal = 3.0;
@@ -358,7 +356,6 @@ PetscErrorCode TopOpt::SetUpMESH () {
   PetscOptionsGetReal (NULL, NULL, "-ycmin", &(xc[2]), &flg);
   PetscOptionsGetReal (NULL, NULL, "-ycmax", &(xc[3]), &flg);
   PetscOptionsGetReal (NULL, NULL, "-penal", &penal, &flg);
-  PetscOptionsGetInt (NULL, NULL, "-nlvls", &nlvls, &flg); // NEEDS THIS TO CHECK IF MESH IS OK BEFORE PROCEEDING !!!!
 
   // Write parameters for the physics _ OWNED BY TOPOPT
   PetscPrintf (PETSC_COMM_WORLD,
@@ -377,34 +374,10 @@ PetscErrorCode TopOpt::SetUpMESH () {
   PetscPrintf (PETSC_COMM_WORLD,
       "# Dimensions: (-xcmin,-xcmax,-ycmin,-ycmax): (%f,%f)\n", xc[1] - xc[0],
       xc[3] - xc[2]);
-  PetscPrintf (PETSC_COMM_WORLD, "# -nlvls: %i\n", nlvls);
   PetscPrintf (PETSC_COMM_WORLD,
       "##############################################"
           "##########################\n");
 
-  // Check if the mesh supports the chosen number of MG levels
-  PetscScalar divisor = PetscPowScalar(2.0, (PetscScalar )nlvls - 1.0);
-  // x - dir
-  if (std::floor ((PetscScalar) (nxyz[0] - 1) / divisor) != (nxyz[0] - 1.0)
-      / ((PetscInt) divisor)) {
-    PetscPrintf (PETSC_COMM_WORLD,
-        "MESH DIMENSION NOT COMPATIBLE WITH NUMBER OF MULTIGRID LEVELS!\n");
-    PetscPrintf (PETSC_COMM_WORLD,
-        "X - number of nodes %i is cannot be halfened %i times\n", nxyz[0],
-        nlvls - 1);
-    exit (0);
-  }
-  // y - dir
-  if (std::floor ((PetscScalar) (nxyz[1] - 1) / divisor) != (nxyz[1] - 1.0)
-      / ((PetscInt) divisor)) {
-    PetscPrintf (PETSC_COMM_WORLD,
-        "MESH DIMENSION NOT COMPATIBLE WITH NUMBER OF MULTIGRID LEVELS!\n");
-    PetscPrintf (PETSC_COMM_WORLD,
-        "Y - number of nodes %i is cannot be halfened %i times\n", nxyz[1],
-        nlvls - 1);
-    exit (0);
-  }
-
   // Start setting up the FE problem
   // Boundary types: DMDA_BOUNDARY_NONE, DMDA_BOUNDARY_GHOSTED,
   // DMDA_BOUNDARY_PERIODIC
@@ -455,6 +428,12 @@ PetscErrorCode TopOpt::SetUpMESH () {
   ierr = DMDASetElementType (da_nodes, DMDA_ELEMENT_Q1);
   CHKERRQ(ierr);
 
+  // # new; number of MG levels: given or chosen from the mesh and its
+  // partitioning (see MGLevels.h), the physics choose the same
+  ierr = MGLevels::GetLevels (da_nodes, &nlvls);
+  CHKERRQ(ierr);
+  PetscPrintf (PETSC_COMM_WORLD, "# -nlvls: %i\n", nlvls);
+
   // Create the element mesh: NOTE THIS DOES NOT INCLUDE THE FILTER !!!
   // find the geometric partitioning of the nodal mesh, so the element mesh will
   // coincide with the nodal mesh
@@ -520,7 +499,6 @@ PetscErrorCode TopOpt::SetUpMESH () {
   PetscOptionsGetReal (NULL, NULL, "-zcmin", &(xc[4]), &flg);
   PetscOptionsGetReal (NULL, NULL, "-zcmax", &(xc[5]), &flg);
   PetscOptionsGetReal (NULL, NULL, "-penal", &penal, &flg);
-  PetscOptionsGetInt (NULL, NULL, "-nlvls", &nlvls, &flg); // NEEDS THIS TO CHECK IF MESH IS OK BEFORE PROCEEDING !!!!
 
   // Write parameters for the physics _ OWNED BY TOPOPT
   PetscPrintf (PETSC_COMM_WORLD,
@@ -540,44 +518,10 @@ PetscErrorCode TopOpt::SetUpMESH () {
   PetscPrintf (PETSC_COMM_WORLD,
       "# Dimensions: (-xcmin,-xcmax,..,-zcmax): (%f,%f,%f)\n", xc[1] - xc[0],
       xc[3] - xc[2], xc[5] - xc[4]);
-  PetscPrintf (PETSC_COMM_WORLD, "# -nlvls: %i\n", nlvls);
   PetscPrintf (PETSC_COMM_WORLD,
       "##############################################"
           "##########################\n");
 
-  // Check if the mesh supports the chosen number of MG levels
-  PetscScalar divisor = PetscPowScalar(2.0, (PetscScalar )nlvls - 1.0);
-  // x - dir
-  if (std::floor ((PetscScalar) (nxyz[0] - 1) / divisor) != (nxyz[0] - 1.0)
-      / ((PetscInt) divisor)) {
-    PetscPrintf (PETSC_COMM_WORLD,
-        "MESH DIMENSION NOT COMPATIBLE WITH NUMBER OF MULTIGRID LEVELS!\n");
-    PetscPrintf (PETSC_COMM_WORLD,
-        "X - number of nodes %i is cannot be halfened %i times\n", nxyz[0],
-        nlvls - 1);
-    exit (0);
-  }
-  // y - dir
-  if (std::floor ((PetscScalar) (nxyz[1] - 1) / divisor) != (nxyz[1] - 1.0)
-      / ((PetscInt) divisor)) {
-    PetscPrintf (PETSC_COMM_WORLD,
-        "MESH DIMENSION NOT COMPATIBLE WITH NUMBER OF MULTIGRID LEVELS!\n");
-    PetscPrintf (PETSC_COMM_WORLD,
-        "Y - number of nodes %i is cannot be halfened %i times\n", nxyz[1],
-        nlvls - 1);
-    exit (0);
-  }
-  // z - dir
-  if (std::floor ((PetscScalar) (nxyz[2] - 1) / divisor) != (nxyz[2] - 1.0)
-      / ((PetscInt) divisor)) {
-    PetscPrintf (PETSC_COMM_WORLD,
-        "MESH DIMENSION NOT COMPATIBLE WITH NUMBER OF MULTIGRID LEVELS!\n");
-    PetscPrintf (PETSC_COMM_WORLD,
-        "Z - number of nodes %i is cannot be halfened %i times\n", nxyz[2],
-        nlvls - 1);
-    exit (0);
-  }
-
   // Start setting up the FE problem
   // Boundary types: DMDA_BOUNDARY_NONE, DMDA_BOUNDARY_GHOSTED,
   // DMDA_BOUNDARY_PERIODIC
@@ -634,6 +578,12 @@ PetscErrorCode TopOpt::SetUpMESH () {
   ierr = DMDASetElementType (da_nodes, DMDA_ELEMENT_Q1);
   CHKERRQ(ierr);
 
+  // # new; number of MG levels: given or chosen from the mesh and its
+  // partitioning (see MGLevels.h), the physics choose the same
+  ierr = MGLevels::GetLevels (da_nodes, &nlvls);
+  CHKERRQ(ierr);
+  PetscPrintf (PETSC_COMM_WORLD, "# -nlvls: %i\n", nlvls);
+
   // Create the element mesh: NOTE THIS DOES NOT INCLUDE THE FILTER !!!
   // find the geometric partitioning of the nodal mesh, so the element mesh will
   // coincide with the nodal mesh
@@ -693,6 +643,9 @@ PetscErrorCode TopOpt::SetUpMESH () {
   delete[] Lz;
 #endif
 
+  // # new; Element connectivity of the nodal mesh, built once
+  mesh = new ElementMesh (da_nodes);
+
   return (ierr);
 }
 
@@ -793,25 +746,19 @@ PetscErrorCode TopOpt::SetUpOPT () {
   /**
    * Newly added items
    */
-  ierr = VecDuplicate (xPhys, &xPassive0); // # new
+  ierr = DomainMask::CheckIndices (numDES, "design domains"); // # new
   CHKERRQ(ierr); // # new
-  ierr = VecDuplicate (xPhys, &xPassive1); // # new
+  ierr = DomainMask::CheckIndices (numSLD, "solid domains"); // # new
   CHKERRQ(ierr); // # new
-  ierr = VecDuplicate (xPhys, &xPassive2); // # new
+  ierr = DomainMask::CheckIndices (numLODFIX, "load conditions"); // # new
   CHKERRQ(ierr); // # new
-  ierr = VecDuplicate (xPhys, &xPassive3); // # new
+  PetscInt nelLocal; // # new
+  ierr = VecGetLocalSize (xPhys, &nelLocal); // # new
   CHKERRQ(ierr); // # new
+  domain = new DomainMask (nelLocal); // # new; all elements outside
   ierr = VecDuplicate (nodeDensity, &nodeAddingCounts); // # new
   CHKERRQ(ierr); // # new
 
-  ierr = VecSet (xPassive0, 0); // # new
-  CHKERRQ(ierr); // # new
-  ierr = VecSet (xPassive1, 0); // # new
-  CHKERRQ(ierr); // # new
-  ierr = VecSet (xPassive2, 0); // # new
-  CHKERRQ(ierr); // # new
-  ierr = VecSet (xPassive3, 0); // # new
-  CHKERRQ(ierr); // # new
   ierr = VecSet (nodeDensity, 0); // # new
   CHKERRQ(ierr); // # new
   ierr = VecSet (nodeAddingCounts, 0); // # new
@@ -1016,10 +963,19 @@ PetscErrorCode TopOpt::WriteRestartFiles (PetscInt *itr, MMA *mma) {
   /**
    * Newly added items
    */
-  VecView (xPassive0, view); // # new
-  VecView (xPassive1, view); // # new
-  VecView (xPassive2, view); // # new
-  VecView (xPassive3, view); // # new
+  // # modified; the domain mask in the encoding of the former xPassive0..3
+  Vec xPassive;
+  PetscScalar *xPassivep;
+  VecDuplicate (xPhys, &xPassive);
+  const DomainMask::Kind kinds[4] = { DomainMask::DESIGN, DomainMask::SOLID,
+      DomainMask::FIXTURE, DomainMask::LOAD };
+  for (PetscInt k = 0; k < 4; k++) {
+    VecGetArray (xPassive, &xPassivep);
+    domain->GetValues (kinds[k], xPassivep);
+    VecRestoreArray (xPassive, &xPassivep);
+    VecView (xPassive, view);
+  }
+  VecDestroy (&xPassive);
   VecView (nodeDensity, view); // # new
   VecView (nodeAddingCounts, view); // # new
 
@@ -1030,3 +986,5 @@ PetscErrorCode TopOpt::WriteRestartFiles (PetscInt *itr, MMA *mma) {
   // PetscPrintf(PETSC_COMM_WORLD,"DONE WRITING DATA\n");
   return ierr;
 }
+
+} // namespace TOPOPT_NS
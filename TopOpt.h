@@ -11,6 +11,11 @@
 #include <sstream>
 
 #include "options.h" // # new; framework options
+#include "ElementMesh.h" // # new; shared element connectivity
+#include "DomainMask.h" // # new; domain membership of the elements
+#include "MGLevels.h" // # new; multigrid depth and coarse solve
+
+namespace TOPOPT_NS {
 
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -64,6 +69,8 @@ class TopOpt {
     DM da_nodes;
     // element mesh (basis for design)
     DM da_elem;
+    // # new; element connectivity of da_nodes, shared by all classes
+    ElementMesh *mesh;
 
     // Optimization parameters
     PetscInt n; // Total number of design variables
@@ -140,12 +147,11 @@ class TopOpt {
     std::string *inputSTL_FIX; // # new; name of fixture file
     std::string *inputSTL_LOD; // # new; name of loading domain file
     std::string *inputSTL_SLD; // # new; name of solid non-designable domain file
-    Vec xPassive0; // # new; the design domain element index
-    Vec xPassive3; // # new; the passive solid element index
-    Vec xPassive1; // # new; the passive fixture position element index
-    Vec xPassive2; // # new; the passive loading position element index
+    DomainMask *domain; // # new; design, solid, fixture and loading elements
     Vec nodeDensity; // # new; node density
     Vec nodeAddingCounts; // # new; node adding counts when summing node density from element density
 };
 
+} // namespace TOPOPT_NS
+
 #endif
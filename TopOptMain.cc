@@ -0,0 +1,275 @@
+#include "Filter.h"
+#include "MMA.h"
+#include "MPIIO.h"
+#include "TopOpt.h"
+#include "mpi.h"
+#include <petsc.h>
+
+#include "options.h" // # new; all the switchers in it
+#include "timer.h" // # new
+#include "PerfLog.h" // # new; per-phase performance log
+#include "StateTolerance.h" // # new; inexact state solves
+
+#include "PrePostProcess.h" // # new; Pre- and post-processing class
+
+// Choose the physical problem to be solved
+#if PHYSICS == 0
+#include "LinearElasticity.h"
+#elif PHYSICS == 1
+#include "LinearCompliant.h"   // # new
+#elif PHYSICS == 2
+#include "LinearHeatConduction.h" // # new
+#endif
+
+/*
+ Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
+
+ Updated: June 2019, Niels Aage
+ Copyright (C) 2013-2019,
+
+ Disclaimer:
+ The authors reserves all rights but does not guaranty that the code is
+ free from errors. Furthermore, we shall not be liable in any event
+ caused by the use of the program.
+ */
+
+/*
+ * Modified by Zhidong Brian Zhang in May 2020, University of Waterloo
+ */
+
+namespace TOPOPT_NS {
+
+// # modified; the former main () of the instance for DIM and PHYSICS, called
+// by main () in main.cc after PETSc has been initialized
+PetscErrorCode TopOptMain () {
+
+  // Error code for debugging
+  PetscErrorCode ierr = 0;
+
+  // # new; log the set-up as one stage
+  PerfLog::StagePush (PerfLog::SETUP);
+
+  // STEP 1: THE OPTIMIZATION PARAMETERS, DATA AND MESH (!!! THE DMDA !!!)
+  TopOpt *opt = new TopOpt ();
+
+  // STEP 2: Pre-processing to define the design domain by using passive element assigning method
+  PrePostProcess *prepost = new PrePostProcess (opt); // # new
+#if IMPORT_GEO == 0
+  // the whole domain is design domain 0, no solid, fix or load domain
+  opt->domain->SetAll (DomainMask::DESIGN, 0); // # modified
+#elif IMPORT_GEO == 1
+  prepost->DesignDomainInitialization (opt); // # new
+#endif
+
+  // STEP 3: THE PHYSICS
+  // 0 - linear elasticity, 1 - linear heat conduction, 2 - compliant
+#if PHYSICS == 0
+  LinearElasticity *physics = new LinearElasticity (opt->da_nodes, opt->mesh,
+      opt->m, opt->numDES, opt->numLODFIX, opt->numNodeLoadAddingCounts,
+      opt->nu, opt->E, opt->loadVector, opt->domain); // # modified
+#elif PHYSICS ==1
+  LinearCompliant *physics = new LinearCompliant (opt->da_nodes, opt->mesh,
+      opt->m, opt->numDES, opt->numLODFIX, opt->nu, opt->E, opt->domain); // # new
+#elif PHYSICS == 2
+  LinearHeatConduction *physics = new LinearHeatConduction (opt->da_nodes,
+      opt->da_elem, opt->mesh, opt->m, opt->numDES, opt->numLODFIX,
+      opt->domain); // # new
+#endif
+
+  // STEP 4: THE FILTERING
+  Filter *filter = new Filter (opt->da_nodes, opt->xPhys, opt->filter,
+      opt->rmin, opt->domain); // # modified
+
+  // STEP 5: VISUALIZATION USING VTK
+  MPIIO *output = new MPIIO (opt->da_nodes, 4, "ux, uy, uz, nodeDen", 7,
+      "x, xTilde, xPhys, xPassive0, xPassive1, xPassive2, xPassive3"); // # modified; all point data must use 3 coordinates in VTK
+
+  // STEP 6: THE OPTIMIZER MMA
+  MMA *mma;
+  PetscInt itr = 0;
+  opt->AllocateMMAwithRestart (&itr, &mma); // allow for restart !
+  // mma->SetAsymptotes(0.2, 0.65, 1.05);
+
+  // STEP 7: FILTER THE INITIAL DESIGN/RESTARTED DESIGN
+  PerfLog::Begin (PerfLog::FILTER); // # new
+  ierr = filter->FilterProject (opt->x, opt->xTilde, opt->xPhys,
+      opt->projectionFilter, opt->beta, opt->eta);
+  CHKERRQ(ierr);
+  PerfLog::End (PerfLog::FILTER); // # new
+
+  // # new; the set-up is row 0 of the timing log
+  PerfLog::WriteIteration (0);
+  PerfLog::StagePop ();
+  PerfLog::StagePush (PerfLog::OPTIMIZATION);
+
+  // # new; tolerance of the state solves along the optimization
+  StateTolerance stateTol;
+  stateTol.Print ();
+
+  // STEP 8: OPTIMIZATION LOOP
+  PetscScalar ch = 1.0;
+  double t1, t2;
+  PetscBool mmaUpdated = PETSC_FALSE; // # new; MMA has multipliers
+  while (itr < opt->maxItr && ch > 0.01) {
+    // Update iteration counter
+    itr++;
+
+    // start timer
+    t1 = MPI_Wtime ();
+
+    // # new; inexact state solves: tolerance from the progress so far
+    if (stateTol.IsActive ()) {
+      ierr = physics->SetStateTolerance (stateTol.Get (itr));
+      CHKERRQ(ierr);
+    }
+
+    // Compute (a) obj+const, (b) sens, (c) obj+const+sens
+    ierr = physics->ComputeObjectiveConstraintsSensitivities (&(opt->fx),
+        &(opt->gx[0]), opt->dfdx, opt->dgdx, opt->xPhys, opt->Emin,
+        opt->Emax, opt->penal, opt->volfrac, opt->domain); // # new
+    CHKERRQ(ierr);
+
+    // Compute objective scale
+    if (itr == 1) {
+      opt->fscale = 10.0 / opt->fx;
+    }
+    // Scale objectie and sens
+    opt->fx = opt->fx * opt->fscale;
+    VecScale (opt->dfdx, opt->fscale);
+
+    // Filter sensitivities (chainrule)
+    PerfLog::Begin (PerfLog::FILTER); // # new
+    ierr = filter->Gradients (opt->x, opt->xTilde, opt->dfdx, opt->m, opt->dgdx,
+        opt->projectionFilter, opt->beta, opt->eta);
+    CHKERRQ(ierr);
+    PerfLog::End (PerfLog::FILTER); // # new
+
+    // Sets outer movelimits on design variables
+    PerfLog::Begin (PerfLog::MMAUPDATE); // # new
+    ierr = mma->SetOuterMovelimit (opt->Xmin, opt->Xmax, opt->movlim, opt->x,
+        opt->xmin, opt->xmax);
+    CHKERRQ(ierr);
+
+    // # new; KKT residual of the current design and its sensitivities, with
+    // the multipliers of the last MMA subproblem (none before the first)
+    PetscScalar kktNorm2 = -1.0;
+    if (stateTol.IsActive () && mmaUpdated) {
+      PetscScalar kktNormInf;
+      ierr = mma->KKTresidual (opt->x, opt->dfdx, opt->gx, opt->dgdx,
+          opt->xmin, opt->xmax, &kktNorm2, &kktNormInf);
+      CHKERRQ(ierr);
+    }
+
+    // Update design by MMA
+    ierr = mma->Update (opt->x, opt->dfdx, opt->gx, opt->dgdx, opt->xmin,
+        opt->xmax);
+    CHKERRQ(ierr);
+    mmaUpdated = PETSC_TRUE; // # new
+
+    // Inf norm on the design change
+    ch = mma->DesignChange (opt->x, opt->xold);
+
+    // # new; progress of the design for the next state tolerance
+    if (stateTol.IsActive ()) {
+      stateTol.SetProgress (ch, kktNorm2);
+    }
+    PerfLog::End (PerfLog::MMAUPDATE); // # new
+
+    // Increase beta if needed
+    PetscBool changeBeta = PETSC_FALSE;
+    if (opt->projectionFilter) {
+      changeBeta = filter->IncreaseBeta (&(opt->beta), opt->betaFinal,
+          opt->gx[0], itr, ch);
+    }
+
+    // Filter design field
+    PerfLog::Begin (PerfLog::FILTER); // # new
+    ierr = filter->FilterProject (opt->x, opt->xTilde, opt->xPhys,
+        opt->projectionFilter, opt->beta, opt->eta);
+    CHKERRQ(ierr);
+
+    // Discreteness measure
+    PetscScalar mnd = filter->GetMND (opt->xPhys);
+    PerfLog::End (PerfLog::FILTER); // # new
+
+    // stop timer
+    t2 = MPI_Wtime ();
+
+    // Print to screen
+    PetscPrintf (PETSC_COMM_WORLD,
+        "It.: %i, True fx: %f, Scaled fx: %f, gx[0]: %f, ch.: %f, "
+            "mnd.: %f, time: %f\n", itr, opt->fx / opt->fscale, opt->fx,
+        opt->gx[0], ch, mnd, t2 - t1);
+
+    // Write field data: first 10 iterations and then every 20th
+    if (itr < 11 || itr % 20 == 0 || changeBeta) {
+      PerfLog::Begin (PerfLog::VTKWRITE); // # new
+      prepost->UpdateNodeDensity (opt); // # new; update node density
+      output->WriteVTK (physics->da_nodal, physics->GetStateField (),
+          opt->nodeDensity, opt->x, opt->xTilde, opt->xPhys, opt->domain,
+          itr); // # modified
+      PerfLog::End (PerfLog::VTKWRITE); // # new
+    }
+
+    // Dump data needed for restarting code at termination
+    if (itr % 10 == 0) {
+      PerfLog::Begin (PerfLog::RESTART); // # new
+      opt->WriteRestartFiles (&itr, mma);
+      physics->WriteRestartFiles ();
+      PerfLog::End (PerfLog::RESTART); // # new
+    }
+
+    // # new; timing log of this iteration
+    PerfLog::WriteIteration (itr);
+  }
+  PerfLog::StagePop (); // # new
+
+  PerfLog::StagePush (PerfLog::FEA); // # new
+
+  // # new; the final design is analysed with the full accuracy
+  if (stateTol.IsActive ()) {
+    ierr = physics->SetStateTolerance (stateTol.GetFinal ());
+    CHKERRQ(ierr);
+  }
+
+  // # new; FEA with the TopOpt final results
+  for (PetscInt loadConditionFEA = 0; loadConditionFEA < opt->numLODFIXFEA;
+      ++loadConditionFEA) {
+    physics->FEAWithTopOptResults (opt->xPhys, opt->domain, loadConditionFEA,
+        opt->loadVectorFEA);
+    PerfLog::Begin (PerfLog::VTKWRITE); // # new
+    output->WriteVTK (physics->da_nodal, physics->GetStateField (),
+        opt->nodeDensity, opt->x, opt->xTilde, opt->xPhys, opt->domain,
+        itr); // # modified
+    PerfLog::End (PerfLog::VTKWRITE); // # new
+    itr++;
+  }
+
+  // Write restart WriteRestartFiles
+  PerfLog::Begin (PerfLog::RESTART); // # new
+  opt->WriteRestartFiles (&itr, mma);
+  physics->WriteRestartFiles ();
+  PerfLog::End (PerfLog::RESTART); // # new
+
+  // Dump final design
+  PerfLog::Begin (PerfLog::VTKWRITE); // # new
+  output->WriteVTK (physics->da_nodal, physics->GetStateField (),
+      opt->nodeDensity, opt->x, opt->xTilde, opt->xPhys, opt->domain,
+      itr); // # modified
+  PerfLog::End (PerfLog::VTKWRITE); // # new
+
+  PerfLog::WriteIteration (itr); // # new
+  PerfLog::StagePop (); // # new
+
+  // STEP 9: CLEAN UP AFTER YOURSELF
+  delete mma;
+  delete output;
+  delete filter;
+  delete opt;
+  delete physics;
+  delete prepost; // # new
+
+  return ierr;
+}
+
+} // namespace TOPOPT_NS
@@ -0,0 +1,134 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * WarmStart.cc
+ */
+
+#include "WarmStart.h"
+
+const char *const WarmStart::names[NMODES] = { "none", "loadcase",
+    "extrapolate" };
+
+WarmStart::WarmStart () {
+
+  PetscBool flg;
+  PetscInt m = LOADCASE;
+  PetscOptionsGetEList (NULL, NULL, "-warmStart", names, NMODES, &m, &flg);
+  mode = (Mode) m;
+  stateKept = PETSC_FALSE;
+  n = 0;
+  last = NULL;
+  prev = NULL;
+  count = NULL;
+}
+
+WarmStart::~WarmStart () {
+
+  if (last != NULL) VecDestroyVecs (n, &last);
+  if (prev != NULL) VecDestroyVecs (n, &prev);
+  PetscFree (count);
+}
+
+PetscErrorCode WarmStart::SetUp (Vec U, PetscInt n, PetscBool stateKept) {
+
+  PetscErrorCode ierr = 0;
+
+  this->n = n;
+  this->stateKept = stateKept;
+  if (mode == NONE) {
+    return ierr;
+  }
+  if (!stateKept) {
+    ierr = VecDuplicateVecs (U, n, &last);
+    CHKERRQ(ierr);
+  }
+  if (mode == EXTRAPOLATE) {
+    ierr = VecDuplicateVecs (U, n, &prev);
+    CHKERRQ(ierr);
+  }
+  ierr = PetscCalloc1 (n, &count);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode WarmStart::Guess (PetscInt lc, Vec U) {
+
+  PetscErrorCode ierr = 0;
+
+  if (mode == NONE || count[lc] == 0) {
+    return ierr;
+  }
+
+  if (stateKept) {
+    // U holds u_k: keep it as u_k-1 of the next guess
+    if (mode == EXTRAPOLATE) {
+      if (count[lc] > 1) {
+        // prev = 2 u_k - u_k-1, then swap it into U
+        ierr = VecAYPX (prev[lc], -1.0, U);
+        CHKERRQ(ierr);
+        ierr = VecAXPY (prev[lc], 1.0, U);
+        CHKERRQ(ierr);
+        ierr = VecSwap (prev[lc], U);
+        CHKERRQ(ierr);
+      } else {
+        ierr = VecCopy (U, prev[lc]);
+        CHKERRQ(ierr);
+      }
+    }
+  } else if (mode == EXTRAPOLATE && count[lc] > 1) {
+    ierr = VecAXPBYPCZ (U, 2.0, -1.0, 0.0, last[lc], prev[lc]);
+    CHKERRQ(ierr);
+  } else {
+    ierr = VecCopy (last[lc], U);
+    CHKERRQ(ierr);
+  }
+
+  return ierr;
+}
+
+PetscErrorCode WarmStart::Store (PetscInt lc, Vec U) {
+
+  PetscErrorCode ierr = 0;
+
+  if (mode == NONE) {
+    return ierr;
+  }
+
+  if (!stateKept) {
+    if (mode == EXTRAPOLATE) {
+      Vec v = prev[lc];
+      prev[lc] = last[lc];
+      last[lc] = v;
+    }
+    ierr = VecCopy (U, last[lc]);
+    CHKERRQ(ierr);
+  }
+  count[lc]++;
+
+  return ierr;
+}
+
+PetscErrorCode WarmStart::Print () const {
+
+  PetscPrintf (PETSC_COMM_WORLD, "# Initial guess: %s (-warmStart) \n",
+      names[mode]);
+
+  return 0;
+}
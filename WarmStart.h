@@ -0,0 +1,91 @@
+//-------------------------------------------------------------------
+//
+// Copyright (C) 2018 - 2020 by the TopADD authors
+//
+// This file is part of the TopADD.
+//
+// The TopADD is free software; you can use it, redistribute
+// it, and/or modify it under the terms of the GNU Lesser General
+// Public License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+// The full text of the license can be found in the file LICENSE.md at
+// the top level directory of TopADD.
+//
+// Author: Zhidong Brian Zhang
+// Created on: May 2020
+//
+// ---------------------------------------------------------------------
+
+/*
+ * WarmStart.h
+ *
+ * Initial guesses of the state solves across the design iterations
+ * (-warmStart), shared by all physics:
+ *
+ *  none         the state vector as left by the previous solve (the
+ *               original behaviour: the last load condition solved)
+ *  loadcase     the solution of the same load condition in the previous
+ *               design iteration (default)
+ *  extrapolate  the linear extrapolation 2 u_k - u_k-1 of the last two
+ *               solutions of the load condition
+ *
+ * Physics with one state vector for all load conditions keep copies of
+ * the solutions here. Physics that keep a state vector per load condition
+ * (stateKept) already hold u_k in it, only u_k-1 is copied for the
+ * extrapolation.
+ */
+
+#ifndef WARMSTART_H_
+#define WARMSTART_H_
+
+#include <petsc.h>
+
+class WarmStart {
+
+  public:
+
+    enum Mode {
+      NONE,
+      LOADCASE,
+      EXTRAPOLATE,
+      NMODES
+    };
+
+    // Read -warmStart
+    WarmStart ();
+
+    // Destructor
+    ~WarmStart ();
+
+    // Keep the solutions of n load conditions, vectors of the layout of U
+    PetscErrorCode SetUp (Vec U, PetscInt n, PetscBool stateKept);
+
+    // Initial guess of load condition lc in U (unchanged if there is no
+    // solution of lc yet)
+    PetscErrorCode Guess (PetscInt lc, Vec U);
+
+    // Keep the solution U of load condition lc
+    PetscErrorCode Store (PetscInt lc, Vec U);
+
+    // Stop guessing, e.g. for the solves of other loads after the
+    // optimization
+    void Disable () {
+      mode = NONE;
+    }
+
+    // Print the mode
+    PetscErrorCode Print () const;
+
+  private:
+
+    static const char *const names[NMODES];
+
+    Mode mode; // Initial guess
+    PetscBool stateKept; // The physics keep the state per load condition
+    PetscInt n; // Number of load conditions
+    Vec *last; // Last solution per load condition (if not stateKept)
+    Vec *prev; // Solution before (EXTRAPOLATE)
+    PetscInt *count; // Solutions stored per load condition
+};
+
+#endif /* WARMSTART_H_ */
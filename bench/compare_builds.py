@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+
+"""
+Compare the time per optimization iteration of the debug (topopt) and the
+release (topopt-opt) builds on the default 2D and 3D problems.
+
+Usage (from the top level directory, the CAD models are read from there):
+  ./bench/compare_builds.py -np 4 -itr 5 [-- extra topopt options]
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# MPI launcher, e.g. MPIEXEC="mpiexec --bind-to core"
+MPIEXEC = os.environ.get("MPIEXEC", "mpiexec").split()
+
+RE_ITR = re.compile(r"^It\.: *(\d+),.*time: *([0-9.eE+-]+)")
+
+def runCase(exe, np, dim, itr, extra):
+	workdir = tempfile.mkdtemp(prefix="topopt_bench_")
+	cmd = MPIEXEC + ["-np", str(np), exe, "-dim", str(dim),
+		"-maxItr", str(itr), "-workdir", workdir] + extra
+	try:
+		out = subprocess.run(cmd, stdout=subprocess.PIPE,
+			stderr=subprocess.STDOUT, universal_newlines=True)
+	finally:
+		shutil.rmtree(workdir, ignore_errors=True)
+	if out.returncode != 0:
+		sys.stderr.write(out.stdout)
+		sys.exit("'%s' failed" % " ".join(cmd))
+	times = [float(m.group(2)) for m in map(RE_ITR.match, out.stdout.splitlines()) if m]
+	if not times:
+		sys.exit("'%s' reported no iterations" % " ".join(cmd))
+	# The first iteration includes the setup of the solver, report it apart
+	steady = times[1:] if len(times) > 1 else times
+	return times[0], sum(steady) / len(steady)
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__)
+	parser.add_argument("-np", type=int, default=1, help="number of MPI ranks")
+	parser.add_argument("-itr", type=int, default=5, help="optimization iterations")
+	parser.add_argument("-debug", default="./topopt", help="debug executable")
+	parser.add_argument("-opt", default="./topopt-opt", help="release executable")
+	parser.add_argument("extra", nargs="*", help="options passed to topopt")
+	args = parser.parse_args()
+
+	print("# np = %d, %d iterations, times in s" % (args.np, args.itr))
+	print("%-4s %12s %12s %12s %12s %9s" % ("dim", "debug 1st",
+		"debug itr", "opt 1st", "opt itr", "speedup"))
+	for dim in (2, 3):
+		d1, dItr = runCase(args.debug, args.np, dim, args.itr, args.extra)
+		o1, oItr = runCase(args.opt, args.np, dim, args.itr, args.extra)
+		print("%-4d %12.4f %12.4f %12.4f %12.4f %9.2f" % (dim,
+			d1, dItr, o1, oItr, dItr / oItr))
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+
+"""
+Strong and weak scaling of topopt on fixed-iteration cases.
+
+Every case (dimension, physics, filter type, mesh size) is run for a fixed
+number of iterations with -timing_log (see PerfLog.h) on each number of MPI
+ranks. The rows of the optimization iterations are averaged into a scaling
+table: time per iteration and per phase, state solver iterations per
+iteration, memory high-water mark (all ranks) and parallel efficiency with
+respect to the smallest number of ranks.
+
+  strong: the mesh is fixed, efficiency = t(n0) n0 / (t(n) n)
+  weak:   the mesh grows with the ranks (one axis doubled per doubling of
+          the ranks, so -np must be powers of two), efficiency = t(n0) / t(n)
+
+Usage (from the top level directory, the CAD models are read from there):
+  ./bench/scaling.py -mode strong -np 1,2,4 -dim 2,3 -physics 0 -filter 1
+  ./bench/scaling.py -mode weak -np 1,2,4,8 -o weak.csv -- -nlvls 3
+"""
+
+import argparse
+import csv
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# MPI launcher, e.g. MPIEXEC="mpiexec --bind-to core"
+MPIEXEC = os.environ.get("MPIEXEC", "mpiexec").split()
+
+# Number of elements of the default problems (TopOpt.cc), [dim][physics].
+# All are divisible by 8, so the automatic multigrid depth (-nlvls 0, see
+# MGLevels.h) has at least 4 levels.
+ELEMENTS = {
+	2: {0: [240, 120], 1: [240, 120], 2: [200, 248]},
+	3: {0: [64, 32, 32], 1: [80, 40, 8], 2: [48, 64, 48]},
+}
+
+PHASES = ["Voxelization", "PassiveAssign", "Assembly", "MGSetUp", "StateSolve",
+	"Sensitivity", "Filter", "MMAUpdate", "VTKWrite", "RestartWrite"]
+
+def intList(s):
+	return [int(v) for v in s.split(",")]
+
+def meshSize(dim, physics, refine, np, weak):
+	nel = [e * refine for e in ELEMENTS[dim][physics]]
+	if weak:
+		# Double one axis after the other until the mesh matches np
+		k, axis = 1, 0
+		while k < np:
+			nel[axis] *= 2
+			axis = (axis + 1) % dim
+			k *= 2
+	return nel
+
+def runCase(exe, np, dim, physics, filt, nel, itr, extra):
+	workdir = tempfile.mkdtemp(prefix="topopt_bench_")
+	log = os.path.join(workdir, "timing.csv")
+	cmd = MPIEXEC + ["-np", str(np), exe, "-dim", str(dim),
+		"-physics", str(physics), "-filter", str(filt), "-maxItr", str(itr),
+		"-workdir", workdir, "-timing_log", log]
+	for name, n in zip(["-nx", "-ny", "-nz"], nel):
+		cmd += [name, str(n + 1)]
+	cmd += extra
+	try:
+		out = subprocess.run(cmd, stdout=subprocess.PIPE,
+			stderr=subprocess.STDOUT, universal_newlines=True)
+		if out.returncode != 0:
+			sys.stderr.write(out.stdout)
+			sys.exit("'%s' failed" % " ".join(cmd))
+		with open(log) as f:
+			rows = list(csv.DictReader(l for l in f if not l.startswith("#")))
+	finally:
+		shutil.rmtree(workdir, ignore_errors=True)
+
+	# Row 0 is the set-up, the last row the final FEA and output
+	opt = rows[1:-1]
+	if not opt:
+		sys.exit("'%s' logged no iterations" % " ".join(cmd))
+	mean = lambda key: sum(float(r[key]) for r in opt) / len(opt)
+	res = {"time": mean("time"), "setup": float(rows[0]["time"]),
+		"solver_its": mean("solver_its"),
+		"mem_max_MB": max(float(r["mem_max_bytes"]) for r in rows) / 2.0**20}
+	for p in PHASES:
+		res[p] = mean(p)
+	return res
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__,
+		formatter_class=argparse.RawDescriptionHelpFormatter)
+	parser.add_argument("-mode", choices=["strong", "weak"], default="strong")
+	parser.add_argument("-np", type=intList, default=[1, 2, 4],
+		help="numbers of MPI ranks, e.g. 1,2,4")
+	parser.add_argument("-dim", type=intList, default=[2, 3])
+	parser.add_argument("-physics", type=intList, default=[0, 1, 2],
+		help="0-linear elasticity, 1-compliant, 2-heat conduction")
+	parser.add_argument("-filter", type=intList, default=[0, 1, 2],
+		help="0-sensitivity, 1-density, 2-PDE")
+	parser.add_argument("-refine", type=intList, default=[1],
+		help="mesh sizes as multiples of the default meshes")
+	parser.add_argument("-itr", type=int, default=10,
+		help="optimization iterations per run")
+	parser.add_argument("-exe", default="./topopt-opt", help="executable")
+	parser.add_argument("-o", help="write the table also as CSV")
+	parser.add_argument("extra", nargs="*", help="options passed to topopt")
+	args = parser.parse_args()
+
+	weak = args.mode == "weak"
+	if weak:
+		# The mesh only grows by doubling, other rank counts would get
+		# another load per rank than the reference
+		bad = [np for np in args.np if np < 1 or np & (np - 1)]
+		if bad:
+			parser.error("weak scaling needs -np powers of two, got %s"
+				% ",".join(str(np) for np in bad))
+	cols = ["dim", "physics", "filter", "mesh", "np", "time", "solver_its",
+		"mem_max_MB", "efficiency", "setup"] + PHASES
+	table = []
+	print("# %s scaling, %d iterations per run, times in s per iteration"
+		% (args.mode, args.itr))
+	print(" ".join("%12s" % c[:12] for c in cols))
+	for dim in args.dim:
+		for physics in args.physics:
+			for filt in args.filter:
+				for refine in args.refine:
+					ref = None
+					for np in args.np:
+						nel = meshSize(dim, physics, refine, np, weak)
+						res = runCase(args.exe, np, dim, physics, filt, nel,
+							args.itr, args.extra)
+						if ref is None:
+							ref = (np, res["time"])
+						if weak:
+							eff = ref[1] / res["time"]
+						else:
+							eff = ref[1] * ref[0] / (res["time"] * np)
+						row = dict(res, dim=dim, physics=physics, filter=filt,
+							mesh="x".join(str(n) for n in nel), np=np,
+							efficiency=eff)
+						table.append(row)
+						print(" ".join(("%12.4g" % row[c]) if isinstance(row[c],
+							float) else "%12s" % row[c] for c in cols))
+						sys.stdout.flush()
+
+	if args.o:
+		with open(args.o, "w") as f:
+			w = csv.DictWriter(f, fieldnames=cols)
+			w.writeheader()
+			w.writerows(table)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+"""
+Compare the state solver presets (-solverPreset, see SolverPreset.h) on the
+default 2D and 3D problems, and for the Chebyshev smoothers of the cg_*
+presets the reuse of the eigenvalue estimates (-chebEigLag).
+
+Every preset is run for a fixed number of iterations with -timing_log (see
+PerfLog.h). The rows of the optimization iterations are averaged: state
+solver iterations, multigrid set-up and solve time per optimization
+iteration, and the total time per iteration. The first iteration, which
+includes the set-up of the solver and the first eigenvalue estimates, is
+reported apart.
+
+Usage (from the top level directory, the CAD models are read from there):
+  ./bench/solver_presets.py -np 4 -itr 10
+  ./bench/solver_presets.py -preset fgmres,cg_amg -physics 0,2 -- -nlvls 3
+  ./bench/solver_presets.py -preset cg_direct -eigLag 0,5,10,20
+"""
+
+import argparse
+import csv
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# MPI launcher, e.g. MPIEXEC="mpiexec --bind-to core"
+MPIEXEC = os.environ.get("MPIEXEC", "mpiexec").split()
+
+PRESETS = ["fgmres", "cg_direct", "cg_amg"]
+
+def intList(s):
+	return [int(v) for v in s.split(",")]
+
+def strList(s):
+	return s.split(",")
+
+def runCase(exe, np, dim, physics, preset, eigLag, itr, extra):
+	workdir = tempfile.mkdtemp(prefix="topopt_bench_")
+	log = os.path.join(workdir, "timing.csv")
+	cmd = MPIEXEC + ["-np", str(np), exe, "-dim", str(dim),
+		"-physics", str(physics), "-solverPreset", preset,
+		"-chebEigLag", str(eigLag),
+		"-maxItr", str(itr), "-workdir", workdir, "-timing_log", log] + extra
+	try:
+		out = subprocess.run(cmd, stdout=subprocess.PIPE,
+			stderr=subprocess.STDOUT, universal_newlines=True)
+		if out.returncode != 0:
+			sys.stderr.write(out.stdout)
+			sys.exit("'%s' failed" % " ".join(cmd))
+		with open(log) as f:
+			rows = list(csv.DictReader(l for l in f if not l.startswith("#")))
+	finally:
+		shutil.rmtree(workdir, ignore_errors=True)
+
+	# Row 0 is the set-up, the last row the final FEA and output
+	opt = rows[1:-1]
+	if len(opt) < 2:
+		sys.exit("'%s' logged less than 2 iterations" % " ".join(cmd))
+	steady = opt[1:]
+	mean = lambda key: sum(float(r[key]) for r in steady) / len(steady)
+	return {"first": float(opt[0]["time"]),
+		"first_its": float(opt[0]["solver_its"]),
+		"time": mean("time"), "solver_its": mean("solver_its"),
+		"MGSetUp": mean("MGSetUp"), "StateSolve": mean("StateSolve")}
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__,
+		formatter_class=argparse.RawDescriptionHelpFormatter)
+	parser.add_argument("-np", type=int, default=1, help="number of MPI ranks")
+	parser.add_argument("-dim", type=intList, default=[2, 3])
+	parser.add_argument("-physics", type=intList, default=[0],
+		help="0-linear elasticity, 1-compliant, 2-heat conduction")
+	parser.add_argument("-preset", type=strList, default=PRESETS,
+		help="presets, e.g. fgmres,cg_direct")
+	parser.add_argument("-eigLag", type=intList, default=[0, 10],
+		help="-chebEigLag values of the cg_* presets")
+	parser.add_argument("-itr", type=int, default=10,
+		help="optimization iterations per run")
+	parser.add_argument("-exe", default="./topopt-opt", help="executable")
+	parser.add_argument("-o", help="write the table also as CSV")
+	parser.add_argument("extra", nargs="*", help="options passed to topopt")
+	args = parser.parse_args()
+
+	cols = ["dim", "physics", "preset", "eigLag", "first", "first_its", "time",
+		"solver_its", "MGSetUp", "StateSolve", "speedup"]
+	table = []
+	print("# np = %d, %d iterations per run, times in s per iteration, "
+		"speedup of the time to solution w.r.t. the first preset"
+		% (args.np, args.itr))
+	print(" ".join("%11s" % c[:11] for c in cols))
+	for dim in args.dim:
+		for physics in args.physics:
+			ref = None
+			for preset in args.preset:
+				# fgmres has no Chebyshev smoothers
+				lags = [0] if preset == "fgmres" else args.eigLag
+				for eigLag in lags:
+					res = runCase(args.exe, args.np, dim, physics, preset,
+						eigLag, args.itr, args.extra)
+					solve = res["MGSetUp"] + res["StateSolve"]
+					if ref is None:
+						ref = solve
+					row = dict(res, dim=dim, physics=physics, preset=preset,
+						eigLag=eigLag, speedup=ref / solve)
+					table.append(row)
+					print(" ".join(("%11.4g" % row[c]) if isinstance(row[c],
+						float) else "%11s" % row[c] for c in cols))
+					sys.stdout.flush()
+
+	if args.o:
+		with open(args.o, "w") as f:
+			w = csv.DictWriter(f, fieldnames=cols)
+			w.writeheader()
+			w.writerows(table)
+
+if __name__ == "__main__":
+	main()
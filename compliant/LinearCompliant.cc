@@ -1,5 +1,7 @@
 #include "LinearCompliant.h"
 
+namespace TOPOPT_NS {
+
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
 
@@ -13,23 +15,33 @@
  * Modified by Zhidong Brian Zhang in August 2020, University of Waterloo
  */
 
-LinearCompliant::LinearCompliant (DM da_nodes, PetscInt m, PetscInt numDES,
-    PetscInt numLODFIX, PetscScalar nu, PetscScalar E, Vec xPassive0,
-    Vec xPassive1, Vec xPassive2, Vec xPassive3) {
+LinearCompliant::LinearCompliant (DM da_nodes, ElementMesh *mesh, PetscInt m,
+    PetscInt numDES, PetscInt numLODFIX, PetscScalar nu, PetscScalar E,
+    DomainMask *domain) {
   // Set pointers to null
   K = NULL;
   U = NULL;
   RHS = NULL;
   N = NULL;
   ksp = NULL;
+  stateRtol = 1.0e-5;
   da_nodal = NULL;
+  this->mesh = mesh; // shared element connectivity
+  this->domain = domain; // domain membership, owned by TopOpt
 
   // Parameters - to be changed on read of variables
   this->nu = nu;
   this->E = E;
-  nlvls = 4;
+  // same levels as TopOpt (-nlvls, see MGLevels.h)
+  MGLevels::GetLevels (da_nodes, &nlvls);
   PetscBool flg;
-  PetscOptionsGetInt (NULL, NULL, "-nlvls", &nlvls, &flg);
+  eliminateVoid = PETSC_FALSE; // elements outside get Emin stiffness
+  PetscOptionsGetBool (NULL, NULL, "-eliminateVoid", &eliminateVoid, &flg);
+  assemblyMap = PETSC_TRUE; // direct assembly into the CSR values
+  PetscOptionsGetBool (NULL, NULL, "-assemblyMap", &assemblyMap, &flg);
+  asmMap = NULL;
+  symmetricSolve = preset.IsSymmetric (); // CG for the SPD presets
+  PetscOptionsGetBool (NULL, NULL, "-symmetricSolve", &symmetricSolve, &flg);
   PetscOptionsGetReal (NULL, NULL, "-nu", &nu, &flg);
 
   this->m = m;
@@ -40,12 +52,13 @@ LinearCompliant::LinearCompliant (DM da_nodes, PetscInt m, PetscInt numDES,
   U = new Vec[numLODFIX];
   RHS = new Vec[numLODFIX];
   N = new Vec[numLODFIX];
+  dirichlet.SetUp (numLODFIX);
 
   // Setup sitffness matrix, load vector and bcs (Dirichlet) for the design
   // problem
   for (PetscInt loadCondition = 0; loadCondition < this->numLODFIX;
       ++loadCondition) { // # new
-    SetUpLoadAndBC (da_nodes, xPassive0, xPassive1, xPassive2, xPassive3,
+    SetUpLoadAndBC (da_nodes, domain,
         loadCondition);
   }
 }
@@ -56,6 +69,7 @@ LinearCompliant::~LinearCompliant ()
   VecDestroyVecs (numLODFIX, &(U));
   VecDestroyVecs (numLODFIX, &(RHS));
   VecDestroyVecs (numLODFIX, &(N));
+  delete asmMap;
   MatDestroy (&(K));
   KSPDestroy (&(ksp));
 
@@ -67,8 +81,8 @@ LinearCompliant::~LinearCompliant ()
 }
 
 PetscErrorCode
-LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
-    Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadCondition) {
+LinearCompliant::SetUpLoadAndBC (DM da_nodes, DomainMask *domain,
+    PetscInt loadCondition) {
   PetscErrorCode ierr = 0;
 
 #if  DIM ==2
@@ -98,7 +112,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
 
       PetscInt nel, nen;
       const PetscInt *necon;
-      DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
+      mesh->GetElements (&nel, &nen, &necon);
 
       // Use the first element to compute the dx, dy, dz
       dx = lcoorp[DIM * necon[0 * nen + 1] + 0]
@@ -132,14 +146,22 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
     // P1 ! STILL DOESN*T WORK !!!!
     DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
 
+    // The element connectivity is shared with da_nodes
+    ierr = mesh->CheckLayout (da_nodal);
+    CHKERRQ(ierr);
+
     // Allocate matrix and the RHS and Solution vector and Dirichlet vector
     ierr = DMCreateMatrix (da_nodal, &(K));
     CHKERRQ(ierr);
+    ierr = SetSymmetryFlags (K);
+    CHKERRQ(ierr);
     ierr = DMCreateGlobalVector (da_nodal, &(U[0]));
     CHKERRQ(ierr);
     VecDuplicateVecs (U[0], numLODFIX, &(U));
     VecDuplicateVecs (U[0], numLODFIX, &(RHS));
     VecDuplicateVecs (U[0], numLODFIX, &(N));
+    ierr = warmStart.SetUp (U[0], numLODFIX, PETSC_TRUE);
+    CHKERRQ(ierr);
     VecDuplicate (U[0], &(Sv));
 
     // Set the local stiffness matrix
@@ -176,12 +198,6 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
 
   // Compute epsilon parameter for finding points in space:
   PetscScalar epsi = PetscMin(dx * 0.05, dy * 0.05);
-  // Passive design variable vector
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
 
   // Set the RHS and Dirichlet vector
   //  PetscScalar rhs_ele[8]; // local rhs
@@ -191,7 +207,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
   // Find the element size
   PetscInt nel, nen;
   const PetscInt *necon;
-  DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
+  mesh->GetElements (&nel, &nen, &necon);
 
   if (IMPORT_GEO == 0) {
     // Set the values:
@@ -235,7 +251,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
       }
     }
   } else {
-    // Load and constraints, xPassive1 indicates fix
+    // Load and constraints, the fixture domain is clamped
     PetscScalar LoadIntensity = 1.0;
     PetscScalar springStiff = 0.1;
     for (PetscInt i = 0; i < nn; i++) {
@@ -269,7 +285,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
     }
     VecAssemblyBegin (N[loadCondition]);
     VecAssemblyEnd (N[loadCondition]);
-    // Constraints, make xPassive1 domain all dofs clamped
+    // Constraints, make the fixture domain all dofs clamped
     for (PetscInt i = 0; i < nel; i++) {
       memset (n_ele, 0.0, sizeof(n_ele[0]) * 8);
       // Global dof in the RHS vector
@@ -278,7 +294,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
           edof[l * 2 + m] = 2 * necon[i * nen + l] + m; // dof in globe
         }
       }
-      if (xPassive2p[i] != 0) {
+      if (domain->IsFixture (i)) {
         for (PetscInt j = 0; j < 8; j++) {
           n_ele[j] = 0.0;
         }
@@ -315,7 +331,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
 
       PetscInt nel, nen;
       const PetscInt *necon;
-      DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
+      mesh->GetElements (&nel, &nen, &necon);
 
       // Use the first element to compute the dx, dy, dz
       dx = lcoorp[3 * necon[0 * nen + 1] + 0]
@@ -358,14 +374,22 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
     // P1 ! STILL DOESN*T WORK !!!!
     DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
 
+    // The element connectivity is shared with da_nodes
+    ierr = mesh->CheckLayout (da_nodal);
+    CHKERRQ(ierr);
+
     // Allocate matrix and the RHS and Solution vector and Dirichlet vector
     ierr = DMCreateMatrix (da_nodal, &(K));
     CHKERRQ(ierr);
+    ierr = SetSymmetryFlags (K);
+    CHKERRQ(ierr);
     ierr = DMCreateGlobalVector (da_nodal, &(U[0]));
     CHKERRQ(ierr);
     VecDuplicateVecs (U[0], numLODFIX, &(U));
     VecDuplicateVecs (U[0], numLODFIX, &(RHS));
     VecDuplicateVecs (U[0], numLODFIX, &(N));
+    ierr = warmStart.SetUp (U[0], numLODFIX, PETSC_TRUE);
+    CHKERRQ(ierr);
     VecDuplicate (U[0], &(Sv));
 
     // Set the local stiffness matrix
@@ -405,12 +429,6 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
   // Compute epsilon parameter for finding points in space:
   PetscScalar epsi = PetscMin(dx * 0.05, PetscMin(dy * 0.05, dz * 0.05));
 
-  // Passive design variable vector
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
 
   // Set the local RHS and Dirichlet vector
   //  PetscScalar rhs_ele[24]; // local rhs
@@ -421,7 +439,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
   // Find the element size
   PetscInt nel, nen;
   const PetscInt *necon;
-  DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+  mesh->GetElements (&nel, &nen, &necon);
 
   if (IMPORT_GEO == 0) {
     // Set the values:
@@ -475,7 +493,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
       }
     }
   } else {
-    // Load and constraints, xPassive1 indicates fix
+    // Load and constraints, the fixture domain is clamped
     PetscScalar LoadIntensity = 1.0;
     PetscScalar springStiff = 0.1;
     for (PetscInt i = 0; i < nn; i++) {
@@ -516,7 +534,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
     }
     VecAssemblyBegin (N[loadCondition]);
     VecAssemblyEnd (N[loadCondition]);
-    // Constraints, make xPassive1 domain all dofs clamped
+    // Constraints, make the fixture domain all dofs clamped
     for (PetscInt i = 0; i < nel; i++) {
       memset (n_ele, 0.0, sizeof(n_ele[0]) * 24);
       // Global dof in the RHS vector
@@ -525,7 +543,7 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
           edof[l * 3 + m] = 3 * necon[i * nen + l] + m; // dof in globe
         }
       }
-      if (xPassive2p[i] != 0) {
+      if (domain->IsFixture (i)) {
         for (PetscInt j = 0; j < 24; j++) {
           n_ele[j] = 0.0;
         }
@@ -544,13 +562,20 @@ LinearCompliant::SetUpLoadAndBC (DM da_nodes, Vec xPassive0,
   VecAssemblyBegin (RHS[loadCondition]);
   VecAssemblyEnd (RHS[loadCondition]);
   VecRestoreArray (lcoor, &lcoorp);
-  DMDARestoreElements (da_nodal, &nel, &nen, &necon);
   VecAssemblyBegin (Sv);
   VecAssemblyEnd (Sv);
-  VecRestoreArray (xPassive0, &xPassive0p);
-  VecRestoreArray (xPassive1, &xPassive1p);
-  VecRestoreArray (xPassive2, &xPassive2p);
-  VecRestoreArray (xPassive3, &xPassive3p);
+
+  // Eliminate the dofs of the elements outside of all domains: they are
+  // constrained like Dirichlet dofs (identity rows, zero RHS)
+  if (eliminateVoid) {
+    ierr = mesh->EliminateVoidDofs (domain, da_nodal, DIM, N[loadCondition],
+        (PetscBool) (loadCondition == 0));
+    CHKERRQ(ierr);
+  }
+
+  // Cache I - N and the constrained rows of the load condition
+  ierr = SetUpConstrainedRows (loadCondition);
+  CHKERRQ(ierr);
 
   return ierr;
 }
@@ -565,33 +590,57 @@ LinearCompliant::SolveState (Vec xPhys, PetscScalar Emin,
   t1 = MPI_Wtime ();
 
   // Assemble the stiffness matrix
+  PerfLog::Begin (PerfLog::ASSEMBLY);
   ierr = AssembleStiffnessMatrix (xPhys, Emin, Emax, penal, loadCondition);
   CHKERRQ(ierr);
+  PerfLog::End (PerfLog::ASSEMBLY);
 
   // Setup the solver
+  PerfLog::Begin (PerfLog::MGSETUP);
   if (ksp == NULL) {
     ierr = SetUpSolver ();
     CHKERRQ(ierr);
+    ierr = MGLevels::SetUpTelescopeSolve (ksp);
+    CHKERRQ(ierr);
   } else {
     ierr = KSPSetOperators (ksp, K, K);
     CHKERRQ(ierr);
+    PC pc;
+    KSPGetPC (ksp, &pc);
+    ierr = preset.NewOperator (pc); // age of the Chebyshev estimates
+    CHKERRQ(ierr);
     KSPSetUp (ksp);
   }
+  PerfLog::End (PerfLog::MGSETUP);
 
   // Solve
+  ierr = warmStart.Guess (loadCondition, U[loadCondition]);
+  CHKERRQ(ierr);
+  PerfLog::Begin (PerfLog::KSPSOLVE);
   ierr = KSPSolve (ksp, RHS[loadCondition], U[loadCondition]);
   CHKERRQ(ierr);
+  PerfLog::End (PerfLog::KSPSOLVE);
+  ierr = warmStart.Store (loadCondition, U[loadCondition]);
+  CHKERRQ(ierr);
+
+  // Keep the Chebyshev estimates of this set up for the next operators
+  PC pc;
+  KSPGetPC (ksp, &pc);
+  ierr = preset.CacheEigenvalues (pc);
+  CHKERRQ(ierr);
 
   // DEBUG
   // Get iteration number and residual from KSP
   PetscInt niter;
   PetscScalar rnorm;
   KSPGetIterationNumber (ksp, &niter);
+  PerfLog::AddSolverIterations (niter);
   KSPGetResidualNorm (ksp, &rnorm);
   PetscReal RHSnorm;
   ierr = VecNorm (RHS[loadCondition], NORM_2, &RHSnorm);
   CHKERRQ(ierr);
   rnorm = rnorm / RHSnorm;
+  PerfLog::AddSolverResidual (rnorm);
 
   t2 = MPI_Wtime ();
   PetscPrintf (PETSC_COMM_WORLD,
@@ -604,7 +653,7 @@ PetscErrorCode
 LinearCompliant::ComputeObjectiveConstraintsSensitivities (
     PetscScalar *fx, PetscScalar *gx, Vec dfdx, Vec *dgdx, Vec xPhys,
     PetscScalar Emin, PetscScalar Emax, PetscScalar penal, PetscScalar volfrac,
-    Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3) {
+    DomainMask *domain) {
   // Errorcode
   PetscErrorCode ierr;
 
@@ -614,27 +663,19 @@ LinearCompliant::ComputeObjectiveConstraintsSensitivities (
     ierr = SolveState (xPhys, Emin, Emax, penal, loadCondition);
     CHKERRQ(ierr);
   }
+  PerfLog::Begin (PerfLog::SENSITIVITY);
 
 // Get the FE mesh structure (from the nodal mesh)
   PetscInt nel, nen;
   const PetscInt *necon;
-#if DIM == 2
-  ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
-  CHKERRQ(ierr);
-#elif DIM == 3
-  ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+  ierr = mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
-#endif
 // DMDAGetElements(da_nodes,&nel,&nen,&necon); // Still issue with elemtype
 // change !
 
   // Get pointer to the densities
-  PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPhys, &xp);
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
+  const PetscScalar *xp; // read only, keeps the state of xPhys
+  VecGetArrayRead (xPhys, &xp);
 
   // Get Solution
   Vec Uloctmp, *Uloc;
@@ -674,33 +715,38 @@ LinearCompliant::ComputeObjectiveConstraintsSensitivities (
   DMGlobalToLocalEnd (da_nodal, Sv, INSERT_VALUES, Svloc);
   VecGetArray (Svloc, &svp);
 
-  // Edof array
-  PetscInt edof[nedof];
+  // Element energies Uout^T (KE + diag(Sv)) Uin of the design elements,
+  // batched
+  const PetscInt *edof, *elist;
+  PetscInt nact;
+  ierr = mesh->GetEdof (DIM, &edof);
+  CHKERRQ(ierr);
+  ierr = mesh->GetDesignElements (domain, &nact, &elist);
+  CHKERRQ(ierr);
+  PetscScalar *uKue;
+  ierr = PetscMalloc1 (nel, &uKue);
+  CHKERRQ(ierr);
+  // up[0] is Uin, up[1] is Uout
+  ElementKernels<nedof>::QuadraticForm (KE, edof, elist, nact, up[1], up[0],
+      svp, uKue);
+
+  // Elements outside of all domains, the active ones are set below
+  const PetscInt *alist;
+  PetscInt nactive;
+  ierr = mesh->GetActiveElements (domain, &nactive, &alist);
+  CHKERRQ(ierr);
+  for (PetscInt i = 0; i < nel; i++) {
+    df[i] = 1.0E9;
+  }
+  nNonDesign = nel - nact;
 
   fx[0] = 0.0;
-  // Loop over elements
-  for (PetscInt i = 0; i < nel; i++) {
-    // loop over element nodes
-    if (xPassive0p[i] != 0) {
-      for (PetscInt j = 0; j < nen; j++) {
-        // Get local dofs
-        for (PetscInt k = 0; k < DIM; k++) {
-          edof[j * DIM + k] = DIM * necon[i * nen + j] + k;
-        }
-      }
+  // Loop over the active elements
+  for (PetscInt a = 0; a < nactive; a++) {
+    PetscInt i = alist[a];
+    if (domain->IsDesign (i)) {
       // Use SIMP for stiffness interpolation
-      PetscScalar uKu = 0.0;
-      PetscScalar KEtmp = 0.0;
-      for (PetscInt k = 0; k < nedof; k++) {
-        for (PetscInt h = 0; h < nedof; h++) {
-          if (edof[k] == edof[h]) { // on the diagonal, then add the external spring
-            KEtmp = KE[k * nedof + h] + svp[edof[k]];
-          } else {
-            KEtmp = KE[k * nedof + h];
-          }
-          uKu += up[1][edof[k]] * KEtmp * up[0][edof[h]]; // up[0] is Uin, up[1] is Uout
-        }
-      }
+      PetscScalar uKu = uKue[i];
       // Add to objective
       fx[0] += (Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin)) * uKu;
       // Set the Senstivity
@@ -710,13 +756,8 @@ LinearCompliant::ComputeObjectiveConstraintsSensitivities (
         gx[j] += xp[i];
         dg[j][i] = 1;
       }
-    } else if (xPassive1p[i] != 0 || xPassive2p[i] != 0 || xPassive3p[i] != 0) {
+    } else { // passive
       df[i] = -1.0E9;
-      nNonDesign += 1;
-    } else {
-      df[i] = 1.0E9;
-      nNonDesign += 1;
-
     }
   }
 
@@ -741,19 +782,36 @@ LinearCompliant::ComputeObjectiveConstraintsSensitivities (
         1.0 / ((PetscScalar) neltot - nNonDesign)); // # modified
   }
 
-  VecRestoreArray (xPhys, &xp);
-  VecRestoreArray (xPassive0, &xPassive0p); // # new
-  VecRestoreArray (xPassive1, &xPassive1p); // # new
-  VecRestoreArray (xPassive2, &xPassive2p); // # new
-  VecRestoreArray (xPassive3, &xPassive3p); // # new
+  VecRestoreArrayRead (xPhys, &xp);
   VecRestoreArrays (Uloc, numLODFIX, &up);
   VecRestoreArray (dfdx, &df);
   VecRestoreArrays (dgdx, m, &dg);
   VecDestroyVecs (numLODFIX, &Uloc);
+  PetscFree (uKue);
+  PerfLog::End (PerfLog::SENSITIVITY);
 
   return (ierr);
 }
 
+PetscErrorCode
+LinearCompliant::SetStateTolerance (PetscReal rtol) {
+
+  PetscErrorCode ierr = 0;
+
+  stateRtol = rtol;
+  PerfLog::SetSolverTolerance (rtol);
+  if (ksp != NULL) {
+    PetscReal atol, dtol;
+    PetscInt maxits;
+    ierr = KSPGetTolerances (ksp, NULL, &atol, &dtol, &maxits);
+    CHKERRQ(ierr);
+    ierr = KSPSetTolerances (ksp, rtol, atol, dtol, maxits);
+    CHKERRQ(ierr);
+  }
+
+  return ierr;
+}
+
 PetscErrorCode
 LinearCompliant::WriteRestartFiles ()
 {
@@ -793,17 +851,20 @@ LinearCompliant::WriteRestartFiles ()
 }
 
 PetscErrorCode
-LinearCompliant::FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
-    Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadConditionFEA,
+LinearCompliant::FEAWithTopOptResults (Vec xPhys, DomainMask *domain,
+    PetscInt loadConditionFEA,
     PetscScalar *loadVectorFEAp) { // # new
   // Errorcode
   PetscErrorCode ierr = 0;
 
+  // The FEA loads have no history of their own
+  warmStart.Disable ();
+
   PetscPrintf (PETSC_COMM_WORLD, "FEA with TopOpt Results, step: %d\n",
       loadConditionFEA);
 
   // only first load condition because we are solving FEA only one at a time
-  SetUpLoadAndBC (da_nodal, xPassive0, xPassive1, xPassive2, xPassive3, 0);
+  SetUpLoadAndBC (da_nodal, domain, 0);
   // Solve state eqs,
   ierr = SolveState (xPhys, 1E-9, 1.0, 1.0, 0);
   CHKERRQ(ierr);
@@ -828,67 +889,99 @@ LinearCompliant::AssembleStiffnessMatrix (Vec xPhys,
 // Get the FE mesh structure (from the nodal mesh)
   PetscInt nel, nen;
   const PetscInt *necon;
-#if DIM == 2
-  ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
-  CHKERRQ(ierr);
-#elif DIM == 3
-  ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+  ierr = mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
-#endif
 
 // Get pointer to the densities
-  PetscScalar *xp;
-  VecGetArray (xPhys, &xp);
+  const PetscScalar *xp; // read only, keeps the state of xPhys
+  VecGetArrayRead (xPhys, &xp);
 
-// Zero the matrix
-  MatZeroEntries (K);
-
-// Edof array
-  PetscInt edof[nedof];
   PetscScalar ke[nedof * nedof];
 
-// Loop over elements
-  for (PetscInt i = 0; i < nel; i++) {
-    // loop over element nodes
-    for (PetscInt j = 0; j < nen; j++) {
-      // Get local dofs
-      for (PetscInt k = 0; k < DIM; k++) {
-        edof[j * DIM + k] = DIM * necon[i * nen + j] + k;
+// Elements to assemble: all, or only the active ones if the dofs outside
+// of all domains are eliminated (see SetUpLoadAndBC)
+  PetscInt nasm = nel;
+  const PetscInt *alist = NULL;
+  if (eliminateVoid) {
+    ierr = mesh->GetActiveElements (domain, &nasm, &alist);
+    CHKERRQ(ierr);
+  }
+
+// Cached scatter into the CSR storage of the matrix (-assemblyMap),
+// set up on the first assembly
+  if (assemblyMap) {
+    ierr = mesh->SetUpAssemblyMap (K, DIM, &asmMap);
+    CHKERRQ(ierr);
+  }
+
+  if (asmMap != NULL && asmMap->IsSetUp ()) {
+    ierr = asmMap->Assemble (K, KE, xp, Emin, Emax, penal, nasm, alist);
+    CHKERRQ(ierr);
+  } else {
+    // Zero the matrix
+    MatZeroEntries (K);
+
+    // Loop over elements
+    for (PetscInt a = 0; a < nasm; a++) {
+      PetscInt i = (alist != NULL) ? alist[a] : a;
+      // Use SIMP for stiffness interpolation
+      PetscScalar dens = Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
+      for (PetscInt k = 0; k < nedof * nedof; k++) {
+        ke[k] = KE[k] * dens;
       }
+      // Add values to the sparse matrix, one DIM x DIM block per pair of
+      // element nodes
+      ierr = MatSetValuesBlockedLocal (K, nen, necon + i * nen, nen,
+          necon + i * nen, ke, ADD_VALUES);
+      CHKERRQ(ierr);
     }
-    // Use SIMP for stiffness interpolation
-    PetscScalar dens = Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
-    for (PetscInt k = 0; k < nedof * nedof; k++) {
-      ke[k] = KE[k] * dens;
-    }
-    // Add values to the sparse matrix
-    ierr = MatSetValuesLocal (K, nedof, edof, nedof, edof, ke, ADD_VALUES);
-    CHKERRQ(ierr);
+    PetscLogFlops ((nedof * nedof + 3.0) * nasm);
+    MatAssemblyBegin (K, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd (K, MAT_FINAL_ASSEMBLY);
   }
+
 // Add the external spring
   ierr = MatDiagonalSet (K, Sv, ADD_VALUES);
   CHKERRQ(ierr);
 
-  MatAssemblyBegin (K, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd (K, MAT_FINAL_ASSEMBLY);
-
-// Impose the dirichlet conditions, i.e. K = N'*K*N - (N-I)
-// 1.: K = N'*K*N
-  MatDiagonalScale (K, N[loadCondition], N[loadCondition]);
-// 2. Add ones, i.e. K = K + NI, NI = I - N
-  Vec NI;
-  VecDuplicate (N[loadCondition], &NI);
-  VecSet (NI, 1.0);
-  VecAXPY (NI, -1.0, N[loadCondition]);
-  MatDiagonalSet (K, NI, ADD_VALUES);
+// Impose the dirichlet conditions (see DirichletRows.h)
+  ierr = dirichlet.Apply (K, loadCondition, N[loadCondition], Emax);
+  CHKERRQ(ierr);
 
 // Zero out possible loads in the RHS that coincide
 // with Dirichlet conditions
   VecPointwiseMult (RHS[loadCondition], RHS[loadCondition], N[loadCondition]);
 
-  VecDestroy (&NI);
-  VecRestoreArray (xPhys, &xp);
-  DMDARestoreElements (da_nodal, &nel, &nen, &necon);
+  VecRestoreArrayRead (xPhys, &xp);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearCompliant::SetSymmetryFlags (Mat A) {
+
+  PetscErrorCode ierr = 0;
+
+  // K is symmetric, and stays symmetric with the BCs imposed
+  ierr = MatSetOption (A, MAT_SYMMETRIC, PETSC_TRUE);
+  CHKERRQ(ierr);
+  ierr = MatSetOption (A, MAT_SYMMETRY_ETERNAL, PETSC_TRUE);
+  CHKERRQ(ierr);
+
+  return ierr;
+}
+
+PetscErrorCode
+LinearCompliant::SetUpConstrainedRows (PetscInt loadCondition) {
+
+  PetscErrorCode ierr = 0;
+
+  // Diagonal of the constrained rows per unit modulus: the one of a node
+  // in solid material, i.e. of the 2^DIM elements around it (without the
+  // external springs, which only act on the in- and output dofs)
+  ierr = dirichlet.SetUpLoadCondition (loadCondition, N[loadCondition],
+      (1 << DIM) * KE[0]);
+  CHKERRQ(ierr);
 
   return ierr;
 }
@@ -969,7 +1062,7 @@ LinearCompliant::SetUpSolver ()
 
 // SET THE DEFAULT SOLVER PARAMETERS
 // The fine grid solver settings
-  PetscScalar rtol = 1.0e-5;
+  PetscScalar rtol = stateRtol;
   PetscScalar atol = 1.0e-50;
   PetscScalar dtol = 1.0e5;
   PetscInt restart = 100;
@@ -986,7 +1079,8 @@ LinearCompliant::SetUpSolver ()
   PetscInt smooth_sweeps = 4;
 
 // Set up the solver
-  ierr = KSPSetType (ksp, KSPFGMRES); // KSPCG, KSPGMRES
+  // CG if the smoothers keep the V-cycle symmetric (-symmetricSolve)
+  ierr = KSPSetType (ksp, symmetricSolve ? KSPCG : KSPFGMRES); // KSPCG, KSPGMRES
   CHKERRQ(ierr);
 
   ierr = KSPGMRESSetRestart (ksp, restart);
@@ -1008,6 +1102,8 @@ LinearCompliant::SetUpSolver ()
 
 // Set solver from options
   KSPSetFromOptions (ksp);
+  KSPGetTolerances (ksp, &stateRtol, NULL, NULL, NULL);
+  PerfLog::SetSolverTolerance (stateRtol);
 
 // Get the prec again - check if it has changed
   KSPGetPC (ksp, &pc);
@@ -1080,7 +1176,7 @@ LinearCompliant::SetUpSolver ()
       KSP cksp;
       PCMGGetCoarseSolve (pc, &cksp);
       // The solver
-      ierr = KSPSetType (cksp, KSPGMRES); // KSPCG, KSPFGMRES
+      ierr = KSPSetType (cksp, symmetricSolve ? KSPCG : KSPGMRES); // KSPCG, KSPFGMRES
       ierr = KSPGMRESSetRestart (cksp, coarse_restart);
       // ierr = KSPSetType(cksp,KSPCG);
 
@@ -1090,6 +1186,12 @@ LinearCompliant::SetUpSolver ()
       PC cpc;
       KSPGetPC (cksp, &cpc);
       PCSetType (cpc, PCSOR); // PCGAMG, PCSOR, PCSPAI (NEEDS TO BE COMPILED), PCJACOBI
+      // Direct or AMG coarse solve of the cg_* presets
+      ierr = preset.SetUpCoarseSolve (cksp);
+      CHKERRQ(ierr);
+      // Agglomerate a small coarse problem onto fewer ranks
+      ierr = MGLevels::SetUpCoarseSolve (pc, da_nodal, nlvls);
+      CHKERRQ(ierr);
 
       // Set smoothers on all levels (except for coarse grid):
       for (PetscInt k = 1; k < nlvls; k++) {
@@ -1097,9 +1199,23 @@ LinearCompliant::SetUpSolver ()
         PCMGGetSmoother (pc, k, &dksp);
         PC dpc;
         KSPGetPC (dksp, &dpc);
-        ierr = KSPSetType (dksp,
-        KSPGMRES); // KSPCG, KSPGMRES, KSPCHEBYSHEV (VERY GOOD FOR SPD)
-        ierr = KSPGMRESSetRestart (dksp, smooth_sweeps);
+        if (preset.IsSymmetric ()) { // Chebyshev+Jacobi of the cg_* presets
+          ierr = preset.SetUpSmoother (dksp, smooth_sweeps);
+          CHKERRQ(ierr);
+          continue;
+        }
+        if (symmetricSolve) {
+          // -symmetricSolve with the fgmres preset: CG outside needs a fixed
+          // symmetric smoother, Chebyshev with symmetric SOR sweeps
+          ierr = KSPSetType (dksp, KSPCHEBYSHEV);
+          CHKERRQ(ierr);
+          ierr = KSPChebyshevEstEigSet (dksp, 0.0, 0.1, 0.0, 1.1);
+          CHKERRQ(ierr);
+        } else {
+          ierr = KSPSetType (dksp,
+          KSPGMRES); // KSPCG, KSPGMRES, KSPCHEBYSHEV (VERY GOOD FOR SPD)
+          ierr = KSPGMRESSetRestart (dksp, smooth_sweeps);
+        }
         // ierr = KSPSetType(dksp,KSPCHEBYSHEV);
         ierr = KSPSetTolerances (dksp, PETSC_DEFAULT, PETSC_DEFAULT,
         PETSC_DEFAULT, smooth_sweeps); // NOTE in the above maxitr=restart;
@@ -1122,6 +1238,8 @@ LinearCompliant::SetUpSolver ()
       "################# Linear solver settings #####################\n");
   PetscPrintf (PETSC_COMM_WORLD,
       "# Main solver: %s, prec.: %s, maxiter.: %i \n", ksptype, pctype, mmax);
+  preset.Print ();
+  warmStart.Print ();
 
 // Only if pcmg is used
   if (pcmg_flag) {
@@ -1141,6 +1259,7 @@ LinearCompliant::SetUpSolver ()
           "# Level %i smoother: %s, prec.: %s, sweep: %i \n", k, dksptype,
           dpctype, mmax);
     }
+    MGLevels::Print (pc, da_nodal, nlvls);
   }
   PetscPrintf (PETSC_COMM_WORLD,
       "##############################################################\n");
@@ -1149,52 +1268,6 @@ LinearCompliant::SetUpSolver ()
 }
 
 #if DIM == 2
-PetscErrorCode
-LinearCompliant::DMDAGetElements_2D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 4;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (j = ys; j < ye - 1; j++) {
-      for (i = xs; i < xe - 1; i++) {
-        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-        if (da->elementtype == DMDA_ELEMENT_Q1) {
-          for (c = 0; c < ns * nn; c++)
-            da->e[cnt++] = cell[c];
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
 PetscInt
 LinearCompliant::Quad4Isoparametric (PetscScalar *X, PetscScalar *Y,
     PetscScalar nu, PetscInt redInt, PetscScalar *ke) {
@@ -1372,68 +1445,6 @@ LinearCompliant::Inverse2M (PetscScalar J[][2],
 }
 
 #elif DIM == 3
-PetscErrorCode LinearCompliant::DMDAGetElements_3D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs) zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
-          }
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
 PetscInt LinearCompliant::Hex8Isoparametric (PetscScalar *X, PetscScalar *Y,
     PetscScalar *Z, PetscScalar nu, PetscInt redInt, PetscScalar *ke) {
 // HEX8_ISOPARAMETRIC - Computes HEX8 isoparametric element matrices
@@ -1655,3 +1666,5 @@ LinearCompliant::Dot (PetscScalar *v1, PetscScalar *v2,
   }
   return result;
 }
+
+} // namespace TOPOPT_NS
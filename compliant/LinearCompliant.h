@@ -8,6 +8,17 @@
 #include <petsc/private/dmdaimpl.h>
 
 #include "options.h" // framework options, new
+#include "ElementKernels.h" // batched element kernels
+#include "ElementMesh.h" // shared element connectivity
+#include "DomainMask.h" // domain membership of the elements
+#include "AssemblyMap.h" // cached assembly into the CSR values
+#include "DirichletRows.h" // Dirichlet conditions on K
+#include "PerfLog.h" // per-phase performance log
+#include "SolverPreset.h" // named solver configurations
+#include "MGLevels.h" // multigrid depth and coarse solve
+#include "WarmStart.h" // initial guesses of the state solves
+
+namespace TOPOPT_NS {
 
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -28,9 +39,9 @@ class LinearCompliant {
 
   public:
     // Constructor
-    LinearCompliant (DM da_nodes, PetscInt m, PetscInt numDES,
-        PetscInt numLODFIX, PetscScalar nu, PetscScalar E, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3); //new
+    LinearCompliant (DM da_nodes, ElementMesh *mesh, PetscInt m,
+        PetscInt numDES, PetscInt numLODFIX, PetscScalar nu, PetscScalar E,
+        DomainMask *domain); //new
 
     // Destructor
     ~LinearCompliant ();
@@ -39,12 +50,15 @@ class LinearCompliant {
     // SELF_ADJOINT PROBLEMS
     PetscErrorCode ComputeObjectiveConstraintsSensitivities (PetscScalar *fx,
         PetscScalar *gx, Vec dfdx, Vec *dgdx, Vec xPhys, PetscScalar Emin,
-        PetscScalar Emax, PetscScalar penal, PetscScalar volfrac, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3);
+        PetscScalar Emax, PetscScalar penal, PetscScalar volfrac,
+        DomainMask *domain);
 
     // Restart writer
     PetscErrorCode WriteRestartFiles ();
 
+    // Relative tolerance of the next state solves (see StateTolerance.h)
+    PetscErrorCode SetStateTolerance (PetscReal rtol);
+
     // Get pointer to the FE solution
     Vec GetStateField () {
       return (U[0]);
@@ -59,8 +73,8 @@ class LinearCompliant {
     DM da_nodal; // Nodal mesh
 
     // # new; FEA with the TopOpt final results
-    PetscErrorCode FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadConditionFEA,
+    PetscErrorCode FEAWithTopOptResults (Vec xPhys, DomainMask *domain,
+        PetscInt loadConditionFEA,
         PetscScalar *loadVectorFEAp);
 
   private:
@@ -68,6 +82,35 @@ class LinearCompliant {
     PetscInt nn[DIM]; // Number of nodes in each direction, new
     PetscInt ne[DIM]; // Number of elements in each direction, new
     PetscScalar xc[2 * DIM]; // Domain coordinates, new
+    ElementMesh *mesh; // element connectivity, owned by TopOpt, new
+    DomainMask *domain; // domain membership, owned by TopOpt
+
+    // Eliminate the dofs that belong only to elements outside of all domains
+    // (-eliminateVoid), only the active elements are assembled
+    PetscBool eliminateVoid;
+
+    // Dirichlet conditions of the load conditions on K
+    DirichletRows dirichlet;
+
+    // Cache the constrained rows of a load condition, after N is set up,
+    // with the diagonal of the elasticity rows
+    PetscErrorCode SetUpConstrainedRows (PetscInt loadCondition);
+
+    // Cached scatter of the element matrices into K (-assemblyMap)
+    PetscBool assemblyMap;
+    AssemblyMap *asmMap;
+
+    PetscBool symmetricSolve; // CG with symmetric smoothers (-symmetricSolve)
+
+    // Solver configuration (-solverPreset) and the cache of the Chebyshev
+    // eigenvalue estimates
+    SolverPreset preset;
+
+    // Initial guesses of the state solves (-warmStart)
+    WarmStart warmStart;
+
+    // Flag the new stiffness matrix symmetric
+    PetscErrorCode SetSymmetryFlags (Mat A);
 
     // Linear algebra
     Mat K; // Global stiffness matrix
@@ -83,6 +126,7 @@ class LinearCompliant {
 
     // Solver
     KSP ksp; // Pointer to the KSP object i.e. the linear solver+prec
+    PetscReal stateRtol; // Relative tolerance of the state solves
     PetscInt nlvls;
     PetscScalar nu; // Possions ratio
     PetscScalar E; // Possions ratio
@@ -101,8 +145,8 @@ class LinearCompliant {
     Vec Sv; // spring vector
 
     // Set up the FE mesh, data structures, and load and boundary conditions
-    PetscErrorCode SetUpLoadAndBC (DM da_nodes, Vec xPassive0, Vec xPassive1,
-        Vec xPassive2, Vec xPassive3, PetscInt loadCondition);
+    PetscErrorCode SetUpLoadAndBC (DM da_nodes, DomainMask *domain,
+        PetscInt loadCondition);
 
     // Solve the FE problem
     PetscErrorCode SolveState (Vec xPhys, PetscScalar Emin, PetscScalar Emax,
@@ -116,10 +160,6 @@ class LinearCompliant {
     PetscErrorCode SetUpSolver ();
 
 #if DIM == 2
-    // Routine that doesn't change the element type upon repeated calls, new
-    PetscErrorCode DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-
     // Methods used to assemble the element stiffness matrix, new
     PetscInt Quad4Isoparametric (PetscScalar *X, PetscScalar *Y, PetscScalar nu,
         PetscInt redInt, PetscScalar *ke);
@@ -129,10 +169,6 @@ class LinearCompliant {
 
 #elif DIM == 3
 
-    // Routine that doesn't change the element type upon repeated calls, new
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-
     // Methods used to assemble the element stiffness matrix, new
     PetscInt Hex8Isoparametric (PetscScalar *X, PetscScalar *Y, PetscScalar *Z,
         PetscScalar nu, PetscInt redInt, PetscScalar *ke);
@@ -158,4 +194,6 @@ class LinearCompliant {
     }
 };
 
+} // namespace TOPOPT_NS
+
 #endif
@@ -1,5 +1,7 @@
 #include "LinearHeatConduction.h"
 
+namespace TOPOPT_NS {
+
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
 
@@ -13,21 +15,29 @@
  * Modified by Zhidong Brian Zhang in August 2020, University of Waterloo
  */
 
-LinearHeatConduction::LinearHeatConduction (DM da_nodes, DM da_elem, PetscInt m,
-    PetscInt numDES, PetscInt numLODFIX, Vec xPassive0, Vec xPassive1,
-    Vec xPassive2, Vec xPassive3) {
+LinearHeatConduction::LinearHeatConduction (DM da_nodes, DM da_elem,
+    ElementMesh *mesh, PetscInt m, PetscInt numDES, PetscInt numLODFIX,
+    DomainMask *domain) {
   // Set pointers to null
   K = NULL;
   U = NULL;
   RHS = NULL;
   N = NULL;
   ksp = NULL;
+  stateRtol = 1.0e-5;
   da_nodal = NULL;
+  this->mesh = mesh; // shared element connectivity
+  this->domain = domain; // domain membership, owned by TopOpt
 
   // Parameters - to be changed on read of variables
-  nlvls = 4;
+  // same levels as TopOpt (-nlvls, see MGLevels.h)
+  MGLevels::GetLevels (da_nodes, &nlvls);
   PetscBool flg;
-  PetscOptionsGetInt (NULL, NULL, "-nlvls", &nlvls, &flg);
+  eliminateVoid = PETSC_FALSE; // elements outside get Emin conductivity
+  PetscOptionsGetBool (NULL, NULL, "-eliminateVoid", &eliminateVoid, &flg);
+  assemblyMap = PETSC_TRUE; // direct assembly into the CSR values
+  PetscOptionsGetBool (NULL, NULL, "-assemblyMap", &assemblyMap, &flg);
+  asmMap = NULL;
 
   this->m = m;
   this->numDES = numDES; // num of design domain, save for internal uses
@@ -35,13 +45,13 @@ LinearHeatConduction::LinearHeatConduction (DM da_nodes, DM da_elem, PetscInt m,
 
   RHS = new Vec[numLODFIX];
   N = new Vec[numLODFIX];
+  dirichlet.SetUp (numLODFIX);
 
   // Setup heat conductivity matrix, heat load vector and bcs (Dirichlet) for the design
   // problem
   for (PetscInt loadCondition = 0; loadCondition < this->numLODFIX;
       ++loadCondition) { // # new
-    SetUpLoadAndBC (da_nodes, da_elem, xPassive0, xPassive1, xPassive2,
-        xPassive3, loadCondition);
+    SetUpLoadAndBC (da_nodes, da_elem, domain, loadCondition);
   }
 }
 
@@ -50,6 +60,7 @@ LinearHeatConduction::~LinearHeatConduction () {
   VecDestroy (&(U));
   VecDestroyVecs (numLODFIX, &(RHS));
   VecDestroyVecs (numLODFIX, &(N));
+  delete asmMap;
   MatDestroy (&(K));
   KSPDestroy (&(ksp));
 
@@ -59,7 +70,7 @@ LinearHeatConduction::~LinearHeatConduction () {
 }
 
 PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
-    Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3,
+    DomainMask *domain,
     PetscInt loadCondition) {
   PetscErrorCode ierr = 0;
 
@@ -90,7 +101,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
 
       PetscInt nel, nen;
       const PetscInt *necon;
-      DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
+      mesh->GetElements (&nel, &nen, &necon);
 
       // Use the first element to compute the dx, dy, dz
       dx = lcoorp[DIM * necon[0 * nen + 1] + 0]
@@ -124,6 +135,10 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
     // P1 ! STILL DOESN*T WORK !!!!
     DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
 
+    // The element connectivity is shared with da_nodes
+    ierr = mesh->CheckLayout (da_nodal);
+    CHKERRQ(ierr);
+
     // Allocate matrix and the RHS and Solution vector and Dirichlet vector
     ierr = DMCreateMatrix (da_nodal, &(K));
     CHKERRQ(ierr);
@@ -131,6 +146,8 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
     CHKERRQ(ierr);
     VecDuplicateVecs (U, numLODFIX, &(RHS));
     VecDuplicateVecs (U, numLODFIX, &(N));
+    ierr = warmStart.SetUp (U, numLODFIX, PETSC_FALSE);
+    CHKERRQ(ierr);
 
     // Set the local heat conductivity matrix
     PetscScalar X[4] = { 0.0, dx, dx, 0.0 };
@@ -162,12 +179,6 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
 
   // Compute epsilon parameter for finding points in space:
   PetscScalar epsi = PetscMin(dx * 0.05, dy * 0.05);
-  // Passive design variable vector
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
 
   // Set the RHS and Dirichlet vector
   PetscScalar rhs_ele[4]; // local rhs
@@ -186,7 +197,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
   // Find the element size
   PetscInt nel, nen;
   const PetscInt *necon;
-  DMDAGetElements_2D (da_nodes, &nel, &nen, &necon);
+  mesh->GetElements (&nel, &nen, &necon);
 
   if (IMPORT_GEO == 0) {
     // Set the values:
@@ -222,8 +233,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
   } else {
     // Set the values:
     // In this case:
-    // xPassive2 indicates fix,
-    // xPassive3 indicates loading.
+    // fixture and loading elements of the domain mask
     // Load and constraints
     PetscScalar LoadIntensity = 0.001;
     for (PetscInt i = 0; i < nel; i++) {
@@ -234,7 +244,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
       for (PetscInt l = 0; l < nen; l++) {
         edof[l] = necon[i * nen + l]; // dof in globe
       }
-      if (xPassive0p[i] != 0) {
+      if (domain->IsDesign (i)) {
         for (PetscInt j = 0; j < 4; j++) {
           rhs_ele[j] = LoadIntensity;
         }
@@ -242,7 +252,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
             ADD_VALUES);
         CHKERRQ(ierr);
       }
-      if (xPassive2p[i] != 0) {
+      if (domain->IsFixture (i)) {
         for (PetscInt j = 0; j < 4; j++) {
           n_ele[j] = 0.0;
         }
@@ -283,7 +293,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
 
       PetscInt nel, nen;
       const PetscInt *necon;
-      DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
+      mesh->GetElements (&nel, &nen, &necon);
 
       // Use the first element to compute the dx, dy, dz
       dx = lcoorp[3 * necon[0 * nen + 1] + 0]
@@ -325,6 +335,10 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
     // Set the element type to Q1: Otherwise calls to GetElements will change to
     // P1 ! STILL DOESN*T WORK !!!!
     DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
+
+    // The element connectivity is shared with da_nodes
+    ierr = mesh->CheckLayout (da_nodal);
+    CHKERRQ(ierr);
 //  DMDASetElementType (da_nodal, DMDA_ELEMENT_Q1);
 
     // Allocate matrix and the RHS and Solution vector and Dirichlet vector
@@ -334,6 +348,8 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
     CHKERRQ(ierr);
     VecDuplicateVecs (U, numLODFIX, &(RHS));
     VecDuplicateVecs (U, numLODFIX, &(N));
+    ierr = warmStart.SetUp (U, numLODFIX, PETSC_FALSE);
+    CHKERRQ(ierr);
 
     // Set the local heat conductivity matrix
     PetscScalar X[8] = { 0.0, dx, dx, 0.0, 0.0, dx, dx, 0.0 };
@@ -369,12 +385,6 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
   // Compute epsilon parameter for finding points in space:
   PetscScalar epsi = PetscMin(dx * 0.05, PetscMin(dy * 0.05, dz * 0.05));
 
-  // Passive design variable vector
-  PetscScalar *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (xPassive0, &xPassive0p);
-  VecGetArray (xPassive1, &xPassive1p);
-  VecGetArray (xPassive2, &xPassive2p);
-  VecGetArray (xPassive3, &xPassive3p);
 
   // Set the RHS and Dirichlet vector
   PetscScalar rhs_ele[8]; // local rhs
@@ -393,7 +403,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
   // Find the element size
   PetscInt nel, nen;
   const PetscInt *necon;
-  DMDAGetElements_3D (da_nodes, &nel, &nen, &necon);
+  mesh->GetElements (&nel, &nen, &necon);
 
   if (IMPORT_GEO == 0) {
     // Set the values:
@@ -432,8 +442,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
   } else {
     // Set the values:
     // In this case:
-    // xPassive2 indicates fix,
-    // xPassive3 indicates loading.
+    // fixture and loading elements of the domain mask
     // Load and constraints
     PetscScalar LoadIntensity = 0.001;
     for (PetscInt i = 0; i < nel; i++) {
@@ -444,7 +453,7 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
       for (PetscInt l = 0; l < nen; l++) {
         edof[l] = necon[i * nen + l]; // dof in globe
       }
-      if (xPassive0p[i] != 0) {
+      if (domain->IsDesign (i)) {
         for (PetscInt j = 0; j < 8; j++) {
           rhs_ele[j] = LoadIntensity;
         }
@@ -452,7 +461,8 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
             ADD_VALUES);
         CHKERRQ(ierr);
       }
-      if (xPassive2p[i] == 1) {
+      if (domain->GetKind (i) == DomainMask::FIXTURE
+          && domain->GetIndices (i) == 1) {
         for (PetscInt j = 0; j < 8; j++) {
           n_ele[j] = 0.0;
         }
@@ -472,11 +482,18 @@ PetscErrorCode LinearHeatConduction::SetUpLoadAndBC (DM da_nodes, DM da_elem,
   VecAssemblyEnd (RHS[loadCondition]);
   VecRestoreArray (lcoor, &lcoorp);
   VecRestoreArray (elcoor, &elcoorp);
-  DMDARestoreElements (da_nodes, &nel, &nen, &necon);
-  VecRestoreArray (xPassive0, &xPassive0p);
-  VecRestoreArray (xPassive1, &xPassive1p);
-  VecRestoreArray (xPassive2, &xPassive2p);
-  VecRestoreArray (xPassive3, &xPassive3p);
+
+  // Eliminate the dofs of the elements outside of all domains: they are
+  // constrained like Dirichlet dofs (identity rows, zero RHS)
+  if (eliminateVoid) {
+    ierr = mesh->EliminateVoidDofs (domain, da_nodal, 1, N[loadCondition],
+        (PetscBool) (loadCondition == 0));
+    CHKERRQ(ierr);
+  }
+
+  // Cache I - N and the constrained rows of the load condition
+  ierr = SetUpConstrainedRows (loadCondition);
+  CHKERRQ(ierr);
 
   return ierr;
 }
@@ -490,22 +507,43 @@ PetscErrorCode LinearHeatConduction::SolveState (Vec xPhys, PetscScalar Emin,
   t1 = MPI_Wtime ();
 
   // Assemble the heat conductivity matrix
+  PerfLog::Begin (PerfLog::ASSEMBLY);
   ierr = AssembleConductivityMatrix (xPhys, Emin, Emax, penal, loadCondition);
   CHKERRQ(ierr);
+  PerfLog::End (PerfLog::ASSEMBLY);
 
   // Setup the solver
+  PerfLog::Begin (PerfLog::MGSETUP);
   if (ksp == NULL) {
     ierr = SetUpSolver ();
     CHKERRQ(ierr);
+    ierr = MGLevels::SetUpTelescopeSolve (ksp);
+    CHKERRQ(ierr);
   } else {
     ierr = KSPSetOperators (ksp, K, K);
     CHKERRQ(ierr);
+    PC pc;
+    KSPGetPC (ksp, &pc);
+    ierr = preset.NewOperator (pc); // age of the Chebyshev estimates
+    CHKERRQ(ierr);
     KSPSetUp (ksp);
   }
+  PerfLog::End (PerfLog::MGSETUP);
 
   // Solve
+  ierr = warmStart.Guess (loadCondition, U);
+  CHKERRQ(ierr);
+  PerfLog::Begin (PerfLog::KSPSOLVE);
   ierr = KSPSolve (ksp, RHS[loadCondition], U);
   CHKERRQ(ierr);
+  PerfLog::End (PerfLog::KSPSOLVE);
+  ierr = warmStart.Store (loadCondition, U);
+  CHKERRQ(ierr);
+
+  // Keep the Chebyshev estimates of this set up for the next operators
+  PC pc;
+  KSPGetPC (ksp, &pc);
+  ierr = preset.CacheEigenvalues (pc);
   CHKERRQ(ierr);
 
   // DEBUG
@@ -513,11 +551,13 @@ PetscErrorCode LinearHeatConduction::SolveState (Vec xPhys, PetscScalar Emin,
   PetscInt niter;
   PetscScalar rnorm;
   KSPGetIterationNumber (ksp, &niter);
+  PerfLog::AddSolverIterations (niter);
   KSPGetResidualNorm (ksp, &rnorm);
   PetscReal RHSnorm;
   ierr = VecNorm (RHS[loadCondition], NORM_2, &RHSnorm);
   CHKERRQ(ierr);
   rnorm = rnorm / RHSnorm;
+  PerfLog::AddSolverResidual (rnorm);
 
   t2 = MPI_Wtime ();
   PetscPrintf (PETSC_COMM_WORLD,
@@ -529,7 +569,7 @@ PetscErrorCode LinearHeatConduction::SolveState (Vec xPhys, PetscScalar Emin,
 PetscErrorCode LinearHeatConduction::ComputeObjectiveConstraintsSensitivities (
     PetscScalar *fx, PetscScalar *gx, Vec dfdx, Vec *dgdx, Vec xPhys,
     PetscScalar Emin, PetscScalar Emax, PetscScalar penal, PetscScalar volfrac,
-    Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3) {
+    DomainMask *domain) {
   // Errorcode
   PetscErrorCode ierr;
 
@@ -537,27 +577,19 @@ PetscErrorCode LinearHeatConduction::ComputeObjectiveConstraintsSensitivities (
     // Solve state eqs
     ierr = SolveState (xPhys, Emin, Emax, penal, loadCondition);
     CHKERRQ(ierr);
+    PerfLog::Begin (PerfLog::SENSITIVITY);
 
     // Get the FE mesh structure (from the nodal mesh)
     PetscInt nel, nen;
     const PetscInt *necon;
-#if DIM == 2
-    ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
+    ierr = mesh->GetElements (&nel, &nen, &necon);
     CHKERRQ(ierr);
-#elif DIM == 3
-    ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
-    CHKERRQ(ierr);
-#endif
     // DMDAGetElements(da_nodes,&nel,&nen,&necon); // Still issue with elemtype
     // change !
 
     // Get pointer to the densities
-    PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-    VecGetArray (xPhys, &xp);
-    VecGetArray (xPassive0, &xPassive0p);
-    VecGetArray (xPassive1, &xPassive1p);
-    VecGetArray (xPassive2, &xPassive2p);
-    VecGetArray (xPassive3, &xPassive3p);
+    const PetscScalar *xp; // read only, keeps the state of xPhys
+    VecGetArrayRead (xPhys, &xp);
 
     // Get Solution
     Vec Uloc;
@@ -586,26 +618,36 @@ PetscErrorCode LinearHeatConduction::ComputeObjectiveConstraintsSensitivities (
     PetscScalar nNonDesign = 0;
     VecGetSize (xPhys, &neltot);
 
-    // Edof array
-    PetscInt edof[nedof];
+    // Element energies of the design elements, batched
+    const PetscInt *edof, *elist;
+    PetscInt nact;
+    ierr = mesh->GetEdof (1, &edof);
+    CHKERRQ(ierr);
+    ierr = mesh->GetDesignElements (domain, &nact, &elist);
+    CHKERRQ(ierr);
+    PetscScalar *uKue;
+    ierr = PetscMalloc1 (nel, &uKue);
+    CHKERRQ(ierr);
+    ElementKernels<nedof>::QuadraticForm (KE, edof, elist, nact, up, up, NULL,
+        uKue);
 
-    fx[0] = 0.0;
-    // Loop over elements
+    // Elements outside of all domains, the active ones are set below
+    const PetscInt *alist;
+    PetscInt nactive;
+    ierr = mesh->GetActiveElements (domain, &nactive, &alist);
+    CHKERRQ(ierr);
     for (PetscInt i = 0; i < nel; i++) {
-      // loop over element nodes
-      if (xPassive0p[i] != 0) {
+      df[i] = 1.0E9;
+    }
+    nNonDesign = nel - nact;
 
-        for (PetscInt j = 0; j < nen; j++) {
-          // Get local dofs
-          edof[j] = necon[i * nen + j];
-        }
-        // Use SIMP for heat conductivity interpolation
-        PetscScalar uKu = 0.0;
-        for (PetscInt k = 0; k < nedof; k++) {
-          for (PetscInt h = 0; h < nedof; h++) {
-            uKu += up[edof[k]] * KE[k * nedof + h] * up[edof[h]];
-          }
-        }
+    fx[0] = 0.0;
+    // Loop over the active elements
+    for (PetscInt a = 0; a < nactive; a++) {
+      PetscInt i = alist[a];
+      if (domain->IsDesign (i)) {
+      // Use SIMP for heat conductivity interpolation
+        PetscScalar uKu = uKue[i];
         // Add to objective
         fx[0] += (Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin)) * uKu;
         // Set the Senstivity
@@ -616,14 +658,8 @@ PetscErrorCode LinearHeatConduction::ComputeObjectiveConstraintsSensitivities (
           gx[j] += xp[i];
           dg[j][i] = 1;
         }
-      } else if (xPassive1p[i] != 0 || xPassive2p[i] != 0
-                 || xPassive3p[i] != 0) {
+      } else { // passive
         df[i] = -1.0E9;
-        nNonDesign += 1;
-      } else {
-        df[i] = 1.0E9;
-        nNonDesign += 1;
-
       }
     }
 
@@ -649,20 +685,36 @@ PetscErrorCode LinearHeatConduction::ComputeObjectiveConstraintsSensitivities (
           1.0 / ((PetscScalar) neltot - nNonDesign)); // # modified
     }
 
-    VecRestoreArray (xPhys, &xp);
-    VecRestoreArray (xPassive0, &xPassive0p); // # new
-    VecRestoreArray (xPassive1, &xPassive1p); // # new
-    VecRestoreArray (xPassive2, &xPassive2p); // # new
-    VecRestoreArray (xPassive3, &xPassive3p); // # new
+    VecRestoreArrayRead (xPhys, &xp);
     VecRestoreArray (Uloc, &up);
     VecRestoreArray (dfdx, &df);
     VecRestoreArrays (dgdx, m, &dg);
     VecDestroy (&Uloc);
+    PetscFree (uKue);
+    PerfLog::End (PerfLog::SENSITIVITY);
   }
 
   return (ierr);
 }
 
+PetscErrorCode LinearHeatConduction::SetStateTolerance (PetscReal rtol) {
+
+  PetscErrorCode ierr = 0;
+
+  stateRtol = rtol;
+  PerfLog::SetSolverTolerance (rtol);
+  if (ksp != NULL) {
+    PetscReal atol, dtol;
+    PetscInt maxits;
+    ierr = KSPGetTolerances (ksp, NULL, &atol, &dtol, &maxits);
+    CHKERRQ(ierr);
+    ierr = KSPSetTolerances (ksp, rtol, atol, dtol, maxits);
+    CHKERRQ(ierr);
+  }
+
+  return ierr;
+}
+
 PetscErrorCode LinearHeatConduction::WriteRestartFiles () {
 
   PetscErrorCode ierr = 0;
@@ -699,18 +751,19 @@ PetscErrorCode LinearHeatConduction::WriteRestartFiles () {
 }
 
 PetscErrorCode LinearHeatConduction::FEAWithTopOptResults (Vec xPhys,
-    Vec xPassive0,
-    Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadConditionFEA,
+    DomainMask *domain, PetscInt loadConditionFEA,
     PetscScalar *loadVectorFEAp) { // # new
   // Errorcode
   PetscErrorCode ierr = 0;
 
+  // The FEA loads have no history of their own
+  warmStart.Disable ();
+
   PetscPrintf (PETSC_COMM_WORLD, "FEA with TopOpt Results, step: %d\n",
       loadConditionFEA);
 
   // only first load condition because we are solving FEA only one at a time
-  SetUpLoadAndBC (da_nodal, da_nodal, xPassive0, xPassive1, xPassive2,
-      xPassive3, 0);
+  SetUpLoadAndBC (da_nodal, da_nodal, domain, 0);
   // Solve state eqs,
   ierr = SolveState (xPhys, 1E-9, 1.0, 1.0, 0);
   CHKERRQ(ierr);
@@ -734,61 +787,85 @@ PetscErrorCode LinearHeatConduction::AssembleConductivityMatrix (Vec xPhys,
   // Get the FE mesh structure (from the nodal mesh)
   PetscInt nel, nen;
   const PetscInt *necon;
-#if DIM == 2
-  ierr = DMDAGetElements_2D (da_nodal, &nel, &nen, &necon);
-  CHKERRQ(ierr);
-#elif DIM == 3
-  ierr = DMDAGetElements_3D (da_nodal, &nel, &nen, &necon);
+  ierr = mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
-#endif
 
   // Get pointer to the densities
-  PetscScalar *xp;
-  VecGetArray (xPhys, &xp);
-
-  // Zero the matrix
-  MatZeroEntries (K);
+  const PetscScalar *xp; // read only, keeps the state of xPhys
+  VecGetArrayRead (xPhys, &xp);
 
-  // Edof array
-  PetscInt edof[nedof];
   PetscScalar ke[nedof * nedof];
 
-  // Loop over elements
-  for (PetscInt i = 0; i < nel; i++) {
-    // loop over element nodes
-    for (PetscInt j = 0; j < nen; j++) {
-      // Get local dofs
-      edof[j] = necon[i * nen + j];
-    }
-    // Use SIMP for heat conductivity interpolation
-    PetscScalar dens = Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
-    for (PetscInt k = 0; k < nedof * nedof; k++) {
-      ke[k] = KE[k] * dens;
-    }
-    // Add values to the sparse matrix
-    ierr = MatSetValuesLocal (K, nedof, edof, nedof, edof, ke, ADD_VALUES);
+  // Elements to assemble: all, or only the active ones if the dofs outside
+  // of all domains are eliminated (see SetUpLoadAndBC)
+  PetscInt nasm = nel;
+  const PetscInt *alist = NULL;
+  if (eliminateVoid) {
+    ierr = mesh->GetActiveElements (domain, &nasm, &alist);
     CHKERRQ(ierr);
   }
-  MatAssemblyBegin (K, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd (K, MAT_FINAL_ASSEMBLY);
-
-  // Impose the dirichlet conditions, i.e. K = N'*K*N - (N-I)
-  // 1.: K = N'*K*N
-  MatDiagonalScale (K, N[loadCondition], N[loadCondition]);
-  // 2. Add ones, i.e. K = K + NI, NI = I - N
-  Vec NI;
-  VecDuplicate (N[loadCondition], &NI);
-  VecSet (NI, 1.0);
-  VecAXPY (NI, -1.0, N[loadCondition]);
-  MatDiagonalSet (K, NI, ADD_VALUES);
+
+  // Cached scatter into the CSR storage of the matrix (-assemblyMap),
+  // set up on the first assembly
+  if (assemblyMap) {
+    ierr = mesh->SetUpAssemblyMap (K, 1, &asmMap);
+    CHKERRQ(ierr);
+  }
+
+  if (asmMap != NULL && asmMap->IsSetUp ()) {
+    ierr = asmMap->Assemble (K, KE, xp, Emin, Emax, penal, nasm, alist);
+    CHKERRQ(ierr);
+  } else {
+    // Zero the matrix
+    MatZeroEntries (K);
+
+    // Loop over elements
+    for (PetscInt a = 0; a < nasm; a++) {
+      PetscInt i = (alist != NULL) ? alist[a] : a;
+      // Use SIMP for heat conductivity interpolation
+      PetscScalar dens = Emin + PetscPowScalar(xp[i], penal) * (Emax - Emin);
+      for (PetscInt k = 0; k < nedof * nedof; k++) {
+        ke[k] = KE[k] * dens;
+      }
+      // Add values to the sparse matrix (one dof per node, the nodes are
+      // the blocks of size 1)
+      ierr = MatSetValuesBlockedLocal (K, nen, necon + i * nen, nen,
+          necon + i * nen, ke, ADD_VALUES);
+      CHKERRQ(ierr);
+    }
+    PetscLogFlops ((nedof * nedof + 3.0) * nasm);
+    MatAssemblyBegin (K, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd (K, MAT_FINAL_ASSEMBLY);
+  }
+
+  // Impose the dirichlet conditions (see DirichletRows.h)
+  ierr = dirichlet.Apply (K, loadCondition, N[loadCondition], Emax);
+  CHKERRQ(ierr);
 
   // Zero out possible loads in the RHS that coincide
   // with Dirichlet conditions
   VecPointwiseMult (RHS[loadCondition], RHS[loadCondition], N[loadCondition]);
 
-  VecDestroy (&NI);
-  VecRestoreArray (xPhys, &xp);
-  DMDARestoreElements (da_nodal, &nel, &nen, &necon);
+  VecRestoreArrayRead (xPhys, &xp);
+
+  return ierr;
+}
+
+PetscErrorCode LinearHeatConduction::SetUpConstrainedRows (
+    PetscInt loadCondition) {
+
+  PetscErrorCode ierr = 0;
+
+  // Diagonal of the constrained rows per unit conductivity: the one of a
+  // node in solid material, i.e. the diagonal entries of the conductivity
+  // matrices of the 2^DIM elements around it
+  PetscScalar diag = 0.0;
+  for (PetscInt a = 0; a < nedof; a++) {
+    diag += KE[a * nedof + a];
+  }
+  ierr = dirichlet.SetUpLoadCondition (loadCondition, N[loadCondition],
+      diag);
+  CHKERRQ(ierr);
 
   return ierr;
 }
@@ -867,7 +944,7 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
 
   // SET THE DEFAULT SOLVER PARAMETERS
   // The fine grid solver settings
-  PetscScalar rtol = 1.0e-5;
+  PetscScalar rtol = stateRtol;
   PetscScalar atol = 1.0e-50;
   PetscScalar dtol = 1.0e5;
   PetscInt restart = 100;
@@ -884,7 +961,8 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
   PetscInt smooth_sweeps = 4;
 
   // Set up the solver
-  ierr = KSPSetType (ksp, KSPFGMRES); // KSPCG, KSPGMRES
+  // CG if the smoothers keep the V-cycle symmetric (cg_* presets)
+  ierr = KSPSetType (ksp, preset.IsSymmetric () ? KSPCG : KSPFGMRES); // KSPCG, KSPGMRES
   CHKERRQ(ierr);
 
   ierr = KSPGMRESSetRestart (ksp, restart);
@@ -906,6 +984,8 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
 
   // Set solver from options
   KSPSetFromOptions (ksp);
+  KSPGetTolerances (ksp, &stateRtol, NULL, NULL, NULL);
+  PerfLog::SetSolverTolerance (stateRtol);
 
   // Get the prec again - check if it has changed
   KSPGetPC (ksp, &pc);
@@ -977,7 +1057,7 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
       KSP cksp;
       PCMGGetCoarseSolve (pc, &cksp);
       // The solver
-      ierr = KSPSetType (cksp, KSPGMRES); // KSPCG, KSPFGMRES
+      ierr = KSPSetType (cksp, preset.IsSymmetric () ? KSPCG : KSPGMRES); // KSPCG, KSPFGMRES
       ierr = KSPGMRESSetRestart (cksp, coarse_restart);
       // ierr = KSPSetType(cksp,KSPCG);
 
@@ -987,6 +1067,12 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
       PC cpc;
       KSPGetPC (cksp, &cpc);
       PCSetType (cpc, PCSOR); // PCGAMG, PCSOR, PCSPAI (NEEDS TO BE COMPILED), PCJACOBI
+      // Direct or AMG coarse solve of the cg_* presets
+      ierr = preset.SetUpCoarseSolve (cksp);
+      CHKERRQ(ierr);
+      // Agglomerate a small coarse problem onto fewer ranks
+      ierr = MGLevels::SetUpCoarseSolve (pc, da_nodal, nlvls);
+      CHKERRQ(ierr);
 
       // Set smoothers on all levels (except for coarse grid):
       for (PetscInt k = 1; k < nlvls; k++) {
@@ -994,6 +1080,11 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
         PCMGGetSmoother (pc, k, &dksp);
         PC dpc;
         KSPGetPC (dksp, &dpc);
+        if (preset.IsSymmetric ()) { // Chebyshev+Jacobi of the cg_* presets
+          ierr = preset.SetUpSmoother (dksp, smooth_sweeps);
+          CHKERRQ(ierr);
+          continue;
+        }
         ierr = KSPSetType (dksp,
         KSPGMRES); // KSPCG, KSPGMRES, KSPCHEBYSHEV (VERY GOOD FOR SPD)
         ierr = KSPGMRESSetRestart (dksp, smooth_sweeps);
@@ -1019,6 +1110,8 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
       "################# Linear solver settings #####################\n");
   PetscPrintf (PETSC_COMM_WORLD,
       "# Main solver: %s, prec.: %s, maxiter.: %i \n", ksptype, pctype, mmax);
+  preset.Print ();
+  warmStart.Print ();
 
   // Only if pcmg is used
   if (pcmg_flag) {
@@ -1038,6 +1131,7 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
           "# Level %i smoother: %s, prec.: %s, sweep: %i \n", k, dksptype,
           dpctype, mmax);
     }
+    MGLevels::Print (pc, da_nodal, nlvls);
   }
   PetscPrintf (PETSC_COMM_WORLD,
       "##############################################################\n");
@@ -1046,51 +1140,6 @@ PetscErrorCode LinearHeatConduction::SetUpSolver () {
 }
 
 #if DIM == 2
-PetscErrorCode LinearHeatConduction::DMDAGetElements_2D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 4;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (j = ys; j < ye - 1; j++) {
-      for (i = xs; i < xe - 1; i++) {
-        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-        if (da->elementtype == DMDA_ELEMENT_Q1) {
-          for (c = 0; c < ns * nn; c++)
-            da->e[cnt++] = cell[c];
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
 PetscInt LinearHeatConduction::Quad4Isoparametric (PetscScalar *X,
     PetscScalar *Y, PetscInt redInt, PetscScalar *ke) {
   // QUA4_ISOPARAMETRIC - Computes QUA4 isoparametric element matrices
@@ -1241,68 +1290,6 @@ PetscScalar LinearHeatConduction::Inverse2M (PetscScalar J[][2],
 }
 
 #elif DIM == 3
-PetscErrorCode LinearHeatConduction::DMDAGetElements_3D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs) zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
-          }
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
 PetscInt LinearHeatConduction::Hex8Isoparametric (PetscScalar *X,
     PetscScalar *Y, PetscScalar *Z, PetscInt redInt, PetscScalar *ke) {
   // HEX8_ISOPARAMETRIC - Computes HEX8 isoparametric element matrices
@@ -1503,3 +1490,5 @@ PetscScalar LinearHeatConduction::Dot (PetscScalar *v1, PetscScalar *v2,
   }
   return result;
 }
+
+} // namespace TOPOPT_NS
@@ -8,6 +8,17 @@
 #include <petsc/private/dmdaimpl.h>
 
 #include "options.h" // framework options
+#include "ElementKernels.h" // batched element kernels
+#include "ElementMesh.h" // shared element connectivity
+#include "DomainMask.h" // domain membership of the elements
+#include "AssemblyMap.h" // cached assembly into the CSR values
+#include "DirichletRows.h" // Dirichlet conditions on K
+#include "PerfLog.h" // per-phase performance log
+#include "SolverPreset.h" // named solver configurations
+#include "MGLevels.h" // multigrid depth and coarse solve
+#include "WarmStart.h" // initial guesses of the state solves
+
+namespace TOPOPT_NS {
 
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -28,9 +39,8 @@ class LinearHeatConduction {
 
   public:
     // Constructor
-    LinearHeatConduction (DM da_nodes, DM da_elem, PetscInt m, PetscInt numDES,
-        PetscInt numLODFIX, Vec xPassive0, Vec xPassive1, Vec xPassive2,
-        Vec xPassive3);
+    LinearHeatConduction (DM da_nodes, DM da_elem, ElementMesh *mesh,
+        PetscInt m, PetscInt numDES, PetscInt numLODFIX, DomainMask *domain);
 
     // Destructor
     ~LinearHeatConduction ();
@@ -40,11 +50,14 @@ class LinearHeatConduction {
     PetscErrorCode ComputeObjectiveConstraintsSensitivities (PetscScalar *fx,
         PetscScalar *gx, Vec dfdx, Vec *dgdx, Vec xPhys, PetscScalar Emin,
         PetscScalar Emax, PetscScalar penal, PetscScalar volfrac,
-        Vec xPassive0, Vec xPassive1, Vec xPassive2, Vec xPassive3);
+        DomainMask *domain);
 
     // Restart writer
     PetscErrorCode WriteRestartFiles ();
 
+    // Relative tolerance of the next state solves (see StateTolerance.h)
+    PetscErrorCode SetStateTolerance (PetscReal rtol);
+
     // Get pointer to the FE solution
     Vec GetStateField () {
       return (U);
@@ -59,8 +72,8 @@ class LinearHeatConduction {
     DM da_nodal; // Nodal mesh
 
     // # new; FEA with the TopOpt final results
-    PetscErrorCode FEAWithTopOptResults (Vec xPhys, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadConditionFEA,
+    PetscErrorCode FEAWithTopOptResults (Vec xPhys, DomainMask *domain,
+        PetscInt loadConditionFEA,
         PetscScalar *loadVectorFEAp);
 
   private:
@@ -68,6 +81,30 @@ class LinearHeatConduction {
     PetscInt nn[DIM]; // Number of nodes in each direction
     PetscInt ne[DIM]; // Number of elements in each direction
     PetscScalar xc[2 * DIM]; // Domain coordinates
+    ElementMesh *mesh; // element connectivity, owned by TopOpt
+    DomainMask *domain; // domain membership, owned by TopOpt
+
+    // Eliminate the dofs that belong only to elements outside of all domains
+    // (-eliminateVoid), only the active elements are assembled
+    PetscBool eliminateVoid;
+
+    // Dirichlet conditions of the load conditions on K
+    DirichletRows dirichlet;
+
+    // Cache the constrained rows of a load condition, after N is set up,
+    // with the diagonal of the conduction rows
+    PetscErrorCode SetUpConstrainedRows (PetscInt loadCondition);
+
+    // Cached scatter of the element matrices into K (-assemblyMap)
+    PetscBool assemblyMap;
+    AssemblyMap *asmMap;
+
+    // Solver configuration (-solverPreset) and the cache of the Chebyshev
+    // eigenvalue estimates
+    SolverPreset preset;
+
+    // Initial guesses of the state solves (-warmStart)
+    WarmStart warmStart;
 
     // Linear algebra
     Mat K; // Global heat conduction matrix
@@ -84,6 +121,7 @@ class LinearHeatConduction {
 
     // Solver
     KSP ksp; // Pointer to the KSP object i.e. the linear solver+prec
+    PetscReal stateRtol; // Relative tolerance of the state solves
     PetscInt nlvls;
 
     // Loading conditions
@@ -97,8 +135,8 @@ class LinearHeatConduction {
     PetscInt m; // # new
 
     // Set up the FE mesh and data structures
-    PetscErrorCode SetUpLoadAndBC (DM da_nodes, DM da_elem, Vec xPassive0,
-        Vec xPassive1, Vec xPassive2, Vec xPassive3, PetscInt loadCondition);
+    PetscErrorCode SetUpLoadAndBC (DM da_nodes, DM da_elem, DomainMask *domain,
+        PetscInt loadCondition);
 
     // Solve the FE problem
     PetscErrorCode SolveState (Vec xPhys, PetscScalar Emin, PetscScalar Emax,
@@ -112,10 +150,6 @@ class LinearHeatConduction {
     PetscErrorCode SetUpSolver ();
 
 #if DIM == 2
-    // Routine that doesn't change the element type upon repeated calls
-    PetscErrorCode DMDAGetElements_2D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-
     // Methods used to assemble the element heat conductivity matrix
     PetscInt Quad4Isoparametric (PetscScalar *X, PetscScalar *Y,
         PetscInt redInt, PetscScalar *ke);
@@ -125,10 +159,6 @@ class LinearHeatConduction {
 
 #elif DIM == 3
 
-    // Routine that doesn't change the element type upon repeated calls
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-
     // Methods used to assemble the element heat conductivity matrix
     PetscInt Hex8Isoparametric (PetscScalar *X, PetscScalar *Y, PetscScalar *Z,
         PetscInt redInt, PetscScalar *ke);
@@ -154,4 +184,6 @@ class LinearHeatConduction {
     }
 };
 
+} // namespace TOPOPT_NS
+
 #endif
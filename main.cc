@@ -1,23 +1,9 @@
-#include "Filter.h"
-#include "MMA.h"
-#include "MPIIO.h"
-#include "TopOpt.h"
 #include "mpi.h"
 #include <petsc.h>
 
-#include "options.h" // # new; all the switchers in it
-#include "timer.h" // # new
-
-#include "PrePostProcess.h" // # new; Pre- and post-processing class
-
-// Choose the physical problem to be solved
-#if PHYSICS == 0
-#include "LinearElasticity.h"
-#elif PHYSICS == 1
-#include "LinearCompliant.h"   // # new
-#elif PHYSICS == 2
-#include "LinearHeatConduction.h" // # new
-#endif
+#include "options.h" // # new; defaults of -dim and -physics
+#include "PerfLog.h" // # new; per-phase performance log
+#include "Threads.h" // # new; OpenMP threads per rank
 
 /*
  Authors: Niels Aage, Erik Andreassen, Boyan Lazarov, August 2013
@@ -35,7 +21,24 @@
  * Modified by Zhidong Brian Zhang in May 2020, University of Waterloo
  */
 
-static char help[] = "2D/3D TopOpt using KSP-MG on PETSc's DMDA (structured grids) \n"; // # modified
+// # new; the optimization of every combination of DIM and PHYSICS is
+// compiled into its own namespace (TopOptMain.cc and the classes it uses),
+// so all element loops are specialised on DIM at compile time. main ()
+// only selects one of them at runtime.
+#define DECLARE_TOPOPT_MAIN(d, p) \
+  namespace TOPOPT_NS_NAME(d, p) { \
+    PetscErrorCode TopOptMain (); \
+  }
+DECLARE_TOPOPT_MAIN(2, 0)
+DECLARE_TOPOPT_MAIN(2, 1)
+DECLARE_TOPOPT_MAIN(2, 2)
+DECLARE_TOPOPT_MAIN(3, 0)
+DECLARE_TOPOPT_MAIN(3, 1)
+DECLARE_TOPOPT_MAIN(3, 2)
+
+static char help[] = "2D/3D TopOpt using KSP-MG on PETSc's DMDA (structured grids) \n"
+    "  -dim <2,3>: dimension of the problem\n"
+    "  -physics <0,1,2>: 0-linear elasticity, 1-compliant, 2-heat conduction\n"; // # modified
 
 int main (int argc, char *argv[]) {
 
@@ -45,168 +48,45 @@ int main (int argc, char *argv[]) {
   // Initialize PETSc / MPI and pass input arguments to PETSc
   PetscInitialize (&argc, &argv, PETSC_NULL, help);
 
-  // STEP 1: THE OPTIMIZATION PARAMETERS, DATA AND MESH (!!! THE DMDA !!!)
-  TopOpt *opt = new TopOpt ();
-
-  // STEP 2: Pre-processing to define the design domain by using passive element assigning method
-  PrePostProcess *prepost = new PrePostProcess (opt); // # new
-#if IMPORT_GEO == 0
-  VecSet(opt->xPassive0, 1.0);  // the whole domain is design domain
-  VecSet(opt->xPassive1, 0.0);  // no non-designable solid domain
-  VecSet(opt->xPassive2, 0.0);  // no fix domain
-  VecSet(opt->xPassive3, 0.0);  // no load domain
-#elif IMPORT_GEO == 1
-  prepost->DesignDomainInitialization (opt); // # new
-#endif
-
-  // STEP 3: THE PHYSICS
-  // 0 - linear elasticity, 1 - linear heat conduction, 2 - compliant
-#if PHYSICS == 0
-  LinearElasticity *physics = new LinearElasticity (opt->da_nodes, opt->m,
-      opt->numDES, opt->numLODFIX, opt->numNodeLoadAddingCounts, opt->nu,
-      opt->E, opt->loadVector, opt->xPassive0, opt->xPassive1, opt->xPassive2,
-      opt->xPassive3);
-#elif PHYSICS ==1
-  LinearCompliant *physics = new LinearCompliant (opt->da_nodes, opt->m,
-      opt->numDES, opt->numLODFIX, opt->nu, opt->E, opt->xPassive0,
-      opt->xPassive1, opt->xPassive2, opt->xPassive3); // # new
-#elif PHYSICS == 2
-  LinearHeatConduction *physics = new LinearHeatConduction (opt->da_nodes,
-      opt->da_elem, opt->m, opt->numDES, opt->numLODFIX, opt->xPassive0,
-      opt->xPassive1, opt->xPassive2, opt->xPassive3); // # new
-#endif
-
-  // STEP 4: THE FILTERING
-  Filter *filter = new Filter (opt->da_nodes, opt->xPhys, opt->filter,
-      opt->rmin, opt->xPassive0, opt->xPassive1, opt->xPassive2,
-      opt->xPassive3); // # modified
-
-  // STEP 5: VISUALIZATION USING VTK
-  MPIIO *output = new MPIIO (opt->da_nodes, 4, "ux, uy, uz, nodeDen", 7,
-      "x, xTilde, xPhys, xPassive0, xPassive1, xPassive2, xPassive3"); // # modified; all point data must use 3 coordinates in VTK
-
-  // STEP 6: THE OPTIMIZER MMA
-  MMA *mma;
-  PetscInt itr = 0;
-  opt->AllocateMMAwithRestart (&itr, &mma); // allow for restart !
-  // mma->SetAsymptotes(0.2, 0.65, 1.05);
-
-  // STEP 7: FILTER THE INITIAL DESIGN/RESTARTED DESIGN
-  ierr = filter->FilterProject (opt->x, opt->xTilde, opt->xPhys,
-      opt->projectionFilter, opt->beta, opt->eta);
+  // # new; Register the log stages and events, open -timing_log
+  ierr = PerfLog::Initialize ();
   CHKERRQ(ierr);
 
-  // STEP 8: OPTIMIZATION LOOP
-  PetscScalar ch = 1.0;
-  double t1, t2;
-  while (itr < opt->maxItr && ch > 0.01) {
-    // Update iteration counter
-    itr++;
-
-    // start timer
-    t1 = MPI_Wtime ();
-
-    // Compute (a) obj+const, (b) sens, (c) obj+const+sens
-    ierr = physics->ComputeObjectiveConstraintsSensitivities (&(opt->fx),
-        &(opt->gx[0]), opt->dfdx, opt->dgdx, opt->xPhys, opt->Emin,
-        opt->Emax, opt->penal, opt->volfrac, opt->xPassive0, opt->xPassive1,
-        opt->xPassive2, opt->xPassive3); // # new
-    CHKERRQ(ierr);
-
-    // Compute objective scale
-    if (itr == 1) {
-      opt->fscale = 10.0 / opt->fx;
-    }
-    // Scale objectie and sens
-    opt->fx = opt->fx * opt->fscale;
-    VecScale (opt->dfdx, opt->fscale);
-
-    // Filter sensitivities (chainrule)
-    ierr = filter->Gradients (opt->x, opt->xTilde, opt->dfdx, opt->m, opt->dgdx,
-        opt->projectionFilter, opt->beta, opt->eta);
-    CHKERRQ(ierr);
-
-    // Sets outer movelimits on design variables
-    ierr = mma->SetOuterMovelimit (opt->Xmin, opt->Xmax, opt->movlim, opt->x,
-        opt->xmin, opt->xmax);
-    CHKERRQ(ierr);
-
-    // Update design by MMA
-    ierr = mma->Update (opt->x, opt->dfdx, opt->gx, opt->dgdx, opt->xmin,
-        opt->xmax);
-    CHKERRQ(ierr);
-
-    // Inf norm on the design change
-    ch = mma->DesignChange (opt->x, opt->xold);
-
-    // Increase beta if needed
-    PetscBool changeBeta = PETSC_FALSE;
-    if (opt->projectionFilter) {
-      changeBeta = filter->IncreaseBeta (&(opt->beta), opt->betaFinal,
-          opt->gx[0], itr, ch);
-    }
-
-    // Filter design field
-    ierr = filter->FilterProject (opt->x, opt->xTilde, opt->xPhys,
-        opt->projectionFilter, opt->beta, opt->eta);
-    CHKERRQ(ierr);
-
-    // Discreteness measure
-    PetscScalar mnd = filter->GetMND (opt->xPhys);
-
-    // stop timer
-    t2 = MPI_Wtime ();
-
-    // Print to screen
-    PetscPrintf (PETSC_COMM_WORLD,
-        "It.: %i, True fx: %f, Scaled fx: %f, gx[0]: %f, ch.: %f, "
-            "mnd.: %f, time: %f\n", itr, opt->fx / opt->fscale, opt->fx,
-        opt->gx[0], ch, mnd, t2 - t1);
-
-    // Write field data: first 10 iterations and then every 20th
-    if (itr < 11 || itr % 20 == 0 || changeBeta) {
-      prepost->UpdateNodeDensity (opt); // # new; update node density
-      output->WriteVTK (physics->da_nodal, physics->GetStateField (),
-          opt->nodeDensity, opt->x, opt->xTilde, opt->xPhys, opt->xPassive0,
-          opt->xPassive1, opt->xPassive2, opt->xPassive3, itr); // # modified
-    }
-
-    // Dump data needed for restarting code at termination
-    if (itr % 10 == 0) {
-      opt->WriteRestartFiles (&itr, mma);
-      physics->WriteRestartFiles ();
-    }
-  }
+  // # new; Threads per rank of the element loops (-threads)
+  ierr = Threads::Initialize ();
+  CHKERRQ(ierr);
 
-  // # new; FEA with the TopOpt final results
-  for (PetscInt loadConditionFEA = 0; loadConditionFEA < opt->numLODFIXFEA;
-      ++loadConditionFEA) {
-    physics->FEAWithTopOptResults (opt->xPhys, opt->xPassive0, opt->xPassive1,
-        opt->xPassive2, opt->xPassive3, loadConditionFEA, opt->loadVectorFEA);
-    output->WriteVTK (physics->da_nodal, physics->GetStateField (),
-        opt->nodeDensity, opt->x, opt->xTilde, opt->xPhys, opt->xPassive0,
-        opt->xPassive1, opt->xPassive2, opt->xPassive3, itr); // # modified
-    itr++;
+  // # new; select the dimension and the physical problem
+  PetscInt dim = DIM;
+  PetscInt physics = PHYSICS;
+  PetscBool flg;
+  PetscOptionsGetInt (NULL, NULL, "-dim", &dim, &flg);
+  PetscOptionsGetInt (NULL, NULL, "-physics", &physics, &flg);
+
+  PetscPrintf (PETSC_COMM_WORLD, "# Problem: %DD, physics %D "
+      "(0-linear elasticity, 1-compliant, 2-heat conduction)\n", dim, physics);
+
+  if (dim == 2 && physics == 0) {
+    ierr = TOPOPT_NS_NAME(2, 0)::TopOptMain ();
+  } else if (dim == 2 && physics == 1) {
+    ierr = TOPOPT_NS_NAME(2, 1)::TopOptMain ();
+  } else if (dim == 2 && physics == 2) {
+    ierr = TOPOPT_NS_NAME(2, 2)::TopOptMain ();
+  } else if (dim == 3 && physics == 0) {
+    ierr = TOPOPT_NS_NAME(3, 0)::TopOptMain ();
+  } else if (dim == 3 && physics == 1) {
+    ierr = TOPOPT_NS_NAME(3, 1)::TopOptMain ();
+  } else if (dim == 3 && physics == 2) {
+    ierr = TOPOPT_NS_NAME(3, 2)::TopOptMain ();
+  } else {
+    PetscPrintf (PETSC_COMM_WORLD, "ERROR: unsupported -dim %D -physics %D\n",
+        dim, physics);
+    ierr = 1;
   }
 
-  // Write restart WriteRestartFiles
-  opt->WriteRestartFiles (&itr, mma);
-  physics->WriteRestartFiles ();
-
-  // Dump final design
-  output->WriteVTK (physics->da_nodal, physics->GetStateField (),
-      opt->nodeDensity, opt->x, opt->xTilde, opt->xPhys, opt->xPassive0,
-      opt->xPassive1, opt->xPassive2, opt->xPassive3, itr); // # modified
-
-  // STEP 9: CLEAN UP AFTER YOURSELF
-  delete mma;
-  delete output;
-  delete filter;
-  delete opt;
-  delete physics;
-  delete prepost; // # new
+  PerfLog::Finalize (); // # new
 
   // Finalize PETSc / MPI
   PetscFinalize ();
-  return 0;
+  return ierr;
 }
@@ -4,12 +4,34 @@
  * Created by Zhidong Brian Zhang in May 2020, University of Waterloo
  */
 
+/*
+ * The framework is compiled once per combination of DIM and PHYSICS
+ * (-DDIM=.. -DPHYSICS=.., see makefile), each into its own namespace
+ * TOPOPT_NS, and linked into one executable. The values below are the
+ * defaults of the runtime options -dim and -physics.
+ */
+
+#ifndef TOPOPT_OPTIONS_H
+#define TOPOPT_OPTIONS_H
+
 // Dimension
+#ifndef DIM
 #define DIM 2                 // 2-2D, 3-3D
+#endif
 
 // Import geometry or not
+#ifndef IMPORT_GEO
 #define IMPORT_GEO 1          // 0-Default geometries, 1-Imported CAD geometries
+#endif
 
 // Physical problems to be studied
+#ifndef PHYSICS
 #define PHYSICS 0             //0-Linear elasticity, 1-Compliant, 2-Heat conduction
+#endif
+
+// Namespace of the instance for DIM and PHYSICS, e.g. topopt_d3_p0
+#define TOPOPT_NS_NAME_(d, p) topopt_d ## d ## _p ## p
+#define TOPOPT_NS_NAME(d, p) TOPOPT_NS_NAME_(d, p)
+#define TOPOPT_NS TOPOPT_NS_NAME(DIM, PHYSICS)
 
+#endif
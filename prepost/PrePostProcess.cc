@@ -19,6 +19,8 @@
 
 #include <PrePostProcess.h>
 
+namespace TOPOPT_NS {
+
 PrePostProcess::PrePostProcess (TopOpt *opt) {
   // Design domain dimensions
 #if DIM == 2
@@ -59,14 +61,18 @@ PetscErrorCode PrePostProcess::DesignDomainInitialization (TopOpt *opt) {
 
   // Import and voxelize
   t1 = MPI_Wtime ();
+  PerfLog::Begin (PerfLog::VOXELIZATION);
   ierr = ImportAndVoxelizeGeometry (opt);
+  PerfLog::End (PerfLog::VOXELIZATION);
   t2 = MPI_Wtime ();
   PetscPrintf (PETSC_COMM_WORLD,
       "# Importing and voxelizing totally took %f s\n", t2 - t1);
 
   // Assign passive element
   t1 = MPI_Wtime ();
+  PerfLog::Begin (PerfLog::PASSIVE);
   ierr = AssignPassiveElement (opt);
+  PerfLog::End (PerfLog::PASSIVE);
   t2 = MPI_Wtime ();
   PetscPrintf (PETSC_COMM_WORLD, "# Assigning passive element took %f s\n",
       t2 - t1);
@@ -92,11 +98,11 @@ PetscErrorCode PrePostProcess::CalculateNodeLoadAddingTotalCounts (
   PetscInt nel, nen;
   const PetscInt *necon;
 #if DIM == 2
-  ierr = DMDAGetElements_2D (opt->da_nodes, &nel, &nen, &necon);
+  ierr = opt->mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
   PetscScalar eNodeAddingCounts[4] = { 1, 1, 1, 1 }; // elemental node adding counts
 #elif DIM == 3
-  ierr = DMDAGetElements_3D (opt->da_nodes, &nel, &nen, &necon);
+  ierr = opt->mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
   PetscScalar eNodeAddingCounts[8] = { 1, 1, 1, 1, 1, 1, 1, 1 }; // elemental node adding counts
 #endif
@@ -106,12 +112,8 @@ PetscErrorCode PrePostProcess::CalculateNodeLoadAddingTotalCounts (
   // change !
 
   // Get pointer to the densities
-  PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
+  PetscScalar *xp;
   VecGetArray (opt->xPhys, &xp);
-  VecGetArray (opt->xPassive0, &xPassive0p);
-  VecGetArray (opt->xPassive1, &xPassive1p);
-  VecGetArray (opt->xPassive2, &xPassive2p);
-  VecGetArray (opt->xPassive3, &xPassive3p);
 
   // Edof array, new
   PetscInt edof[nen];
@@ -119,7 +121,7 @@ PetscErrorCode PrePostProcess::CalculateNodeLoadAddingTotalCounts (
   // Loop over elements
   for (PetscInt i = 0; i < nel; i++) {
     // loop over element nodes
-    if (xPassive2p[i] != 0) {
+    if (opt->domain->IsFixture (i)) {
 //      memset (eNodeDensity, 0.0, sizeof(eNodeDensity[0]) * nen);
       for (PetscInt j = 0; j < nen; j++) {
         // global numbering of each node
@@ -142,7 +144,6 @@ PetscErrorCode PrePostProcess::CalculateNodeLoadAddingTotalCounts (
   opt->numNodeLoadAddingCounts = static_cast<PetscInt> (tmp);
   VecAssemblyBegin (opt->nodeAddingCounts);
   VecAssemblyEnd (opt->nodeAddingCounts);
-  DMDARestoreElements (opt->da_nodes, &nel, &nen, &necon);
 
   return ierr;
 }
@@ -153,70 +154,77 @@ PetscErrorCode PrePostProcess::UpdateNodeDensity (TopOpt *opt) {
   // Get the FE mesh structure (from the nodal mesh)
   PetscInt nel, nen;
   const PetscInt *necon;
-#if DIM == 2
-  ierr = DMDAGetElements_2D (opt->da_nodes, &nel, &nen, &necon);
+  ierr = opt->mesh->GetElements (&nel, &nen, &necon);
   CHKERRQ(ierr);
-  PetscScalar eNodeAddingCounts[4] = { 1, 1, 1, 1 }; // elemental node adding counts
-  PetscScalar eNodeDensity[4]; // elemental node density
-#elif DIM == 3
-  ierr = DMDAGetElements_3D (opt->da_nodes, &nel, &nen, &necon);
+  // Node density in the first dof of each node
+  PetscInt ndof = (PHYSICS == 2) ? 1 : DIM;
+
+  // Element colours: the elements of one colour share no node, so that the
+  // threads can add into the local arrays without conflicts
+  PetscInt ncolors;
+  const PetscInt *color;
+  ierr = opt->mesh->GetColors (&ncolors, &color);
   CHKERRQ(ierr);
-  PetscScalar eNodeAddingCounts[8] = { 1, 1, 1, 1, 1, 1, 1, 1 }; // elemental node adding counts
-  PetscScalar eNodeDensity[8]; // elemental node density
-#endif
+  if (Threads::Count () == 1) {
+    ncolors = 1;
+  }
 
+  // Sum into the local (ghosted) vectors, then add into the global ones
+  Vec ndLoc, ncLoc;
+  ierr = DMGetLocalVector (opt->da_nodes, &ndLoc);
+  CHKERRQ(ierr);
+  ierr = DMGetLocalVector (opt->da_nodes, &ncLoc);
+  CHKERRQ(ierr);
+  VecZeroEntries (ndLoc);
+  VecZeroEntries (ncLoc);
   VecZeroEntries (opt->nodeDensity); // zero off nodeDensity vector
   VecZeroEntries (opt->nodeAddingCounts); // zero off nodeAddingCounts vector
-  // DMDAGetElements(da_nodes,&nel,&nen,&necon); // Still issue with elemtype
-  // change !
 
   // Get pointer to the densities
-  PetscScalar *xp, *xPassive0p, *xPassive1p, *xPassive2p, *xPassive3p;
-  VecGetArray (opt->xPhys, &xp);
-  VecGetArray (opt->xPassive0, &xPassive0p);
-  VecGetArray (opt->xPassive1, &xPassive1p);
-  VecGetArray (opt->xPassive2, &xPassive2p);
-  VecGetArray (opt->xPassive3, &xPassive3p);
-
-  // Edof array, new
-  PetscInt edof[nen];
-
-  // Loop over elements
-  for (PetscInt i = 0; i < nel; i++) {
-    // loop over element nodes
-    if (xPassive0p[i] == 0 /*&& xPassive1p[i] == 0 && xPassive2p[i] == 0
-     && xPassive3p[i] == 0*/) {
-      memset (eNodeDensity, 0.0, sizeof(eNodeDensity[0]) * nen);
-      for (PetscInt j = 0; j < nen; j++) {
-        eNodeDensity[j] = xp[i];
-        // global numbering of each node
-        if (PHYSICS == 0 || PHYSICS == 1) {
-          edof[j] = DIM * necon[i * nen + j];
-        } else if (PHYSICS == 2) {
-          edof[j] = 1 * necon[i * nen + j]; // for heat conduction, only has 1 dof per node
+  const PetscScalar *xp;
+  PetscScalar *nd, *nc;
+  VecGetArrayRead (opt->xPhys, &xp);
+  VecGetArray (ndLoc, &nd);
+  VecGetArray (ncLoc, &nc);
+
+  // Loop over elements, colour by colour
+  for (PetscInt c = 0; c < ncolors; c++) {
+    TOPOPT_OMP(omp parallel for schedule(static))
+    for (PetscInt i = 0; i < nel; i++) {
+      if (ncolors > 1 && color[i] != c) continue;
+      if (!opt->domain->IsDesign (i) /*&& !opt->domain->IsPassive (i)*/) {
+        // loop over element nodes
+        for (PetscInt j = 0; j < nen; j++) {
+          nd[ndof * necon[i * nen + j]] += xp[i];
+          nc[ndof * necon[i * nen + j]] += 1.0;
         }
       }
-      ierr = VecSetValuesLocal (opt->nodeDensity, nen, edof, eNodeDensity,
-          ADD_VALUES);
-      CHKERRQ(ierr);
-      ierr = VecSetValuesLocal (opt->nodeAddingCounts, nen, edof,
-          eNodeAddingCounts, ADD_VALUES);
-      CHKERRQ(ierr);
     }
   }
 
+  VecRestoreArrayRead (opt->xPhys, &xp);
+  VecRestoreArray (ndLoc, &nd);
+  VecRestoreArray (ncLoc, &nc);
+  ierr = DMLocalToGlobalBegin (opt->da_nodes, ndLoc, ADD_VALUES,
+      opt->nodeDensity);
+  CHKERRQ(ierr);
+  ierr = DMLocalToGlobalEnd (opt->da_nodes, ndLoc, ADD_VALUES,
+      opt->nodeDensity);
+  CHKERRQ(ierr);
+  ierr = DMLocalToGlobalBegin (opt->da_nodes, ncLoc, ADD_VALUES,
+      opt->nodeAddingCounts);
+  CHKERRQ(ierr);
+  ierr = DMLocalToGlobalEnd (opt->da_nodes, ncLoc, ADD_VALUES,
+      opt->nodeAddingCounts);
+  CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector (opt->da_nodes, &ndLoc);
+  CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector (opt->da_nodes, &ncLoc);
+  CHKERRQ(ierr);
+
   //  Calculate the average node density by using pointwise dividing
-  VecAssemblyBegin (opt->nodeAddingCounts);
-  VecAssemblyEnd (opt->nodeAddingCounts);
-  VecAssemblyBegin (opt->nodeDensity);
-  VecAssemblyEnd (opt->nodeDensity);
   VecPointwiseDivide (opt->nodeDensity, opt->nodeDensity,
       opt->nodeAddingCounts);
-  VecAssemblyBegin (opt->nodeAddingCounts);
-  VecAssemblyEnd (opt->nodeAddingCounts);
-  DMDARestoreElements (opt->da_nodes, &nel, &nen, &necon);
-  VecAssemblyBegin (opt->nodeDensity);
-  VecAssemblyEnd (opt->nodeDensity);
 
   return ierr;
 }
@@ -392,41 +400,16 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
   VecGetArrayRead (elcoor, &elcoorp);
 
 #if DIM == 2
-  // Get pointer to the densities and xpassive index vec
-  PetscScalar **xp_2D, **xPassive0p_2D, **xPassive1p_2D, **xPassive2p_2D,
-      **xPassive3p_2D;
+  // Get pointer to the densities
+  PetscScalar **xp_2D;
 
-  // Local vector of the global x and xPassive vectors
-  Vec xloc, xPassive0loc, xPassive1loc, xPassive2loc, xPassive3loc;
+  // Local vector of the global x
+  Vec xloc;
   DMCreateLocalVector (opt->da_elem, &xloc);
   DMGlobalToLocalBegin (opt->da_elem, opt->x, INSERT_VALUES, xloc);
   DMGlobalToLocalEnd (opt->da_elem, opt->x, INSERT_VALUES, xloc);
-  DMCreateLocalVector (opt->da_elem, &xPassive0loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive0, INSERT_VALUES,
-      xPassive0loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive0, INSERT_VALUES,
-      xPassive0loc);
-  DMCreateLocalVector (opt->da_elem, &xPassive1loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive1, INSERT_VALUES,
-      xPassive1loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive1, INSERT_VALUES,
-      xPassive1loc);
-  DMCreateLocalVector (opt->da_elem, &xPassive2loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive2, INSERT_VALUES,
-      xPassive2loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive2, INSERT_VALUES,
-      xPassive2loc);
-  DMCreateLocalVector (opt->da_elem, &xPassive3loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive3, INSERT_VALUES,
-      xPassive3loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive3, INSERT_VALUES,
-      xPassive3loc);
 
   DMDAVecGetArray (opt->da_elem, xloc, &xp_2D);
-  DMDAVecGetArray (opt->da_elem, xPassive0loc, &xPassive0p_2D);
-  DMDAVecGetArray (opt->da_elem, xPassive1loc, &xPassive1p_2D);
-  DMDAVecGetArray (opt->da_elem, xPassive2loc, &xPassive2p_2D);
-  DMDAVecGetArray (opt->da_elem, xPassive3loc, &xPassive3p_2D);
 
   PetscInt xs, xe, Xs, Xe;
   PetscInt ys, ye, Ys, Ye;
@@ -440,27 +423,24 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
   Ye += Ys;
 
   int occTmp; // occupancy temporary variable
+  PetscInt e; // local element in the domain mask, -1 for ghosts
   for (PetscInt i = Xs; i < Xe; i++) {
     for (PetscInt j = Ys; j < Ye; j++) {
       xp_2D[j][i] = 0.0;
 
       voxIndex = j * nx + i;
+      e = (i >= xs && i < xe && j >= ys && j < ye) ?
+          (i - xs) + (j - ys) * (xe - xs) : -1;
       for (unsigned int designDomain = 0; designDomain < numDES;
           ++designDomain) {
         if (!opt->inputSTL_DES[designDomain].empty ()) {
           occTmp = occDES[designDomain][voxIndex / BATCH];
           if ((occTmp >> (voxIndex % BATCH)) & 1) {
             xp_2D[j][i] = opt->volfrac;
-            xPassive0p_2D[j][i] += 1.0 * std::pow (2, 1.0 * designDomain);
-            xPassive1p_2D[j][i] = 0;
-            xPassive2p_2D[j][i] = 0;
-            xPassive3p_2D[j][i] = 0;
+            if (e >= 0) opt->domain->Add (e, DomainMask::DESIGN, designDomain);
           } else {
             xp_2D[j][i] = 0.0;
-            xPassive0p_2D[j][i] = 0;
-            xPassive1p_2D[j][i] = 0;
-            xPassive2p_2D[j][i] = 0;
-            xPassive3p_2D[j][i] = 0;
+            if (e >= 0) opt->domain->Clear (e);
           }
         }
       }
@@ -471,10 +451,7 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
           occTmp = occSLD[solidDomain][voxIndex / BATCH];
           if ((occTmp >> (voxIndex % BATCH)) & 1) {
             xp_2D[j][i] = 1.0;
-            xPassive0p_2D[j][i] = 0;
-            xPassive1p_2D[j][i] += 1.0 * std::pow (2, 1.0 * solidDomain);
-            xPassive2p_2D[j][i] = 0;
-            xPassive3p_2D[j][i] = 0;
+            if (e >= 0) opt->domain->Add (e, DomainMask::SOLID, solidDomain);
           }
         }
       }
@@ -487,10 +464,9 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
             occTmp = occFIX[loadCondition][voxIndex / BATCH];
             if ((occTmp >> (voxIndex % BATCH)) & 1) {
               xp_2D[j][i] = 1.0;
-              xPassive0p_2D[j][i] = 0;
-              xPassive1p_2D[j][i] = 0;
-              xPassive2p_2D[j][i] += 1.0 * std::pow (2, 1.0 * loadCondition);
-              xPassive3p_2D[j][i] = 0;
+              if (e >= 0) {
+                opt->domain->Add (e, DomainMask::FIXTURE, loadCondition);
+              }
             }
             break;
           }
@@ -501,10 +477,7 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
             occTmp = occLOD[loadCondition][voxIndex / BATCH];
             if ((occTmp >> (voxIndex % BATCH)) & 1) {
               xp_2D[j][i] = 1.0;
-              xPassive0p_2D[j][i] = 0;
-              xPassive1p_2D[j][i] = 0;
-              xPassive2p_2D[j][i] = 0;
-              xPassive3p_2D[j][i] += 1.0 * std::pow (2, 1.0 * loadCondition);
+              if (e >= 0) opt->domain->Add (e, DomainMask::LOAD, loadCondition);
             }
             break;
           }
@@ -514,69 +487,23 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
     }
   }
 
-// Restore the local x and xPassive vectors to their global vectors
+// Restore the local x to its global vector
   DMLocalToGlobalBegin (opt->da_elem, xloc, INSERT_VALUES, opt->x);
   DMLocalToGlobalEnd (opt->da_elem, xloc, INSERT_VALUES, opt->x);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive0loc, INSERT_VALUES,
-      opt->xPassive0);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive0loc, INSERT_VALUES,
-      opt->xPassive0);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive1loc, INSERT_VALUES,
-      opt->xPassive1);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive1loc, INSERT_VALUES,
-      opt->xPassive1);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive2loc, INSERT_VALUES,
-      opt->xPassive2);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive2loc, INSERT_VALUES,
-      opt->xPassive2);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive3loc, INSERT_VALUES,
-      opt->xPassive3);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive3loc, INSERT_VALUES,
-      opt->xPassive3);
 
   DMDAVecRestoreArray (opt->da_elem, xloc, &xp_2D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive0loc, &xPassive0p_2D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive1loc, &xPassive1p_2D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive2loc, &xPassive2p_2D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive3loc, &xPassive3p_2D);
 
 #elif DIM ==3
-  // Get pointer to the densities and xpassive index vec
-  PetscScalar ***xp_3D, ***xPassive0p_3D, ***xPassive1p_3D,
-      ***xPassive2p_3D,
-      ***xPassive3p_3D;
+  // Get pointer to the densities
+  PetscScalar ***xp_3D;
 
-  // Local vector of the global x and xPassive vectors
-  Vec xloc, xPassive0loc, xPassive1loc, xPassive2loc, xPassive3loc;
+  // Local vector of the global x
+  Vec xloc;
   DMCreateLocalVector (opt->da_elem, &xloc);
   DMGlobalToLocalBegin (opt->da_elem, opt->x, INSERT_VALUES, xloc);
   DMGlobalToLocalEnd (opt->da_elem, opt->x, INSERT_VALUES, xloc);
-  DMCreateLocalVector (opt->da_elem, &xPassive0loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive0, INSERT_VALUES,
-      xPassive0loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive0, INSERT_VALUES,
-      xPassive0loc);
-  DMCreateLocalVector (opt->da_elem, &xPassive1loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive1, INSERT_VALUES,
-      xPassive1loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive1, INSERT_VALUES,
-      xPassive1loc);
-  DMCreateLocalVector (opt->da_elem, &xPassive2loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive2, INSERT_VALUES,
-      xPassive2loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive2, INSERT_VALUES,
-      xPassive2loc);
-  DMCreateLocalVector (opt->da_elem, &xPassive3loc);
-  DMGlobalToLocalBegin (opt->da_elem, opt->xPassive3, INSERT_VALUES,
-      xPassive3loc);
-  DMGlobalToLocalEnd (opt->da_elem, opt->xPassive3, INSERT_VALUES,
-      xPassive3loc);
 
   DMDAVecGetArray (opt->da_elem, xloc, &xp_3D);
-  DMDAVecGetArray (opt->da_elem, xPassive0loc, &xPassive0p_3D);
-  DMDAVecGetArray (opt->da_elem, xPassive1loc, &xPassive1p_3D);
-  DMDAVecGetArray (opt->da_elem, xPassive2loc, &xPassive2p_3D);
-  DMDAVecGetArray (opt->da_elem, xPassive3loc, &xPassive3p_3D);
 
   PetscInt xs, xe, Xs, Xe;
   PetscInt ys, ye, Ys, Ye;
@@ -593,12 +520,16 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
   Ze += Zs;
 
   int occTmp; // occupancy temporary variable
+  PetscInt e; // local element in the domain mask, -1 for ghosts
   for (PetscInt k = Zs; k < Ze; k++) {
     for (PetscInt j = Ys; j < Ye; j++) {
       for (PetscInt i = Xs; i < Xe; i++) {
 
         xp_3D[k][j][i] = 0.0;
         voxIndex = k * nx * ny + j * nx + i;
+        e = (i >= xs && i < xe && j >= ys && j < ye && k >= zs && k < ze) ?
+            (i - xs) + (j - ys) * (xe - xs) + (k - zs) * (xe - xs) * (ye - ys) :
+            -1;
 
         for (unsigned int designDomain = 0; designDomain < numDES;
             ++designDomain) {
@@ -606,17 +537,12 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
             occTmp = occDES[designDomain][voxIndex / BATCH];
             if ((occTmp >> (voxIndex % BATCH)) & 1) {
               xp_3D[k][j][i] = opt->volfrac;
-              xPassive0p_3D[k][j][i] += 1.0
-                                        * std::pow (2, 1.0 * designDomain);
-              xPassive1p_3D[k][j][i] = 0;
-              xPassive2p_3D[k][j][i] = 0;
-              xPassive3p_3D[k][j][i] = 0;
+              if (e >= 0) {
+                opt->domain->Add (e, DomainMask::DESIGN, designDomain);
+              }
             } else {
               xp_3D[k][j][i] = 0.0;
-              xPassive0p_3D[k][j][i] = 0;
-              xPassive1p_3D[k][j][i] = 0;
-              xPassive2p_3D[k][j][i] = 0;
-              xPassive3p_3D[k][j][i] = 0;
+              if (e >= 0) opt->domain->Clear (e);
             }
           }
         }
@@ -627,11 +553,7 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
             occTmp = occSLD[solidDomain][voxIndex / BATCH];
             if ((occTmp >> (voxIndex % BATCH)) & 1) {
               xp_3D[k][j][i] = 1.0;
-              xPassive0p_3D[k][j][i] = 0;
-              xPassive1p_3D[k][j][i] += 1.0
-                                        * std::pow (2, 1.0 * solidDomain);
-              xPassive2p_3D[k][j][i] = 0;
-              xPassive3p_3D[k][j][i] = 0;
+              if (e >= 0) opt->domain->Add (e, DomainMask::SOLID, solidDomain);
             }
           }
         }
@@ -644,11 +566,9 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
               occTmp = occFIX[loadCondition][voxIndex / BATCH];
               if ((occTmp >> (voxIndex % BATCH)) & 1) {
                 xp_3D[k][j][i] = 1.0;
-                xPassive0p_3D[k][j][i] = 0;
-                xPassive1p_3D[k][j][i] = 0;
-                xPassive2p_3D[k][j][i] += 1.0
-                                          * std::pow (2, 1.0 * loadCondition);
-                xPassive3p_3D[k][j][i] = 0;
+                if (e >= 0) {
+                  opt->domain->Add (e, DomainMask::FIXTURE, loadCondition);
+                }
               }
               break;
             }
@@ -659,11 +579,9 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
               occTmp = occLOD[loadCondition][voxIndex / BATCH];
               if ((occTmp >> (voxIndex % BATCH)) & 1) {
                 xp_3D[k][j][i] = 1.0;
-                xPassive0p_3D[k][j][i] = 0;
-                xPassive1p_3D[k][j][i] = 0;
-                xPassive2p_3D[k][j][i] = 0;
-                xPassive3p_3D[k][j][i] += 1.0
-                                          * std::pow (2, 1.0 * loadCondition);
+                if (e >= 0) {
+                  opt->domain->Add (e, DomainMask::LOAD, loadCondition);
+                }
               }
               break;
             }
@@ -674,31 +592,11 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
     }
   }
 
-// Restore the local x and xPassive vectors to their global vectors
+// Restore the local x to its global vector
   DMLocalToGlobalBegin (opt->da_elem, xloc, INSERT_VALUES, opt->x);
   DMLocalToGlobalEnd (opt->da_elem, xloc, INSERT_VALUES, opt->x);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive0loc, INSERT_VALUES,
-      opt->xPassive0);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive0loc, INSERT_VALUES,
-      opt->xPassive0);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive1loc, INSERT_VALUES,
-      opt->xPassive1);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive1loc, INSERT_VALUES,
-      opt->xPassive1);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive2loc, INSERT_VALUES,
-      opt->xPassive2);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive2loc, INSERT_VALUES,
-      opt->xPassive2);
-  DMLocalToGlobalBegin (opt->da_elem, xPassive3loc, INSERT_VALUES,
-      opt->xPassive3);
-  DMLocalToGlobalEnd (opt->da_elem, xPassive3loc, INSERT_VALUES,
-      opt->xPassive3);
 
   DMDAVecRestoreArray (opt->da_elem, xloc, &xp_3D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive0loc, &xPassive0p_3D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive1loc, &xPassive1p_3D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive2loc, &xPassive2p_3D);
-  DMDAVecRestoreArray (opt->da_elem, xPassive3loc, &xPassive3p_3D);
 
 #endif
 
@@ -706,19 +604,7 @@ PrePostProcess::AssignPassiveElement (TopOpt *opt)
   VecRestoreArrayRead (elcoor, &elcoorp);
   VecAssemblyBegin (opt->x);
   VecAssemblyEnd (opt->x);
-  VecAssemblyBegin (opt->xPassive0);
-  VecAssemblyEnd (opt->xPassive0);
-  VecAssemblyBegin (opt->xPassive1);
-  VecAssemblyEnd (opt->xPassive1);
-  VecAssemblyBegin (opt->xPassive2);
-  VecAssemblyEnd (opt->xPassive2);
-  VecAssemblyBegin (opt->xPassive3);
-  VecAssemblyEnd (opt->xPassive3);
   VecDestroy (&xloc);
-  VecDestroy (&xPassive0loc);
-  VecDestroy (&xPassive1loc);
-  VecDestroy (&xPassive2loc);
-  VecDestroy (&xPassive3loc);
 
   return ierr;
 }
@@ -757,113 +643,4 @@ PrePostProcess::CleanUp ()
   return ierr;
 }
 
-#if DIM == 2
-PetscErrorCode
-PrePostProcess::DMDAGetElements_2D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) { // new
-  PetscErrorCode ierr = 0;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt cnt = 0, cell[4], ns = 1, nn = 4;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 4;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, NULL, &xe, &ye, NULL);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, NULL, &Xe, &Ye, NULL);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (j = ys; j < ye - 1; j++) {
-      for (i = xs; i < xe - 1; i++) {
-        cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs);
-        cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs);
-        cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs);
-        cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs);
-        if (da->elementtype == DMDA_ELEMENT_Q1) {
-          for (c = 0; c < ns * nn; c++)
-            da->e[cnt++] = cell[c];
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-
-#elif DIM == 3
-PetscErrorCode
-PrePostProcess::DMDAGetElements_3D (DM dm, PetscInt *nel,
-    PetscInt *nen, const PetscInt *e[]) {
-  PetscErrorCode ierr;
-  DM_DA *da = (DM_DA*) dm->data;
-  PetscInt i, xs, xe, Xs, Xe;
-  PetscInt j, ys, ye, Ys, Ye;
-  PetscInt k, zs, ze, Zs, Ze;
-  PetscInt cnt = 0, cell[8], ns = 1, nn = 8;
-  PetscInt c;
-  if (!da->e) {
-    if (da->elementtype == DMDA_ELEMENT_Q1) {
-      ns = 1;
-      nn = 8;
-    }
-    ierr = DMDAGetCorners (dm, &xs, &ys, &zs, &xe, &ye, &ze);
-    CHKERRQ(ierr);
-    ierr = DMDAGetGhostCorners (dm, &Xs, &Ys, &Zs, &Xe, &Ye, &Ze);
-    CHKERRQ(ierr);
-    xe += xs;
-    Xe += Xs;
-    if (xs != Xs) xs -= 1;
-    ye += ys;
-    Ye += Ys;
-    if (ys != Ys) ys -= 1;
-    ze += zs;
-    Ze += Zs;
-    if (zs != Zs) zs -= 1;
-    da->ne = ns * (xe - xs - 1) * (ye - ys - 1) * (ze - zs - 1);
-    PetscMalloc((1 + nn * da->ne) * sizeof(PetscInt), &da->e);
-    for (k = zs; k < ze - 1; k++) {
-      for (j = ys; j < ye - 1; j++) {
-        for (i = xs; i < xe - 1; i++) {
-          cell[0] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[1] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[2] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[3] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs) * (Xe - Xs) * (Ye - Ys);
-          cell[4] = (i - Xs) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[5] = (i - Xs + 1) + (j - Ys) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[6] = (i - Xs + 1) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          cell[7] = (i - Xs) + (j - Ys + 1) * (Xe - Xs)
-                    + (k - Zs + 1) * (Xe - Xs) * (Ye - Ys);
-          if (da->elementtype == DMDA_ELEMENT_Q1) {
-            for (c = 0; c < ns * nn; c++)
-              da->e[cnt++] = cell[c];
-          }
-        }
-      }
-    }
-  }
-  *nel = da->ne;
-  *nen = nn;
-  *e = da->e;
-  return (0);
-}
-#endif
+} // namespace TOPOPT_NS
@@ -26,6 +26,11 @@
 #include "options.h"
 // Stl voxelizer
 #include <./vox/StlVoxelizer.h>
+// Performance log
+#include "PerfLog.h"
+#include "Threads.h"
+
+namespace TOPOPT_NS {
 
 /**
  * class Pre- and post-processing class
@@ -124,24 +129,8 @@ class PrePostProcess {
      */
     PetscErrorCode CleanUp ();
 
-    /**
-     * Get the DMDA mesh info
-     * \param[in] PETSc DM
-     * \param[out] *nel, pointer to the number of element
-     * \param[out] *nen, pointer to the number of nodes in each element
-     * \param[out] *e[], pointer to the global indices of the elements' vertices
-     * \return PetscErrorCode
-     */
-#if DIM == 2
-    PetscErrorCode DMDAGetElements_2D (
-        DM dm, PetscInt *nel,
-        PetscInt *nen,
-        const PetscInt *e[]); // new
-#elif DIM == 3
-    PetscErrorCode DMDAGetElements_3D (DM dm, PetscInt *nel, PetscInt *nen,
-        const PetscInt *e[]);
-#endif
-
 };
 
+} // namespace TOPOPT_NS
+
 #endif /* PrePostProcess_H_ */